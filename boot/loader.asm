@@ -70,6 +70,7 @@ org 0x8000
 ;   00100000 - 001fefff    1,044,480 bytes     内核中断栈(Kernel interrupt stack)
 ;   00200000 - 002fffff    1,048,576 bytes     内核栈(Kernel stack)
 ;   00300000 - (krnize)                        内核镜像(Kernel image)
+;   00a00000 - (initrd size)                   初始内存盘(Initial RAM disk, 可选)
 ;
 ;=============================================================================
 load:
@@ -188,7 +189,9 @@ load:
 
         ; 寻找内核镜像的第一个扇区，以及内核镜像的大小
         ; 将结果放在 bx 和 eax 寄存器中。
-        call    FindKernel
+        mov     si,     Kernel.Filename
+        mov     cx,     Kernel.Filename.Length
+        call    FindFile
         jc      .error.kernelNotFound
 
         ; 显示状态信息
@@ -203,6 +206,29 @@ load:
         mov     si,     String.Status.KernelLoaded
         call    DisplayStatusString
 
+    ;-------------------------------------------------------------------------
+    ; 将initrd加载到upper memory(如果cdrom上有的话)
+    ;-------------------------------------------------------------------------
+    .loadInitrd:
+
+        ; 内核通过大小是否为0来判断有没有initrd
+        mov     dword [Globals.InitrdSize],     0
+
+        mov     si,     Initrd.Filename
+        mov     cx,     Initrd.Filename.Length
+        call    FindFile
+        jc      .initrdDone
+
+        ; 紧跟在内核镜像的保留区域后面加载initrd
+        call    LoadInitrd
+        jc      .error.initrdLoadFailed
+
+        ; 显示状态信息
+        mov     si,     String.Status.InitrdLoaded
+        call    DisplayStatusString
+
+    .initrdDone:
+
         ; 关闭中断，直到启动内核时才再一次开启中断。
         ; 再次开启中断之前，内核负责设置中断控制器和表。
         cli
@@ -397,6 +423,11 @@ bits 16
         mov     si,     String.Error.KernelLoadFailed
         jmp     .error
 
+    .error.initrdLoadFailed:
+
+        mov     si,     String.Error.InitrdLoadFailed
+        jmp     .error
+
     .error.noSSE:
 
         mov     si,     String.Error.NoSSE
@@ -535,13 +566,17 @@ ReadMemLayout:
 
 
 ;=============================================================================
-; FindKernel
+; FindFile
 ;
-; 扫描cdrom的根目录，寻找文件名为"MONK.SYS"的文件。
+; 扫描cdrom的根目录，寻找文件名为 SI 的文件(例如"MONK.SYS;1")。
 ; 如果找到的话，返回文件的开始扇区和文件大小。
 ;
+; Input registers:
+;   SI      ISO 9660 格式的文件名
+;   CX      文件名的长度
+;
 ; Return registers:
-;   EAX     内核文件大小
+;   EAX     文件大小
 ;   BX      开始扇区
 ;
 ; Return flags:
@@ -550,7 +585,7 @@ ReadMemLayout:
 ; Killed registers:
 ;   None
 ;=============================================================================
-FindKernel:
+FindFile:
 
     ; 保存寄存器，以防这些寄存器被杀掉。
     push    cx
@@ -558,6 +593,10 @@ FindKernel:
     push    si
     push    di
 
+    ; 读扇区时会用到 cx 和 si，所以把要找的文件名保存起来
+    mov     [FindFile.Name],        si
+    mov     [FindFile.NameLength],  cx
+
     ; 从全局变量中读取驱动编号和根目录扇区
     ; 这些全局变量是在1-stage的boot loader中保存的
     mov     dl,     [Globals.DriveNumber]
@@ -584,20 +623,19 @@ FindKernel:
         test    byte [di + ISO.DirectoryEntry.FileFlags],   0x02
         jnz     .nextDirEntry
 
-        ; 文件名的长度和"MONK.SYS;1"一样吗？
-        cmp     byte [di + ISO.DirectoryEntry.NameLength], \
-                    Kernel.Filename.Length
+        ; 文件名的长度一样吗？
+        mov     cx,     [FindFile.NameLength]
+        cmp     [di + ISO.DirectoryEntry.NameLength],   cl
         jne     .nextDirEntry
 
-        ; 文件名是"MONK.SYS;1"吗？
+        ; 文件名一样吗？
         push    di
-        mov     cx,     Kernel.Filename.Length
-        mov     si,     Kernel.Filename
+        mov     si,     [FindFile.Name]
         add     di,     ISO.DirectoryEntry.Name
         cld
         rep     cmpsb
         pop     di
-        je      .kernelFound
+        je      .fileFound
 
     .nextDirEntry:
 
@@ -612,7 +650,7 @@ FindKernel:
         inc     bx
         jmp     .processSector
 
-    .kernelFound:
+    .fileFound:
 
         ; 在bx中返回开始扇区
         mov     bx,     [di + ISO.DirectoryEntry.LocationLBA]
@@ -643,6 +681,13 @@ FindKernel:
         ret
 
 
+;-----------------------------------------------------------------------------
+; FindFile 的状态变量
+;-----------------------------------------------------------------------------
+FindFile.Name                   dw      0
+FindFile.NameLength             dw      0
+
+
 ;=============================================================================
 ; ReadSectors
 ;
@@ -683,7 +728,59 @@ ReadSectors:
 ;=============================================================================
 ; LoadKernel
 ;
-; 将内核加载进内存
+; 将内核加载到 Mem.Kernel.Image
+;
+; Input registers:
+;   EAX     内核文件的大小
+;   BX      内核文件的第一个扇区
+;
+; Return flags:
+;   CF      错误标志位
+;
+; Killed registers:
+;   None
+;=============================================================================
+LoadKernel:
+
+    mov     [Globals.KernelSize],       eax
+    push    edi
+    mov     edi,    Mem.Kernel.Image
+    call    LoadFile
+    pop     edi
+    ret
+
+
+;=============================================================================
+; LoadInitrd
+;
+; 将initrd加载到 Mem.Initrd，并把它的地址和大小记录在全局变量中，
+; 内核会把这段内存标记为保留内存，然后直接映射其中的文件页。
+;
+; Input registers:
+;   EAX     initrd文件的大小
+;   BX      initrd文件的第一个扇区
+;
+; Return flags:
+;   CF      错误标志位
+;
+; Killed registers:
+;   None
+;=============================================================================
+LoadInitrd:
+
+    mov     dword [Globals.InitrdAddress],  Mem.Initrd
+    mov     [Globals.InitrdSize],           eax
+    push    edi
+    mov     edi,    Mem.Initrd
+    call    LoadFile
+    pop     edi
+    ret
+
+
+;=============================================================================
+; LoadFile
+;
+; 将一个文件加载进内存
 ;
 ; 有两个问题需要解决：
 ;
@@ -701,8 +798,9 @@ ReadSectors:
 ;     4. 切换回实模式。
 ;
 ; Input registers:
-;   EAX     内核文件的大小
-;   BX      内核文件的第一个扇区
+;   EAX     文件的大小
+;   BX      文件的第一个扇区
+;   EDI     upper memory中的目标地址
 ;
 ; Return flags:
 ;   CF      错误标志位
@@ -710,29 +808,29 @@ ReadSectors:
 ; Killed registers:
 ;   None
 ;=============================================================================
-LoadKernel:
+LoadFile:
 
     ; 将寄存器压栈。
     push    es
     pusha
 
     ; 保存实模式下的栈指针。
-    mov     [LoadKernel.StackPointer],  sp
+    mov     [LoadFile.StackPointer],    sp
 
     ; 读取cdrom磁盘号。
     mov     dl,     [Globals.DriveNumber]
 
-    ; 保存内核文件的大小。
-    mov     [Globals.KernelSize],       eax
+    ; 保存目标地址。
+    mov     [LoadFile.TargetPointer],   edi
 
-    ; 将内核文件的大小从按字节位单位转换成按扇区为单位(需要向上取整)
+    ; 将文件的大小从按字节位单位转换成按扇区为单位(需要向上取整)
     add     eax,    Mem.Sector.Buffer.Size - 1
     shr     eax,    11 ; 除以2048(2KB)
 
     ; 将状态保存在code memory，因为在实模式和保护模式之间来回切换时，很难使用栈
-    mov     [LoadKernel.CurrentSector], bx
+    mov     [LoadFile.CurrentSector], bx
     add     ax,                         bx
-    mov     [LoadKernel.LastSector],    ax
+    mov     [LoadFile.LastSector],    ax
 
     .loadChunk:
 
@@ -758,7 +856,7 @@ LoadKernel:
     .proceed:
 
         ; 将已经加载的扇区数量保存下来，这样当拷贝到upper memory时，我们可以在保护模式下访问它。
-        mov     [LoadKernel.SectorsToCopy],     cx
+        mov     [LoadFile.SectorsToCopy],     cx
 
         ; 将内核文件的一个分片读取到缓冲区中。
         call    ReadSectors
@@ -798,15 +896,15 @@ bits 32
         xor     ecx,    ecx
         xor     esi,    esi
         xor     edi,    edi
-        mov     bx,     [LoadKernel.SectorsToCopy]
+        mov     bx,     [LoadFile.SectorsToCopy]
         mov     cx,     bx
         shl     ecx,    11       ; multiply by sector size (2048)
         mov     esi,    Mem.Kernel.LoadBuffer
-        mov     edi,    [LoadKernel.TargetPointer]
+        mov     edi,    [LoadFile.TargetPointer]
 
         ; 增加计数器和指针
-        add     [LoadKernel.TargetPointer],     ecx
-        add     [LoadKernel.CurrentSector],     bx
+        add     [LoadFile.TargetPointer],     ecx
+        add     [LoadFile.CurrentSector],     bx
 
         ; 拷贝分片
         cld
@@ -848,7 +946,7 @@ bits 16
 
         ; 恢复实模式栈指针
         xor     esp,    esp
-        mov     sp,     [LoadKernel.StackPointer]
+        mov     sp,     [LoadFile.StackPointer]
 
         ; 再次开启中断
         sti
@@ -856,8 +954,8 @@ bits 16
     .checkCompletion:
 
         ; 检查拷贝是否完成
-        mov     ax,     [LoadKernel.LastSector]
-        mov     bx,     [LoadKernel.CurrentSector]
+        mov     ax,     [LoadFile.LastSector]
+        mov     bx,     [LoadFile.CurrentSector]
         cmp     ax,     bx
         je      .success
 
@@ -900,14 +998,14 @@ bits 16
         ret
 
 ;-----------------------------------------------------------------------------
-; LoadKernel 的状态变量
+; LoadFile 的状态变量
 ;-----------------------------------------------------------------------------
 align 4
-LoadKernel.TargetPointer        dd      Mem.Kernel.Image
-LoadKernel.CurrentSector        dw      0
-LoadKernel.LastSector           dw      0
-LoadKernel.SectorsToCopy        dw      0
-LoadKernel.StackPointer         dw      0
+LoadFile.TargetPointer          dd      0
+LoadFile.CurrentSector          dw      0
+LoadFile.LastSector             dw      0
+LoadFile.SectorsToCopy          dw      0
+LoadFile.StackPointer           dw      0
 
 
 ;=============================================================================
@@ -1191,6 +1289,7 @@ String.Status.CPU64Detected   db "64-bit CPU detected",     0
 String.Status.SSEEnabled      db "SSE enabled",             0
 String.Status.KernelFound     db "Kernel found",            0
 String.Status.KernelLoaded    db "Kernel loaded",           0
+String.Status.InitrdLoaded    db "Initrd loaded",           0
 
 String.Error.Prefix           db "ERROR: ",                 0
 String.Error.No64BitMode      db "CPU is not 64-bit",       0
@@ -1199,6 +1298,7 @@ String.Error.NoSSE2           db "No SSE2 support",         0
 String.Error.NoFXinst         db "No FXSAVE/FXRSTOR",       0
 String.Error.KernelNotFound   db "Kernel not found",        0
 String.Error.KernelLoadFailed db "Kernel load failed",      0
+String.Error.InitrdLoadFailed db "Initrd load failed",      0
 
 ;-----------------------------------------------------------------------------
 ; 文件名字符串
@@ -1207,6 +1307,9 @@ String.Error.KernelLoadFailed db "Kernel load failed",      0
 Kernel.Filename         db      "MONK.SYS;1"
 Kernel.Filename.Length  equ     ($ - Kernel.Filename)
 
+Initrd.Filename         db      "INITRD.IMG;1"
+Initrd.Filename.Length  equ     ($ - Initrd.Filename)
+
 ;-----------------------------------------------------------------------------
 ; ReadSectors使用的DAP缓冲区
 ;-----------------------------------------------------------------------------
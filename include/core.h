@@ -40,5 +40,10 @@
 /// Compile-time static assertion
 #define STATIC_ASSERT(a, b)  _Static_assert(a, b)
 
+/// Check the format string and arguments of a printf-style function at
+/// compile time. f is the format's parameter number and a the first
+/// variable argument's, or 0 for a va_list.
+#define PRINTF_FORMAT(f, a)  __attribute__((format(printf, f, a)))
+
 /// Forced structure packing (use only when absolutely necessary)
 #define PACKSTRUCT           __attribute__((packed, aligned(1)))
@@ -0,0 +1,125 @@
+//============================================================================
+/// @file       bio.h
+/// @brief      Block I/O layer: bios, plugging and multi-queue dispatch.
+/// @details    Filesystems and other block users describe I/O as bios. Bios
+///             submitted between blk_start_plug and blk_finish_plug are held
+///             back, sorted, and merged with their neighbours into as few
+///             driver requests as possible. Requests are staged on the
+///             submitting CPU's software queue and dispatched to the
+///             hardware queue that CPU maps to.
+//============================================================================
+
+#pragma once
+
+#include <core.h>
+#include <kernel/block/blkdev.h>
+
+// Maximum number of segments in one bio.
+#define MAX_BIO_SEGS         4
+
+// Number of bios a plug holds before it is flushed automatically.
+#define BLK_PLUG_MAX         32
+
+// Number of per-CPU software queues.
+#define MAX_BLK_CPUS         16
+
+typedef struct bio bio_t;
+
+//----------------------------------------------------------------------------
+//  @typedef    bio_end_io
+/// @brief      Completion callback for a bio.
+/// @details    Called with interrupts disabled, once the bio's status has
+///             been set.
+/// @param[in]  bio     The completed bio.
+//----------------------------------------------------------------------------
+typedef void (*bio_end_io)(bio_t *bio);
+
+//----------------------------------------------------------------------------
+//  @struct     bio
+/// @brief      A block I/O operation on a run of consecutive sectors.
+//----------------------------------------------------------------------------
+struct bio
+{
+    blkdev_t     *dev;                 ///< Target device.
+    int           op;                  ///< BLK_OP_* operation.
+    uint64_t      sector;              ///< First sector.
+    uint32_t      count;               ///< Number of sectors.
+    blkseg_t      segs[MAX_BIO_SEGS];  ///< Data segments.
+    int           nsegs;               ///< Number of segments.
+    volatile int  status;              ///< BLK_STATUS_* result.
+    bio_end_io    end_io;              ///< Completion callback, or NULL.
+    void         *private;             ///< Owner's private data.
+    bio_t        *next;                ///< Link used by the block layer.
+};
+
+//----------------------------------------------------------------------------
+//  @struct     blk_plug
+/// @brief      A batch of bios held back for sorting and merging.
+//----------------------------------------------------------------------------
+typedef struct blk_plug
+{
+    bio_t *head;    ///< Held bios, sorted by device and sector.
+    int    count;   ///< Number of held bios.
+} blk_plug_t;
+
+//----------------------------------------------------------------------------
+//  @function   bio_init
+/// @brief      Initialize an empty bio.
+/// @param[in]  bio     The bio to initialize.
+/// @param[in]  dev     The target device.
+/// @param[in]  op      The BLK_OP_* operation.
+/// @param[in]  sector  The first sector.
+//----------------------------------------------------------------------------
+void
+bio_init(bio_t *bio, blkdev_t *dev, int op, uint64_t sector);
+
+//----------------------------------------------------------------------------
+//  @function   bio_add
+/// @brief      Append a data segment to a bio.
+/// @details    A segment that continues the previous one in memory extends
+///             it. Otherwise the join must fall on a page boundary, so every
+///             driver can describe the bio.
+/// @param[in]  bio     The bio.
+/// @param[in]  addr    Identity-mapped address of the data.
+/// @param[in]  len     Length in bytes, a multiple of the sector size.
+/// @returns    true if the segment was added, false if the bio is full or
+///             the segment cannot join it.
+//----------------------------------------------------------------------------
+bool
+bio_add(bio_t *bio, void *addr, uint32_t len);
+
+//----------------------------------------------------------------------------
+//  @function   bio_submit
+/// @brief      Submit a bio for asynchronous completion.
+/// @details    If the calling CPU has a plug active, the bio is held until
+///             the plug is finished. Otherwise it is dispatched at once.
+/// @param[in]  bio     The bio. It must stay valid until it completes.
+//----------------------------------------------------------------------------
+void
+bio_submit(bio_t *bio);
+
+//----------------------------------------------------------------------------
+//  @function   bio_wait
+/// @brief      Wait for a submitted bio to complete.
+/// @param[in]  bio     The bio.
+/// @returns    The bio's final status.
+//----------------------------------------------------------------------------
+int
+bio_wait(bio_t *bio);
+
+//----------------------------------------------------------------------------
+//  @function   blk_start_plug
+/// @brief      Start holding back the calling CPU's bio submissions.
+/// @param[in]  plug    Plug storage, usually on the caller's stack.
+//----------------------------------------------------------------------------
+void
+blk_start_plug(blk_plug_t *plug);
+
+//----------------------------------------------------------------------------
+//  @function   blk_finish_plug
+/// @brief      Merge and dispatch the bios held by a plug, and stop
+///             plugging.
+/// @param[in]  plug    The plug passed to blk_start_plug.
+//----------------------------------------------------------------------------
+void
+blk_finish_plug(blk_plug_t *plug);
@@ -0,0 +1,230 @@
+//============================================================================
+/// @file       blkdev.h
+/// @brief      Block device registry and request interface.
+/// @details    Storage drivers register a blkdev_t describing the device and
+///             its hardware queues. Requests are submitted to one queue and
+///             completed asynchronously by the driver, which calls the
+///             request's done callback from its interrupt (or poll) path.
+//============================================================================
+
+#pragma once
+
+#include <core.h>
+
+// Maximum number of registered block devices.
+#define MAX_BLKDEVS          8
+
+// Maximum number of hardware queues per block device.
+#define MAX_BLK_QUEUES       8
+
+// Maximum number of scatter-gather segments in one request.
+#define MAX_BLK_SEGS         16
+
+// Block request operations
+#define BLK_OP_READ          0
+#define BLK_OP_WRITE         1
+#define BLK_OP_FLUSH         2
+
+// Block request status values
+#define BLK_STATUS_PENDING   1
+#define BLK_STATUS_OK        0
+#define BLK_STATUS_ERROR     (-1)
+#define BLK_STATUS_UNSUPP    (-2)
+
+typedef struct blkdev blkdev_t;
+typedef struct blkreq blkreq_t;
+
+//----------------------------------------------------------------------------
+//  @struct     blkseg_t
+/// @brief      One physically contiguous piece of a scatter-gather request.
+//----------------------------------------------------------------------------
+typedef struct blkseg
+{
+    void    *addr;      ///< Identity-mapped address (e.g. a pfdb frame).
+    uint32_t len;       ///< Length in bytes, a multiple of the sector size.
+} blkseg_t;
+
+//----------------------------------------------------------------------------
+//  @typedef    blkreq_done
+/// @brief      Completion callback for a block request.
+/// @details    Called by the driver with interrupts disabled, once the
+///             request's status has been set.
+/// @param[in]  req     The completed request.
+//----------------------------------------------------------------------------
+typedef void (*blkreq_done)(blkreq_t *req);
+
+//----------------------------------------------------------------------------
+//  @struct     blkreq
+/// @brief      A single block I/O request.
+/// @details    The data is either one contiguous buffer (buf) or a list of
+///             segments (segs/nsegs). Either way it must be identity-mapped
+///             kernel memory (for example from kpage_alloc), since drivers
+///             hand its address to the device for DMA.
+//----------------------------------------------------------------------------
+struct blkreq
+{
+    int               op;        ///< BLK_OP_* operation.
+    uint64_t          sector;    ///< First sector (in dev->sector_size units).
+    uint32_t          count;     ///< Number of sectors.
+    void             *buf;       ///< Data buffer (count * sector_size bytes),
+                                 ///< used when nsegs is 0.
+    const blkseg_t   *segs;      ///< Scatter-gather segments.
+    int               nsegs;     ///< Number of segments (0 = use buf).
+    volatile int      status;    ///< BLK_STATUS_* result.
+    blkreq_done       done;      ///< Completion callback, or NULL.
+    void             *private;   ///< Owner's private data.
+    blkreq_t         *next;      ///< Link for queues owned by the submitter.
+};
+
+//----------------------------------------------------------------------------
+//  @struct     blkdev_ops
+/// @brief      Driver entry points for a block device.
+//----------------------------------------------------------------------------
+typedef struct blkdev_ops
+{
+    /// Queue a request on hardware queue `queue'. Returns false if the queue
+    /// is full. The device need not be notified until kick is called, so
+    /// several requests can be batched into one doorbell write.
+    bool (*submit)(blkdev_t *dev, int queue, blkreq_t *req);
+
+    /// Notify the device of requests queued since the last kick.
+    void (*kick)(blkdev_t *dev, int queue);
+
+    /// Reap completed requests on a queue without waiting for an interrupt.
+    void (*poll)(blkdev_t *dev, int queue);
+} blkdev_ops_t;
+
+//----------------------------------------------------------------------------
+//  @struct     blkdev
+/// @brief      A registered block device.
+//----------------------------------------------------------------------------
+struct blkdev
+{
+    char                name[8];     ///< Device name (e.g. "vda").
+    uint32_t            sector_size; ///< Bytes per sector.
+    uint64_t            sectors;     ///< Capacity in sectors.
+    uint32_t            max_sectors; ///< Largest request, in sectors.
+    int                 max_segs;    ///< Most segments in one request
+                                     ///< (0 = MAX_BLK_SEGS).
+    uint32_t            max_seg_size;///< Largest segment, in bytes
+                                     ///< (0 = no limit).
+    int                 nr_queues;   ///< Number of hardware queues.
+    const blkdev_ops_t *ops;         ///< Driver entry points.
+    void               *drvdata;     ///< Driver private data.
+    int                 id;          ///< Registry index (set on register).
+};
+
+//----------------------------------------------------------------------------
+//  @function   blkreq_segs
+/// @brief      Return a request's data as a segment list.
+/// @param[in]  dev     The device the request is for.
+/// @param[in]  req     The request.
+/// @param[out] single  Storage for the segment describing req->buf when the
+///                     request has no segment list.
+/// @param[out] nsegs   Receives the number of segments.
+/// @returns    The segment list.
+//----------------------------------------------------------------------------
+static inline const blkseg_t *
+blkreq_segs(const blkdev_t *dev, const blkreq_t *req, blkseg_t *single,
+            int *nsegs)
+{
+    if (req->nsegs > 0) {
+        *nsegs = req->nsegs;
+        return req->segs;
+    }
+    single->addr = req->buf;
+    single->len  = req->count * dev->sector_size;
+    *nsegs       = (req->op == BLK_OP_FLUSH) ? 0 : 1;
+    return single;
+}
+
+//----------------------------------------------------------------------------
+//  @function   blkdev_register
+/// @brief      Register a block device, making it visible by name.
+/// @param[in]  dev     The device. It must stay valid for the kernel's life.
+/// @returns    true on success, false if the registry is full.
+//----------------------------------------------------------------------------
+bool
+blkdev_register(blkdev_t *dev);
+
+//----------------------------------------------------------------------------
+//  @function   blkdev_find
+/// @brief      Look up a registered block device by name.
+/// @param[in]  name    The device name.
+/// @returns    The device, or NULL if none is registered with that name.
+//----------------------------------------------------------------------------
+blkdev_t *
+blkdev_find(const char *name);
+
+//----------------------------------------------------------------------------
+//  @function   blkdev_next
+/// @brief      Iterate over registered block devices.
+/// @param[in]  prev    The previous device, or NULL to start.
+/// @returns    The next device, or NULL after the last one.
+//----------------------------------------------------------------------------
+blkdev_t *
+blkdev_next(const blkdev_t *prev);
+
+//----------------------------------------------------------------------------
+//  @function   blkdev_queue
+/// @brief      Return the hardware queue the calling CPU should submit to.
+/// @param[in]  dev     The device.
+//----------------------------------------------------------------------------
+int
+blkdev_queue(const blkdev_t *dev);
+
+//----------------------------------------------------------------------------
+//  @function   blkdev_poll
+/// @brief      Reap completed requests on every queue of a device.
+/// @details    Devices without interrupts complete requests only when
+///             polled, so code that leaves requests in flight must poll.
+/// @param[in]  dev     The device.
+//----------------------------------------------------------------------------
+void
+blkdev_poll(blkdev_t *dev);
+
+//----------------------------------------------------------------------------
+//  @function   blkdev_wait
+/// @brief      Wait for a submitted request to complete.
+/// @details    Polls the request's queue, so it works whether or not
+///             interrupts are enabled.
+/// @param[in]  dev     The device.
+/// @param[in]  queue   The queue the request was submitted to.
+/// @param[in]  req     The request.
+/// @returns    The request's final status.
+//----------------------------------------------------------------------------
+int
+blkdev_wait(blkdev_t *dev, int queue, blkreq_t *req);
+
+//----------------------------------------------------------------------------
+//  @function   blkdev_read
+/// @brief      Synchronously read sectors from a block device.
+/// @param[in]  dev     The device.
+/// @param[in]  sector  The first sector.
+/// @param[in]  count   The number of sectors.
+/// @param[out] buf     Identity-mapped destination buffer.
+/// @returns    BLK_STATUS_OK on success, or a negative BLK_STATUS_* value.
+//----------------------------------------------------------------------------
+int
+blkdev_read(blkdev_t *dev, uint64_t sector, uint32_t count, void *buf);
+
+//----------------------------------------------------------------------------
+//  @function   blkdev_write
+/// @brief      Synchronously write sectors to a block device.
+/// @param[in]  dev     The device.
+/// @param[in]  sector  The first sector.
+/// @param[in]  count   The number of sectors.
+/// @param[in]  buf     Identity-mapped source buffer.
+/// @returns    BLK_STATUS_OK on success, or a negative BLK_STATUS_* value.
+//----------------------------------------------------------------------------
+int
+blkdev_write(blkdev_t *dev, uint64_t sector, uint32_t count, const void *buf);
+
+//----------------------------------------------------------------------------
+//  @function   blkdev_flush
+/// @brief      Synchronously flush a device's volatile write cache.
+/// @param[in]  dev     The device.
+/// @returns    BLK_STATUS_OK on success, or a negative BLK_STATUS_* value.
+//----------------------------------------------------------------------------
+int
+blkdev_flush(blkdev_t *dev);
@@ -0,0 +1,127 @@
+//============================================================================
+/// @file       pcache.h
+/// @brief      Page cache for block devices.
+/// @details    Device data is cached a page at a time, indexed by device and
+///             page number. Each cached page is a pfdb frame whose reference
+///             count is 1 for the cache itself plus one for every user. Pages
+///             with no users are reclaimed with a two-list (inactive/active)
+///             CLOCK when free memory runs low. Sequential readers trigger
+///             read-ahead, whose window doubles while the stream continues.
+///
+///             Writes only dirty the cached pages. Each device has a flusher
+///             that writes its dirty pages in ascending order, so neighbours
+///             merge into large sequential requests. It runs when the CPU
+///             goes idle, once the pages have waited a while or too many
+///             are dirty. A writer that takes the cache over its dirty limit
+///             flushes its own device before it continues.
+//============================================================================
+
+#pragma once
+
+#include <core.h>
+#include <kernel/block/bio.h>
+#include <kernel/block/blkdev.h>
+
+// Cached page flags
+#define PG_UPTODATE          (1 << 0)   ///< Data is valid.
+#define PG_LOCKED            (1 << 1)   ///< I/O is in flight.
+#define PG_ERROR             (1 << 2)   ///< The last read failed.
+#define PG_REFERENCED        (1 << 3)   ///< Accessed since the last scan.
+#define PG_ACTIVE            (1 << 4)   ///< On the active list.
+#define PG_DIRTY             (1 << 5)   ///< Modified since it was written.
+#define PG_WRITEBACK         (1 << 6)   ///< Being written to the device.
+
+//----------------------------------------------------------------------------
+//  @struct     cpage_t
+/// @brief      A page of device data held in the page cache.
+//----------------------------------------------------------------------------
+typedef struct cpage
+{
+    blkdev_t          *dev;      ///< Device the data belongs to.
+    uint64_t           index;    ///< Page number on the device.
+    void              *data;     ///< The page frame (identity-mapped).
+    volatile uint32_t  flags;    ///< PG_* flags.
+    struct cpage      *prev;     ///< LRU list links.
+    struct cpage      *next;
+    bio_t              bio;      ///< I/O for this page.
+} cpage_t;
+
+//----------------------------------------------------------------------------
+//  @function   pcache_get
+/// @brief      Return a cached page of device data, reading it if needed.
+/// @param[in]  dev     The device.
+/// @param[in]  index   The page number (byte offset / PAGE_SIZE).
+/// @returns    The page with a reference held for the caller, or NULL if the
+///             page is past the end of the device or could not be read.
+///             Release it with pcache_put.
+//----------------------------------------------------------------------------
+cpage_t *
+pcache_get(blkdev_t *dev, uint64_t index);
+
+//----------------------------------------------------------------------------
+//  @function   pcache_put
+/// @brief      Release a reference returned by pcache_get.
+/// @param[in]  page    The page.
+//----------------------------------------------------------------------------
+void
+pcache_put(cpage_t *page);
+
+//----------------------------------------------------------------------------
+//  @function   pcache_read
+/// @brief      Read bytes from a device through the page cache.
+/// @param[in]  dev     The device.
+/// @param[in]  offset  Byte offset on the device.
+/// @param[out] buf     Destination buffer.
+/// @param[in]  len     Number of bytes.
+/// @returns    BLK_STATUS_OK on success, or a negative BLK_STATUS_* value.
+//----------------------------------------------------------------------------
+int
+pcache_read(blkdev_t *dev, uint64_t offset, void *buf, uint64_t len);
+
+//----------------------------------------------------------------------------
+//  @function   pcache_write
+/// @brief      Write bytes to a device through the page cache.
+/// @details    The cached pages are updated and marked dirty; the flusher
+///             writes them to the device later. Pages overwritten completely
+///             are not read first. Use pcache_sync to wait for the data to
+///             reach the device.
+/// @param[in]  dev     The device.
+/// @param[in]  offset  Byte offset on the device.
+/// @param[in]  buf     Source buffer.
+/// @param[in]  len     Number of bytes.
+/// @returns    BLK_STATUS_OK on success, or a negative BLK_STATUS_* value.
+//----------------------------------------------------------------------------
+int
+pcache_write(blkdev_t *dev, uint64_t offset, const void *buf, uint64_t len);
+
+//----------------------------------------------------------------------------
+//  @function   pcache_writeback
+/// @brief      Run the flushers: start writing the dirty pages of devices
+///             whose pages have waited long enough, or of all devices if
+///             too much of the cache is dirty. Pages written through
+///             tracked mappings (see page_track_dirty) are picked up first.
+/// @details    Called from the idle loop. It doesn't wait for the writes,
+///             but first polls every device, completing writes started by
+///             earlier calls on devices that have no interrupts.
+//----------------------------------------------------------------------------
+void
+pcache_writeback();
+
+//----------------------------------------------------------------------------
+//  @function   pcache_sync
+/// @brief      Write all dirty pages of a device and wait for them.
+/// @param[in]  dev     The device, or NULL for all devices.
+/// @returns    BLK_STATUS_OK, or BLK_STATUS_ERROR if a write failed since
+///             the last sync.
+//----------------------------------------------------------------------------
+int
+pcache_sync(blkdev_t *dev);
+
+//----------------------------------------------------------------------------
+//  @function   pcache_shrink
+/// @brief      Reclaim unused pages from the cache.
+/// @param[in]  count   The number of pages to try to free.
+/// @returns    The number of pages freed.
+//----------------------------------------------------------------------------
+int
+pcache_shrink(int count);
@@ -49,6 +49,19 @@ log_addcallback(loglevel_t maxlevel, log_callback cb);
 void
 log_removecallback(log_callback cb);
 
+//----------------------------------------------------------------------------
+//  @function   log_replay
+/// @brief      Pass the messages still held in the log buffer to a callback,
+///             oldest first.
+/// @details    Lets a handler registered late catch up on messages logged
+///             before it was added.
+/// @param[in]  maxlevel    Replay messages up to and including this log
+///                         level.
+/// @param[in]  cb          The callback function
+//----------------------------------------------------------------------------
+void
+log_replay(loglevel_t maxlevel, log_callback cb);
+
 //----------------------------------------------------------------------------
 //  @function   log
 /// @brief      Log a message to the kernel log buffer.
@@ -68,7 +81,7 @@ log(loglevel_t level, const char *str);
 ///                     va_start.
 //----------------------------------------------------------------------------
 void
-logf(loglevel_t level, const char *format, ...);
+logf(loglevel_t level, const char *format, ...) PRINTF_FORMAT(2, 3);
 
 //----------------------------------------------------------------------------
 //  @function   logvf
@@ -80,4 +93,5 @@ logf(loglevel_t level, const char *format, ...);
 ///                     va_start.
 //----------------------------------------------------------------------------
 void
-logvf(loglevel_t level, const char *format, va_list args);
+logvf(loglevel_t level, const char *format, va_list args)
+PRINTF_FORMAT(2, 0);
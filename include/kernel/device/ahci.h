@@ -0,0 +1,19 @@
+//============================================================================
+/// @file       ahci.h
+/// @brief      AHCI SATA host controller driver.
+//============================================================================
+
+#pragma once
+
+#include <core.h>
+
+//----------------------------------------------------------------------------
+//  @function   ahci_init
+/// @brief      Register the AHCI PCI driver and bring up any SATA disks
+///             attached to AHCI controllers found by pci_init.
+/// @details    Each disk is registered with the block layer as "sda",
+///             "sdb", and so on. Disks that support native command queuing
+///             use up to 32 queued commands at once.
+//----------------------------------------------------------------------------
+void
+ahci_init();
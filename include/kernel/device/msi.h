@@ -0,0 +1,90 @@
+//============================================================================
+/// @file       msi.h
+/// @brief      PCI message signaled interrupts (MSI and MSI-X).
+/// @details    MSI vectors bypass the 8259 PIC. Each vector is delivered
+///             straight to a local APIC, so a device gets its own interrupt
+///             vector (or one per queue) and never shares an IRQ line.
+//============================================================================
+
+#pragma once
+
+#include <core.h>
+#include <kernel/device/pci.h>
+
+// Range of interrupt vectors handed out to MSI/MSI-X interrupts.
+#define TRAP_MSI_FIRST  0x30
+#define TRAP_MSI_LAST   0xee
+
+//----------------------------------------------------------------------------
+//  @typedef    msi_handler
+/// @brief      Handler called when a device's MSI/MSI-X vector fires.
+/// @param[in]  data    The opaque pointer passed to msi_set_handler.
+//----------------------------------------------------------------------------
+typedef void (*msi_handler)(void *data);
+
+//----------------------------------------------------------------------------
+//  @function   msi_alloc
+/// @brief      Allocate interrupt vectors for a device and program them
+///             into its MSI-X (preferred) or MSI capability.
+/// @details    All vectors start out masked where the device supports
+///             masking; install a handler before unmasking them. Legacy
+///             INTx delivery is disabled on success.
+/// @param[in]  dev     The device.
+/// @param[in]  count   The number of vectors wanted (1-MAX_PCI_VECTORS).
+/// @returns    The number of vectors allocated, which may be less than
+///             count, or 0 if the device can't use MSI.
+//----------------------------------------------------------------------------
+int
+msi_alloc(pcidev_t *dev, int count);
+
+//----------------------------------------------------------------------------
+//  @function   msi_free
+/// @brief      Disable MSI/MSI-X on a device and release its vectors.
+/// @param[in]  dev     The device.
+//----------------------------------------------------------------------------
+void
+msi_free(pcidev_t *dev);
+
+//----------------------------------------------------------------------------
+//  @function   msi_set_handler
+/// @brief      Install the handler for one of a device's vectors.
+/// @param[in]  dev     The device.
+/// @param[in]  index   The vector index (0 to count-1).
+/// @param[in]  handler The handler, or NULL to remove it.
+/// @param[in]  data    Opaque pointer passed to the handler.
+//----------------------------------------------------------------------------
+void
+msi_set_handler(pcidev_t *dev, int index, msi_handler handler, void *data);
+
+//----------------------------------------------------------------------------
+//  @function   msi_set_affinity
+/// @brief      Route one of a device's vectors to a local APIC.
+/// @details    MSI-X routes each vector independently. Plain MSI has one
+///             address register, so all of the device's vectors move.
+/// @param[in]  dev     The device.
+/// @param[in]  index   The vector index.
+/// @param[in]  apic_id The destination local APIC ID.
+//----------------------------------------------------------------------------
+void
+msi_set_affinity(pcidev_t *dev, int index, uint8_t apic_id);
+
+//----------------------------------------------------------------------------
+//  @function   msi_mask
+/// @brief      Mask or unmask one of a device's vectors.
+/// @details    Has no effect on MSI functions without per-vector masking.
+/// @param[in]  dev     The device.
+/// @param[in]  index   The vector index.
+/// @param[in]  mask    true to mask the vector, false to unmask it.
+//----------------------------------------------------------------------------
+void
+msi_mask(pcidev_t *dev, int index, bool mask);
+
+//----------------------------------------------------------------------------
+//  @function   msi_vector
+/// @brief      Return the CPU interrupt vector assigned to a device vector.
+/// @param[in]  dev     The device.
+/// @param[in]  index   The vector index.
+/// @returns    The interrupt vector, or 0 if index is not allocated.
+//----------------------------------------------------------------------------
+uint8_t
+msi_vector(const pcidev_t *dev, int index);
@@ -0,0 +1,21 @@
+//============================================================================
+/// @file       nvme.h
+/// @brief      NVM Express controller driver.
+//============================================================================
+
+#pragma once
+
+#include <core.h>
+
+//----------------------------------------------------------------------------
+//  @function   nvme_init
+/// @brief      Register the NVMe PCI driver and bring up the first namespace
+///             of each NVMe controller found by pci_init.
+/// @details    Each namespace is registered with the block layer as
+///             "nvme0n1", "nvme1n1", and so on. The driver creates one I/O
+///             submission/completion queue pair per CPU. Each pair belongs
+///             to one CPU and is only touched with interrupts disabled, so
+///             the I/O path needs no locks.
+//----------------------------------------------------------------------------
+void
+nvme_init();
@@ -8,5 +8,330 @@
 
 #include <core.h>
 
+//----------------------------------------------------------------------------
+// Constants
+//----------------------------------------------------------------------------
+
+/// Size of the legacy (port I/O reachable) PCI configuration space.
+#define PCI_CONFIG_SIZE      0x100
+
+/// Size of the PCIe extended configuration space (ECAM only).
+#define PCI_CONFIG_SIZE_EXT  0x1000
+
+/// Maximum number of PCI functions held in the device table.
+#define MAX_PCI_DEVICES      64
+
+/// Maximum number of capabilities cached per function.
+#define MAX_PCI_CAPS         12
+
+/// Wildcard value matching any vendor, device, class or subclass.
+#define PCI_ANY              0xffff
+
+// Configuration space register offsets (type 0 and type 1 headers)
+#define PCI_REG_VENDOR       0x00
+#define PCI_REG_DEVICE       0x02
+#define PCI_REG_COMMAND      0x04
+#define PCI_REG_STATUS       0x06
+#define PCI_REG_REVISION     0x08
+#define PCI_REG_PROGIF       0x09
+#define PCI_REG_SUBCLASS     0x0a
+#define PCI_REG_CLASS        0x0b
+#define PCI_REG_HDRTYPE      0x0e
+#define PCI_REG_BAR0         0x10
+#define PCI_REG_SECONDARY    0x19
+#define PCI_REG_SUBVENDOR    0x2c
+#define PCI_REG_SUBSYSTEM    0x2e
+#define PCI_REG_CAPPTR       0x34
+#define PCI_REG_IRQLINE      0x3c
+#define PCI_REG_IRQPIN       0x3d
+
+// Command register bits
+#define PCI_CMD_IO           (1 << 0)    ///< Respond to I/O space accesses.
+#define PCI_CMD_MEMORY       (1 << 1)    ///< Respond to memory accesses.
+#define PCI_CMD_MASTER       (1 << 2)    ///< Allow bus mastering (DMA).
+#define PCI_CMD_INTX_OFF     (1 << 10)   ///< Disable legacy INTx interrupts.
+
+// Status register bits
+#define PCI_STATUS_CAPS      (1 << 4)    ///< Capability list present.
+
+// Interrupt modes (pcidev_t::msi_mode)
+#define PCI_MSI_NONE         0           ///< Legacy INTx (or none).
+#define PCI_MSI_MSI          1           ///< MSI.
+#define PCI_MSI_MSIX         2           ///< MSI-X.
+
+// Capability IDs
+#define PCI_CAP_PM           0x01        ///< Power management.
+#define PCI_CAP_MSI          0x05        ///< Message signaled interrupts.
+#define PCI_CAP_VENDOR       0x09        ///< Vendor-specific.
+#define PCI_CAP_PCIE         0x10        ///< PCI express.
+#define PCI_CAP_MSIX         0x11        ///< Extended MSI (MSI-X).
+
+/// Maximum number of MSI/MSI-X vectors allocated to one function.
+#define MAX_PCI_VECTORS      16
+
+// BAR flags
+#define PCI_BAR_IO           (1 << 0)    ///< BAR decodes I/O ports.
+#define PCI_BAR_MEM64        (1 << 1)    ///< 64-bit memory BAR.
+#define PCI_BAR_PREFETCH     (1 << 2)    ///< Prefetchable memory BAR.
+
+//----------------------------------------------------------------------------
+//  @struct     pcibar_t
+/// @brief      A sized base address register.
+//----------------------------------------------------------------------------
+struct pcibar
+{
+    uint64_t addr;           ///< Base address (port number for I/O BARs).
+    uint64_t size;           ///< Size in bytes, or 0 if unimplemented.
+    uint32_t flags;          ///< PCI_BAR_* flags.
+};
+
+typedef struct pcibar pcibar_t;
+
+//----------------------------------------------------------------------------
+//  @struct     pcicap_t
+/// @brief      A capability list entry.
+//----------------------------------------------------------------------------
+struct pcicap
+{
+    uint8_t id;              ///< Capability ID.
+    uint8_t offset;          ///< Offset of the capability in config space.
+};
+
+typedef struct pcicap pcicap_t;
+
+struct pcidrv;
+
+//----------------------------------------------------------------------------
+//  @struct     pcidev_t
+/// @brief      A cached record describing one PCI function.
+/// @details    Records are filled in once by pci_init, so drivers never need
+///             to rescan configuration space to find their devices.
+//----------------------------------------------------------------------------
+struct pcidev
+{
+    uint8_t              bus;        ///< Bus number.
+    uint8_t              device;     ///< Device number.
+    uint8_t              func;       ///< Function number.
+    uint8_t              hdrtype;    ///< Header type (without MF bit).
+    uint16_t             vendor;     ///< Vendor ID.
+    uint16_t             devid;      ///< Device ID.
+    uint16_t             subvendor;  ///< Subsystem vendor ID.
+    uint16_t             subsys;     ///< Subsystem ID.
+    uint8_t              class;      ///< Class code.
+    uint8_t              subclass;   ///< Subclass code.
+    uint8_t              progif;     ///< Programming interface.
+    uint8_t              revision;   ///< Revision ID.
+    uint8_t              irq_line;   ///< Legacy interrupt line.
+    uint8_t              irq_pin;    ///< Legacy interrupt pin (0 = none).
+    uint8_t              secondary;  ///< Secondary bus (bridges only).
+    uint8_t              caps_count; ///< Number of cached capabilities.
+    pcicap_t             caps[MAX_PCI_CAPS];
+    pcibar_t             bar[6];     ///< Sized BARs (2 for bridges).
+    uint8_t              msi_mode;   ///< PCI_MSI_* interrupt mode.
+    uint8_t              msi_count;  ///< Number of allocated vectors.
+    uint8_t              msi_vector[MAX_PCI_VECTORS];
+    volatile uint32_t   *msix_table; ///< Mapped MSI-X vector table.
+    const struct pcidrv *driver;     ///< Driver bound to the function.
+    void                *drvdata;    ///< Driver private data.
+};
+
+typedef struct pcidev pcidev_t;
+
+//----------------------------------------------------------------------------
+//  @struct     pciid_t
+/// @brief      A device match table entry.
+/// @details    Any field may be PCI_ANY. A table is terminated by an entry
+///             whose vendor is 0.
+//----------------------------------------------------------------------------
+struct pciid
+{
+    uint16_t vendor;
+    uint16_t devid;
+    uint16_t class;
+    uint16_t subclass;
+};
+
+typedef struct pciid pciid_t;
+
+//----------------------------------------------------------------------------
+//  @struct     pcidrv_t
+/// @brief      A PCI driver registration.
+//----------------------------------------------------------------------------
+struct pcidrv
+{
+    const char    *name;       ///< Driver name.
+    const pciid_t *ids;        ///< Match table.
+
+    /// Called for each matching, unbound function. Return true to bind
+    /// the driver to the function.
+    bool (*probe)(pcidev_t *dev);
+};
+
+typedef struct pcidrv pcidrv_t;
+
+//----------------------------------------------------------------------------
+//  @enum       pci_access
+/// @brief      Mechanism used to reach PCI configuration space.
+//----------------------------------------------------------------------------
+enum pci_access
+{
+    PCI_ACCESS_LEGACY = 0,   ///< Port I/O through 0xCF8/0xCFC.
+    PCI_ACCESS_ECAM   = 1,   ///< PCIe memory-mapped configuration (MCFG).
+};
+
+//----------------------------------------------------------------------------
+//  @function   pci_init
+/// @brief      Initialize the PCI configuration space accessors and scan
+///             the PCI hierarchy into the device table.
+/// @details    The scan recurses through every PCI-to-PCI bridge and is
+///             performed exactly once. This must be called before any other
+///             PCI function.
+//----------------------------------------------------------------------------
 void
 pci_init();
+
+//----------------------------------------------------------------------------
+//  @function   pci_next_device
+/// @brief      Return the next function in the device table.
+/// @param[in]  prev    Pointer to the device returned by a previous call to
+///                     this function. Pass NULL for the first call.
+/// @returns    A pointer to the next device, or NULL if none remain.
+//----------------------------------------------------------------------------
+pcidev_t *
+pci_next_device(const pcidev_t *prev);
+
+//----------------------------------------------------------------------------
+//  @function   pci_find_cap
+/// @brief      Find a capability in a function's cached capability list.
+/// @param[in]  dev     The device.
+/// @param[in]  id      The capability ID to look for.
+/// @returns    The configuration space offset of the capability, or 0 if the
+///             function does not have it.
+//----------------------------------------------------------------------------
+uint8_t
+pci_find_cap(const pcidev_t *dev, uint8_t id);
+
+//----------------------------------------------------------------------------
+//  @function   pci_register_driver
+/// @brief      Register a driver and bind it to every matching function in
+///             the device table that is not already bound.
+/// @param[in]  drv     The driver registration. Must remain valid for the
+///                     lifetime of the kernel.
+/// @returns    The number of functions bound to the driver.
+//----------------------------------------------------------------------------
+int
+pci_register_driver(const pcidrv_t *drv);
+
+//----------------------------------------------------------------------------
+//  @function   pci_enable
+/// @brief      Set bits in a function's command register.
+/// @param[in]  dev     The device.
+/// @param[in]  cmd     PCI_CMD_* bits to set.
+//----------------------------------------------------------------------------
+void
+pci_enable(const pcidev_t *dev, uint16_t cmd);
+
+//----------------------------------------------------------------------------
+//  @function   pci_access
+/// @brief      Return the mechanism used to access configuration space.
+/// @details    ECAM is used for every bus covered by an ACPI MCFG entry.
+///             Buses not covered by MCFG fall back to legacy port I/O.
+/// @returns    PCI_ACCESS_ECAM if an MCFG table was found, otherwise
+///             PCI_ACCESS_LEGACY.
+//----------------------------------------------------------------------------
+enum pci_access
+pci_access();
+
+//----------------------------------------------------------------------------
+//  @function   pci_config_read32
+/// @brief      Read a dword from a function's configuration space.
+/// @details    When ECAM is available this is a single memory-mapped load
+///             and requires no locking. Offsets beyond PCI_CONFIG_SIZE are
+///             only reachable through ECAM; reading them without ECAM
+///             returns all ones.
+/// @param[in]  bus     Bus number (0-255).
+/// @param[in]  device  Device number (0-31).
+/// @param[in]  func    Function number (0-7).
+/// @param[in]  offset  Dword-aligned byte offset (0-4095).
+/// @returns    The configuration dword, or 0xffffffff if unreachable.
+//----------------------------------------------------------------------------
+uint32_t
+pci_config_read32(uint32_t bus, uint32_t device, uint32_t func,
+                  uint32_t offset);
+
+//----------------------------------------------------------------------------
+//  @function   pci_config_read16
+/// @brief      Read a word from a function's configuration space.
+/// @param[in]  bus     Bus number (0-255).
+/// @param[in]  device  Device number (0-31).
+/// @param[in]  func    Function number (0-7).
+/// @param[in]  offset  Word-aligned byte offset (0-4095).
+/// @returns    The configuration word, or 0xffff if unreachable.
+//----------------------------------------------------------------------------
+uint16_t
+pci_config_read16(uint32_t bus, uint32_t device, uint32_t func,
+                  uint32_t offset);
+
+//----------------------------------------------------------------------------
+//  @function   pci_config_read8
+/// @brief      Read a byte from a function's configuration space.
+/// @param[in]  bus     Bus number (0-255).
+/// @param[in]  device  Device number (0-31).
+/// @param[in]  func    Function number (0-7).
+/// @param[in]  offset  Byte offset (0-4095).
+/// @returns    The configuration byte, or 0xff if unreachable.
+//----------------------------------------------------------------------------
+uint8_t
+pci_config_read8(uint32_t bus, uint32_t device, uint32_t func,
+                 uint32_t offset);
+
+//----------------------------------------------------------------------------
+//  @function   pci_config_write32
+/// @brief      Write a dword to a function's configuration space.
+/// @details    Writes to unreachable offsets are silently dropped.
+/// @param[in]  bus     Bus number (0-255).
+/// @param[in]  device  Device number (0-31).
+/// @param[in]  func    Function number (0-7).
+/// @param[in]  offset  Dword-aligned byte offset (0-4095).
+/// @param[in]  value   The value to write.
+//----------------------------------------------------------------------------
+void
+pci_config_write32(uint32_t bus, uint32_t device, uint32_t func,
+                   uint32_t offset, uint32_t value);
+
+//----------------------------------------------------------------------------
+//  @function   pci_config_write16
+/// @brief      Write a word to a function's configuration space.
+/// @param[in]  bus     Bus number (0-255).
+/// @param[in]  device  Device number (0-31).
+/// @param[in]  func    Function number (0-7).
+/// @param[in]  offset  Word-aligned byte offset (0-4095).
+/// @param[in]  value   The value to write.
+//----------------------------------------------------------------------------
+void
+pci_config_write16(uint32_t bus, uint32_t device, uint32_t func,
+                   uint32_t offset, uint16_t value);
+
+//----------------------------------------------------------------------------
+//  @function   pci_config_write8
+/// @brief      Write a byte to a function's configuration space.
+/// @param[in]  bus     Bus number (0-255).
+/// @param[in]  device  Device number (0-31).
+/// @param[in]  func    Function number (0-7).
+/// @param[in]  offset  Byte offset (0-4095).
+/// @param[in]  value   The value to write.
+//----------------------------------------------------------------------------
+void
+pci_config_write8(uint32_t bus, uint32_t device, uint32_t func,
+                  uint32_t offset, uint8_t value);
+
+//----------------------------------------------------------------------------
+//  @function   pci_map_bar
+/// @brief      Map a memory BAR into the kernel page table.
+/// @param[in]  dev     The device.
+/// @param[in]  index   The BAR index (0-5).
+/// @returns    A pointer to the uncached BAR memory, or NULL if the BAR is
+///             not an implemented memory BAR.
+//----------------------------------------------------------------------------
+void *
+pci_map_bar(const pcidev_t *dev, int index);
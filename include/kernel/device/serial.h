@@ -1,4 +1,138 @@
+//============================================================================
+/// @file       serial.h
+/// @brief      Interrupt-driven 16550 UART (COM1/COM2) driver.
+/// @details    Output is queued in a per-port transmit ring and moved into
+///             the UART's 16-byte FIFO by the transmitter-empty interrupt,
+///             so writers never wait for the line. Received bytes are
+///             collected by the receive interrupt into a per-port ring.
+//============================================================================
+
 #pragma once
 
-void serial_init(void);
-void serial_write_com(int, unsigned char);
+#include <core.h>
+#include <stdarg.h>
+#include <kernel/debug/log.h>
+
+// Port numbers
+#define COM1                 1
+#define COM2                 2
+
+// Line rates
+#define SERIAL_BAUD_MAX      115200     ///< The UART's base clock / 16.
+#define SERIAL_BAUD_DEFAULT  115200
+
+// Ring sizes, in bytes. Both must be powers of two. The transmit ring
+// holds over a second of output at the default rate, enough to absorb a
+// burst of log messages.
+#define SERIAL_TX_RING       16384
+#define SERIAL_RX_RING       256
+
+//----------------------------------------------------------------------------
+//  @function   serial_init
+/// @brief      Initialize COM1 and COM2 at the default rate and install the
+///             serial interrupt handlers.
+/// @details    Ports that don't respond are ignored, and writes to them are
+///             discarded. Calling serial_init more than once is harmless.
+//----------------------------------------------------------------------------
+void
+serial_init(void);
+
+//----------------------------------------------------------------------------
+//  @function   serial_configure
+/// @brief      Set a port's line rate. The line is always 8N1.
+/// @param[in]  com     The port (COM1 or COM2).
+/// @param[in]  baud    The rate in bits per second, at most SERIAL_BAUD_MAX.
+///                     Rates that don't divide SERIAL_BAUD_MAX are rounded
+///                     up to the next one that does.
+/// @returns    0 on success, -ENODEV for a missing port, or -EINVAL for an
+///             unsupported rate.
+//----------------------------------------------------------------------------
+int
+serial_configure(int com, uint32_t baud);
+
+//----------------------------------------------------------------------------
+//  @function   serial_write
+/// @brief      Queue bytes for transmission without waiting for the line.
+/// @details    Bytes that don't fit in the transmit ring are dropped and
+///             counted, except when the caller runs with interrupts
+///             disabled: then nothing can drain the ring, so the ring is
+///             emptied by polling instead.
+/// @param[in]  com     The port (COM1 or COM2).
+/// @param[in]  buf     The bytes to send.
+/// @param[in]  len     The number of bytes to send.
+/// @returns    The number of bytes queued.
+//----------------------------------------------------------------------------
+size_t
+serial_write(int com, const void *buf, size_t len);
+
+//----------------------------------------------------------------------------
+//  @function   serial_write_com
+/// @brief      Queue a single byte for transmission.
+/// @param[in]  com     The port (COM1 or COM2).
+/// @param[in]  data    The byte to send.
+//----------------------------------------------------------------------------
+void
+serial_write_com(int com, unsigned char data);
+
+//----------------------------------------------------------------------------
+//  @function   serial_printf
+/// @brief      Queue printf-formatted output for transmission.
+/// @details    Output is formatted straight into the transmit ring, in one
+///             piece, with a carriage return added before each line feed.
+///             Bytes that don't fit are handled as by serial_write.
+/// @param[in]  com     The port (COM1 or COM2).
+/// @param[in]  format  The null-terminated format string.
+/// @param[in]  ...     Variable arguments list to be initialized with
+///                     va_start.
+/// @returns    The number of characters formatted.
+//----------------------------------------------------------------------------
+int
+serial_printf(int com, const char *format, ...) PRINTF_FORMAT(2, 3);
+
+//----------------------------------------------------------------------------
+//  @function   serial_vprintf
+/// @brief      Queue printf-formatted output for transmission using a
+///             variable argument list.
+/// @details    See serial_printf for further details.
+/// @param[in]  com     The port (COM1 or COM2).
+/// @param[in]  format  The null-terminated format string.
+/// @param[in]  args    Variable arguments list to be initialized with
+///                     va_start.
+/// @returns    The number of characters formatted.
+//----------------------------------------------------------------------------
+int
+serial_vprintf(int com, const char *format, va_list args)
+PRINTF_FORMAT(2, 0);
+
+//----------------------------------------------------------------------------
+//  @function   serial_flush
+/// @brief      Wait until everything queued on a port has left the UART.
+/// @details    Polls the line, so it works with interrupts disabled, e.g.
+///             before a halt.
+/// @param[in]  com     The port (COM1 or COM2).
+//----------------------------------------------------------------------------
+void
+serial_flush(int com);
+
+//----------------------------------------------------------------------------
+//  @function   serial_read
+/// @brief      Take received bytes from a port without waiting.
+/// @param[in]  com     The port (COM1 or COM2).
+/// @param[out] buf     The buffer to receive into.
+/// @param[in]  len     The size of `buf'.
+/// @returns    The number of bytes stored, 0 if none have arrived.
+//----------------------------------------------------------------------------
+size_t
+serial_read(int com, void *buf, size_t len);
+
+//----------------------------------------------------------------------------
+//  @function   serial_log_init
+/// @brief      Copy kernel log messages to a serial port.
+/// @details    Messages already in the log buffer are sent first. Each
+///             message is stamped with the time since boot and its level,
+///             and queued without waiting for the line.
+/// @param[in]  com         The port (COM1 or COM2).
+/// @param[in]  maxlevel    Send messages up to and including this level.
+//----------------------------------------------------------------------------
+void
+serial_log_init(int com, loglevel_t maxlevel);
@@ -8,6 +8,13 @@
 
 #include <core.h>
 
+//----------------------------------------------------------------------------
+//  @typedef    timer_callback
+/// @brief      Function called on every timer interrupt.
+/// @details    Runs in interrupt context with interrupts disabled.
+//----------------------------------------------------------------------------
+typedef void (*timer_callback)();
+
 //----------------------------------------------------------------------------
 //  @function   timer_init
 /// @brief      Initialize the timer controller so that it interrupts the
@@ -38,3 +45,25 @@ timer_enable();
 //----------------------------------------------------------------------------
 void
 timer_disable();
+
+//----------------------------------------------------------------------------
+//  @function   timer_ticks
+/// @brief      Return the number of timer interrupts since timer_init.
+//----------------------------------------------------------------------------
+uint64_t
+timer_ticks();
+
+//----------------------------------------------------------------------------
+//  @function   timer_rate
+/// @brief      Return the actual timer interrupt frequency in Hz.
+//----------------------------------------------------------------------------
+uint32_t
+timer_rate();
+
+//----------------------------------------------------------------------------
+//  @function   timer_addcallback
+/// @brief      Add a function to be called on every timer interrupt.
+/// @param[in]  cb      The callback function.
+//----------------------------------------------------------------------------
+void
+timer_addcallback(timer_callback cb);
@@ -16,6 +16,12 @@
 /// The number of available virtual consoles.
 #define MAX_TTYS  4
 
+/// Rows kept per console, counting the 25 on screen and the scrollback
+/// history above them. May be overridden at build time.
+#ifndef TTY_HISTORY_ROWS
+#define TTY_HISTORY_ROWS  1024
+#endif
+
 //----------------------------------------------------------------------------
 //  @enum       textcolor_t
 /// @brief      Color values used for tty text.
@@ -63,6 +69,16 @@ typedef struct screenpos screenpos_t;
 void
 tty_init();
 
+//----------------------------------------------------------------------------
+//  @function   tty_flush
+/// @brief      Copy pending changes to the active console onto the screen.
+/// @details    Console output is drawn into a memory buffer, and changed
+///             rows are copied to the screen at most once per timer tick.
+///             Call this to make output visible immediately.
+//----------------------------------------------------------------------------
+void
+tty_flush();
+
 //----------------------------------------------------------------------------
 //  @function   tty_activate
 /// @brief      Activate the requested virtual console.
@@ -133,6 +149,18 @@ tty_get_textcolor_bg(int id);
 void
 tty_clear(int id);
 
+//----------------------------------------------------------------------------
+//  @function   tty_scroll
+/// @brief      Scroll the virtual console's view through its history.
+/// @details    The view stays put until more text is written to the
+///             console, which returns it to the bottom.
+/// @param[in]  id      Virtual tty id (0-3).
+/// @param[in]  rows    Rows to scroll back (positive) or forward (negative).
+///                     The view stops at the ends of the history.
+//----------------------------------------------------------------------------
+void
+tty_scroll(int id, int rows);
+
 //----------------------------------------------------------------------------
 //  @function   tty_setpos
 /// @brief      Set the position of the cursor on the virtual console.
@@ -158,9 +186,21 @@ tty_getpos(int id, screenpos_t *pos);
 /// @brief      Output a null-terminated string to the virtual console using
 ///             the console's current text color and screen position.
 ///
-/// @details    A newline character (\\n) causes the screen position to
-///             be updated as though a carriage return and line feed were
-///             performed.
+/// @details    The console emulates a VT100-style terminal. A newline
+///             character (\\n) causes the screen position to be updated
+///             as though a carriage return and line feed were performed.
+///             Carriage return (\\r), tab (\\t) and backspace (\\b) are
+///             also recognized; backspace erases the character it backs
+///             over.
+///
+///             ANSI control sequences (\033[...) move the cursor (A-G, H,
+///             f, d, s, u), erase (J, K), insert and delete lines (L, M),
+///             scroll (S, T), set the scroll region (r), select colors and
+///             bold or reverse text (m), and show or hide the cursor
+///             (?25h, ?25l). \0337 and \0338 save and restore the cursor,
+///             and \033D, \033E and \033M move down or up a line,
+///             scrolling at the edges of the scroll region. Other sequences
+///             are ignored.
 ///
 ///             To change the foreground color on the fly without having to
 ///             call a console function, you may use the escape sequence
@@ -168,7 +208,9 @@ tty_getpos(int id, screenpos_t *pos);
 ///             foreground color to use for all following text. If x is a
 ///             hexadecimal digit, then it represents one of the 16 textcolor
 ///             codes. If x is '-', then it represents the console's
-///             original foreground color setting.
+///             original foreground color setting. Because of this, a
+///             control sequence consisting of just a letter from A to F or
+///             a to f takes effect when the following character arrives.
 ///
 ///             To change the background color on the fly, use the escape
 ///             sequence \033{x}. The meaning of x is the same as with
@@ -203,4 +245,4 @@ tty_printc(int id, char ch);
 /// @returns    The number of characters written to the console.
 //----------------------------------------------------------------------------
 int
-tty_printf(int id, const char *format, ...);
+tty_printf(int id, const char *format, ...) PRINTF_FORMAT(2, 3);
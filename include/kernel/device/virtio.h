@@ -0,0 +1,239 @@
+//============================================================================
+/// @file       virtio.h
+/// @brief      Virtio 1.x PCI transport and virtqueues.
+/// @details    Supports the modern (capability-based) PCI transport with
+///             split and packed virtqueues. Buffers are queued with
+///             virtq_add and published with virtq_kick, which only writes
+///             the doorbell if the device has asked to be notified, so a
+///             batch of buffers costs a single notification.
+//============================================================================
+
+#pragma once
+
+#include <core.h>
+#include <kernel/device/pci.h>
+#include <kernel/device/msi.h>
+#include <kernel/spinlock.h>
+
+// PCI vendor ID used by all virtio devices.
+#define VIRTIO_PCI_VENDOR        0x1af4
+
+// Device status bits
+#define VIRTIO_STATUS_ACK        (1 << 0)
+#define VIRTIO_STATUS_DRIVER     (1 << 1)
+#define VIRTIO_STATUS_DRIVER_OK  (1 << 2)
+#define VIRTIO_STATUS_FEATURES_OK (1 << 3)
+#define VIRTIO_STATUS_FAILED     (1 << 7)
+
+// Device-independent feature bits
+#define VIRTIO_F_INDIRECT_DESC   28
+#define VIRTIO_F_EVENT_IDX       29
+#define VIRTIO_F_VERSION_1       32
+#define VIRTIO_F_RING_PACKED     34
+
+/// Largest virtqueue size the driver will use.
+#define VIRTQ_MAX_SIZE           256
+
+/// Maximum number of virtqueues per device.
+#define VIRTIO_MAX_QUEUES        (MAX_PCI_VECTORS - 1)
+
+/// Build a 64-bit feature mask from a feature bit number.
+#define VIRTIO_FEATURE(bit)      ((uint64_t)1 << (bit))
+
+typedef struct virtio_dev virtio_dev_t;
+typedef struct virtq      virtq_t;
+
+//----------------------------------------------------------------------------
+//  @struct     virtq_buf
+/// @brief      One physically contiguous buffer of a virtqueue chain.
+//----------------------------------------------------------------------------
+typedef struct virtq_buf
+{
+    const void *addr;       ///< Identity-mapped address of the buffer.
+    uint32_t    len;        ///< Length in bytes.
+} virtq_buf_t;
+
+//----------------------------------------------------------------------------
+//  @struct     virtq
+/// @brief      A split or packed virtqueue.
+//----------------------------------------------------------------------------
+struct virtq
+{
+    virtio_dev_t      *vdev;
+    uint16_t           index;       ///< Queue index on the device.
+    uint16_t           size;        ///< Number of descriptors.
+    uint16_t           num_free;    ///< Free descriptors.
+    uint16_t           free_head;   ///< Head of the free list (split) or next
+                                    ///< free slot (packed).
+    uint16_t           last_used;   ///< Next used index (or slot) to reap.
+    uint16_t           free_id;     ///< Head of the free buffer ID stack
+                                    ///< (packed only).
+    uint16_t           avail_idx;   ///< Next avail index (split only).
+    uint16_t           pending;     ///< Entries added since the last kick.
+    bool               packed;      ///< true for a packed virtqueue.
+    bool               event_idx;   ///< VIRTIO_F_EVENT_IDX negotiated.
+    bool               cb_disabled; ///< Interrupts suppressed by the driver.
+    bool               avail_wrap;  ///< Packed ring driver wrap counter.
+    bool               used_wrap;   ///< Packed ring device wrap counter.
+    void              *desc;        ///< Descriptor table (or packed ring).
+    void              *avail;       ///< Driver area.
+    void              *used;        ///< Device area.
+    volatile uint16_t *notify;      ///< Doorbell register.
+    uint16_t           next[VIRTQ_MAX_SIZE];  ///< Chain links (split) or
+                                              ///< free buffer IDs (packed).
+    uint16_t           chain[VIRTQ_MAX_SIZE]; ///< Descriptors per buffer ID.
+    void              *cookie[VIRTQ_MAX_SIZE];
+    spin_lock_t        lock;
+};
+
+//----------------------------------------------------------------------------
+//  @struct     virtio_dev
+/// @brief      A virtio device on the PCI transport.
+//----------------------------------------------------------------------------
+struct virtio_dev
+{
+    pcidev_t          *pci;
+    volatile uint8_t  *common;      ///< Common configuration structure.
+    volatile uint8_t  *isr;         ///< ISR status register.
+    volatile uint8_t  *device;      ///< Device-specific configuration.
+    volatile uint8_t  *notify_base; ///< Notification area.
+    uint32_t           notify_mult; ///< Notification offset multiplier.
+    uint64_t           features;    ///< Negotiated features.
+    int                num_queues;  ///< Queues set up by virtio_setup_queue.
+    bool               msix;        ///< Queues interrupt through MSI-X.
+    virtq_t            queue[VIRTIO_MAX_QUEUES];
+};
+
+//----------------------------------------------------------------------------
+//  @function   virtio_init
+/// @brief      Locate a virtio PCI device's configuration structures,
+///             reset it and negotiate features.
+/// @param[out] vdev        The virtio device record to initialize.
+/// @param[in]  pci         The PCI function.
+/// @param[in]  features    Device-specific features the driver supports.
+///                         VERSION_1, EVENT_IDX and RING_PACKED are added
+///                         automatically.
+/// @returns    true if the device accepted the negotiated features.
+//----------------------------------------------------------------------------
+bool
+virtio_init(virtio_dev_t *vdev, pcidev_t *pci, uint64_t features);
+
+//----------------------------------------------------------------------------
+//  @function   virtio_max_queues
+/// @brief      Return the number of virtqueues the device provides.
+//----------------------------------------------------------------------------
+int
+virtio_max_queues(const virtio_dev_t *vdev);
+
+//----------------------------------------------------------------------------
+//  @function   virtio_alloc_vectors
+/// @brief      Allocate one MSI-X vector per virtqueue.
+/// @param[in]  vdev    The device.
+/// @param[in]  nqueues The number of queues that will be set up.
+/// @returns    true if MSI-X is enabled. If false, queues must be polled.
+//----------------------------------------------------------------------------
+bool
+virtio_alloc_vectors(virtio_dev_t *vdev, int nqueues);
+
+//----------------------------------------------------------------------------
+//  @function   virtio_setup_queue
+/// @brief      Allocate and enable a virtqueue.
+/// @details    If virtio_alloc_vectors succeeded, queue n is bound to MSI-X
+///             vector n and handler is installed on it. Otherwise the queue
+///             must be polled.
+/// @param[in]  vdev    The device.
+/// @param[in]  index   The queue index.
+/// @param[in]  handler The queue's interrupt handler, or NULL.
+/// @param[in]  data    Opaque pointer passed to the handler.
+/// @returns    The virtqueue, or NULL on failure.
+//----------------------------------------------------------------------------
+virtq_t *
+virtio_setup_queue(virtio_dev_t *vdev, int index, msi_handler handler,
+                   void *data);
+
+//----------------------------------------------------------------------------
+//  @function   virtio_ready
+/// @brief      Set DRIVER_OK, letting the device start processing queues.
+//----------------------------------------------------------------------------
+void
+virtio_ready(virtio_dev_t *vdev);
+
+//----------------------------------------------------------------------------
+//  @function   virtio_has_feature
+/// @brief      Return true if a feature bit was negotiated.
+//----------------------------------------------------------------------------
+bool
+virtio_has_feature(const virtio_dev_t *vdev, int bit);
+
+//----------------------------------------------------------------------------
+//  @function   virtio_config_read8/16/32/64
+/// @brief      Read from the device-specific configuration structure.
+/// @param[in]  vdev    The device.
+/// @param[in]  offset  Byte offset within the configuration structure.
+//----------------------------------------------------------------------------
+uint8_t
+virtio_config_read8(const virtio_dev_t *vdev, uint32_t offset);
+
+uint16_t
+virtio_config_read16(const virtio_dev_t *vdev, uint32_t offset);
+
+uint32_t
+virtio_config_read32(const virtio_dev_t *vdev, uint32_t offset);
+
+uint64_t
+virtio_config_read64(const virtio_dev_t *vdev, uint32_t offset);
+
+//----------------------------------------------------------------------------
+//  @function   virtq_add
+/// @brief      Add a descriptor chain to a virtqueue without notifying the
+///             device.
+/// @details    The caller must hold vq->lock with interrupts disabled.
+/// @param[in]  vq      The virtqueue.
+/// @param[in]  bufs    The buffers: first the out (device-readable) buffers,
+///                     then the in (device-writable) buffers.
+/// @param[in]  out     The number of out buffers.
+/// @param[in]  in      The number of in buffers.
+/// @param[in]  cookie  Non-NULL value returned by virtq_get on completion.
+/// @returns    false if the virtqueue does not have enough free descriptors.
+//----------------------------------------------------------------------------
+bool
+virtq_add(virtq_t *vq, const virtq_buf_t *bufs, int out, int in,
+          void *cookie);
+
+//----------------------------------------------------------------------------
+//  @function   virtq_kick
+/// @brief      Publish chains added since the last kick, and notify the
+///             device unless it has suppressed notifications.
+/// @details    The caller must hold vq->lock with interrupts disabled.
+//----------------------------------------------------------------------------
+void
+virtq_kick(virtq_t *vq);
+
+//----------------------------------------------------------------------------
+//  @function   virtq_get
+/// @brief      Reap one completed chain from a virtqueue.
+/// @details    The caller must hold vq->lock with interrupts disabled.
+/// @param[in]  vq      The virtqueue.
+/// @param[out] len     Receives the number of bytes the device wrote (may
+///                     be NULL).
+/// @returns    The completed chain's cookie, or NULL if none are pending.
+//----------------------------------------------------------------------------
+void *
+virtq_get(virtq_t *vq, uint32_t *len);
+
+//----------------------------------------------------------------------------
+//  @function   virtq_disable_cb
+/// @brief      Ask the device not to interrupt for this queue. Used while
+///             the driver is already reaping completions.
+//----------------------------------------------------------------------------
+void
+virtq_disable_cb(virtq_t *vq);
+
+//----------------------------------------------------------------------------
+//  @function   virtq_enable_cb
+/// @brief      Re-enable interrupts for this queue.
+/// @returns    false if completions arrived while interrupts were off, in
+///             which case the caller should reap again.
+//----------------------------------------------------------------------------
+bool
+virtq_enable_cb(virtq_t *vq);
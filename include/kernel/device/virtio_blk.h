@@ -0,0 +1,19 @@
+//============================================================================
+/// @file       virtio_blk.h
+/// @brief      Virtio block device driver.
+//============================================================================
+
+#pragma once
+
+#include <core.h>
+
+//----------------------------------------------------------------------------
+//  @function   virtio_blk_init
+/// @brief      Register the virtio-blk PCI driver and bring up any virtio
+///             block devices found by pci_init.
+/// @details    Each device is registered with the block layer as "vda",
+///             "vdb", and so on, with one request queue per CPU (up to the
+///             number of queues the device offers).
+//----------------------------------------------------------------------------
+void
+virtio_blk_init();
@@ -0,0 +1,21 @@
+//============================================================================
+/// @file       virtio_net.h
+/// @brief      Virtio network device driver.
+//============================================================================
+
+#pragma once
+
+#include <core.h>
+
+//----------------------------------------------------------------------------
+//  @function   virtio_net_init
+/// @brief      Register the virtio-net PCI driver and bring up any virtio
+///             network devices found by pci_init.
+/// @details    Each device is registered as "eth0", "eth1", and so on, with
+///             one receive/transmit queue pair per CPU (up to the number of
+///             pairs the device offers). Receive rings are filled from a
+///             pool allocated at probe time. Checksum and TCP segmentation
+///             offloads are used when the device supports them.
+//----------------------------------------------------------------------------
+void
+virtio_net_init();
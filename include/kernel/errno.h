@@ -0,0 +1,45 @@
+//============================================================================
+/// @file       errno.h
+/// @brief      Kernel error codes.
+/// @details    Kernel services that can fail for several reasons return one
+///             of these codes negated (e.g. -ENOENT), and 0 or a positive
+///             value on success.
+//============================================================================
+
+#pragma once
+
+#define EPERM                1      ///< Operation not permitted
+#define ENOENT               2      ///< No such file or directory
+#define EIO                  5      ///< I/O error
+#define EBADF                9      ///< Bad file descriptor
+#define EAGAIN               11     ///< Try again
+#define ENOMEM               12     ///< Out of memory
+#define EBUSY                16     ///< Device or resource busy
+#define EEXIST               17     ///< File exists
+#define ENODEV               19     ///< No such device
+#define ENOTDIR              20     ///< Not a directory
+#define EISDIR               21     ///< Is a directory
+#define EINVAL               22     ///< Invalid argument
+#define ENFILE               23     ///< File table overflow
+#define EFBIG                27     ///< File too large
+#define ENOSPC               28     ///< No space left on device
+#define EROFS                30     ///< Read-only file system
+#define EPIPE                32     ///< Broken pipe
+#define ENAMETOOLONG         36     ///< File name too long
+#define ENOSYS               38     ///< Function not implemented
+#define ENOTEMPTY            39     ///< Directory not empty
+#define ENOTSOCK             88     ///< Socket operation on non-socket
+#define EMSGSIZE             90     ///< Message too long
+#define EPROTONOSUPPORT      93     ///< Protocol not supported
+#define EOPNOTSUPP           95     ///< Operation not supported
+#define EAFNOSUPPORT         97     ///< Address family not supported
+#define EADDRINUSE           98     ///< Address already in use
+#define ENETUNREACH          101    ///< Network is unreachable
+#define ECONNRESET           104    ///< Connection reset by peer
+#define ENOBUFS              105    ///< No buffer space available
+#define EISCONN              106    ///< Transport endpoint is already connected
+#define ENOTCONN             107    ///< Transport endpoint is not connected
+#define ETIMEDOUT            110    ///< Connection timed out
+#define ECONNREFUSED         111    ///< Connection refused
+#define EALREADY             114    ///< Operation already in progress
+#define EINPROGRESS          115    ///< Operation now in progress
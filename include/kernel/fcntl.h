@@ -1,3 +1,5 @@
+#pragma once
+
 #define O_RDONLY 0x000
 #define O_WRONLY 0x001
 #define O_RDWR 0x002
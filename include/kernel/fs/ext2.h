@@ -0,0 +1,22 @@
+//============================================================================
+/// @file       ext2.h
+/// @brief      Second extended filesystem.
+//============================================================================
+
+#pragma once
+
+#include <core.h>
+
+//----------------------------------------------------------------------------
+//  @function   ext2_init
+/// @brief      Register the "ext2" filesystem type with the VFS.
+/// @details    All metadata and file data go through the device's page
+///             cache. New blocks are allocated next to the ones a file last
+///             received, within the same block group where possible, so
+///             files written sequentially stay contiguous on disk. Each
+///             directory keeps a hashed index of its entries after its first
+///             lookup, so later lookups (including failed ones) read at most
+///             one entry from the cache.
+//----------------------------------------------------------------------------
+void
+ext2_init();
@@ -0,0 +1,20 @@
+//============================================================================
+/// @file       initrd.h
+/// @brief      Filesystem over the initial RAM disk.
+//============================================================================
+
+#pragma once
+
+#include <core.h>
+
+//----------------------------------------------------------------------------
+//  @function   initrd_init
+/// @brief      Register the read-only "initrd" filesystem type with the VFS.
+/// @details    The boot loader loads the initrd, a cpio "newc" archive, into
+///             reserved memory. Mounting indexes the archive in place: names
+///             and file contents are never copied, and vfs_mmap maps file
+///             pages straight out of the loaded archive when their data is
+///             page-aligned (scripts/mkinitrd.sh packs archives that way).
+//----------------------------------------------------------------------------
+void
+initrd_init();
@@ -0,0 +1,21 @@
+//============================================================================
+/// @file       iso9660.h
+/// @brief      ISO 9660 CD-ROM filesystem.
+//============================================================================
+
+#pragma once
+
+#include <core.h>
+
+//----------------------------------------------------------------------------
+//  @function   iso9660_init
+/// @brief      Register the read-only "iso9660" filesystem type with the VFS.
+/// @details    The Rock Ridge (POSIX names, relocated directories) and
+///             Joliet (UCS-2 names) extensions are understood, with Rock
+///             Ridge preferred when a disc has both. File data is read
+///             through the device's page cache, and vfs_mmap maps cached
+///             pages of files whose extents are page-aligned without
+///             copying them.
+//----------------------------------------------------------------------------
+void
+iso9660_init();
@@ -0,0 +1,18 @@
+//============================================================================
+/// @file       tmpfs.h
+/// @brief      In-memory filesystem.
+//============================================================================
+
+#pragma once
+
+#include <core.h>
+
+//----------------------------------------------------------------------------
+//  @function   tmpfs_init
+/// @brief      Register the "tmpfs" filesystem type with the VFS.
+/// @details    A tmpfs keeps all of its data in memory. File contents live
+///             directly in page frames from the pfdb, indexed by a radix tree
+///             per file. vfs_mmap maps those frames without copying them.
+//----------------------------------------------------------------------------
+void
+tmpfs_init();
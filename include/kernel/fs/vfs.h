@@ -0,0 +1,340 @@
+//============================================================================
+/// @file       vfs.h
+/// @brief      Virtual file system layer.
+/// @details    Filesystems register a type with a mount function, and each
+///             mounted instance is described by a superblock. Path lookups
+///             go through a hashed dentry cache that also remembers names
+///             known not to exist (negative entries), and an inode cache
+///             keyed by superblock and inode number. A path whose components
+///             are all cached resolves with one hash lookup per component
+///             and no calls into the filesystem.
+///
+///             Functions that can fail return 0 (or a count) on success and
+///             a negated errno.h code on failure.
+//============================================================================
+
+#pragma once
+
+#include <core.h>
+#include <kernel/block/blkdev.h>
+#include <kernel/mem/paging.h>
+#include <kernel/stat.h>
+
+// Longest single path component, in bytes.
+#define NAME_MAX             63
+
+// Size of the per-inode area reserved for the filesystem.
+#define INODE_FSDATA_SIZE    128
+
+// Cache and table sizes
+#define MAX_DENTRIES         512
+#define MAX_INODES           256
+#define MAX_FILES            64
+#define MAX_MOUNTS           8
+#define MAX_FSTYPES          8
+
+typedef struct superblock superblock_t;
+typedef struct inode      inode_t;
+typedef struct dentry     dentry_t;
+typedef struct file       file_t;
+
+//----------------------------------------------------------------------------
+//  @struct     dirent_t
+/// @brief      A directory entry returned by readdir.
+//----------------------------------------------------------------------------
+typedef struct dirent
+{
+    uint64_t ino;                   ///< Inode number.
+    int      type;                  ///< T_DIR, T_FILE or T_DEV.
+    char     name[NAME_MAX + 1];    ///< Null-terminated name.
+} dirent_t;
+
+//----------------------------------------------------------------------------
+//  @struct     inode_ops_t
+/// @brief      Filesystem operations on an inode. Unsupported operations may
+///             be left NULL.
+//----------------------------------------------------------------------------
+typedef struct inode_ops
+{
+    /// Find `name' in directory `dir' and return its inode number in `ino'.
+    /// Returns -ENOENT if it doesn't exist.
+    int (*lookup)(inode_t *dir, const char *name, int len, uint64_t *ino);
+
+    /// Create a file or directory (`type' is T_FILE or T_DIR) called `name'
+    /// in `dir', returning its inode number in `ino'.
+    int (*create)(inode_t *dir, const char *name, int len, int type,
+                  uint64_t *ino);
+
+    /// Remove the entry `name' from `dir'. `inode' is the inode it names.
+    int (*unlink)(inode_t *dir, const char *name, int len, inode_t *inode);
+
+    /// Read up to `len' bytes at `off'. Returns the byte count.
+    int64_t (*read)(inode_t *inode, uint64_t off, void *buf, uint64_t len);
+
+    /// Write `len' bytes at `off'. Returns the byte count.
+    int64_t (*write)(inode_t *inode, uint64_t off, const void *buf,
+                     uint64_t len);
+
+    /// Return the directory entry at cursor `pos' and advance the cursor.
+    /// Returns 0 at the end of the directory, 1 if an entry was returned.
+    int (*readdir)(inode_t *dir, uint64_t *pos, dirent_t *ent);
+
+    /// Return the frame holding file page `index' with a reference held for
+    /// the caller, so it can be mapped without copying. A missing page is
+    /// allocated if `write' is set or it lies inside the file.
+    int (*getpage)(inode_t *inode, uint64_t index, bool write, void **page);
+} inode_ops_t;
+
+//----------------------------------------------------------------------------
+//  @struct     super_ops_t
+/// @brief      Filesystem operations on a mounted instance.
+//----------------------------------------------------------------------------
+typedef struct super_ops
+{
+    /// Fill in an inode's type, size, nlink, ops and fsdata from its number.
+    int  (*read_inode)(inode_t *inode);
+
+    /// Release filesystem resources for an inode leaving the cache. May be
+    /// NULL.
+    void (*evict_inode)(inode_t *inode);
+} super_ops_t;
+
+//----------------------------------------------------------------------------
+//  @struct     superblock
+/// @brief      A mounted filesystem instance.
+//----------------------------------------------------------------------------
+struct superblock
+{
+    const struct fstype *type;      ///< Filesystem type.
+    const super_ops_t   *ops;       ///< Set by the filesystem's mount.
+    blkdev_t            *dev;       ///< Backing device, or NULL.
+    uint64_t             root_ino;  ///< Set by the filesystem's mount.
+    bool                 readonly;  ///< Reject modifications.
+    dentry_t            *root;      ///< Root dentry of this mount.
+    dentry_t            *covered;   ///< Mount point, or NULL for "/".
+    void                *private;   ///< Filesystem private data.
+};
+
+//----------------------------------------------------------------------------
+//  @struct     inode
+/// @brief      A cached inode.
+//----------------------------------------------------------------------------
+struct inode
+{
+    superblock_t      *sb;          ///< Owning filesystem.
+    uint64_t           ino;         ///< Inode number.
+    int                type;        ///< T_DIR, T_FILE or T_DEV.
+    uint16_t           nlink;       ///< Link count.
+    uint64_t           size;        ///< Size in bytes.
+    const inode_ops_t *ops;         ///< Filesystem operations.
+    int                refcount;    ///< References from dentries and users.
+    inode_t           *hnext;       ///< Hash chain.
+    inode_t           *lprev;       ///< Unused-inode LRU links.
+    inode_t           *lnext;
+    uint64_t           fsdata[INODE_FSDATA_SIZE / 8];  ///< Filesystem data.
+};
+
+//----------------------------------------------------------------------------
+//  @struct     dentry
+/// @brief      A cached name in a directory.
+/// @details    A dentry whose inode is NULL is negative: it records that the
+///             name does not exist.
+//----------------------------------------------------------------------------
+struct dentry
+{
+    char          name[NAME_MAX + 1];
+    uint8_t       len;              ///< Name length.
+    uint32_t      hash;             ///< Hash of parent and name.
+    dentry_t     *parent;           ///< Parent (itself for a root).
+    inode_t      *inode;            ///< Inode, or NULL if negative.
+    superblock_t *mounted;          ///< Filesystem mounted here, or NULL.
+    int           refcount;         ///< References from children and users.
+    dentry_t     *hnext;            ///< Hash chain.
+    dentry_t     *lprev;            ///< Unused-dentry LRU links.
+    dentry_t     *lnext;
+};
+
+//----------------------------------------------------------------------------
+//  @struct     file
+/// @brief      An open file.
+//----------------------------------------------------------------------------
+struct file
+{
+    dentry_t *dentry;               ///< The opened name.
+    inode_t  *inode;                ///< The opened inode.
+    int       flags;                ///< O_* open flags.
+    uint64_t  pos;                  ///< Current offset (or readdir cursor).
+    int       refcount;
+};
+
+//----------------------------------------------------------------------------
+//  @struct     fstype
+/// @brief      A filesystem type.
+//----------------------------------------------------------------------------
+typedef struct fstype
+{
+    const char *name;               ///< Name used by vfs_mount.
+
+    /// Set up `sb' for the filesystem on `dev' (which may be NULL for
+    /// memory-backed filesystems): fill in ops and root_ino.
+    int (*mount)(superblock_t *sb, blkdev_t *dev);
+} fstype_t;
+
+//----------------------------------------------------------------------------
+//  @function   vfs_register_fs
+/// @brief      Register a filesystem type.
+/// @param[in]  type    The type. It must stay valid for the kernel's life.
+/// @returns    0 on success, or a negated errno code.
+//----------------------------------------------------------------------------
+int
+vfs_register_fs(const fstype_t *type);
+
+//----------------------------------------------------------------------------
+//  @function   vfs_mount
+/// @brief      Mount a filesystem.
+/// @details    The first mount must be at "/". Later mounts cover an
+///             existing directory.
+/// @param[in]  path    The mount point.
+/// @param[in]  fsname  The filesystem type name.
+/// @param[in]  dev     The backing device, or NULL.
+/// @param[in]  readonly Mount read-only.
+/// @returns    0 on success, or a negated errno code.
+//----------------------------------------------------------------------------
+int
+vfs_mount(const char *path, const char *fsname, blkdev_t *dev,
+          bool readonly);
+
+//----------------------------------------------------------------------------
+//  @function   vfs_iget
+/// @brief      Return a referenced inode from the inode cache, reading it
+///             from the filesystem if it isn't cached.
+/// @param[in]  sb      The filesystem.
+/// @param[in]  ino     The inode number.
+/// @param[out] out     Receives the inode.
+/// @returns    0 on success, or a negated errno code.
+//----------------------------------------------------------------------------
+int
+vfs_iget(superblock_t *sb, uint64_t ino, inode_t **out);
+
+//----------------------------------------------------------------------------
+//  @function   vfs_iput
+/// @brief      Release an inode reference.
+/// @param[in]  inode   The inode.
+//----------------------------------------------------------------------------
+void
+vfs_iput(inode_t *inode);
+
+//----------------------------------------------------------------------------
+//  @function   vfs_lookup
+/// @brief      Resolve an absolute path to a referenced, positive dentry.
+/// @param[in]  path    The path.
+/// @param[out] out     Receives the dentry. Release it with vfs_dput.
+/// @returns    0 on success, or a negated errno code.
+//----------------------------------------------------------------------------
+int
+vfs_lookup(const char *path, dentry_t **out);
+
+//----------------------------------------------------------------------------
+//  @function   vfs_dput
+/// @brief      Release a dentry reference.
+/// @param[in]  dentry  The dentry.
+//----------------------------------------------------------------------------
+void
+vfs_dput(dentry_t *dentry);
+
+//----------------------------------------------------------------------------
+//  @function   vfs_open
+/// @brief      Open a file or directory.
+/// @param[in]  path    Absolute path.
+/// @param[in]  flags   O_* flags from fcntl.h. O_CREATE creates a missing
+///                     file.
+/// @param[out] out     Receives the open file.
+/// @returns    0 on success, or a negated errno code.
+//----------------------------------------------------------------------------
+int
+vfs_open(const char *path, int flags, file_t **out);
+
+//----------------------------------------------------------------------------
+//  @function   vfs_close
+/// @brief      Close an open file.
+/// @param[in]  file    The file.
+//----------------------------------------------------------------------------
+void
+vfs_close(file_t *file);
+
+//----------------------------------------------------------------------------
+//  @function   vfs_read
+/// @brief      Read from the current offset of an open file.
+/// @returns    The number of bytes read (0 at end of file), or a negated
+///             errno code.
+//----------------------------------------------------------------------------
+int64_t
+vfs_read(file_t *file, void *buf, uint64_t len);
+
+//----------------------------------------------------------------------------
+//  @function   vfs_write
+/// @brief      Write at the current offset of an open file.
+/// @returns    The number of bytes written, or a negated errno code.
+//----------------------------------------------------------------------------
+int64_t
+vfs_write(file_t *file, const void *buf, uint64_t len);
+
+//----------------------------------------------------------------------------
+//  @function   vfs_seek
+/// @brief      Set the offset of an open file.
+/// @returns    0 on success, or a negated errno code.
+//----------------------------------------------------------------------------
+int
+vfs_seek(file_t *file, uint64_t pos);
+
+//----------------------------------------------------------------------------
+//  @function   vfs_readdir
+/// @brief      Read the next entry of an open directory.
+/// @returns    1 if an entry was returned, 0 at the end, or a negated errno
+///             code.
+//----------------------------------------------------------------------------
+int
+vfs_readdir(file_t *file, dirent_t *ent);
+
+//----------------------------------------------------------------------------
+//  @function   vfs_mmap
+/// @brief      Map pages of an open file into a page table without copying.
+/// @details    The file's own page frames are mapped, so writes through a
+///             writable mapping are visible to readers of the file. Remove
+///             the mapping with page_free, which drops the page references.
+/// @param[in]  file    The open file. It must support getpage.
+/// @param[in]  pt      The page table to map into.
+/// @param[in]  vaddr   Page-aligned virtual address of the mapping.
+/// @param[in]  off     Page-aligned file offset of the first page.
+/// @param[in]  len     Length of the mapping in bytes.
+/// @returns    0 on success, or a negated errno code. -ENOMEM means a
+///             writable mapping of a disk file couldn't have its writes
+///             tracked for write-back.
+//----------------------------------------------------------------------------
+int
+vfs_mmap(file_t *file, pagetable_t *pt, void *vaddr, uint64_t off,
+         uint64_t len);
+
+//----------------------------------------------------------------------------
+//  @function   vfs_stat
+/// @brief      Return information about the inode a path names.
+/// @returns    0 on success, or a negated errno code.
+//----------------------------------------------------------------------------
+int
+vfs_stat(const char *path, struct stat *st);
+
+//----------------------------------------------------------------------------
+//  @function   vfs_mkdir
+/// @brief      Create a directory.
+/// @returns    0 on success, or a negated errno code.
+//----------------------------------------------------------------------------
+int
+vfs_mkdir(const char *path);
+
+//----------------------------------------------------------------------------
+//  @function   vfs_unlink
+/// @brief      Remove a file or empty directory.
+/// @returns    0 on success, or a negated errno code.
+//----------------------------------------------------------------------------
+int
+vfs_unlink(const char *path);
@@ -13,13 +13,18 @@
 // 常量
 //----------------------------------------------------------------------------
 
-// 硬件中断(hardware IRQ)的值，定时器中断设置为0，键盘中断设置为1。
+// 硬件中断(hardware IRQ)的值，定时器中断设置为0，键盘中断设置为1，
+// 串口COM2和COM1分别为3和4。
 #define IRQ_TIMER             0
 #define IRQ_KEYBOARD          1
+#define IRQ_COM2              3
+#define IRQ_COM1              4
 
 // 中断向量号：硬件中断陷入(hardware IRQ traps)
 #define TRAP_IRQ_TIMER        0x20
 #define TRAP_IRQ_KEYBOARD     0x21
+#define TRAP_IRQ_COM2         0x23
+#define TRAP_IRQ_COM1         0x24
 
 // 可编程中断控制器端口常量(PIC port constants)
 #define PIC_PORT_CMD_MASTER   0x20   ///< 主PIC芯片的命令端口
@@ -0,0 +1,52 @@
+//============================================================================
+/// @file       lapic.h
+/// @brief      Local advanced programmable interrupt controller (APIC).
+//============================================================================
+
+#pragma once
+
+#include <core.h>
+
+// Interrupt vector used for spurious local APIC interrupts.
+#define TRAP_LAPIC_SPURIOUS  0xef
+
+//----------------------------------------------------------------------------
+//  @function   lapic_init
+/// @brief      Software-enable the local APIC of the boot CPU.
+/// @details    The legacy 8259 PIC keeps delivering its interrupts through
+///             the local APIC's LINT0 pin, so this only makes the local APIC
+///             accept message-signaled interrupts.
+/// @returns    true if a local APIC was found in the ACPI MADT.
+//----------------------------------------------------------------------------
+bool
+lapic_init();
+
+//----------------------------------------------------------------------------
+//  @function   lapic_present
+/// @brief      Return true if lapic_init enabled a local APIC.
+//----------------------------------------------------------------------------
+bool
+lapic_present();
+
+//----------------------------------------------------------------------------
+//  @function   lapic_id
+/// @brief      Return the local APIC ID of the calling CPU.
+//----------------------------------------------------------------------------
+uint8_t
+lapic_id();
+
+//----------------------------------------------------------------------------
+//  @function   lapic_cpu_count
+/// @brief      Return the number of usable processors listed in the MADT.
+/// @details    Drivers use this to size per-CPU hardware queues. Only the
+///             boot CPU is started, but queues are laid out as if all were.
+//----------------------------------------------------------------------------
+int
+lapic_cpu_count();
+
+//----------------------------------------------------------------------------
+//  @function   lapic_eoi
+/// @brief      Signal the end of an interrupt delivered by the local APIC.
+//----------------------------------------------------------------------------
+void
+lapic_eoi();
@@ -131,3 +131,117 @@ page_alloc(pagetable_t *pt, void *vaddr, int count);
 //----------------------------------------------------------------------------
 void
 page_free(pagetable_t *pt, void *vaddr, int count);
+
+//----------------------------------------------------------------------------
+//  @function   page_map
+/// @brief      Map an existing kernel page at a virtual address, sharing it
+///             rather than copying it.
+/// @details    The page gains a reference, which page_free drops when the
+///             mapping is removed.
+/// @param[in]  pt      Handle to the page table to add the mapping to.
+/// @param[in]  vaddr   The virtual address to map the page at.
+/// @param[in]  page    A page allocated by kpage_alloc.
+/// @param[in]  writable Allow writes through the mapping.
+//----------------------------------------------------------------------------
+void
+page_map(pagetable_t *pt, void *vaddr, void *page, bool writable);
+
+//----------------------------------------------------------------------------
+//  @function   page_track_dirty
+/// @brief      Collect the dirty bits of a writable shared mapping.
+/// @details    The CPU sets PF_DIRTY in a page table entry when the page is
+///             written through it. For tracked ranges, page_harvest_dirty
+///             moves those bits onto the frames, where kpage_clear_dirty
+///             reads them. Removing a mapping always records its dirty bit
+///             on the frame, tracked or not. Tracking ends when page_free
+///             removes the pages or the page table is destroyed.
+/// @param[in]  pt      The page table holding the mapping.
+/// @param[in]  vaddr   The virtual address of the first page.
+/// @param[in]  count   The number of pages.
+/// @returns    False if too many ranges are tracked already.
+//----------------------------------------------------------------------------
+bool
+page_track_dirty(pagetable_t *pt, void *vaddr, int count);
+
+//----------------------------------------------------------------------------
+//  @function   page_harvest_dirty
+/// @brief      Move the dirty bits of all tracked mappings onto their frames
+///             and clear them in the page tables.
+/// @returns    The number of frames currently marked dirty.
+//----------------------------------------------------------------------------
+uint32_t
+page_harvest_dirty();
+
+//----------------------------------------------------------------------------
+//  @function   page_map_mmio
+/// @brief      Map a device's memory-mapped I/O range into the kernel page
+///             table as uncached memory.
+/// @details    The range is identity mapped, so the returned pointer equals
+///             the physical address. Because user page tables share the
+///             kernel's PML4 entries, the mapping is visible in all of them.
+/// @param[in]  paddr   Physical address of the I/O range.
+/// @param[in]  size    Size of the range in bytes.
+/// @returns    A pointer to the mapped range.
+//----------------------------------------------------------------------------
+void *
+page_map_mmio(uint64_t paddr, uint64_t size);
+
+//----------------------------------------------------------------------------
+//  @function   kpage_alloc
+/// @brief      Allocate physically contiguous pages for kernel use.
+/// @details    Physical memory is identity mapped in the kernel, so the
+///             returned pointer is also the physical address of the pages,
+///             which makes them suitable for device DMA. The pages are zeroed
+///             and each starts with a reference count of 1.
+/// @param[in]  count   The number of contiguous pages to allocate.
+/// @returns    A pointer to the first page, or NULL if no run of free pages
+///             is large enough.
+//----------------------------------------------------------------------------
+void *
+kpage_alloc(int count);
+
+//----------------------------------------------------------------------------
+//  @function   kpage_free
+/// @brief      Drop a reference to each of a run of kernel pages. A page
+///             returns to the free list when its last reference is dropped.
+/// @param[in]  addr    The address of the first page.
+/// @param[in]  count   The number of pages.
+//----------------------------------------------------------------------------
+void
+kpage_free(void *addr, int count);
+
+//----------------------------------------------------------------------------
+//  @function   kpage_ref
+/// @brief      Add a reference to a page allocated by kpage_alloc.
+/// @details    Pages in reserved memory, such as the initrd, are accepted
+///             but not reference counted, so they can be mapped with
+///             page_map as well.
+/// @param[in]  addr    The address of the page.
+//----------------------------------------------------------------------------
+void
+kpage_ref(void *addr);
+
+//----------------------------------------------------------------------------
+//  @function   kpage_refcount
+/// @brief      Return the reference count of a page allocated by kpage_alloc.
+/// @param[in]  addr    The address of the page.
+//----------------------------------------------------------------------------
+int
+kpage_refcount(void *addr);
+
+//----------------------------------------------------------------------------
+//  @function   kpage_clear_dirty
+/// @brief      Test and clear the dirty mark a page picked up from writes
+///             through its mappings.
+/// @param[in]  addr    The address of the page.
+/// @returns    True if the page was written since the last call.
+//----------------------------------------------------------------------------
+bool
+kpage_clear_dirty(void *addr);
+
+//----------------------------------------------------------------------------
+//  @function   kpage_avail
+/// @brief      Return the number of free physical pages.
+//----------------------------------------------------------------------------
+uint32_t
+kpage_avail();
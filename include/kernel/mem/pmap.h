@@ -82,3 +82,13 @@ pmap_add(uint64_t addr, uint64_t size, enum pmemtype type);
 //----------------------------------------------------------------------------
 const pmap_t *
 pmap();
+
+//----------------------------------------------------------------------------
+//  @function   pmap_initrd
+/// @brief      返回boot loader加载的初始内存盘(initrd)
+/// @details    initrd所在的物理内存在内存映射中被标记为保留内存，并且是一一映射的
+/// @param[out] size    initrd的大小(字节)，没有initrd时为0
+/// @returns    initrd的地址，没有initrd时返回NULL
+//----------------------------------------------------------------------------
+const void *
+pmap_initrd(uint64_t *size);
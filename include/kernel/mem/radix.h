@@ -0,0 +1,69 @@
+//============================================================================
+/// @file       radix.h
+/// @brief      Radix tree mapping 64-bit indexes to pointers.
+/// @details    Each node holds 64 slots, so a tree of height h covers indexes
+///             below 2^(6h). Nodes are carved from kernel pages. Callers
+///             provide their own locking.
+//============================================================================
+
+#pragma once
+
+#include <core.h>
+
+#define RADIX_SHIFT          6
+#define RADIX_SLOTS          (1 << RADIX_SHIFT)
+
+typedef struct radix_node radix_node_t;
+
+//----------------------------------------------------------------------------
+//  @struct     radix_t
+/// @brief      The root of a radix tree. Zero-initialized means empty.
+//----------------------------------------------------------------------------
+typedef struct radix
+{
+    radix_node_t *root;
+    int           height;   ///< Number of node levels (0 = empty).
+} radix_t;
+
+//----------------------------------------------------------------------------
+//  @function   radix_lookup
+/// @brief      Find the item stored at an index.
+/// @param[in]  tree    The tree.
+/// @param[in]  index   The index.
+/// @returns    The item, or NULL if the slot is empty.
+//----------------------------------------------------------------------------
+void *
+radix_lookup(const radix_t *tree, uint64_t index);
+
+//----------------------------------------------------------------------------
+//  @function   radix_insert
+/// @brief      Store an item at an index, growing the tree as needed.
+/// @param[in]  tree    The tree.
+/// @param[in]  index   The index.
+/// @param[in]  item    The item (not NULL).
+/// @returns    true on success, false if the slot is occupied or no memory
+///             is available for new nodes.
+//----------------------------------------------------------------------------
+bool
+radix_insert(radix_t *tree, uint64_t index, void *item);
+
+//----------------------------------------------------------------------------
+//  @function   radix_delete
+/// @brief      Remove the item at an index, freeing nodes left empty.
+/// @param[in]  tree    The tree.
+/// @param[in]  index   The index.
+/// @returns    The removed item, or NULL if the slot was empty.
+//----------------------------------------------------------------------------
+void *
+radix_delete(radix_t *tree, uint64_t index);
+
+//----------------------------------------------------------------------------
+//  @function   radix_next
+/// @brief      Find the first item at or after an index.
+/// @param[in]  tree    The tree.
+/// @param[in,out] index On entry, the index to start from. On return, the
+///                     index of the item found.
+/// @returns    The item, or NULL if there are none at or after the index.
+//----------------------------------------------------------------------------
+void *
+radix_next(const radix_t *tree, uint64_t *index);
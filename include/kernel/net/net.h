@@ -0,0 +1,114 @@
+//============================================================================
+/// @file       net.h
+/// @brief      IPv4 network stack: interfaces and addressing.
+/// @details    The stack handles Ethernet, ARP, IPv4, ICMP echo, UDP and
+///             TCP. Packets travel between layers as pbuf chains; headers
+///             are pushed and pulled in place, received payload is queued
+///             on sockets without copying, and transmitted payload is cloned
+///             out of the send queue by reference. Each network device
+///             gets one interface with a static address assigned by
+///             net_config, and a loopback interface at 127.0.0.1 carries
+///             traffic between local endpoints.
+//============================================================================
+
+#pragma once
+
+#include <core.h>
+#include <kernel/net/netdev.h>
+
+/// An IPv4 address in network byte order.
+typedef uint32_t ip4_addr_t;
+
+/// Build an IPv4 address from its dotted-quad components.
+#define IP4_ADDR(a, b, c, d) \
+    ((ip4_addr_t)((a) | ((b) << 8) | ((c) << 16) | ((uint32_t)(d) << 24)))
+
+/// Expand an address into four printf arguments for "%u.%u.%u.%u".
+#define IP4_BYTES(x) \
+    (unsigned)((x) & 0xff), (unsigned)(((x) >> 8) & 0xff), \
+    (unsigned)(((x) >> 16) & 0xff), (unsigned)((x) >> 24)
+
+#define IP4_ANY              IP4_ADDR(0, 0, 0, 0)
+#define IP4_BROADCAST        IP4_ADDR(255, 255, 255, 255)
+
+// Readiness events reported for sockets
+#define NET_EV_READ          (1 << 0)   ///< Data, end of stream, or a
+                                        ///< connection waiting to be
+                                        ///< accepted.
+#define NET_EV_WRITE         (1 << 1)   ///< Room to send.
+#define NET_EV_HUP           (1 << 2)   ///< Connection closed.
+#define NET_EV_ERR           (1 << 3)   ///< Connection failed or reset.
+
+// Byte order conversion
+static inline uint16_t htons(uint16_t x) { return __builtin_bswap16(x); }
+static inline uint16_t ntohs(uint16_t x) { return __builtin_bswap16(x); }
+static inline uint32_t htonl(uint32_t x) { return __builtin_bswap32(x); }
+static inline uint32_t ntohl(uint32_t x) { return __builtin_bswap32(x); }
+
+//----------------------------------------------------------------------------
+//  @struct     netif_t
+/// @brief      An IPv4 interface on a network device.
+//----------------------------------------------------------------------------
+typedef struct netif
+{
+    netdev_t  *dev;         ///< The underlying device.
+    ip4_addr_t addr;        ///< Interface address.
+    ip4_addr_t mask;        ///< Subnet mask.
+    ip4_addr_t gw;          ///< Default gateway, or IP4_ANY.
+    bool       up;          ///< An address has been assigned.
+} netif_t;
+
+//----------------------------------------------------------------------------
+//  @function   net_init
+/// @brief      Allocate the packet buffer pool, bring up the loopback
+///             interface and start receiving.
+/// @details    Must be called before any network driver is initialized, so
+///             that drivers can fill their receive rings.
+//----------------------------------------------------------------------------
+void
+net_init();
+
+//----------------------------------------------------------------------------
+//  @function   net_config
+/// @brief      Assign an address to a device's interface.
+/// @param[in]  dev     The network device.
+/// @param[in]  addr    The interface address.
+/// @param[in]  mask    The subnet mask.
+/// @param[in]  gw      The default gateway, or IP4_ANY for none.
+/// @returns    0 on success, or -ENOMEM if no interface is free.
+//----------------------------------------------------------------------------
+int
+net_config(netdev_t *dev, ip4_addr_t addr, ip4_addr_t mask, ip4_addr_t gw);
+
+//----------------------------------------------------------------------------
+//  @function   net_netif
+/// @brief      Return the interface of a network device.
+/// @param[in]  dev     The network device.
+/// @returns    The interface, or NULL if the device has none.
+//----------------------------------------------------------------------------
+netif_t *
+net_netif(const netdev_t *dev);
+
+//----------------------------------------------------------------------------
+//  @function   net_poll
+/// @brief      Run the stack's timers and poll devices for completed work.
+/// @details    Called from the kernel's idle loop. Retransmission, delayed
+///             acknowledgement and ARP timers advance with the timer tick.
+///             Receive queues left in polling mode by their interrupt
+///             handlers get another budget of packets.
+/// @returns    true if queues are still in polling mode, in which case the
+///             caller should call again rather than wait for an interrupt.
+//----------------------------------------------------------------------------
+bool
+net_poll();
+
+//----------------------------------------------------------------------------
+//  @function   net_parse_addr
+/// @brief      Parse a dotted-quad IPv4 address.
+/// @param[in]  str     The string, e.g. "10.0.2.15".
+/// @param[out] addr    The parsed address.
+/// @returns    The number of characters consumed, or 0 if `str' does not
+///             start with an address.
+//----------------------------------------------------------------------------
+int
+net_parse_addr(const char *str, ip4_addr_t *addr);
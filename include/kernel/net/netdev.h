@@ -0,0 +1,237 @@
+//============================================================================
+/// @file       netdev.h
+/// @brief      Network device registry and packet interface.
+/// @details    NIC drivers register a netdev_t describing the device, its
+///             queues and the offloads it supports. Packets are pbuf chains:
+///             a transmitted packet belongs to the driver, which frees it
+///             once the device is done with it, and a received packet
+///             belongs to the handler installed with netdev_set_rx_handler.
+//============================================================================
+
+#pragma once
+
+#include <core.h>
+#include <kernel/net/pbuf.h>
+
+// Maximum number of registered network devices.
+#define MAX_NETDEVS          4
+
+// Maximum number of queue pairs per network device.
+#define MAX_NET_QUEUES       8
+
+// Maximum number of pbufs in one transmitted packet. Enough for a 64KiB
+// segmentation-offload packet in 2KiB pieces plus its headers.
+#define MAX_NET_SEGS         36
+
+// Packets a polled queue may process per turn, and per run of the poll
+// loop across all queues before the rest is deferred to the idle loop.
+#define NAPI_WEIGHT          64
+#define NAPI_BUDGET          256
+
+// Ethernet constants
+#define ETH_ALEN             6
+#define ETH_HLEN             14
+#define ETH_MTU              1500
+
+// Device features
+#define NETDEV_F_TX_CSUM     (1 << 0)   ///< Fills in checksums on transmit.
+#define NETDEV_F_RX_CSUM     (1 << 1)   ///< Validates received checksums.
+#define NETDEV_F_TSO         (1 << 2)   ///< Segments large TCP/IPv4 sends.
+#define NETDEV_F_LOOPBACK    (1 << 3)   ///< Loops packets back; no ARP.
+
+typedef struct netdev netdev_t;
+
+//----------------------------------------------------------------------------
+//  @struct     netdev_ops
+/// @brief      Driver entry points for a network device.
+//----------------------------------------------------------------------------
+typedef struct netdev_ops
+{
+    /// Queue a packet for transmission on queue `queue', taking ownership
+    /// of it. Returns false, leaving the packet with the caller, if the
+    /// queue is full. The device need not be notified until kick is called,
+    /// so a burst of packets costs one doorbell write.
+    bool (*xmit)(netdev_t *dev, int queue, pbuf_t *pb);
+
+    /// Notify the device of packets queued since the last kick.
+    void (*kick)(netdev_t *dev, int queue);
+
+    /// Reap transmit completions on a queue and schedule its receive
+    /// polling, without waiting for an interrupt.
+    void (*poll)(netdev_t *dev, int queue);
+} netdev_ops_t;
+
+//----------------------------------------------------------------------------
+//  @struct     netdev_stats_t
+/// @brief      Per-queue traffic counters.
+//----------------------------------------------------------------------------
+typedef struct netdev_stats
+{
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t rx_dropped;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t tx_dropped;
+} netdev_stats_t;
+
+//----------------------------------------------------------------------------
+//  @struct     netdev
+/// @brief      A registered network device.
+//----------------------------------------------------------------------------
+struct netdev
+{
+    char                name[8];        ///< Device name (e.g. "eth0").
+    uint8_t             mac[ETH_ALEN];  ///< Hardware address.
+    uint16_t            mtu;            ///< Largest IP packet.
+    uint32_t            features;       ///< NETDEV_F_* offloads.
+    uint32_t            gso_max;        ///< Largest PBUF_GSO_TCPV4 packet.
+    int                 nr_queues;      ///< Number of queue pairs.
+    bool                link_up;        ///< Carrier detected.
+    const netdev_ops_t *ops;            ///< Driver entry points.
+    void               *drvdata;        ///< Driver private data.
+    void               *private;        ///< Protocol stack data.
+    int                 id;             ///< Registry index.
+    atomic_uint         kick_pending;   ///< Queues awaiting netdev_flush.
+    netdev_stats_t      stats[MAX_NET_QUEUES];
+};
+
+//----------------------------------------------------------------------------
+//  @struct     napi_t
+/// @brief      Polling context for one receive queue.
+/// @details    A driver's interrupt handler masks the queue's interrupt and
+///             schedules its napi_t instead of processing packets itself.
+///             The poll function then runs with a budget until the queue
+///             drains, when it calls napi_complete and unmasks the
+///             interrupt. Under load the queue stays in polling mode and
+///             costs no interrupts at all.
+//----------------------------------------------------------------------------
+typedef struct napi napi_t;
+struct napi
+{
+    /// Process up to `budget' packets. A poll that does less than its
+    /// budget has drained the queue and must call napi_complete before
+    /// re-enabling the queue's interrupt.
+    int         (*poll)(napi_t *napi, int budget);
+
+    netdev_t    *dev;           ///< The device.
+    int          queue;         ///< The device's queue.
+    atomic_bool  scheduled;     ///< On a poll list.
+    napi_t      *next;          ///< Poll list link.
+};
+
+//----------------------------------------------------------------------------
+//  @typedef    netdev_rx_handler
+/// @brief      Receive handler called for each received packet.
+/// @details    Called from the driver's interrupt or poll path with
+///             interrupts disabled. The handler owns the packet and must
+///             free it.
+/// @param[in]  dev     The receiving device.
+/// @param[in]  queue   The receive queue.
+/// @param[in]  pb      The packet, starting at its Ethernet header.
+//----------------------------------------------------------------------------
+typedef void (*netdev_rx_handler)(netdev_t *dev, int queue, pbuf_t *pb);
+
+//----------------------------------------------------------------------------
+//  @function   netdev_register
+/// @brief      Register a network device.
+/// @param[in]  dev     The device. It must stay valid for the kernel's life.
+/// @returns    true on success, false if the registry is full.
+//----------------------------------------------------------------------------
+bool
+netdev_register(netdev_t *dev);
+
+//----------------------------------------------------------------------------
+//  @function   netdev_find
+/// @brief      Look up a registered network device by name.
+/// @param[in]  name    The device name.
+/// @returns    The device, or NULL if none is registered with that name.
+//----------------------------------------------------------------------------
+netdev_t *
+netdev_find(const char *name);
+
+//----------------------------------------------------------------------------
+//  @function   netdev_next
+/// @brief      Iterate over registered network devices.
+/// @param[in]  prev    The previous device, or NULL to start.
+/// @returns    The next device, or NULL after the last one.
+//----------------------------------------------------------------------------
+netdev_t *
+netdev_next(const netdev_t *prev);
+
+//----------------------------------------------------------------------------
+//  @function   netdev_queue
+/// @brief      Return the queue pair the calling CPU should use.
+/// @param[in]  dev     The device.
+//----------------------------------------------------------------------------
+int
+netdev_queue(const netdev_t *dev);
+
+//----------------------------------------------------------------------------
+//  @function   netdev_set_rx_handler
+/// @brief      Install the handler that receives packets from all devices.
+/// @param[in]  handler The handler, or NULL to drop received packets.
+//----------------------------------------------------------------------------
+void
+netdev_set_rx_handler(netdev_rx_handler handler);
+
+//----------------------------------------------------------------------------
+//  @function   netdev_receive
+/// @brief      Pass a received packet up from a driver.
+/// @param[in]  dev     The receiving device.
+/// @param[in]  queue   The receive queue.
+/// @param[in]  pb      The packet. Ownership passes to the stack.
+//----------------------------------------------------------------------------
+void
+netdev_receive(netdev_t *dev, int queue, pbuf_t *pb);
+
+//----------------------------------------------------------------------------
+//  @function   netdev_xmit
+/// @brief      Transmit a packet on the calling CPU's queue.
+/// @details    The device is not notified until netdev_flush is called, so
+///             the packets sent while handling one event share a doorbell
+///             write.
+/// @param[in]  dev     The device.
+/// @param[in]  pb      The packet. Ownership passes to the device; it is
+///                     freed and counted as dropped if the queue is full.
+/// @returns    true if the packet was queued.
+//----------------------------------------------------------------------------
+bool
+netdev_xmit(netdev_t *dev, pbuf_t *pb);
+
+//----------------------------------------------------------------------------
+//  @function   netdev_flush
+/// @brief      Notify every device of the packets queued by netdev_xmit.
+//----------------------------------------------------------------------------
+void
+netdev_flush();
+
+//----------------------------------------------------------------------------
+//  @function   napi_schedule
+/// @brief      Queue a polling context on the calling CPU's poll list.
+/// @details    Called with interrupts disabled, typically from the
+///             interrupt handler after masking the queue's interrupt.
+/// @param[in]  napi    The polling context.
+/// @returns    true if it was not already scheduled.
+//----------------------------------------------------------------------------
+bool
+napi_schedule(napi_t *napi);
+
+//----------------------------------------------------------------------------
+//  @function   napi_complete
+/// @brief      Leave polling mode once a queue has drained.
+/// @param[in]  napi    The polling context.
+//----------------------------------------------------------------------------
+void
+napi_complete(napi_t *napi);
+
+//----------------------------------------------------------------------------
+//  @function   napi_run
+/// @brief      Poll the calling CPU's scheduled queues.
+/// @details    Queues are polled round-robin, NAPI_WEIGHT packets at a
+///             time, until they drain or NAPI_BUDGET packets have been
+///             processed. Nested calls from within a poll return at once.
+/// @returns    true if queues are still scheduled.
+//----------------------------------------------------------------------------
+bool
+napi_run();
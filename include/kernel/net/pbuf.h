@@ -0,0 +1,178 @@
+//============================================================================
+/// @file       pbuf.h
+/// @brief      Reference-counted network packet buffers.
+/// @details    Packet data lives in fixed-size fragments carved from a pool
+///             allocated at boot. A pbuf describes a window onto one
+///             fragment; a packet is a chain of pbufs linked through next.
+///             Fragments are reference-counted, so a pbuf can be cloned
+///             (for example to retransmit data still held in a socket's send
+///             queue) without copying its bytes. Protocol headers are added
+///             and removed by moving a buffer's data pointer within its
+///             fragment's headroom.
+//============================================================================
+
+#pragma once
+
+#include <core.h>
+
+// Size of one pool fragment.
+#define PBUF_SIZE            2048
+
+// Headroom reserved in front of locally generated packets, enough for the
+// link, IP and TCP headers.
+#define PBUF_HEADROOM        128
+
+// Packet flags (valid on the first pbuf of a packet)
+#define PBUF_CSUM_PARTIAL    (1 << 0)   ///< TX: the device computes the L4
+                                        ///< checksum from csum_start and
+                                        ///< stores it at csum_offset.
+#define PBUF_CSUM_VALID      (1 << 1)   ///< RX: L4 checksum verified.
+#define PBUF_GSO_TCPV4       (1 << 2)   ///< TX: the device splits the packet
+                                        ///< into gso_size TCP segments.
+
+typedef struct pbuf pbuf_t;
+
+//----------------------------------------------------------------------------
+//  @struct     pbuf
+/// @brief      One piece of a packet.
+//----------------------------------------------------------------------------
+struct pbuf
+{
+    pbuf_t   *next;         ///< Next piece of the same packet.
+    pbuf_t   *nextpkt;      ///< Next packet in a queue.
+    uint8_t  *frag;         ///< Fragment holding the data.
+    uint8_t  *data;         ///< First byte of this piece.
+    uint32_t  len;          ///< Bytes in this piece.
+    uint32_t  tot_len;      ///< Bytes in the whole chain (first pbuf only).
+    uint16_t  flags;        ///< PBUF_* flags.
+    uint16_t  csum_start;   ///< PBUF_CSUM_PARTIAL: checksum start offset.
+    uint16_t  csum_offset;  ///< PBUF_CSUM_PARTIAL: offset of the checksum
+                            ///< field from csum_start.
+    uint16_t  hdr_len;      ///< PBUF_GSO_TCPV4: header bytes.
+    uint16_t  gso_size;     ///< PBUF_GSO_TCPV4: payload per segment.
+    uint16_t  port;         ///< Datagram queues: sender's port.
+    uint32_t  addr;         ///< Datagram queues: sender's address.
+};
+
+//----------------------------------------------------------------------------
+//  @function   pbuf_init
+/// @brief      Allocate the fragment pool.
+//----------------------------------------------------------------------------
+void
+pbuf_init();
+
+//----------------------------------------------------------------------------
+//  @function   pbuf_alloc
+/// @brief      Allocate a single-piece packet backed by a new fragment.
+/// @param[in]  headroom    Bytes to reserve in front of the data.
+/// @param[in]  len         Initial data length.
+/// @returns    The pbuf, or NULL if the pool is exhausted or headroom + len
+///             exceeds PBUF_SIZE.
+//----------------------------------------------------------------------------
+pbuf_t *
+pbuf_alloc(uint32_t headroom, uint32_t len);
+
+//----------------------------------------------------------------------------
+//  @function   pbuf_free
+/// @brief      Free a chain of pbufs, dropping a reference to each fragment.
+/// @param[in]  pb      The first pbuf of the chain, or NULL.
+//----------------------------------------------------------------------------
+void
+pbuf_free(pbuf_t *pb);
+
+//----------------------------------------------------------------------------
+//  @function   pbuf_clone
+/// @brief      Create a new chain sharing a byte range of an existing one.
+/// @param[in]  pb      The source chain.
+/// @param[in]  off     Offset of the first byte to share.
+/// @param[in]  len     Number of bytes to share.
+/// @param[in]  maxbufs Maximum number of pieces in the new chain. The clone
+///                     is cut short if the range spans more pieces.
+/// @returns    The clone, whose tot_len gives the bytes actually shared, or
+///             NULL if the pool is exhausted.
+//----------------------------------------------------------------------------
+pbuf_t *
+pbuf_clone(const pbuf_t *pb, uint32_t off, uint32_t len, int maxbufs);
+
+//----------------------------------------------------------------------------
+//  @function   pbuf_push
+/// @brief      Extend a packet's first piece backwards to make room for a
+///             header.
+/// @details    The checksum and segmentation offload offsets move with the
+///             start of the packet.
+/// @param[in]  pb      The packet.
+/// @param[in]  n       Bytes to add.
+/// @returns    A pointer to the new first byte, or NULL if there is not
+///             enough headroom or the fragment is shared.
+//----------------------------------------------------------------------------
+void *
+pbuf_push(pbuf_t *pb, uint32_t n);
+
+//----------------------------------------------------------------------------
+//  @function   pbuf_pull
+/// @brief      Remove a header from the front of a packet's first piece.
+/// @param[in]  pb      The packet.
+/// @param[in]  n       Bytes to remove. Must not exceed pb->len.
+//----------------------------------------------------------------------------
+void
+pbuf_pull(pbuf_t *pb, uint32_t n);
+
+//----------------------------------------------------------------------------
+//  @function   pbuf_drop
+/// @brief      Remove bytes from the front of a chain, freeing pieces that
+///             become empty.
+/// @param[in]  pb      The chain.
+/// @param[in]  n       Bytes to remove.
+/// @returns    The new first pbuf, or NULL if the chain is now empty.
+//----------------------------------------------------------------------------
+pbuf_t *
+pbuf_drop(pbuf_t *pb, uint32_t n);
+
+//----------------------------------------------------------------------------
+//  @function   pbuf_trim
+/// @brief      Shorten a chain to `len' bytes, freeing unused pieces.
+/// @param[in]  pb      The chain.
+/// @param[in]  len     The new length. Must not exceed pb->tot_len.
+//----------------------------------------------------------------------------
+void
+pbuf_trim(pbuf_t *pb, uint32_t len);
+
+//----------------------------------------------------------------------------
+//  @function   pbuf_cat
+/// @brief      Append one chain to the end of another.
+/// @param[in]  head    The chain to extend.
+/// @param[in]  tail    The chain to append. It must not be used afterwards.
+//----------------------------------------------------------------------------
+void
+pbuf_cat(pbuf_t *head, pbuf_t *tail);
+
+//----------------------------------------------------------------------------
+//  @function   pbuf_append
+/// @brief      Copy bytes onto the end of a chain, filling the last piece's
+///             tailroom before allocating new pieces.
+/// @param[in]  head    The chain, updated if it was NULL.
+/// @param[in]  src     The bytes to copy.
+/// @param[in]  len     Number of bytes.
+/// @returns    The number of bytes appended, short if the pool ran out.
+//----------------------------------------------------------------------------
+uint32_t
+pbuf_append(pbuf_t **head, const void *src, uint32_t len);
+
+//----------------------------------------------------------------------------
+//  @function   pbuf_copyout
+/// @brief      Copy bytes out of a chain.
+/// @param[in]  pb      The chain.
+/// @param[in]  off     Offset of the first byte to copy.
+/// @param[out] dst     The destination buffer.
+/// @param[in]  len     Maximum number of bytes to copy.
+/// @returns    The number of bytes copied.
+//----------------------------------------------------------------------------
+uint32_t
+pbuf_copyout(const pbuf_t *pb, uint32_t off, void *dst, uint32_t len);
+
+//----------------------------------------------------------------------------
+//  @function   pbuf_avail
+/// @brief      Return the number of free fragments in the pool.
+//----------------------------------------------------------------------------
+int
+pbuf_avail();
@@ -0,0 +1,217 @@
+//============================================================================
+/// @file       socket.h
+/// @brief      BSD-style sockets over the TCP and UDP endpoints.
+/// @details    Sockets are named by small integer descriptors from a
+///             system-wide table. Calls block by polling the stack until
+///             they can complete, unless the socket was created with
+///             SOCK_NONBLOCK or the call is given MSG_DONTWAIT. Readiness
+///             is reported level-triggered through epoll-style instances,
+///             which live in the same descriptor table.
+//============================================================================
+
+#pragma once
+
+#include <core.h>
+#include <kernel/net/net.h>
+
+// Maximum number of open sockets and epoll instances.
+#define MAX_SOCKETS          128
+
+// Address family, socket types and protocols
+#define AF_INET              2
+#define SOCK_STREAM          1
+#define SOCK_DGRAM           2
+#define SOCK_NONBLOCK        0x800      ///< Or'd into the type.
+#define IPPROTO_TCP          6
+#define IPPROTO_UDP          17
+
+// Send and receive flags
+#define MSG_DONTWAIT         0x40
+
+// Epoll events, operations and limits
+#define EPOLLIN              0x001
+#define EPOLLOUT             0x004
+#define EPOLLERR             0x008
+#define EPOLLHUP             0x010
+#define EPOLL_CTL_ADD        1
+#define EPOLL_CTL_DEL        2
+#define EPOLL_CTL_MOD        3
+#define MAX_EPOLL_ITEMS      256        ///< Registrations, system-wide.
+
+typedef uint32_t socklen_t;
+
+//----------------------------------------------------------------------------
+//  @struct     sockaddr_in
+/// @brief      An IPv4 socket address.
+//----------------------------------------------------------------------------
+struct sockaddr_in
+{
+    uint16_t   sin_family;  ///< AF_INET
+    uint16_t   sin_port;    ///< Port, in network byte order.
+    ip4_addr_t sin_addr;
+    uint8_t    sin_zero[8];
+};
+
+//----------------------------------------------------------------------------
+//  @struct     epoll_event
+/// @brief      Events of interest, or events ready, on a descriptor.
+//----------------------------------------------------------------------------
+struct epoll_event
+{
+    uint32_t events;        ///< EPOLL* bits.
+    uint64_t data;          ///< Caller's cookie.
+} PACKSTRUCT;
+
+//----------------------------------------------------------------------------
+//  @function   sock_socket
+/// @brief      Create a socket.
+/// @param[in]  domain      AF_INET.
+/// @param[in]  type        SOCK_STREAM or SOCK_DGRAM, optionally or'd with
+///                         SOCK_NONBLOCK.
+/// @param[in]  protocol    0, or the protocol matching `type'.
+/// @returns    The new descriptor, or a negative errno.
+//----------------------------------------------------------------------------
+int
+sock_socket(int domain, int type, int protocol);
+
+//----------------------------------------------------------------------------
+//  @function   sock_bind
+/// @brief      Assign a local address to a socket.
+/// @param[in]  fd      The socket.
+/// @param[in]  addr    The local address. A zero port picks an ephemeral
+///                     one for datagram sockets.
+/// @param[in]  len     The size of `addr'.
+/// @returns    0 on success, or a negative errno.
+//----------------------------------------------------------------------------
+int
+sock_bind(int fd, const struct sockaddr_in *addr, socklen_t len);
+
+//----------------------------------------------------------------------------
+//  @function   sock_listen
+/// @brief      Accept stream connections on a bound socket.
+/// @param[in]  fd      The socket.
+/// @param[in]  backlog Maximum connections waiting to be accepted.
+/// @returns    0 on success, or a negative errno.
+//----------------------------------------------------------------------------
+int
+sock_listen(int fd, int backlog);
+
+//----------------------------------------------------------------------------
+//  @function   sock_accept
+/// @brief      Take a connection from a listening socket.
+/// @param[in]  fd      The listening socket.
+/// @param[out] addr    The peer's address, or NULL.
+/// @param[in,out] len  The size of `addr', updated to the size stored.
+/// @returns    The new connection's descriptor, or a negative errno.
+//----------------------------------------------------------------------------
+int
+sock_accept(int fd, struct sockaddr_in *addr, socklen_t *len);
+
+//----------------------------------------------------------------------------
+//  @function   sock_connect
+/// @brief      Connect a socket to a remote address.
+/// @details    Stream sockets start the handshake; a non-blocking socket
+///             returns -EINPROGRESS and reports EPOLLOUT once connected.
+///             Datagram sockets record the default destination.
+/// @param[in]  fd      The socket.
+/// @param[in]  addr    The remote address.
+/// @param[in]  len     The size of `addr'.
+/// @returns    0 on success, or a negative errno.
+//----------------------------------------------------------------------------
+int
+sock_connect(int fd, const struct sockaddr_in *addr, socklen_t len);
+
+//----------------------------------------------------------------------------
+//  @function   sock_sendto
+/// @brief      Send data on a socket.
+/// @param[in]  fd      The socket.
+/// @param[in]  buf     The data.
+/// @param[in]  len     The number of bytes to send.
+/// @param[in]  flags   MSG_DONTWAIT, or 0.
+/// @param[in]  addr    The destination of a datagram, or NULL to use the
+///                     connected address.
+/// @param[in]  alen    The size of `addr'.
+/// @returns    The number of bytes sent, or a negative errno.
+//----------------------------------------------------------------------------
+int64_t
+sock_sendto(int fd, const void *buf, size_t len, int flags,
+            const struct sockaddr_in *addr, socklen_t alen);
+
+//----------------------------------------------------------------------------
+//  @function   sock_recvfrom
+/// @brief      Receive data from a socket.
+/// @param[in]  fd      The socket.
+/// @param[out] buf     The buffer to receive into.
+/// @param[in]  len     The size of `buf'.
+/// @param[in]  flags   MSG_DONTWAIT, or 0.
+/// @param[out] addr    The sender's address, or NULL.
+/// @param[in,out] alen The size of `addr', updated to the size stored.
+/// @returns    The number of bytes received, 0 at the end of a stream, or
+///             a negative errno.
+//----------------------------------------------------------------------------
+int64_t
+sock_recvfrom(int fd, void *buf, size_t len, int flags,
+              struct sockaddr_in *addr, socklen_t *alen);
+
+//----------------------------------------------------------------------------
+//  @function   sock_send
+/// @brief      Send data on a connected socket.
+//----------------------------------------------------------------------------
+static inline int64_t
+sock_send(int fd, const void *buf, size_t len, int flags)
+{
+    return sock_sendto(fd, buf, len, flags, NULL, 0);
+}
+
+//----------------------------------------------------------------------------
+//  @function   sock_recv
+/// @brief      Receive data from a connected socket.
+//----------------------------------------------------------------------------
+static inline int64_t
+sock_recv(int fd, void *buf, size_t len, int flags)
+{
+    return sock_recvfrom(fd, buf, len, flags, NULL, NULL);
+}
+
+//----------------------------------------------------------------------------
+//  @function   sock_close
+/// @brief      Close a socket or epoll instance.
+/// @param[in]  fd      The descriptor.
+/// @returns    0 on success, or -EBADF.
+//----------------------------------------------------------------------------
+int
+sock_close(int fd);
+
+//----------------------------------------------------------------------------
+//  @function   sock_epoll_create
+/// @brief      Create an epoll instance.
+/// @returns    The instance's descriptor, or a negative errno.
+//----------------------------------------------------------------------------
+int
+sock_epoll_create();
+
+//----------------------------------------------------------------------------
+//  @function   sock_epoll_ctl
+/// @brief      Add, change or remove a socket in an epoll instance.
+/// @param[in]  epfd    The epoll instance.
+/// @param[in]  op      EPOLL_CTL_ADD, EPOLL_CTL_MOD or EPOLL_CTL_DEL.
+/// @param[in]  fd      The socket.
+/// @param[in]  ev      The events of interest and cookie; unused for
+///                     EPOLL_CTL_DEL.
+/// @returns    0 on success, or a negative errno.
+//----------------------------------------------------------------------------
+int
+sock_epoll_ctl(int epfd, int op, int fd, const struct epoll_event *ev);
+
+//----------------------------------------------------------------------------
+//  @function   sock_epoll_wait
+/// @brief      Wait for registered sockets to become ready.
+/// @param[in]  epfd    The epoll instance.
+/// @param[out] events  The ready sockets' events and cookies.
+/// @param[in]  max     The capacity of `events'.
+/// @param[in]  timeout Milliseconds to wait; 0 to return at once, or -1 to
+///                     wait indefinitely.
+/// @returns    The number of events stored, or a negative errno.
+//----------------------------------------------------------------------------
+int
+sock_epoll_wait(int epfd, struct epoll_event *events, int max, int timeout);
@@ -0,0 +1,137 @@
+//============================================================================
+/// @file       tcp.h
+/// @brief      Transmission Control Protocol.
+/// @details    All calls are non-blocking. Connections are kept in one
+///             table per CPU, so connections handled by different CPUs
+///             never contend for a lock. Received payload is queued as the
+///             pbufs it arrived in, and sent payload is transmitted by
+///             cloning references to the send queue; tcp_recv_pbuf and
+///             tcp_send_pbuf let kernel users move data without copying at
+///             all.
+//============================================================================
+
+#pragma once
+
+#include <core.h>
+#include <kernel/net/net.h>
+#include <kernel/net/pbuf.h>
+
+typedef struct tcp_pcb tcp_pcb_t;
+
+//----------------------------------------------------------------------------
+//  @function   tcp_listen
+/// @brief      Accept connections on a local port.
+/// @param[in]  addr    The local address, or IP4_ANY for all interfaces.
+/// @param[in]  port    The local port.
+/// @param[in]  backlog Maximum connections waiting to be accepted.
+/// @param[out] pcb     The listening endpoint.
+/// @returns    0 on success, -EADDRINUSE or -ENOMEM on failure.
+//----------------------------------------------------------------------------
+int
+tcp_listen(ip4_addr_t addr, uint16_t port, int backlog, tcp_pcb_t **pcb);
+
+//----------------------------------------------------------------------------
+//  @function   tcp_accept
+/// @brief      Take an established connection from a listener's queue.
+/// @param[in]  listener    The listening endpoint.
+/// @param[out] conn        The connection.
+/// @returns    0 on success, -EAGAIN if no connection is waiting, or
+///             -EINVAL if `listener' is not listening.
+//----------------------------------------------------------------------------
+int
+tcp_accept(tcp_pcb_t *listener, tcp_pcb_t **conn);
+
+//----------------------------------------------------------------------------
+//  @function   tcp_connect
+/// @brief      Start opening a connection.
+/// @details    The connection reports NET_EV_WRITE once established, or
+///             NET_EV_ERR if it is refused or times out.
+/// @param[in]  addr    The remote address.
+/// @param[in]  port    The remote port.
+/// @param[out] conn    The connection.
+/// @returns    0 if the connection attempt started, or -ENETUNREACH,
+///             -EADDRINUSE or -ENOMEM.
+//----------------------------------------------------------------------------
+int
+tcp_connect(ip4_addr_t addr, uint16_t port, tcp_pcb_t **conn);
+
+//----------------------------------------------------------------------------
+//  @function   tcp_send
+/// @brief      Copy data into a connection's send queue.
+/// @param[in]  pcb     The connection.
+/// @param[in]  buf     The data.
+/// @param[in]  len     Number of bytes.
+/// @returns    The number of bytes queued (possibly fewer than `len'), or
+///             -EAGAIN if the send queue is full, -ENOTCONN, -EPIPE or
+///             -ECONNRESET.
+//----------------------------------------------------------------------------
+int64_t
+tcp_send(tcp_pcb_t *pcb, const void *buf, size_t len);
+
+//----------------------------------------------------------------------------
+//  @function   tcp_send_pbuf
+/// @brief      Append a pbuf chain to a connection's send queue without
+///             copying it.
+/// @param[in]  pcb     The connection.
+/// @param[in]  pb      The data. On success the connection owns it.
+/// @returns    0 on success, or the errors of tcp_send. On failure the
+///             caller still owns `pb'.
+//----------------------------------------------------------------------------
+int
+tcp_send_pbuf(tcp_pcb_t *pcb, pbuf_t *pb);
+
+//----------------------------------------------------------------------------
+//  @function   tcp_recv
+/// @brief      Copy received data out of a connection.
+/// @param[in]  pcb     The connection.
+/// @param[out] buf     The destination buffer.
+/// @param[in]  len     Size of the buffer.
+/// @returns    The number of bytes copied, 0 at end of stream, or -EAGAIN
+///             if no data is waiting, -ENOTCONN or -ECONNRESET.
+//----------------------------------------------------------------------------
+int64_t
+tcp_recv(tcp_pcb_t *pcb, void *buf, size_t len);
+
+//----------------------------------------------------------------------------
+//  @function   tcp_recv_pbuf
+/// @brief      Take all received data from a connection without copying.
+/// @param[in]  pcb     The connection.
+/// @param[out] pb      The data, which the caller must free.
+/// @returns    The number of bytes taken, or as for tcp_recv.
+//----------------------------------------------------------------------------
+int64_t
+tcp_recv_pbuf(tcp_pcb_t *pcb, pbuf_t **pb);
+
+//----------------------------------------------------------------------------
+//  @function   tcp_error
+/// @brief      Return the error that ended a connection.
+/// @returns    A negative errno such as -ECONNREFUSED, or 0.
+//----------------------------------------------------------------------------
+int
+tcp_error(const tcp_pcb_t *pcb);
+
+//----------------------------------------------------------------------------
+//  @function   tcp_events
+/// @brief      Return the NET_EV_* events pending on an endpoint.
+//----------------------------------------------------------------------------
+int
+tcp_events(const tcp_pcb_t *pcb);
+
+//----------------------------------------------------------------------------
+//  @function   tcp_peer
+/// @brief      Return the remote address and port of a connection.
+//----------------------------------------------------------------------------
+void
+tcp_peer(const tcp_pcb_t *pcb, ip4_addr_t *addr, uint16_t *port);
+
+//----------------------------------------------------------------------------
+//  @function   tcp_close
+/// @brief      Release an endpoint.
+/// @details    Queued data is still delivered before the connection is shut
+///             down, unless received data was left unread, in which case
+///             the connection is reset. Connections waiting on a closed
+///             listener are reset. The endpoint must not be used again.
+/// @param[in]  pcb     The endpoint.
+//----------------------------------------------------------------------------
+void
+tcp_close(tcp_pcb_t *pcb);
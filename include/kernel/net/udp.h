@@ -0,0 +1,75 @@
+//============================================================================
+/// @file       udp.h
+/// @brief      User Datagram Protocol.
+/// @details    All calls are non-blocking. Received datagrams are queued as
+///             the pbufs they arrived in.
+//============================================================================
+
+#pragma once
+
+#include <core.h>
+#include <kernel/net/net.h>
+
+typedef struct udp_pcb udp_pcb_t;
+
+//----------------------------------------------------------------------------
+//  @function   udp_open
+/// @brief      Open a datagram endpoint.
+/// @param[in]  addr    The local address, or IP4_ANY for all interfaces.
+/// @param[in]  port    The local port, or 0 to choose a free one.
+/// @param[out] pcb     The endpoint.
+/// @returns    0 on success, -EADDRINUSE or -ENOMEM on failure.
+//----------------------------------------------------------------------------
+int
+udp_open(ip4_addr_t addr, uint16_t port, udp_pcb_t **pcb);
+
+//----------------------------------------------------------------------------
+//  @function   udp_sendto
+/// @brief      Send a datagram.
+/// @param[in]  pcb     The endpoint.
+/// @param[in]  addr    The destination address.
+/// @param[in]  port    The destination port.
+/// @param[in]  buf     The payload.
+/// @param[in]  len     Payload length.
+/// @returns    `len' on success, or -EMSGSIZE, -ENETUNREACH or -ENOBUFS.
+//----------------------------------------------------------------------------
+int64_t
+udp_sendto(udp_pcb_t *pcb, ip4_addr_t addr, uint16_t port, const void *buf,
+           size_t len);
+
+//----------------------------------------------------------------------------
+//  @function   udp_recvfrom
+/// @brief      Receive a datagram.
+/// @param[in]  pcb     The endpoint.
+/// @param[out] buf     The destination buffer. A longer datagram is
+///                     truncated.
+/// @param[in]  len     Size of the buffer.
+/// @param[out] addr    The sender's address, if not NULL.
+/// @param[out] port    The sender's port, if not NULL.
+/// @returns    The number of bytes copied, or -EAGAIN if no datagram is
+///             waiting.
+//----------------------------------------------------------------------------
+int64_t
+udp_recvfrom(udp_pcb_t *pcb, void *buf, size_t len, ip4_addr_t *addr,
+             uint16_t *port);
+
+//----------------------------------------------------------------------------
+//  @function   udp_events
+/// @brief      Return the NET_EV_* events pending on an endpoint.
+//----------------------------------------------------------------------------
+int
+udp_events(const udp_pcb_t *pcb);
+
+//----------------------------------------------------------------------------
+//  @function   udp_local
+/// @brief      Return the local port of an endpoint.
+//----------------------------------------------------------------------------
+uint16_t
+udp_local(const udp_pcb_t *pcb);
+
+//----------------------------------------------------------------------------
+//  @function   udp_close
+/// @brief      Close an endpoint, discarding queued datagrams.
+//----------------------------------------------------------------------------
+void
+udp_close(udp_pcb_t *pcb);
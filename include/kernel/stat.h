@@ -1,3 +1,5 @@
+#pragma once
+
 #define T_DIR 1  // Directory
 #define T_FILE 2 // File
 #define T_DEV 3  // Device
@@ -7,9 +7,33 @@
 
 #include <core.h>
 
+// System call numbers, matching the x86-64 Linux ABI.
+#define SYS_CLOSE            3
+#define SYS_SOCKET           41
+#define SYS_CONNECT          42
+#define SYS_ACCEPT           43
+#define SYS_SENDTO           44
+#define SYS_RECVFROM         45
+#define SYS_BIND             49
+#define SYS_LISTEN           50
+#define SYS_EPOLL_CREATE     213
+#define SYS_EPOLL_WAIT       232
+#define SYS_EPOLL_CTL        233
+
 //----------------------------------------------------------------------------
 //  @function   syscall_init
 /// @brief      Set up the CPU to handle system calls.
 //----------------------------------------------------------------------------
 void
 syscall_init();
+
+//----------------------------------------------------------------------------
+//  @function   syscall_dispatch
+/// @brief      Perform a system call.
+/// @param[in]  num     The SYS_* number.
+/// @param[in]  arg0-arg5   The call's arguments, in ABI order.
+/// @returns    The call's result, or -ENOSYS for an unknown call.
+//----------------------------------------------------------------------------
+int64_t
+syscall_dispatch(uint64_t num, uint64_t arg0, uint64_t arg1, uint64_t arg2,
+                 uint64_t arg3, uint64_t arg4, uint64_t arg5);
@@ -166,6 +166,21 @@ void enable_interrupts();
 //----------------------------------------------------------------------------
 void disable_interrupts();
 
+//----------------------------------------------------------------------------
+//  @function   save_interrupts
+/// @brief      Disable interrupts, returning the previous flags register.
+/// @returns    The flags register value to pass to restore_interrupts.
+//----------------------------------------------------------------------------
+uint64_t save_interrupts();
+
+//----------------------------------------------------------------------------
+//  @function   restore_interrupts
+/// @brief      Re-enable interrupts if they were enabled when the flags
+///             were saved by save_interrupts.
+/// @param[in]  flags   The flags register value from save_interrupts.
+//----------------------------------------------------------------------------
+void restore_interrupts(uint64_t flags);
+
 //----------------------------------------------------------------------------
 //  @function   halt
 /// @brief      Halt the CPU until an interrupt occurs.
@@ -186,8 +201,6 @@ void fatal();
 
 void write_cr3(uintptr_t cr3);
 
-uintptr_t read_cr3(void);
-
 __forceinline void get_cpuid(unsigned int Mop, unsigned int Sop, unsigned int *a, unsigned int *b, unsigned int *c, unsigned int *d)
 {
     __asm__ __volatile__(
@@ -198,4 +211,12 @@ __forceinline void get_cpuid(unsigned int Mop, unsigned int Sop, unsigned int *a
 
 #endif // __NO_INLINE__
 
+//----------------------------------------------------------------------------
+//  @function   read_cr3
+/// @brief      Return the physical address of the current page table.
+/// @details    Implemented in cpu.asm only, so it is declared whether or
+///             not the inline versions are in use.
+//----------------------------------------------------------------------------
+uintptr_t read_cr3(void);
+
 #include "cpu_inl.h"
@@ -138,6 +138,27 @@ disable_interrupts()
     asm volatile ("cli");
 }
 
+__forceinline uint64_t
+save_interrupts()
+{
+    uint64_t flags;
+    asm volatile (
+        "pushfq\n"
+        "pop    %[f]\n"
+        "cli\n"
+        : [f] "=r" (flags)
+        :
+        : "memory");
+    return flags;
+}
+
+__forceinline void
+restore_interrupts(uint64_t flags)
+{
+    if (flags & (1 << 9))
+        asm volatile ("sti" ::: "memory");
+}
+
 __forceinline void
 halt()
 {
@@ -8,6 +8,15 @@
 #include <core.h>
 #include <stdarg.h>
 
+//----------------------------------------------------------------------------
+//  @typedef    printf_sink
+/// @brief      Receives a piece of formatted output from cbprintf.
+/// @param[in]  arg     The argument passed to cbprintf.
+/// @param[in]  buf     The characters, not null-terminated.
+/// @param[in]  n       The number of characters.
+//----------------------------------------------------------------------------
+typedef void (*printf_sink)(void *arg, const char *buf, size_t n);
+
 //----------------------------------------------------------------------------
 //  @function   snprintf
 /// @brief      Compose a printf-formatted string into the target buffer.
@@ -25,7 +34,7 @@
 ///             n was sufficiently large.
 //----------------------------------------------------------------------------
 int
-snprintf(char *buf, size_t n, const char *format, ...);
+snprintf(char *buf, size_t n, const char *format, ...) PRINTF_FORMAT(3, 4);
 
 //----------------------------------------------------------------------------
 //  @function   vsnprintf
@@ -45,4 +54,39 @@ snprintf(char *buf, size_t n, const char *format, ...);
 ///             n was sufficiently large.
 //----------------------------------------------------------------------------
 int
-vsnprintf(char *buf, size_t n, const char *format, va_list arg);
+vsnprintf(char *buf, size_t n, const char *format, va_list arg)
+PRINTF_FORMAT(3, 0);
+
+//----------------------------------------------------------------------------
+//  @function   cbprintf
+/// @brief      Format a printf-formatted string and pass it to a sink
+///             callback in pieces.
+/// @details    Output is staged in a small buffer on the stack, and the sink
+///             is called each time it fills, so output of any length is
+///             formatted without a buffer to hold all of it.
+/// @param[in]  sink    The function receiving the output.
+/// @param[in]  arg     An argument passed to each call of `sink'.
+/// @param[in]  format  A format-specifier string.
+/// @param[in]  ...     A variable argument list based on the contents of the
+///                     format string.
+/// @returns    The number of characters passed to the sink.
+//----------------------------------------------------------------------------
+int
+cbprintf(printf_sink sink, void *arg, const char *format, ...)
+PRINTF_FORMAT(3, 4);
+
+//----------------------------------------------------------------------------
+//  @function   vcbprintf
+/// @brief      Format a printf-formatted string using a variable argument
+///             list and pass it to a sink callback in pieces.
+/// @details    See cbprintf for further details.
+/// @param[in]  sink    The function receiving the output.
+/// @param[in]  arg     An argument passed to each call of `sink'.
+/// @param[in]  format  A format-specifier string.
+/// @param[in]  args    Variable arguments list to be initialized with
+///                     va_start.
+/// @returns    The number of characters passed to the sink.
+//----------------------------------------------------------------------------
+int
+vcbprintf(printf_sink sink, void *arg, const char *format, va_list args)
+PRINTF_FORMAT(3, 0);
@@ -65,6 +65,19 @@ strlcat(char *dst, const char *src, size_t dstsize);
 int
 strcmp(const char *str1, const char *str2);
 
+//----------------------------------------------------------------------------
+//  @function   memcmp
+/// @brief      Compare the bytes of two memory regions.
+/// @param[in]  buf1    Pointer to the first region.
+/// @param[in]  buf2    Pointer to the second region.
+/// @param[in]  num     Number of bytes to compare.
+/// @returns    < 0 if the first differing byte in buf1 has a lower value.
+///             = 0 if the regions are identical.
+///             > 0 otherwise.
+//----------------------------------------------------------------------------
+int
+memcmp(const void *buf1, const void *buf2, size_t num);
+
 //----------------------------------------------------------------------------
 //  @function   memcpy
 /// @brief      Copy bytes from one memory region to another.
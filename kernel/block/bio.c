@@ -0,0 +1,456 @@
+//============================================================================
+/// @file       bio.c
+/// @brief      Block I/O layer: bios, plugging and multi-queue dispatch.
+//============================================================================
+
+#include <core.h>
+#include <libc/string.h>
+#include <kernel/block/bio.h>
+#include <kernel/debug/log.h>
+#include <kernel/interrupt/lapic.h>
+#include <kernel/mem/paging.h>
+#include <kernel/spinlock.h>
+#include <kernel/x86/cpu.h>
+
+// Number of driver requests shared by all devices.
+#define MAX_BLK_REQUESTS     64
+
+// A driver request built from one or more merged bios.
+struct request
+{
+    blkreq_t        req;
+    blkseg_t        segs[MAX_BLK_SEGS];
+    bio_t          *bios;           ///< Merged bios, in sector order
+    bio_t          *last;
+    int             queue;          ///< Hardware queue
+    struct request *next;           ///< Free list link
+};
+
+// Per-CPU software queue: requests still open for merging. Only the
+// owning CPU touches it, with interrupts disabled.
+struct swq
+{
+    blkreq_t *head;
+    blkreq_t *tail;
+};
+
+// Hardware queue: requests waiting for room in the driver's queue.
+struct hwq
+{
+    spin_lock_t   lock;             ///< Protects head/tail
+    blkreq_t     *head;
+    blkreq_t     *tail;
+    volatile int  running;          ///< Dispatch in progress
+    volatile bool again;            ///< More work arrived during dispatch
+};
+
+struct devq
+{
+    struct swq swq[MAX_BLK_CPUS];
+    struct hwq hwq[MAX_BLK_QUEUES];
+};
+
+static struct devq     devqs[MAX_BLKDEVS];
+static struct request  requests[MAX_BLK_REQUESTS];
+static struct request *free_requests;
+static spin_lock_t     pool_lock;
+static bool            pool_ready;
+static blk_plug_t     *plugs[MAX_BLK_CPUS];
+
+static inline int
+cpu_index()
+{
+    return lapic_present() ? lapic_id() % MAX_BLK_CPUS : 0;
+}
+
+static struct request *
+request_alloc()
+{
+    spin_lock(pool_lock);
+    if (!pool_ready) {
+        for (int i = 0; i < MAX_BLK_REQUESTS; i++) {
+            requests[i].next = free_requests;
+            free_requests    = &requests[i];
+        }
+        pool_ready = true;
+    }
+    struct request *rq = free_requests;
+    if (rq != NULL)
+        free_requests = rq->next;
+    spin_unlock(pool_lock);
+    return rq;
+}
+
+static void
+request_free(struct request *rq)
+{
+    spin_lock(pool_lock);
+    rq->next      = free_requests;
+    free_requests = rq;
+    spin_unlock(pool_lock);
+}
+
+// Return true if data ending at `end' may be followed by `seg' in the same
+// request: either it continues in memory, or both sides of the join fall
+// on page boundaries.
+static inline bool
+seg_joinable(const blkseg_t *prev, const blkseg_t *seg)
+{
+    uint64_t end = (uint64_t)prev->addr + prev->len;
+    if (end == (uint64_t)seg->addr)
+        return true;
+    return (end & (PAGE_SIZE - 1)) == 0 &&
+           ((uint64_t)seg->addr & (PAGE_SIZE - 1)) == 0;
+}
+
+// Return true if `seg' may extend `prev' in place: it continues it in
+// memory, and the result is no longer than `maxlen'.
+static inline bool
+seg_extends(const blkseg_t *prev, const blkseg_t *seg, uint32_t maxlen)
+{
+    return (uint8_t *)prev->addr + prev->len == (uint8_t *)seg->addr &&
+           prev->len + seg->len <= maxlen;
+}
+
+// Append segments of at most `maxlen' bytes to a list, extending its last
+// segment where the data continues in memory. Returns false, leaving the
+// list untouched, if the list would overflow.
+static bool
+segs_append(blkseg_t *segs, int *nsegs, int max, uint32_t maxlen,
+            const blkseg_t *add, int count)
+{
+    // Count the segments needed before changing anything.
+    int      n    = *nsegs;
+    blkseg_t last = n > 0 ? segs[n - 1] : (blkseg_t){ NULL, 0 };
+    for (int i = 0; i < count; i++) {
+        if (n > 0 && seg_extends(&last, &add[i], maxlen)) {
+            last.len += add[i].len;
+        }
+        else {
+            last = add[i];
+            n++;
+        }
+    }
+    if (n > max)
+        return false;
+
+    n = *nsegs;
+    for (int i = 0; i < count; i++) {
+        if (n > 0 && seg_extends(&segs[n - 1], &add[i], maxlen))
+            segs[n - 1].len += add[i].len;
+        else
+            segs[n++] = add[i];
+    }
+    *nsegs = n;
+    return true;
+}
+
+void
+bio_init(bio_t *bio, blkdev_t *dev, int op, uint64_t sector)
+{
+    memzero(bio, sizeof(*bio));
+    bio->dev    = dev;
+    bio->op     = op;
+    bio->sector = sector;
+    bio->status = BLK_STATUS_PENDING;
+}
+
+bool
+bio_add(bio_t *bio, void *addr, uint32_t len)
+{
+    blkdev_t *dev = bio->dev;
+    blkseg_t  seg = { addr, len };
+    if (bio->nsegs > 0 && !seg_joinable(&bio->segs[bio->nsegs - 1], &seg))
+        return false;
+    if (bio->count + len / dev->sector_size > dev->max_sectors)
+        return false;
+
+    // Cut the data into pieces the device accepts as single segments.
+    blkseg_t pieces[MAX_BIO_SEGS];
+    int      npieces = 0;
+    for (uint32_t off = 0; off < len; npieces++) {
+        if (npieces == MAX_BIO_SEGS)
+            return false;
+        pieces[npieces].addr = (uint8_t *)addr + off;
+        pieces[npieces].len  = min(len - off, dev->max_seg_size);
+        off += pieces[npieces].len;
+    }
+    if (!segs_append(bio->segs, &bio->nsegs, min(MAX_BIO_SEGS, dev->max_segs),
+                     dev->max_seg_size, pieces, npieces))
+        return false;
+
+    bio->count += len / bio->dev->sector_size;
+    return true;
+}
+
+// Try to append a bio to the end of an open request.
+static bool
+request_merge(blkreq_t *req, bio_t *bio)
+{
+    struct request *rq   = (struct request *)req->private;
+    bio_t          *last = rq->last;
+
+    if (bio->op == BLK_OP_FLUSH || req->op != bio->op)
+        return false;
+    if (last->dev != bio->dev || req->sector + req->count != bio->sector)
+        return false;
+    if (req->count + bio->count > bio->dev->max_sectors)
+        return false;
+    if (!seg_joinable(&req->segs[req->nsegs - 1], &bio->segs[0]))
+        return false;
+
+    blkdev_t *dev   = bio->dev;
+    int       nsegs = req->nsegs;
+    if (!segs_append(rq->segs, &nsegs, dev->max_segs, dev->max_seg_size,
+                     bio->segs, bio->nsegs))
+        return false;
+
+    req->nsegs  = nsegs;
+    req->count += bio->count;
+    rq->last->next = bio;
+    rq->last       = bio;
+    bio->next      = NULL;
+    return true;
+}
+
+static void
+request_done(blkreq_t *req);
+
+static void
+request_init(struct request *rq, bio_t *bio, int queue)
+{
+    blkreq_t *req = &rq->req;
+    memzero(req, sizeof(*req));
+    req->op      = bio->op;
+    req->sector  = bio->sector;
+    req->count   = bio->count;
+    req->segs    = rq->segs;
+    req->status  = BLK_STATUS_PENDING;
+    req->done    = request_done;
+    req->private = rq;
+
+    memcpy(rq->segs, bio->segs, bio->nsegs * sizeof(blkseg_t));
+    req->nsegs = bio->nsegs;
+    rq->bios   = bio;
+    rq->last   = bio;
+    rq->queue  = queue;
+    bio->next  = NULL;
+}
+
+// Hand a hardware queue's waiting requests to the driver until its queue
+// fills, with a single kick for the batch. Re-entrant calls (for example
+// from a completion inside submit) are folded into the running dispatch.
+static void
+hwq_run(blkdev_t *dev, int queue)
+{
+    struct hwq *hq = &devqs[dev->id].hwq[queue];
+
+    do {
+        hq->again = true;
+        if (__sync_lock_test_and_set(&hq->running, 1))
+            return;
+
+        hq->again     = false;
+        int submitted = 0;
+        for (;;) {
+            spin_lock(hq->lock);
+            blkreq_t *req = hq->head;
+            if (req != NULL && (hq->head = req->next) == NULL)
+                hq->tail = NULL;
+            spin_unlock(hq->lock);
+            if (req == NULL)
+                break;
+
+            req->next = NULL;
+            if (!dev->ops->submit(dev, queue, req)) {
+                spin_lock(hq->lock);
+                req->next = hq->head;
+                hq->head  = req;
+                if (hq->tail == NULL)
+                    hq->tail = req;
+                spin_unlock(hq->lock);
+                break;
+            }
+            submitted++;
+        }
+        if (submitted > 0)
+            dev->ops->kick(dev, queue);
+
+        __sync_lock_release(&hq->running);
+    } while (hq->again);
+}
+
+// Move a CPU's open requests for a device onto its hardware queue and
+// dispatch them.
+static void
+swq_flush(blkdev_t *dev, int cpu)
+{
+    struct swq *sq = &devqs[dev->id].swq[cpu];
+    if (sq->head == NULL)
+        return;
+
+    int         queue = blkdev_queue(dev);
+    struct hwq *hq    = &devqs[dev->id].hwq[queue];
+
+    spin_lock(hq->lock);
+    if (hq->tail != NULL)
+        hq->tail->next = sq->head;
+    else
+        hq->head = sq->head;
+    hq->tail = sq->tail;
+    spin_unlock(hq->lock);
+
+    sq->head = sq->tail = NULL;
+    hwq_run(dev, queue);
+}
+
+static void
+request_done(blkreq_t *req)
+{
+    struct request *rq  = (struct request *)req->private;
+    blkdev_t       *dev = rq->bios->dev;
+    int             queue = rq->queue;
+
+    bio_t *bio = rq->bios;
+    while (bio != NULL) {
+        bio_t *next = bio->next;
+        bio->next   = NULL;
+        bio->status = req->status;
+        if (bio->end_io != NULL)
+            bio->end_io(bio);
+        bio = next;
+    }
+    request_free(rq);
+
+    // A slot just opened in the driver's queue.
+    hwq_run(dev, queue);
+}
+
+// Reap completions on every queue of every block device.
+static void
+poll_all()
+{
+    for (blkdev_t *d = blkdev_next(NULL); d != NULL; d = blkdev_next(d))
+        blkdev_poll(d);
+}
+
+// Merge a sorted list of bios into requests on the calling CPU's software
+// queues, then dispatch them. Interrupts must be disabled.
+static void
+dispatch(bio_t *list)
+{
+    int       cpu     = cpu_index();
+    blkdev_t *touched[MAX_BLKDEVS];
+    int       ntouched = 0;
+
+    while (list != NULL) {
+        bio_t *bio = list;
+        list       = bio->next;
+
+        blkdev_t   *dev = bio->dev;
+        struct swq *sq  = &devqs[dev->id].swq[cpu];
+        if (sq->tail != NULL && request_merge(sq->tail, bio))
+            continue;
+
+        struct request *rq;
+        while ((rq = request_alloc()) == NULL) {
+            // Out of requests: push out what we have and reap completions
+            // until one is returned. The pool is shared, so the requests
+            // may all be in flight on other devices or queues.
+            for (int i = 0; i < ntouched; i++)
+                swq_flush(touched[i], cpu);
+            poll_all();
+        }
+        request_init(rq, bio, blkdev_queue(dev));
+
+        if (sq->head == NULL) {
+            sq->head = &rq->req;
+            int i = 0;
+            while (i < ntouched && touched[i] != dev)
+                i++;
+            if (i == ntouched)
+                touched[ntouched++] = dev;
+        }
+        else {
+            sq->tail->next = &rq->req;
+        }
+        sq->tail = &rq->req;
+    }
+
+    for (int i = 0; i < ntouched; i++)
+        swq_flush(touched[i], cpu);
+}
+
+void
+bio_submit(bio_t *bio)
+{
+    bio->status = BLK_STATUS_PENDING;
+    bio->next   = NULL;
+
+    uint64_t    flags = save_interrupts();
+    blk_plug_t *plug  = plugs[cpu_index()];
+
+    if (plug == NULL) {
+        dispatch(bio);
+        restore_interrupts(flags);
+        return;
+    }
+
+    // Keep the plug sorted by device and sector so neighbours meet.
+    bio_t **link = &plug->head;
+    while (*link != NULL &&
+           ((*link)->dev->id < bio->dev->id ||
+            ((*link)->dev == bio->dev && (*link)->sector <= bio->sector)))
+        link = &(*link)->next;
+    bio->next = *link;
+    *link     = bio;
+
+    if (++plug->count >= BLK_PLUG_MAX) {
+        bio_t *held = plug->head;
+        plug->head  = NULL;
+        plug->count = 0;
+        dispatch(held);
+    }
+    restore_interrupts(flags);
+}
+
+int
+bio_wait(bio_t *bio)
+{
+    blkdev_t *dev   = bio->dev;
+    int       queue = blkdev_queue(dev);
+
+    while (bio->status == BLK_STATUS_PENDING) {
+        uint64_t flags = save_interrupts();
+        dev->ops->poll(dev, queue);
+        hwq_run(dev, queue);
+        restore_interrupts(flags);
+    }
+    return bio->status;
+}
+
+void
+blk_start_plug(blk_plug_t *plug)
+{
+    plug->head  = NULL;
+    plug->count = 0;
+
+    uint64_t flags = save_interrupts();
+    plugs[cpu_index()] = plug;
+    restore_interrupts(flags);
+}
+
+void
+blk_finish_plug(blk_plug_t *plug)
+{
+    uint64_t flags = save_interrupts();
+    if (plugs[cpu_index()] == plug)
+        plugs[cpu_index()] = NULL;
+
+    bio_t *held = plug->head;
+    plug->head  = NULL;
+    plug->count = 0;
+    if (held != NULL)
+        dispatch(held);
+    restore_interrupts(flags);
+}
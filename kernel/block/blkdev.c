@@ -0,0 +1,188 @@
+//============================================================================
+/// @file       blkdev.c
+/// @brief      Block device registry and request interface.
+//============================================================================
+
+#include <core.h>
+#include <libc/string.h>
+#include <kernel/block/blkdev.h>
+#include <kernel/debug/log.h>
+#include <kernel/interrupt/lapic.h>
+#include <kernel/x86/cpu.h>
+
+static blkdev_t *devs[MAX_BLKDEVS];
+static int       devcount;
+
+bool
+blkdev_register(blkdev_t *dev)
+{
+    if (devcount == MAX_BLKDEVS) {
+        logf(LOG_WARNING, "[blk] Device table full; ignoring %s.", dev->name);
+        return false;
+    }
+
+    if (dev->nr_queues > MAX_BLK_QUEUES)
+        dev->nr_queues = MAX_BLK_QUEUES;
+
+    // Fill in the default segment limits, and keep segments whole sectors.
+    if (dev->max_segs <= 0 || dev->max_segs > MAX_BLK_SEGS)
+        dev->max_segs = MAX_BLK_SEGS;
+    uint32_t seg_size = dev->max_seg_size ? dev->max_seg_size : UINT32_MAX;
+    dev->max_seg_size = max(seg_size / dev->sector_size, 1u) *
+                        dev->sector_size;
+
+    dev->id          = devcount;
+    devs[devcount++] = dev;
+
+    logf(LOG_INFO, "[blk] %s: %lu sectors of %u bytes, %d queue(s).",
+         dev->name, dev->sectors, dev->sector_size, dev->nr_queues);
+    return true;
+}
+
+blkdev_t *
+blkdev_find(const char *name)
+{
+    for (int i = 0; i < devcount; i++) {
+        if (!strcmp(devs[i]->name, name))
+            return devs[i];
+    }
+    return NULL;
+}
+
+blkdev_t *
+blkdev_next(const blkdev_t *prev)
+{
+    int i = 0;
+    if (prev != NULL) {
+        while (i < devcount && devs[i] != prev)
+            i++;
+        i++;
+    }
+    return i < devcount ? devs[i] : NULL;
+}
+
+int
+blkdev_queue(const blkdev_t *dev)
+{
+    // Each CPU gets its own hardware queue so submissions never contend.
+    if (dev->nr_queues <= 1 || !lapic_present())
+        return 0;
+    return lapic_id() % dev->nr_queues;
+}
+
+void
+blkdev_poll(blkdev_t *dev)
+{
+    uint64_t flags = save_interrupts();
+    for (int q = 0; q < max(dev->nr_queues, 1); q++)
+        dev->ops->poll(dev, q);
+    restore_interrupts(flags);
+}
+
+int
+blkdev_wait(blkdev_t *dev, int queue, blkreq_t *req)
+{
+    while (req->status == BLK_STATUS_PENDING) {
+        uint64_t flags = save_interrupts();
+        dev->ops->poll(dev, queue);
+        restore_interrupts(flags);
+    }
+    return req->status;
+}
+
+// Submit as many of the requests as the queue has room for, at least one,
+// and wait for them. Returns the number submitted.
+static int
+submit_wait(blkdev_t *dev, int queue, blkreq_t *reqs, int count)
+{
+    int n = 0;
+
+    // The queue may be full of other requests, such as asynchronous
+    // write-back. Reap completions until a slot frees up.
+    while (n == 0) {
+        uint64_t flags = save_interrupts();
+        while (n < count && dev->ops->submit(dev, queue, &reqs[n]))
+            n++;
+        if (n > 0)
+            dev->ops->kick(dev, queue);
+        else
+            dev->ops->poll(dev, queue);
+        restore_interrupts(flags);
+    }
+
+    for (int i = 0; i < n; i++)
+        blkdev_wait(dev, queue, &reqs[i]);
+    return n;
+}
+
+static int
+transfer(blkdev_t *dev, int op, uint64_t sector, uint32_t count, void *buf)
+{
+    if (sector + count > dev->sectors)
+        return BLK_STATUS_ERROR;
+
+    int      queue = blkdev_queue(dev);
+    uint8_t *ptr   = (uint8_t *)buf;
+
+    // Each piece is a single segment, so it's limited by the segment size
+    // as well as the request size.
+    uint32_t limit = min(dev->max_sectors,
+                         dev->max_seg_size / dev->sector_size);
+
+    // Split transfers larger than the device's maximum request size, and
+    // queue a batch of pieces before a single kick.
+    blkreq_t reqs[8];
+    while (count > 0) {
+        int      n = 0;
+        uint64_t s = sector;
+        uint32_t c = count;
+        uint8_t *p = ptr;
+        for (; n < arrsize(reqs) && c > 0; n++) {
+            blkreq_t *req = &reqs[n];
+            memzero(req, sizeof(*req));
+            req->op     = op;
+            req->sector = s;
+            req->count  = min(c, limit);
+            req->buf    = p;
+            req->status = BLK_STATUS_PENDING;
+
+            s += req->count;
+            c -= req->count;
+            p += (uint64_t)req->count * dev->sector_size;
+        }
+
+        int done = submit_wait(dev, queue, reqs, n);
+        for (int i = 0; i < done; i++) {
+            if (reqs[i].status != BLK_STATUS_OK)
+                return reqs[i].status;
+            sector += reqs[i].count;
+            count  -= reqs[i].count;
+            ptr    += (uint64_t)reqs[i].count * dev->sector_size;
+        }
+    }
+    return BLK_STATUS_OK;
+}
+
+int
+blkdev_read(blkdev_t *dev, uint64_t sector, uint32_t count, void *buf)
+{
+    return transfer(dev, BLK_OP_READ, sector, count, buf);
+}
+
+int
+blkdev_write(blkdev_t *dev, uint64_t sector, uint32_t count, const void *buf)
+{
+    return transfer(dev, BLK_OP_WRITE, sector, count, (void *)buf);
+}
+
+int
+blkdev_flush(blkdev_t *dev)
+{
+    blkreq_t req;
+    memzero(&req, sizeof(req));
+    req.op     = BLK_OP_FLUSH;
+    req.status = BLK_STATUS_PENDING;
+
+    submit_wait(dev, blkdev_queue(dev), &req, 1);
+    return req.status;
+}
@@ -0,0 +1,693 @@
+//============================================================================
+/// @file       pcache.c
+/// @brief      Page cache for block devices.
+//============================================================================
+
+#include <core.h>
+#include <libc/string.h>
+#include <kernel/block/pcache.h>
+#include <kernel/debug/log.h>
+#include <kernel/mem/paging.h>
+#include <kernel/mem/radix.h>
+#include <kernel/spinlock.h>
+#include <kernel/x86/cpu.h>
+
+// Reclaim cached pages when fewer than this many frames are free.
+#define PCACHE_MIN_FREE      1024
+
+// Number of pages to reclaim at once under memory pressure.
+#define PCACHE_SHRINK_BATCH  32
+
+// Read-ahead window limits, in pages.
+#define RA_MIN_PAGES         4
+#define RA_MAX_PAGES         32
+
+// Dirty pages may fill this percentage of free and cached memory before
+// writers are throttled. A throttled writer flushes down to the background
+// percentage, which is also where the idle flusher stops waiting.
+#define DIRTY_RATIO          20
+#define DIRTY_BACKGROUND     10
+
+// Idle passes a device's dirty pages wait for more writes to gather
+// before the flusher starts on them.
+#define DIRTY_EXPIRE         20
+
+// Dirty pages submitted at once, and batches per device per idle pass.
+#define FLUSH_BATCH          64
+#define FLUSH_IDLE_BATCHES   4
+
+typedef struct lru
+{
+    cpage_t  *head;             ///< Oldest page
+    cpage_t  *tail;             ///< Newest page
+    uint32_t  count;
+} lru_t;
+
+// Per-device cache state.
+struct devcache
+{
+    radix_t  pages;             ///< Page number -> cpage_t
+    uint64_t expect;            ///< Page a sequential reader reads next
+    uint64_t ra_next;           ///< First page not yet read ahead
+    uint32_t ra_size;           ///< Current read-ahead window
+    uint64_t cursor;            ///< Page the flusher resumes from
+    uint32_t dirty;             ///< Dirty pages
+    uint32_t age;               ///< Idle passes since the flusher ran
+    volatile uint32_t writeback;    ///< Pages being written
+    volatile bool     werror;       ///< A write failed since the last sync
+};
+
+static struct devcache caches[MAX_BLKDEVS];
+static lru_t           inactive;
+static lru_t           active;
+static cpage_t        *free_descs;
+static spin_lock_t     pclock;
+static uint32_t        dirty_pages;
+
+static void
+lru_remove(lru_t *list, cpage_t *page)
+{
+    if (page->prev != NULL)
+        page->prev->next = page->next;
+    else
+        list->head = page->next;
+    if (page->next != NULL)
+        page->next->prev = page->prev;
+    else
+        list->tail = page->prev;
+    page->prev = page->next = NULL;
+    list->count--;
+}
+
+static void
+lru_append(lru_t *list, cpage_t *page)
+{
+    page->prev = list->tail;
+    page->next = NULL;
+    if (list->tail != NULL)
+        list->tail->next = page;
+    else
+        list->head = page;
+    list->tail = page;
+    list->count++;
+}
+
+static cpage_t *
+desc_alloc()
+{
+    if (free_descs == NULL) {
+        uint8_t *mem = kpage_alloc(1);
+        int      n   = PAGE_SIZE / sizeof(cpage_t);
+        for (int i = 0; mem != NULL && i < n; i++) {
+            cpage_t *desc = (cpage_t *)mem + i;
+            desc->next = free_descs;
+            free_descs = desc;
+        }
+    }
+
+    cpage_t *desc = free_descs;
+    if (desc != NULL) {
+        free_descs = desc->next;
+        memzero(desc, sizeof(*desc));
+    }
+    return desc;
+}
+
+static void
+desc_free(cpage_t *desc)
+{
+    desc->next = free_descs;
+    free_descs = desc;
+}
+
+static inline uint32_t
+sectors_per_page(const blkdev_t *dev)
+{
+    return PAGE_SIZE / dev->sector_size;
+}
+
+static inline uint64_t
+device_pages(const blkdev_t *dev)
+{
+    return div_up(dev->sectors, sectors_per_page(dev));
+}
+
+// Note an access for the CLOCK: a page referenced twice while inactive
+// moves to the active list.
+static void
+mark_accessed(cpage_t *page)
+{
+    if (!(page->flags & PG_REFERENCED)) {
+        page->flags |= PG_REFERENCED;
+    }
+    else if (!(page->flags & PG_ACTIVE)) {
+        lru_remove(&inactive, page);
+        page->flags = (page->flags & ~PG_REFERENCED) | PG_ACTIVE;
+        lru_append(&active, page);
+    }
+}
+
+// Mark a page dirty. The caller holds pclock.
+static void
+set_dirty(cpage_t *page)
+{
+    if (!(page->flags & PG_DIRTY)) {
+        __sync_fetch_and_or(&page->flags, PG_DIRTY);
+        caches[page->dev->id].dirty++;
+        dirty_pages++;
+    }
+}
+
+// Evict up to `count' unused pages. The caller holds pclock.
+static int
+shrink_locked(int count)
+{
+    int freed = 0;
+    int scan  = 2 * (int)(inactive.count + active.count);
+
+    while (freed < count && scan-- > 0) {
+        // Keep the active list no larger than the inactive one, giving
+        // demoted pages another chance to be referenced.
+        if (active.count > inactive.count) {
+            cpage_t *page = active.head;
+            lru_remove(&active, page);
+            page->flags &= ~(PG_ACTIVE | PG_REFERENCED);
+            lru_append(&inactive, page);
+        }
+
+        cpage_t *page = inactive.head;
+        if (page == NULL)
+            break;
+        lru_remove(&inactive, page);
+
+        if (page->flags & PG_REFERENCED) {
+            page->flags = (page->flags & ~PG_REFERENCED) | PG_ACTIVE;
+            lru_append(&active, page);
+            continue;
+        }
+        if ((page->flags & PG_LOCKED) || kpage_refcount(page->data) > 1) {
+            lru_append(&inactive, page);
+            continue;
+        }
+
+        // Dirty pages stay until the flusher has written them, including
+        // pages written through a mapping that has since gone away.
+        if (kpage_clear_dirty(page->data))
+            set_dirty(page);
+        if (page->flags & (PG_DIRTY | PG_WRITEBACK)) {
+            lru_append(&inactive, page);
+            continue;
+        }
+
+        radix_delete(&caches[page->dev->id].pages, page->index);
+        kpage_free(page->data, 1);
+        desc_free(page);
+        freed++;
+    }
+    return freed;
+}
+
+int
+pcache_shrink(int count)
+{
+    uint64_t flags = save_interrupts();
+    spin_lock(pclock);
+    int freed = shrink_locked(count);
+    spin_unlock(pclock);
+    restore_interrupts(flags);
+    return freed;
+}
+
+// Create an empty, locked page for `index'. The caller holds pclock and
+// has checked that the page isn't cached.
+static cpage_t *
+page_create(blkdev_t *dev, uint64_t index)
+{
+    if (kpage_avail() < PCACHE_MIN_FREE)
+        shrink_locked(PCACHE_SHRINK_BATCH);
+
+    void *data = kpage_alloc(1);
+    if (data == NULL && shrink_locked(PCACHE_SHRINK_BATCH) > 0)
+        data = kpage_alloc(1);
+    if (data == NULL)
+        return NULL;
+
+    cpage_t *page = desc_alloc();
+    if (page == NULL) {
+        kpage_free(data, 1);
+        return NULL;
+    }
+    page->dev   = dev;
+    page->index = index;
+    page->data  = data;
+    page->flags = PG_LOCKED;
+
+    // Readers that find the page before its read is submitted wait on
+    // this bio.
+    page->bio.dev    = dev;
+    page->bio.status = BLK_STATUS_PENDING;
+
+    if (!radix_insert(&caches[dev->id].pages, index, page)) {
+        kpage_free(data, 1);
+        desc_free(page);
+        return NULL;
+    }
+    lru_append(&inactive, page);
+    return page;
+}
+
+static void
+read_done(bio_t *bio)
+{
+    // May run on another CPU than pclock's holder, so update atomically and
+    // publish the result before dropping PG_LOCKED.
+    cpage_t *page = (cpage_t *)bio->private;
+    if (bio->status == BLK_STATUS_OK)
+        __sync_fetch_and_or(&page->flags, PG_UPTODATE);
+    else
+        __sync_fetch_and_or(&page->flags, PG_ERROR);
+    __sync_fetch_and_and(&page->flags, ~PG_LOCKED);
+}
+
+// Start reading a locked page. Must be called without pclock held.
+static void
+read_start(cpage_t *page)
+{
+    blkdev_t *dev    = page->dev;
+    uint32_t  spp    = sectors_per_page(dev);
+    uint64_t  sector = page->index * spp;
+    uint32_t  count  = (uint32_t)min((uint64_t)spp, dev->sectors - sector);
+
+    // A short final page is zero-filled past the end of the device.
+    if (count < spp)
+        memzero(page->data, PAGE_SIZE);
+
+    bio_init(&page->bio, dev, BLK_OP_READ, sector);
+    bio_add(&page->bio, page->data, count * dev->sector_size);
+    page->bio.end_io  = read_done;
+    page->bio.private = page;
+    bio_submit(&page->bio);
+}
+
+// Create pages ahead of a sequential reader. Called with pclock held;
+// returns a list (linked through bio.next) of pages to start reading.
+static cpage_t *
+readahead(blkdev_t *dev, uint64_t index)
+{
+    struct devcache *dc = &caches[dev->id];
+
+    if (index != dc->expect) {
+        // Random access: collapse the window.
+        dc->expect  = index + 1;
+        dc->ra_next = index + 1;
+        dc->ra_size = 0;
+        return NULL;
+    }
+    dc->expect = index + 1;
+
+    // Wait until the reader is halfway through the last window.
+    if (dc->ra_next > index + dc->ra_size / 2)
+        return NULL;
+
+    dc->ra_size = dc->ra_size ? min(dc->ra_size * 2, RA_MAX_PAGES)
+                              : RA_MIN_PAGES;
+
+    uint64_t start = max(dc->ra_next, index + 1);
+    uint64_t end   = min(index + 1 + dc->ra_size, device_pages(dev));
+
+    cpage_t *list = NULL;
+    for (uint64_t i = start; i < end; i++) {
+        if (radix_lookup(&dc->pages, i) != NULL)
+            continue;
+        cpage_t *page = page_create(dev, i);
+        if (page == NULL)
+            break;
+        page->bio.next = (bio_t *)list;
+        list           = page;
+    }
+    dc->ra_next = max(dc->ra_next, end);
+    return list;
+}
+
+cpage_t *
+pcache_get(blkdev_t *dev, uint64_t index)
+{
+    if (index >= device_pages(dev))
+        return NULL;
+
+    uint64_t flags = save_interrupts();
+    spin_lock(pclock);
+
+    bool     start = false;
+    cpage_t *page  = radix_lookup(&caches[dev->id].pages, index);
+    if (page == NULL) {
+        page  = page_create(dev, index);
+        start = (page != NULL);
+    }
+    else {
+        mark_accessed(page);
+        if ((page->flags & (PG_ERROR | PG_LOCKED)) == PG_ERROR) {
+            // Retry a failed read.
+            page->flags      = (page->flags & ~PG_ERROR) | PG_LOCKED;
+            page->bio.status = BLK_STATUS_PENDING;
+            start            = true;
+        }
+    }
+    if (page != NULL)
+        kpage_ref(page->data);
+
+    cpage_t *ahead = readahead(dev, index);
+
+    spin_unlock(pclock);
+
+    // Submit the demand read and the read-ahead pages as one plugged batch
+    // so they merge into large requests.
+    blk_plug_t plug;
+    blk_start_plug(&plug);
+    if (start)
+        read_start(page);
+    while (ahead != NULL) {
+        cpage_t *next = (cpage_t *)ahead->bio.next;
+        read_start(ahead);
+        ahead = next;
+    }
+    blk_finish_plug(&plug);
+
+    restore_interrupts(flags);
+
+    if (page == NULL)
+        return NULL;
+
+    while (page->flags & PG_LOCKED)
+        bio_wait(&page->bio);
+    if (!(page->flags & PG_UPTODATE)) {
+        pcache_put(page);
+        return NULL;
+    }
+    return page;
+}
+
+void
+pcache_put(cpage_t *page)
+{
+    kpage_free(page->data, 1);
+}
+
+int
+pcache_read(blkdev_t *dev, uint64_t offset, void *buf, uint64_t len)
+{
+    if (offset + len > dev->sectors * dev->sector_size)
+        return BLK_STATUS_ERROR;
+
+    uint8_t *dst = (uint8_t *)buf;
+    while (len > 0) {
+        uint64_t off = offset & (PAGE_SIZE - 1);
+        uint64_t n   = min(len, PAGE_SIZE - off);
+
+        cpage_t *page = pcache_get(dev, offset / PAGE_SIZE);
+        if (page == NULL)
+            return BLK_STATUS_ERROR;
+        memcpy(dst, (uint8_t *)page->data + off, n);
+        pcache_put(page);
+
+        dst    += n;
+        offset += n;
+        len    -= n;
+    }
+    return BLK_STATUS_OK;
+}
+
+// Return a referenced page that the caller will overwrite completely, so a
+// missing page is created without reading it from the device.
+static cpage_t *
+page_overwrite(blkdev_t *dev, uint64_t index)
+{
+    uint64_t flags = save_interrupts();
+    spin_lock(pclock);
+
+    cpage_t *page = radix_lookup(&caches[dev->id].pages, index);
+    if (page != NULL) {
+        mark_accessed(page);
+    }
+    else if ((page = page_create(dev, index)) != NULL) {
+        page->flags      = PG_UPTODATE;
+        page->bio.status = BLK_STATUS_OK;
+    }
+    if (page != NULL)
+        kpage_ref(page->data);
+
+    spin_unlock(pclock);
+    restore_interrupts(flags);
+
+    // Let an in-flight read finish before its data is replaced.
+    while (page != NULL && (page->flags & PG_LOCKED))
+        bio_wait(&page->bio);
+    return page;
+}
+
+static inline uint32_t
+dirty_limit(int ratio)
+{
+    uint64_t pages = kpage_avail() + inactive.count + active.count;
+    return (uint32_t)(pages * ratio / 100);
+}
+
+static void
+write_done(bio_t *bio)
+{
+    // May run on another CPU than pclock's holder, like read_done.
+    cpage_t         *page = (cpage_t *)bio->private;
+    struct devcache *dc   = &caches[page->dev->id];
+    if (bio->status != BLK_STATUS_OK)
+        dc->werror = true;
+    __sync_fetch_and_sub(&dc->writeback, 1);
+    __sync_fetch_and_and(&page->flags, ~PG_WRITEBACK);
+}
+
+// Start writing up to `max' dirty pages of a device, in ascending page
+// order from where its flusher stopped last time. The pages are submitted
+// under one plug so runs of neighbouring pages merge into large sequential
+// requests. Returns the number of pages submitted, which are stored in
+// `pages'.
+static int
+writeback(blkdev_t *dev, cpage_t **pages, int max)
+{
+    struct devcache *dc    = &caches[dev->id];
+    int              count = 0;
+
+    uint64_t flags = save_interrupts();
+    spin_lock(pclock);
+
+    uint64_t start   = dc->cursor;
+    uint64_t index   = start;
+    bool     wrapped = false;
+    while (count < max && dc->dirty > 0) {
+        cpage_t *page = radix_next(&dc->pages, &index);
+        if (page == NULL || (wrapped && index >= start)) {
+            if (wrapped)
+                break;
+            wrapped = true;
+            index   = 0;
+            continue;
+        }
+        index++;
+
+        // A page dirtied again during its write waits for the next pass.
+        if ((page->flags & (PG_DIRTY | PG_WRITEBACK)) != PG_DIRTY)
+            continue;
+        __sync_fetch_and_and(&page->flags, ~PG_DIRTY);
+        __sync_fetch_and_or(&page->flags, PG_WRITEBACK);
+        __sync_fetch_and_add(&dc->writeback, 1);
+        dc->dirty--;
+        dirty_pages--;
+        pages[count++] = page;
+    }
+    dc->cursor = index;
+    dc->age    = 0;
+
+    spin_unlock(pclock);
+
+    blk_plug_t plug;
+    blk_start_plug(&plug);
+    uint32_t spp = sectors_per_page(dev);
+    for (int i = 0; i < count; i++) {
+        cpage_t *page   = pages[i];
+        uint64_t sector = page->index * spp;
+        uint32_t n      = (uint32_t)min((uint64_t)spp, dev->sectors - sector);
+        bio_init(&page->bio, dev, BLK_OP_WRITE, sector);
+        bio_add(&page->bio, page->data, n * dev->sector_size);
+        page->bio.end_io  = write_done;
+        page->bio.private = page;
+        bio_submit(&page->bio);
+    }
+    blk_finish_plug(&plug);
+
+    restore_interrupts(flags);
+    return count;
+}
+
+static void
+writeback_wait(cpage_t **pages, int count)
+{
+    for (int i = 0; i < count; i++) {
+        while (pages[i]->flags & PG_WRITEBACK)
+            bio_wait(&pages[i]->bio);
+    }
+}
+
+// Wait until none of a device's pages are being written.
+static void
+writeback_drain(blkdev_t *dev)
+{
+    struct devcache *dc    = &caches[dev->id];
+    uint64_t         index = 0;
+
+    while (dc->writeback > 0) {
+        uint64_t flags = save_interrupts();
+        spin_lock(pclock);
+        cpage_t *page;
+        while ((page = radix_next(&dc->pages, &index)) != NULL &&
+               !(page->flags & PG_WRITEBACK))
+            index++;
+        spin_unlock(pclock);
+        restore_interrupts(flags);
+
+        // Pages under write-back can't be evicted, so the page stays valid.
+        if (page == NULL) {
+            index = 0;
+            continue;
+        }
+        while (page->flags & PG_WRITEBACK)
+            bio_wait(&page->bio);
+        index++;
+    }
+}
+
+// Pick up pages dirtied through writable mappings.
+static void
+harvest_mapped()
+{
+    if (page_harvest_dirty() == 0)
+        return;
+
+    uint64_t flags = save_interrupts();
+    spin_lock(pclock);
+    for (int id = 0; id < MAX_BLKDEVS; id++) {
+        uint64_t index = 0;
+        cpage_t *page;
+        while ((page = radix_next(&caches[id].pages, &index)) != NULL) {
+            if (kpage_clear_dirty(page->data))
+                set_dirty(page);
+            index++;
+        }
+    }
+    spin_unlock(pclock);
+    restore_interrupts(flags);
+}
+
+// Throttle a writer that has pushed the cache past its dirty limit: it
+// writes back its own device until the cache is under the background
+// limit, so dirty data can't pile up faster than the device takes it.
+static void
+balance_dirty(blkdev_t *dev)
+{
+    if (dirty_pages <= dirty_limit(DIRTY_RATIO))
+        return;
+
+    cpage_t *pages[FLUSH_BATCH];
+    while (dirty_pages > dirty_limit(DIRTY_BACKGROUND)) {
+        int count = writeback(dev, pages, FLUSH_BATCH);
+        if (count == 0)
+            break;
+        writeback_wait(pages, count);
+    }
+}
+
+int
+pcache_write(blkdev_t *dev, uint64_t offset, const void *buf, uint64_t len)
+{
+    if (offset + len > dev->sectors * dev->sector_size)
+        return BLK_STATUS_ERROR;
+
+    const uint8_t *src = (const uint8_t *)buf;
+    while (len > 0) {
+        uint64_t off   = offset & (PAGE_SIZE - 1);
+        uint64_t n     = min(len, PAGE_SIZE - off);
+        uint64_t index = offset / PAGE_SIZE;
+
+        cpage_t *page = (n == PAGE_SIZE) ? page_overwrite(dev, index)
+                                         : pcache_get(dev, index);
+        if (page == NULL)
+            return BLK_STATUS_ERROR;
+        memcpy((uint8_t *)page->data + off, src, n);
+
+        uint64_t flags = save_interrupts();
+        spin_lock(pclock);
+        if (n == PAGE_SIZE) {
+            __sync_fetch_and_and(&page->flags, ~PG_ERROR);
+            __sync_fetch_and_or(&page->flags, PG_UPTODATE);
+        }
+        set_dirty(page);
+        spin_unlock(pclock);
+        restore_interrupts(flags);
+        pcache_put(page);
+
+        src    += n;
+        offset += n;
+        len    -= n;
+    }
+
+    balance_dirty(dev);
+    return BLK_STATUS_OK;
+}
+
+void
+pcache_writeback()
+{
+    // Reap earlier write-back first. Devices without interrupts complete
+    // requests only when polled, and nothing else polls them while idle.
+    for (blkdev_t *dev = blkdev_next(NULL); dev; dev = blkdev_next(dev))
+        blkdev_poll(dev);
+
+    harvest_mapped();
+
+    cpage_t *pages[FLUSH_BATCH];
+    bool     over = dirty_pages > dirty_limit(DIRTY_BACKGROUND);
+    for (blkdev_t *dev = blkdev_next(NULL); dev; dev = blkdev_next(dev)) {
+        struct devcache *dc = &caches[dev->id];
+        if (dc->dirty == 0 || (++dc->age < DIRTY_EXPIRE && !over))
+            continue;
+
+        // Submit without waiting. Completions arrive by interrupt, or for
+        // polled devices, at the next call.
+        for (int i = 0; i < FLUSH_IDLE_BATCHES; i++) {
+            if (writeback(dev, pages, FLUSH_BATCH) < FLUSH_BATCH)
+                break;
+        }
+    }
+}
+
+int
+pcache_sync(blkdev_t *dev)
+{
+    harvest_mapped();
+
+    cpage_t *pages[FLUSH_BATCH];
+    int      status = BLK_STATUS_OK;
+    blkdev_t *d     = (dev != NULL) ? dev : blkdev_next(NULL);
+    for (; d != NULL; d = (dev != NULL) ? NULL : blkdev_next(d)) {
+        struct devcache *dc = &caches[d->id];
+        do {
+            int count;
+            while ((count = writeback(d, pages, FLUSH_BATCH)) > 0)
+                writeback_wait(pages, count);
+            writeback_drain(d);
+        } while (dc->dirty > 0);
+
+        if (dc->werror) {
+            dc->werror = false;
+            status     = BLK_STATUS_ERROR;
+        }
+    }
+    return status;
+}
@@ -37,7 +37,7 @@ dump_cpuflags(char *buf, size_t bufsize, uint64_t rflags)
         B(CPU_EFLAGS_CARRY), B(CPU_EFLAGS_PARITY), B(CPU_EFLAGS_ADJUST),
         B(CPU_EFLAGS_ZERO), B(CPU_EFLAGS_SIGN), B(CPU_EFLAGS_TRAP),
         B(CPU_EFLAGS_INTERRUPT), B(CPU_EFLAGS_DIRECTION),
-        B(CPU_EFLAGS_OVERFLOW), (rflags >> 12) & 3);
+        B(CPU_EFLAGS_OVERFLOW), (unsigned)(rflags >> 12) & 3);
 
 #undef B
 }
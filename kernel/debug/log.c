@@ -17,6 +17,10 @@
 #define MBUFSIZE       (1 << MBUFSHIFT) // 64KiB
 #define MBUFMASK       (MBUFSIZE - 1)
 
+// Longest message kept, not counting the terminator. Longer messages are
+// truncated.
+#define MAX_MSGLEN     1023
+
 // Callback registrations
 #define MAX_CALLBACKS  8
 
@@ -60,6 +64,10 @@ struct context
 
 static struct context lc;
 
+/// Holds a message that wraps around the end of the message buffer while
+/// it's passed to callbacks.
+static char scratch[MAX_MSGLEN + 1];
+
 static void
 evict_record()
 {
@@ -104,13 +112,10 @@ evict_oldest_msg()
     }
 }
 
-static int
-add_msg(const char *str)
+static void
+add_chars(const char *str, int schars)
 {
-    int offset = lc.mtail;
-
     // Evict one or more log records if we're going to exceed the buffer size.
-    int schars = strlen(str) + 1;
     if (lc.mbufsz + schars > MBUFSIZE)
         evict_msg(lc.mbufsz + schars - MBUFSIZE);
 
@@ -127,10 +132,46 @@ add_msg(const char *str)
     }
 
     lc.mbufsz += schars;
+}
 
+static int
+add_msg(const char *str)
+{
+    int offset = lc.mtail;
+    int len    = min((int)strlen(str), MAX_MSGLEN);
+    add_chars(str, len);
+    add_chars("", 1);
     return offset;
 }
 
+// Return the message at an offset in the message buffer as a contiguous
+// string, copying it to the scratch buffer if it wraps around.
+static const char *
+msg_str(int offset)
+{
+    int len = 0;
+    while (lc.mbuf[(offset + len) & MBUFMASK] != 0)
+        len++;
+    if (offset + len < MBUFSIZE)
+        return lc.mbuf + offset;
+
+    int split = MBUFSIZE - offset;
+    memcpy(scratch, lc.mbuf + offset, split);
+    memcpy(scratch + split, lc.mbuf, len + 1 - split);
+    return scratch;
+}
+
+// Sink for logvf: append formatted output to the message being built at
+// the tail of the message buffer.
+static void
+log_sink(void *arg, const char *buf, size_t n)
+{
+    int *len   = (int *)arg;
+    int  chars = min((int)n, MAX_MSGLEN - *len);
+    add_chars(buf, chars);
+    *len += chars;
+}
+
 static void
 add_record(int offset, loglevel_t level, const char *str)
 {
@@ -175,11 +216,22 @@ log_removecallback(log_callback cb)
         if (lc.callbacks[i].cb == cb) {
             memmove(lc.callbacks + i, lc.callbacks + i + 1,
                     sizeof(callback_t) * (lc.callbacks_size - (i + 1)));
+            lc.callbacks_size--;
             return;
         }
     }
 }
 
+void
+log_replay(loglevel_t maxlevel, log_callback cb)
+{
+    for (int i = 0, r = lc.rhead; i < lc.rbufsz; i++, r = (r + 1) & RBUFMASK) {
+        const record_t *record = &lc.rbuf[r];
+        if (record->level <= maxlevel)
+            cb(record->level, msg_str(record->moffset));
+    }
+}
+
 void
 log(loglevel_t level, const char *str)
 {
@@ -199,8 +251,10 @@ logf(loglevel_t level, const char *format, ...)
 void
 logvf(loglevel_t level, const char *format, va_list args)
 {
-    char str[1024];
-    vsnprintf(str, arrsize(str), format, args);
-    int offset = add_msg(str);
-    add_record(offset, level, str);
+    // Format the message straight into the message buffer.
+    int offset = lc.mtail;
+    int len    = 0;
+    vcbprintf(log_sink, &len, format, args);
+    add_chars("", 1);
+    add_record(offset, level, msg_str(offset));
 }
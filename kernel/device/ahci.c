@@ -0,0 +1,825 @@
+//============================================================================
+/// @file       ahci.c
+/// @brief      AHCI SATA host controller driver.
+//============================================================================
+
+#include <core.h>
+#include <libc/string.h>
+#include <kernel/block/blkdev.h>
+#include <kernel/debug/log.h>
+#include <kernel/device/ahci.h>
+#include <kernel/device/msi.h>
+#include <kernel/device/pci.h>
+#include <kernel/mem/paging.h>
+#include <kernel/spinlock.h>
+#include <kernel/x86/cpu.h>
+
+// Driver limits
+#define MAX_AHCI_HBAS        2
+#define MAX_AHCI_DISKS       8
+#define AHCI_SLOTS           32
+#define AHCI_PRDTS           MAX_BLK_SEGS
+#define AHCI_MAX_SECTORS     1024
+#define AHCI_SECTOR_SIZE     512
+#define ATAPI_SECTOR_SIZE    2048
+#define AHCI_TIMEOUT         10000000
+
+// Generic host control registers
+#define HBA_CAP              0x00
+#define HBA_GHC              0x04
+#define HBA_IS               0x08
+#define HBA_PI               0x0c
+#define HBA_VS               0x10
+#define HBA_CAP2             0x24
+#define HBA_BOHC             0x28
+
+#define HBA_CAP_NP(c)        (((c) & 0x1f) + 1)
+#define HBA_CAP_NCS(c)       ((((c) >> 8) & 0x1f) + 1)
+#define HBA_CAP_SNCQ         (1u << 30)
+#define HBA_CAP_S64A         (1u << 31)
+#define HBA_GHC_IE           (1u << 1)
+#define HBA_GHC_AE           (1u << 31)
+#define HBA_CAP2_BOH         (1u << 0)
+#define HBA_BOHC_BOS         (1u << 0)
+#define HBA_BOHC_OOS         (1u << 1)
+
+// Port registers (relative to the port's register block)
+#define PORT_BASE(n)         (0x100 + (n) * 0x80)
+#define PORT_CLB             0x00
+#define PORT_CLBU            0x04
+#define PORT_FB              0x08
+#define PORT_FBU             0x0c
+#define PORT_IS              0x10
+#define PORT_IE              0x14
+#define PORT_CMD             0x18
+#define PORT_TFD             0x20
+#define PORT_SIG             0x24
+#define PORT_SSTS            0x28
+#define PORT_SERR            0x30
+#define PORT_SACT            0x34
+#define PORT_CI              0x38
+
+#define PORT_CMD_ST          (1u << 0)
+#define PORT_CMD_FRE         (1u << 4)
+#define PORT_CMD_FR          (1u << 14)
+#define PORT_CMD_CR          (1u << 15)
+
+#define PORT_TFD_ERR         (1u << 0)
+#define PORT_TFD_DRQ         (1u << 3)
+#define PORT_TFD_BSY         (1u << 7)
+
+#define PORT_SSTS_DET(s)     ((s) & 0xf)
+#define PORT_DET_PRESENT     3
+
+#define PORT_SIG_ATA         0x00000101
+#define PORT_SIG_ATAPI       0xeb140101
+
+// Port interrupt bits
+#define PORT_INT_DHRS        (1u << 0)   ///< D2H register FIS
+#define PORT_INT_PSS         (1u << 1)   ///< PIO setup FIS
+#define PORT_INT_DSS         (1u << 2)   ///< DMA setup FIS
+#define PORT_INT_SDBS        (1u << 3)   ///< Set device bits FIS (NCQ)
+#define PORT_INT_IFS         (1u << 27)  ///< Interface fatal error
+#define PORT_INT_HBDS        (1u << 28)  ///< Host bus data error
+#define PORT_INT_HBFS        (1u << 29)  ///< Host bus fatal error
+#define PORT_INT_TFES        (1u << 30)  ///< Task file error
+#define PORT_INT_ERROR       (PORT_INT_IFS | PORT_INT_HBDS | PORT_INT_HBFS | \
+                              PORT_INT_TFES)
+#define PORT_INT_ENABLE      (PORT_INT_DHRS | PORT_INT_PSS | PORT_INT_DSS | \
+                              PORT_INT_SDBS | PORT_INT_ERROR)
+
+// ATA commands
+#define ATA_CMD_READ_DMA_EXT     0x25
+#define ATA_CMD_WRITE_DMA_EXT    0x35
+#define ATA_CMD_READ_FPDMA       0x60
+#define ATA_CMD_WRITE_FPDMA      0x61
+#define ATA_CMD_FLUSH_EXT        0xea
+#define ATA_CMD_PACKET           0xa0
+#define ATA_CMD_IDENTIFY_PACKET  0xa1
+#define ATA_CMD_IDENTIFY         0xec
+
+// SCSI commands carried by ATAPI packets
+#define SCSI_READ_CAPACITY       0x25
+#define SCSI_READ_10             0x28
+
+#define ATAPI_FEATURE_DMA        (1 << 0)
+
+#define FIS_TYPE_H2D         0x27
+#define FIS_H2D_CMD          (1 << 7)
+#define ATA_DEVICE_LBA       (1 << 6)
+
+// Command header flags
+#define CMDHDR_CFL(dw)       ((dw) & 0x1f)
+#define CMDHDR_ATAPI         (1 << 5)
+#define CMDHDR_WRITE         (1 << 6)
+#define CMDHDR_PREFETCH      (1 << 7)
+#define CMDHDR_CLEAR_BUSY    (1 << 10)
+
+#define PRDT_DBC_MAX         (4 * 1024 * 1024)
+#define PRDT_INTERRUPT       (1u << 31)
+
+struct cmdhdr
+{
+    uint16_t          flags;
+    uint16_t          prdtl;        ///< PRDT entries
+    volatile uint32_t prdbc;        ///< Bytes transferred
+    uint64_t          ctba;         ///< Command table address
+    uint32_t          reserved[4];
+};
+
+struct fis_h2d
+{
+    uint8_t type;
+    uint8_t flags;
+    uint8_t command;
+    uint8_t featurel;
+    uint8_t lba0, lba1, lba2;
+    uint8_t device;
+    uint8_t lba3, lba4, lba5;
+    uint8_t featureh;
+    uint8_t countl;
+    uint8_t counth;
+    uint8_t icc;
+    uint8_t control;
+    uint8_t reserved[4];
+};
+
+struct prdt
+{
+    uint64_t dba;
+    uint32_t reserved;
+    uint32_t dbc;                   ///< Byte count - 1, interrupt flag
+};
+
+struct cmdtbl
+{
+    uint8_t     cfis[64];
+    uint8_t     acmd[16];
+    uint8_t     reserved[48];
+    struct prdt prdt[AHCI_PRDTS];
+};
+
+STATIC_ASSERT(sizeof(struct cmdhdr) == 32, "Unexpected AHCI header size");
+STATIC_ASSERT(sizeof(struct fis_h2d) == 20, "Unexpected FIS size");
+STATIC_ASSERT(sizeof(struct cmdtbl) % 128 == 0, "Misaligned command table");
+
+// Pages holding a port's command tables.
+#define CMDTBL_PAGES \
+    ((int)div_up(AHCI_SLOTS * sizeof(struct cmdtbl), PAGE_SIZE))
+
+struct hba;
+
+struct port
+{
+    struct hba        *hba;
+    volatile uint8_t  *regs;
+    int                index;
+    struct cmdhdr     *cl;          ///< Command list (32 headers)
+    uint8_t           *fis;         ///< Received FIS area
+    uint16_t          *identify;    ///< IDENTIFY data, then scratch
+    struct cmdtbl     *tbl;         ///< One command table per slot
+    uint32_t           slot_mask;   ///< Usable slots
+    uint32_t           issued;      ///< Slots owned by a request
+    uint32_t           staged_ci;   ///< Slots built but not yet issued
+    uint32_t           staged_sact; ///< NCQ slots built but not yet issued
+    bool               ncq;         ///< Use FPDMA queued commands
+    bool               atapi;       ///< Packet device (CD/DVD drive)
+    blkreq_t          *deferred;    ///< Non-queued command awaiting idle
+    blkreq_t          *req[AHCI_SLOTS];
+    spin_lock_t        lock;
+    blkdev_t           blk;
+};
+
+struct hba
+{
+    pcidev_t          *pci;
+    volatile uint8_t  *abar;
+    uint32_t           cap;
+    struct port       *port[32];
+};
+
+static struct hba  hbas[MAX_AHCI_HBAS];
+static int         hba_count;
+static struct port ports[MAX_AHCI_DISKS];
+static int         port_count;
+static int         cd_count;
+
+static inline uint32_t
+hba_read(const struct hba *hba, uint32_t reg)
+{
+    return *(volatile uint32_t *)(hba->abar + reg);
+}
+
+static inline void
+hba_write(struct hba *hba, uint32_t reg, uint32_t value)
+{
+    *(volatile uint32_t *)(hba->abar + reg) = value;
+}
+
+static inline uint32_t
+port_read(const struct port *port, uint32_t reg)
+{
+    return *(volatile uint32_t *)(port->regs + reg);
+}
+
+static inline void
+port_write(struct port *port, uint32_t reg, uint32_t value)
+{
+    *(volatile uint32_t *)(port->regs + reg) = value;
+}
+
+// Spin until (reg & mask) == value. Returns false on timeout.
+static bool
+port_wait(const struct port *port, uint32_t reg, uint32_t mask,
+          uint32_t value)
+{
+    for (int i = 0; i < AHCI_TIMEOUT; i++) {
+        if ((port_read(port, reg) & mask) == value)
+            return true;
+    }
+    return false;
+}
+
+static bool
+port_stop(struct port *port)
+{
+    uint32_t cmd = port_read(port, PORT_CMD);
+    port_write(port, PORT_CMD, cmd & ~PORT_CMD_ST);
+    if (!port_wait(port, PORT_CMD, PORT_CMD_CR, 0))
+        return false;
+
+    cmd = port_read(port, PORT_CMD);
+    port_write(port, PORT_CMD, cmd & ~PORT_CMD_FRE);
+    return port_wait(port, PORT_CMD, PORT_CMD_FR, 0);
+}
+
+static bool
+port_start(struct port *port)
+{
+    if (!port_wait(port, PORT_TFD, PORT_TFD_BSY | PORT_TFD_DRQ, 0))
+        return false;
+
+    uint32_t cmd = port_read(port, PORT_CMD);
+    port_write(port, PORT_CMD, cmd | PORT_CMD_FRE);
+    port_write(port, PORT_CMD, cmd | PORT_CMD_FRE | PORT_CMD_ST);
+    return true;
+}
+
+// Fill in a slot's command table and header. Returns false if the data
+// needs more PRDT entries than the table holds. For ATA_CMD_PACKET, `cdb'
+// is the SCSI command to send, or NULL to build a READ(10) from the
+// request.
+static bool
+build_command(struct port *port, int slot, const blkreq_t *req, uint8_t cmd,
+              const uint8_t *cdb)
+{
+    struct cmdtbl  *tbl = &port->tbl[slot];
+    struct cmdhdr  *hdr = &port->cl[slot];
+    struct fis_h2d *fis = (struct fis_h2d *)tbl->cfis;
+
+    blkseg_t        single;
+    int             nsegs;
+    const blkseg_t *segs = blkreq_segs(&port->blk, req, &single, &nsegs);
+
+    // Each segment becomes one or more PRDT entries of up to 4MiB.
+    int n = 0;
+    for (int i = 0; i < nsegs; i++) {
+        uint64_t addr = (uint64_t)segs[i].addr;
+        uint32_t left = segs[i].len;
+        while (left > 0) {
+            if (n == AHCI_PRDTS)
+                return false;
+            uint32_t len = min(left, PRDT_DBC_MAX);
+            tbl->prdt[n].dba      = addr;
+            tbl->prdt[n].reserved = 0;
+            tbl->prdt[n].dbc      = len - 1;
+            addr += len;
+            left -= len;
+            n++;
+        }
+    }
+
+    memzero(fis, sizeof(*fis));
+    fis->type    = FIS_TYPE_H2D;
+    fis->flags   = FIS_H2D_CMD;
+    fis->command = cmd;
+    fis->device  = ATA_DEVICE_LBA;
+
+    uint64_t lba   = req->sector;
+    uint32_t count = req->count;
+    fis->lba0 = (uint8_t)lba;
+    fis->lba1 = (uint8_t)(lba >> 8);
+    fis->lba2 = (uint8_t)(lba >> 16);
+    fis->lba3 = (uint8_t)(lba >> 24);
+    fis->lba4 = (uint8_t)(lba >> 32);
+    fis->lba5 = (uint8_t)(lba >> 40);
+
+    if (cmd == ATA_CMD_READ_FPDMA || cmd == ATA_CMD_WRITE_FPDMA) {
+        // Queued commands carry the sector count in the feature field and
+        // the tag in the count field.
+        fis->featurel = (uint8_t)count;
+        fis->featureh = (uint8_t)(count >> 8);
+        fis->countl   = (uint8_t)(slot << 3);
+    }
+    else {
+        fis->countl = (uint8_t)count;
+        fis->counth = (uint8_t)(count >> 8);
+    }
+
+    hdr->flags = CMDHDR_CFL(sizeof(*fis) / 4) | CMDHDR_CLEAR_BUSY;
+    if (req->op == BLK_OP_WRITE)
+        hdr->flags |= CMDHDR_WRITE;
+
+    if (cmd == ATA_CMD_PACKET) {
+        // The LBA and count travel in the SCSI command block instead.
+        memzero(tbl->acmd, sizeof(tbl->acmd));
+        if (cdb != NULL) {
+            memcpy(tbl->acmd, cdb, 12);
+        }
+        else {
+            tbl->acmd[0] = SCSI_READ_10;
+            tbl->acmd[2] = (uint8_t)(lba >> 24);
+            tbl->acmd[3] = (uint8_t)(lba >> 16);
+            tbl->acmd[4] = (uint8_t)(lba >> 8);
+            tbl->acmd[5] = (uint8_t)lba;
+            tbl->acmd[7] = (uint8_t)(count >> 8);
+            tbl->acmd[8] = (uint8_t)count;
+        }
+        memzero(fis, sizeof(*fis));
+        fis->type     = FIS_TYPE_H2D;
+        fis->flags    = FIS_H2D_CMD;
+        fis->command  = ATA_CMD_PACKET;
+        fis->featurel = ATAPI_FEATURE_DMA;
+        hdr->flags   |= CMDHDR_ATAPI;
+    }
+    hdr->prdtl = (uint16_t)n;
+    hdr->prdbc = 0;
+    hdr->ctba  = (uint64_t)tbl;
+    return true;
+}
+
+static uint8_t
+ata_command(const struct port *port, int op)
+{
+    if (port->atapi)
+        return ATA_CMD_PACKET;
+    switch (op) {
+        case BLK_OP_READ:
+            return port->ncq ? ATA_CMD_READ_FPDMA : ATA_CMD_READ_DMA_EXT;
+        case BLK_OP_WRITE:
+            return port->ncq ? ATA_CMD_WRITE_FPDMA : ATA_CMD_WRITE_DMA_EXT;
+        default:
+            return ATA_CMD_FLUSH_EXT;
+    }
+}
+
+static bool
+is_queued(uint8_t cmd)
+{
+    return cmd == ATA_CMD_READ_FPDMA || cmd == ATA_CMD_WRITE_FPDMA;
+}
+
+// Claim a free slot and stage a request in it. Called with the port lock
+// held.
+static bool
+stage(struct port *port, blkreq_t *req)
+{
+    uint32_t free = port->slot_mask & ~port->issued;
+    if (free == 0)
+        return false;
+
+    int     slot = __builtin_ctz(free);
+    uint8_t cmd  = ata_command(port, req->op);
+    if (!build_command(port, slot, req, cmd, NULL))
+        return false;
+
+    port->req[slot]  = req;
+    port->issued    |= 1u << slot;
+    port->staged_ci |= 1u << slot;
+    if (is_queued(cmd))
+        port->staged_sact |= 1u << slot;
+    return true;
+}
+
+// Hand staged slots to the HBA. PxSACT must be set before PxCI for queued
+// commands.
+static void
+issue(struct port *port)
+{
+    if (port->staged_sact != 0)
+        port_write(port, PORT_SACT, port->staged_sact);
+    if (port->staged_ci != 0)
+        port_write(port, PORT_CI, port->staged_ci);
+    port->staged_ci   = 0;
+    port->staged_sact = 0;
+}
+
+static bool
+ahci_submit(blkdev_t *dev, int queue, blkreq_t *req)
+{
+    (void)queue;
+    struct port *port = (struct port *)dev->drvdata;
+
+    if (port->atapi && req->op != BLK_OP_READ) {
+        // Optical drives are read-only here.
+        req->status = BLK_STATUS_UNSUPP;
+        if (req->done != NULL)
+            req->done(req);
+        return true;
+    }
+
+    spin_lock(port->lock);
+
+    bool ok;
+    if (port->ncq && !is_queued(ata_command(port, req->op)) &&
+        (port->issued != 0 || port->deferred != NULL)) {
+        // Non-queued commands can't run alongside queued ones; hold the
+        // command until the queue drains.
+        ok = (port->deferred == NULL);
+        if (ok)
+            port->deferred = req;
+    }
+    else {
+        ok = stage(port, req);
+    }
+
+    spin_unlock(port->lock);
+    return ok;
+}
+
+static void
+ahci_kick(blkdev_t *dev, int queue)
+{
+    (void)queue;
+    struct port *port = (struct port *)dev->drvdata;
+
+    spin_lock(port->lock);
+    issue(port);
+    spin_unlock(port->lock);
+}
+
+static void
+recover(struct port *port)
+{
+    port_stop(port);
+    port_write(port, PORT_SERR, 0xffffffff);
+    port_write(port, PORT_IS, 0xffffffff);
+    port_start(port);
+}
+
+static void
+complete(struct port *port)
+{
+    blkreq_t *done = NULL;
+
+    spin_lock(port->lock);
+
+    uint32_t is = port_read(port, PORT_IS);
+    port_write(port, PORT_IS, is);
+
+    // Slots are finished once the HBA has cleared both their PxCI bit and,
+    // for queued commands, their PxSACT bit.
+    uint32_t busy     = port_read(port, PORT_CI) | port_read(port, PORT_SACT);
+    uint32_t finished = port->issued & ~busy & ~port->staged_ci;
+    int      status   = BLK_STATUS_OK;
+
+    if (is & PORT_INT_ERROR) {
+        // Fail every outstanding command and restart the port.
+        logf(LOG_WARNING, "[ahci] %s: error is=%#x tfd=%#x.",
+             port->blk.name, is, port_read(port, PORT_TFD));
+        finished = port->issued & ~port->staged_ci;
+        status   = BLK_STATUS_ERROR;
+        recover(port);
+    }
+
+    while (finished != 0) {
+        int slot = __builtin_ctz(finished);
+        finished &= finished - 1;
+
+        blkreq_t *req = port->req[slot];
+        port->req[slot] = NULL;
+        port->issued   &= ~(1u << slot);
+
+        req->status = status;
+        req->next   = done;
+        done        = req;
+    }
+
+    // Run a held non-queued command once the queue is idle.
+    if (port->deferred != NULL && port->issued == 0) {
+        blkreq_t *req = port->deferred;
+        port->deferred = NULL;
+
+        bool ncq = port->ncq;
+        port->ncq = false;
+        bool ok = stage(port, req);
+        port->ncq = ncq;
+        if (ok) {
+            issue(port);
+        }
+        else {
+            req->status = BLK_STATUS_ERROR;
+            req->next   = done;
+            done        = req;
+        }
+    }
+
+    spin_unlock(port->lock);
+
+    while (done != NULL) {
+        blkreq_t *req = done;
+        done = req->next;
+        if (req->done != NULL)
+            req->done(req);
+    }
+}
+
+static void
+ahci_poll(blkdev_t *dev, int queue)
+{
+    (void)queue;
+    complete((struct port *)dev->drvdata);
+}
+
+static const blkdev_ops_t ahci_ops =
+{
+    .submit = ahci_submit,
+    .kick   = ahci_kick,
+    .poll   = ahci_poll,
+};
+
+static void
+isr_hba(void *data)
+{
+    struct hba *hba = (struct hba *)data;
+
+    uint64_t flags = save_interrupts();
+
+    uint32_t is = hba_read(hba, HBA_IS);
+    for (uint32_t pending = is; pending != 0; pending &= pending - 1) {
+        int          n    = __builtin_ctz(pending);
+        struct port *port = hba->port[n];
+        if (port != NULL)
+            complete(port);
+        else
+            *(volatile uint32_t *)(hba->abar + PORT_BASE(n) + PORT_IS) =
+                0xffffffff;
+    }
+    hba_write(hba, HBA_IS, is);
+
+    restore_interrupts(flags);
+}
+
+// Run a data-in command in slot 0 with interrupts off and poll for
+// completion.
+static bool
+poll_command(struct port *port, uint8_t cmd, const uint8_t *cdb, void *buf,
+             uint32_t len)
+{
+    blkseg_t seg = { buf, len };
+    blkreq_t req;
+    memzero(&req, sizeof(req));
+    req.op    = BLK_OP_READ;
+    req.count = 1;
+    req.segs  = &seg;
+    req.nsegs = 1;
+
+    if (!build_command(port, 0, &req, cmd, cdb))
+        return false;
+
+    port_write(port, PORT_IS, 0xffffffff);
+    port_write(port, PORT_CI, 1);
+    if (!port_wait(port, PORT_CI, 1, 0))
+        return false;
+    return !(port_read(port, PORT_IS) & PORT_INT_ERROR);
+}
+
+// Undo a failed port_init: stop the port so the HBA is done with its
+// command list and tables, then free them. If the port won't stop, the
+// memory is leaked rather than freed under the HBA.
+static void
+port_release(struct port *port)
+{
+    port_write(port, PORT_IE, 0);
+    if (!port_stop(port)) {
+        logf(LOG_WARNING, "[ahci] Port %d did not stop.", port->index);
+        return;
+    }
+    kpage_free(port->cl, 1);
+    kpage_free(port->tbl, CMDTBL_PAGES);
+    port->cl  = NULL;
+    port->tbl = NULL;
+}
+
+// Finish bringing up a packet device: read its capacity and register it.
+static bool
+atapi_init(struct port *port, int n)
+{
+    // READ CAPACITY returns the last LBA and the block size, big-endian.
+    uint8_t  cdb[12] = { SCSI_READ_CAPACITY };
+    uint8_t *cap     = (uint8_t *)port->identify + 512;
+    if (!poll_command(port, ATA_CMD_PACKET, cdb, cap, 8)) {
+        logf(LOG_INFO, "[ahci] Port %d: no medium.", n);
+        port_release(port);
+        return false;
+    }
+    uint32_t last  = (uint32_t)cap[0] << 24 | (uint32_t)cap[1] << 16 |
+                     (uint32_t)cap[2] << 8 | cap[3];
+    uint32_t bsize = (uint32_t)cap[4] << 24 | (uint32_t)cap[5] << 16 |
+                     (uint32_t)cap[6] << 8 | cap[7];
+    if (bsize != ATAPI_SECTOR_SIZE) {
+        logf(LOG_INFO, "[ahci] Port %d: unsupported block size %u.", n,
+             bsize);
+        port_release(port);
+        return false;
+    }
+
+    // Packet commands can't be queued, so keep one in flight.
+    port->slot_mask = 1;
+
+    blkdev_t *blk = &port->blk;
+    blk->name[0]     = 's';
+    blk->name[1]     = 'r';
+    blk->name[2]     = (char)('0' + cd_count);
+    blk->name[3]     = 0;
+    blk->sector_size = ATAPI_SECTOR_SIZE;
+    blk->sectors     = (uint64_t)last + 1;
+    blk->max_sectors = AHCI_MAX_SECTORS * AHCI_SECTOR_SIZE / ATAPI_SECTOR_SIZE;
+    blk->nr_queues   = 1;
+    blk->ops         = &ahci_ops;
+    blk->drvdata     = port;
+
+    port_write(port, PORT_IE, PORT_INT_ENABLE);
+    port->hba->port[n] = port;
+    port_count++;
+    cd_count++;
+
+    logf(LOG_INFO, "[ahci] %s: port %d, ATAPI.", blk->name, n);
+    return blkdev_register(blk);
+}
+
+static bool
+port_init(struct hba *hba, int n)
+{
+    if (port_count == MAX_AHCI_DISKS)
+        return false;
+
+    struct port *port = &ports[port_count];
+    memzero(port, sizeof(*port));
+    port->hba   = hba;
+    port->index = n;
+    port->regs  = hba->abar + PORT_BASE(n);
+
+    uint32_t ssts = port_read(port, PORT_SSTS);
+    if (PORT_SSTS_DET(ssts) != PORT_DET_PRESENT)
+        return false;
+    uint32_t sig = port_read(port, PORT_SIG);
+    if (sig != PORT_SIG_ATA && sig != PORT_SIG_ATAPI)
+        return false;
+    port->atapi = (sig == PORT_SIG_ATAPI);
+
+    if (!port_stop(port))
+        return false;
+
+    // Command list, received FIS area and IDENTIFY buffer share a page;
+    // the per-slot command tables follow.
+    int      tblpages = CMDTBL_PAGES;
+    uint8_t *mem      = kpage_alloc(1);
+    uint8_t *tbl      = kpage_alloc(tblpages);
+    bool     reach    = (hba->cap & HBA_CAP_S64A) ||
+                        ((uint64_t)mem >> 32 == 0 && (uint64_t)tbl >> 32 == 0);
+    if (mem == NULL || tbl == NULL || !reach) {
+        if (mem != NULL)
+            kpage_free(mem, 1);
+        if (tbl != NULL)
+            kpage_free(tbl, tblpages);
+        return false;
+    }
+
+    port->cl       = (struct cmdhdr *)mem;
+    port->fis      = mem + 0x400;
+    port->identify = (uint16_t *)(mem + 0x800);
+    port->tbl      = (struct cmdtbl *)tbl;
+
+    port_write(port, PORT_CLB, (uint32_t)(uint64_t)port->cl);
+    port_write(port, PORT_CLBU, (uint32_t)((uint64_t)port->cl >> 32));
+    port_write(port, PORT_FB, (uint32_t)(uint64_t)port->fis);
+    port_write(port, PORT_FBU, (uint32_t)((uint64_t)port->fis >> 32));
+    port_write(port, PORT_SERR, 0xffffffff);
+    port_write(port, PORT_IS, 0xffffffff);
+    port_write(port, PORT_IE, 0);
+
+    uint8_t idcmd = port->atapi ? ATA_CMD_IDENTIFY_PACKET : ATA_CMD_IDENTIFY;
+    if (!port_start(port) ||
+        !poll_command(port, idcmd, NULL, port->identify, 512)) {
+        logf(LOG_WARNING, "[ahci] Port %d did not respond.", n);
+        port_release(port);
+        return false;
+    }
+
+    blkdev_t *blk = &port->blk;
+    if (port->atapi)
+        return atapi_init(port, n);
+
+    // IDENTIFY words 100-103: LBA48 capacity. Words 75-76: queue depth
+    // and NCQ support.
+    const uint16_t *id      = port->identify;
+    uint64_t        sectors = (uint64_t)id[100] | (uint64_t)id[101] << 16 |
+                              (uint64_t)id[102] << 32 |
+                              (uint64_t)id[103] << 48;
+    if (sectors == 0)
+        sectors = (uint32_t)id[60] | (uint32_t)id[61] << 16;
+
+    int slots = HBA_CAP_NCS(hba->cap);
+    port->ncq = (hba->cap & HBA_CAP_SNCQ) && (id[76] & (1 << 8));
+    if (port->ncq)
+        slots = min(slots, (id[75] & 0x1f) + 1);
+    port->slot_mask = (slots >= 32) ? 0xffffffff : (1u << slots) - 1;
+
+    blk->name[0]     = 's';
+    blk->name[1]     = 'd';
+    blk->name[2]     = (char)('a' + port_count - cd_count);
+    blk->name[3]     = 0;
+    blk->sector_size = AHCI_SECTOR_SIZE;
+    blk->sectors     = sectors;
+    blk->max_sectors = AHCI_MAX_SECTORS;
+    blk->nr_queues   = 1;
+    blk->ops         = &ahci_ops;
+    blk->drvdata     = port;
+
+    port_write(port, PORT_IE, PORT_INT_ENABLE);
+    hba->port[n] = port;
+    port_count++;
+
+    logf(LOG_INFO, "[ahci] %s: port %d, %s, %d slot(s).", blk->name, n,
+         port->ncq ? "NCQ" : "no NCQ", slots);
+    return blkdev_register(blk);
+}
+
+static bool
+probe(pcidev_t *pci)
+{
+    // Only bind controllers in AHCI mode, not IDE emulation.
+    if (hba_count == MAX_AHCI_HBAS || pci->progif != 0x01)
+        return false;
+
+    struct hba *hba = &hbas[hba_count];
+    hba->pci  = pci;
+    hba->abar = pci_map_bar(pci, 5);
+    if (hba->abar == NULL)
+        return false;
+
+    pci_enable(pci, PCI_CMD_MEMORY | PCI_CMD_MASTER);
+
+    // Take ownership from the firmware if it supports the handoff.
+    if (hba_read(hba, HBA_CAP2) & HBA_CAP2_BOH) {
+        hba_write(hba, HBA_BOHC, hba_read(hba, HBA_BOHC) | HBA_BOHC_OOS);
+        for (int i = 0; i < AHCI_TIMEOUT; i++) {
+            if (!(hba_read(hba, HBA_BOHC) & HBA_BOHC_BOS))
+                break;
+        }
+    }
+
+    hba_write(hba, HBA_GHC, hba_read(hba, HBA_GHC) | HBA_GHC_AE);
+    hba->cap = hba_read(hba, HBA_CAP);
+
+    uint32_t pi    = hba_read(hba, HBA_PI);
+    int      disks = 0;
+    for (int n = 0; n < 32; n++) {
+        if ((pi & (1u << n)) && port_init(hba, n))
+            disks++;
+    }
+    if (disks == 0)
+        return false;
+
+    // Completions arrive by MSI; without it, the block layer polls.
+    if (msi_alloc(pci, 1) > 0) {
+        msi_set_handler(pci, 0, isr_hba, hba);
+        msi_mask(pci, 0, false);
+        hba_write(hba, HBA_IS, 0xffffffff);
+        hba_write(hba, HBA_GHC, hba_read(hba, HBA_GHC) | HBA_GHC_IE);
+    }
+
+    pci->drvdata = hba;
+    hba_count++;
+    return true;
+}
+
+static const pciid_t ahci_ids[] =
+{
+    { PCI_ANY, PCI_ANY, 0x01, 0x06 },   // Mass storage, SATA
+    { 0 }
+};
+
+static const pcidrv_t ahci_driver =
+{
+    .name  = "ahci",
+    .ids   = ahci_ids,
+    .probe = probe,
+};
+
+void
+ahci_init()
+{
+    pci_register_driver(&ahci_driver);
+}
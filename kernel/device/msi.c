@@ -0,0 +1,363 @@
+//============================================================================
+/// @file       msi.c
+/// @brief      PCI message signaled interrupts (MSI and MSI-X).
+//============================================================================
+
+#include <core.h>
+#include <libc/string.h>
+#include <kernel/debug/log.h>
+#include <kernel/device/msi.h>
+#include <kernel/interrupt/interrupt.h>
+#include <kernel/interrupt/lapic.h>
+#include <kernel/spinlock.h>
+
+// MSI capability register offsets (relative to the capability)
+#define MSI_REG_CONTROL     0x02
+#define MSI_REG_ADDR_LO     0x04
+#define MSI_REG_ADDR_HI     0x08    ///< 64-bit capable functions only
+#define MSI_REG_DATA32      0x08
+#define MSI_REG_MASK32      0x0c
+#define MSI_REG_DATA64      0x0c
+#define MSI_REG_MASK64      0x10
+
+// MSI control register bits
+#define MSI_CTL_ENABLE      (1 << 0)
+#define MSI_CTL_MMC_SHIFT   1       ///< Multiple message capable (log2)
+#define MSI_CTL_MME_SHIFT   4       ///< Multiple message enable (log2)
+#define MSI_CTL_64BIT       (1 << 7)
+#define MSI_CTL_PVM         (1 << 8)    ///< Per-vector masking capable
+
+// MSI-X capability register offsets (relative to the capability)
+#define MSIX_REG_CONTROL    0x02
+#define MSIX_REG_TABLE      0x04    ///< Table offset and BAR indicator
+
+// MSI-X control register bits
+#define MSIX_CTL_SIZE_MASK  0x07ff  ///< Table size minus one
+#define MSIX_CTL_FMASK      (1 << 14)   ///< Function mask
+#define MSIX_CTL_ENABLE     (1 << 15)
+
+// MSI-X table entry layout (in dwords, 4 per entry)
+#define MSIX_ENTRY_ADDR_LO  0
+#define MSIX_ENTRY_ADDR_HI  1
+#define MSIX_ENTRY_DATA     2
+#define MSIX_ENTRY_CTL      3
+#define MSIX_ENTRY_MASKED   (1 << 0)
+
+// Message address for fixed delivery to a physical local APIC ID
+#define MSI_ADDR(apic_id)   (0xfee00000u | ((uint32_t)(apic_id) << 12))
+
+struct vector
+{
+    msi_handler handler;
+    void       *data;
+};
+
+static struct vector vectors[256];
+static uint64_t      used[256 / 64];
+static spin_lock_t   lock;
+
+static void
+isr_msi(const interrupt_context_t *context)
+{
+    const struct vector *v = &vectors[context->interrupt & 0xff];
+    if (v->handler != NULL)
+        v->handler(v->data);
+
+    lapic_eoi();
+}
+
+static inline bool
+vector_used(int v)
+{
+    return (used[v / 64] >> (v % 64)) & 1;
+}
+
+// Reserve a naturally aligned block of `count' free vectors, where count is
+// a power of two (multi-message MSI puts the message index in the low bits
+// of the vector). Returns the first vector, or 0 if none are free.
+static int
+vector_alloc(int count)
+{
+    spin_lock(lock);
+
+    int first = (TRAP_MSI_FIRST + count - 1) & ~(count - 1);
+    for (; first + count - 1 <= TRAP_MSI_LAST; first += count) {
+        int i;
+        for (i = 0; i < count; i++) {
+            if (vector_used(first + i))
+                break;
+        }
+        if (i < count)
+            continue;
+
+        for (i = 0; i < count; i++) {
+            int v = first + i;
+            used[v / 64] |= (uint64_t)1 << (v % 64);
+            vectors[v].handler = NULL;
+            vectors[v].data    = NULL;
+            isr_set(v, isr_msi);
+        }
+        spin_unlock(lock);
+        return first;
+    }
+
+    spin_unlock(lock);
+    return 0;
+}
+
+static void
+vector_free(int v)
+{
+    spin_lock(lock);
+    isr_set(v, NULL);
+    vectors[v].handler = NULL;
+    vectors[v].data    = NULL;
+    used[v / 64] &= ~((uint64_t)1 << (v % 64));
+    spin_unlock(lock);
+}
+
+static inline uint16_t
+cfg_read16(const pcidev_t *dev, uint32_t offset)
+{
+    return pci_config_read16(dev->bus, dev->device, dev->func, offset);
+}
+
+static inline void
+cfg_write16(const pcidev_t *dev, uint32_t offset, uint16_t value)
+{
+    pci_config_write16(dev->bus, dev->device, dev->func, offset, value);
+}
+
+static inline uint32_t
+cfg_read32(const pcidev_t *dev, uint32_t offset)
+{
+    return pci_config_read32(dev->bus, dev->device, dev->func, offset);
+}
+
+static inline void
+cfg_write32(const pcidev_t *dev, uint32_t offset, uint32_t value)
+{
+    pci_config_write32(dev->bus, dev->device, dev->func, offset, value);
+}
+
+static int
+alloc_msix(pcidev_t *dev, uint8_t cap, int count)
+{
+    uint16_t ctl  = cfg_read16(dev, cap + MSIX_REG_CONTROL);
+    int      size = (ctl & MSIX_CTL_SIZE_MASK) + 1;
+    if (count > size)
+        count = size;
+
+    uint32_t table = cfg_read32(dev, cap + MSIX_REG_TABLE);
+    uint8_t *base  = pci_map_bar(dev, table & 7);
+    if (base == NULL)
+        return 0;
+    dev->msix_table = (volatile uint32_t *)(base + (table & ~7u));
+
+    // Mask the whole function while the table is being programmed.
+    cfg_write16(dev, cap + MSIX_REG_CONTROL, ctl | MSIX_CTL_FMASK);
+
+    uint32_t addr = MSI_ADDR(lapic_id());
+    int      n;
+    for (n = 0; n < count; n++) {
+        int v = vector_alloc(1);
+        if (v == 0)
+            break;
+
+        volatile uint32_t *entry = dev->msix_table + n * 4;
+        entry[MSIX_ENTRY_CTL]     = MSIX_ENTRY_MASKED;
+        entry[MSIX_ENTRY_ADDR_LO] = addr;
+        entry[MSIX_ENTRY_ADDR_HI] = 0;
+        entry[MSIX_ENTRY_DATA]    = v;
+        dev->msi_vector[n]        = (uint8_t)v;
+    }
+
+    if (n == 0) {
+        cfg_write16(dev, cap + MSIX_REG_CONTROL, ctl);
+        dev->msix_table = NULL;
+        return 0;
+    }
+
+    ctl = (ctl | MSIX_CTL_ENABLE) & ~MSIX_CTL_FMASK;
+    cfg_write16(dev, cap + MSIX_REG_CONTROL, ctl);
+    dev->msi_mode = PCI_MSI_MSIX;
+    return n;
+}
+
+static int
+alloc_msi(pcidev_t *dev, uint8_t cap, int count)
+{
+    uint16_t ctl = cfg_read16(dev, cap + MSI_REG_CONTROL);
+
+    // Multi-message MSI uses a power-of-two block of vectors.
+    int log2 = 0;
+    int mmc  = (ctl >> MSI_CTL_MMC_SHIFT) & 7;
+    while (log2 < mmc && (1 << log2) < count)
+        log2++;
+    if ((1 << log2) > count && log2 > 0)
+        log2--;
+
+    int first = 0;
+    for (; log2 >= 0; log2--) {
+        if ((first = vector_alloc(1 << log2)) != 0)
+            break;
+    }
+    if (first == 0)
+        return 0;
+    count = 1 << log2;
+
+    uint32_t addr = MSI_ADDR(lapic_id());
+    cfg_write32(dev, cap + MSI_REG_ADDR_LO, addr);
+    if (ctl & MSI_CTL_64BIT) {
+        cfg_write32(dev, cap + MSI_REG_ADDR_HI, 0);
+        cfg_write16(dev, cap + MSI_REG_DATA64, (uint16_t)first);
+        if (ctl & MSI_CTL_PVM)
+            cfg_write32(dev, cap + MSI_REG_MASK64, (1u << count) - 1);
+    }
+    else {
+        cfg_write16(dev, cap + MSI_REG_DATA32, (uint16_t)first);
+        if (ctl & MSI_CTL_PVM)
+            cfg_write32(dev, cap + MSI_REG_MASK32, (1u << count) - 1);
+    }
+
+    for (int i = 0; i < count; i++)
+        dev->msi_vector[i] = (uint8_t)(first + i);
+
+    ctl &= ~(7 << MSI_CTL_MME_SHIFT);
+    ctl |= (log2 << MSI_CTL_MME_SHIFT) | MSI_CTL_ENABLE;
+    cfg_write16(dev, cap + MSI_REG_CONTROL, ctl);
+    dev->msi_mode = PCI_MSI_MSI;
+    return count;
+}
+
+int
+msi_alloc(pcidev_t *dev, int count)
+{
+    if (!lapic_present() || dev->msi_mode != PCI_MSI_NONE)
+        return 0;
+
+    if (count < 1)
+        count = 1;
+    if (count > MAX_PCI_VECTORS)
+        count = MAX_PCI_VECTORS;
+
+    int     n   = 0;
+    uint8_t cap = pci_find_cap(dev, PCI_CAP_MSIX);
+    if (cap != 0)
+        n = alloc_msix(dev, cap, count);
+    if (n == 0 && (cap = pci_find_cap(dev, PCI_CAP_MSI)) != 0)
+        n = alloc_msi(dev, cap, count);
+    if (n == 0)
+        return 0;
+
+    dev->msi_count = (uint8_t)n;
+    pci_enable(dev, PCI_CMD_MASTER | PCI_CMD_INTX_OFF);
+
+    logf(LOG_INFO, "[msi] %u/%u/%u using %d %s vector(s) from 0x%02x.",
+         dev->bus, dev->device, dev->func, n,
+         dev->msi_mode == PCI_MSI_MSIX ? "MSI-X" : "MSI",
+         dev->msi_vector[0]);
+    return n;
+}
+
+void
+msi_free(pcidev_t *dev)
+{
+    if (dev->msi_mode == PCI_MSI_MSIX) {
+        uint8_t  cap = pci_find_cap(dev, PCI_CAP_MSIX);
+        uint16_t ctl = cfg_read16(dev, cap + MSIX_REG_CONTROL);
+        cfg_write16(dev, cap + MSIX_REG_CONTROL, ctl & ~MSIX_CTL_ENABLE);
+        for (int i = 0; i < dev->msi_count; i++)
+            dev->msix_table[i * 4 + MSIX_ENTRY_CTL] = MSIX_ENTRY_MASKED;
+    }
+    else if (dev->msi_mode == PCI_MSI_MSI) {
+        uint8_t  cap = pci_find_cap(dev, PCI_CAP_MSI);
+        uint16_t ctl = cfg_read16(dev, cap + MSI_REG_CONTROL);
+        cfg_write16(dev, cap + MSI_REG_CONTROL, ctl & ~MSI_CTL_ENABLE);
+    }
+    else {
+        return;
+    }
+
+    for (int i = 0; i < dev->msi_count; i++)
+        vector_free(dev->msi_vector[i]);
+
+    memzero(dev->msi_vector, sizeof(dev->msi_vector));
+    dev->msi_count  = 0;
+    dev->msi_mode   = PCI_MSI_NONE;
+    dev->msix_table = NULL;
+
+    uint16_t cmd = cfg_read16(dev, PCI_REG_COMMAND);
+    cfg_write16(dev, PCI_REG_COMMAND, cmd & ~PCI_CMD_INTX_OFF);
+}
+
+void
+msi_set_handler(pcidev_t *dev, int index, msi_handler handler, void *data)
+{
+    uint8_t v = msi_vector(dev, index);
+    if (v == 0)
+        return;
+
+    spin_lock(lock);
+    vectors[v].data    = data;
+    vectors[v].handler = handler;
+    spin_unlock(lock);
+}
+
+void
+msi_set_affinity(pcidev_t *dev, int index, uint8_t apic_id)
+{
+    if (msi_vector(dev, index) == 0)
+        return;
+
+    if (dev->msi_mode == PCI_MSI_MSIX) {
+        // Mask the entry while its address changes.
+        volatile uint32_t *entry = dev->msix_table + index * 4;
+        uint32_t           ctl   = entry[MSIX_ENTRY_CTL];
+        entry[MSIX_ENTRY_CTL]     = ctl | MSIX_ENTRY_MASKED;
+        entry[MSIX_ENTRY_ADDR_LO] = MSI_ADDR(apic_id);
+        entry[MSIX_ENTRY_CTL]     = ctl;
+    }
+    else {
+        uint8_t cap = pci_find_cap(dev, PCI_CAP_MSI);
+        cfg_write32(dev, cap + MSI_REG_ADDR_LO, MSI_ADDR(apic_id));
+    }
+}
+
+void
+msi_mask(pcidev_t *dev, int index, bool mask)
+{
+    if (msi_vector(dev, index) == 0)
+        return;
+
+    if (dev->msi_mode == PCI_MSI_MSIX) {
+        volatile uint32_t *entry = dev->msix_table + index * 4;
+        if (mask)
+            entry[MSIX_ENTRY_CTL] |= MSIX_ENTRY_MASKED;
+        else
+            entry[MSIX_ENTRY_CTL] &= ~MSIX_ENTRY_MASKED;
+        return;
+    }
+
+    uint8_t  cap = pci_find_cap(dev, PCI_CAP_MSI);
+    uint16_t ctl = cfg_read16(dev, cap + MSI_REG_CONTROL);
+    if (!(ctl & MSI_CTL_PVM))
+        return;
+
+    uint32_t reg  = cap + ((ctl & MSI_CTL_64BIT) ? MSI_REG_MASK64
+                                                 : MSI_REG_MASK32);
+    uint32_t bits = cfg_read32(dev, reg);
+    if (mask)
+        bits |= 1u << index;
+    else
+        bits &= ~(1u << index);
+    cfg_write32(dev, reg, bits);
+}
+
+uint8_t
+msi_vector(const pcidev_t *dev, int index)
+{
+    if (index < 0 || index >= dev->msi_count)
+        return 0;
+    return dev->msi_vector[index];
+}
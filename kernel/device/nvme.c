@@ -0,0 +1,593 @@
+//============================================================================
+/// @file       nvme.c
+/// @brief      NVM Express controller driver.
+//============================================================================
+
+#include <core.h>
+#include <libc/string.h>
+#include <kernel/block/blkdev.h>
+#include <kernel/debug/log.h>
+#include <kernel/device/msi.h>
+#include <kernel/device/nvme.h>
+#include <kernel/device/pci.h>
+#include <kernel/interrupt/lapic.h>
+#include <kernel/mem/paging.h>
+#include <kernel/x86/cpu.h>
+
+// Driver limits
+#define MAX_NVME_CTRLS       2
+#define NVME_ADMIN_DEPTH     16
+#define NVME_IO_DEPTH        64
+#define NVME_PRP_ENTRIES     32     ///< PRP list entries per command
+#define NVME_MAX_BYTES       (NVME_PRP_ENTRIES * PAGE_SIZE)
+#define NVME_TIMEOUT         50000000
+
+// Controller registers
+#define NVME_REG_CAP         0x00
+#define NVME_REG_VS          0x08
+#define NVME_REG_INTMS       0x0c
+#define NVME_REG_INTMC       0x10
+#define NVME_REG_CC          0x14
+#define NVME_REG_CSTS        0x1c
+#define NVME_REG_AQA         0x24
+#define NVME_REG_ASQ         0x28
+#define NVME_REG_ACQ         0x30
+#define NVME_REG_DBS         0x1000
+
+#define NVME_CAP_MQES(c)     ((uint32_t)((c) & 0xffff) + 1)
+#define NVME_CAP_DSTRD(c)    ((uint32_t)(((c) >> 32) & 0xf))
+
+#define NVME_CC_EN           (1u << 0)
+#define NVME_CC_IOSQES       (6u << 16)     ///< 64-byte SQ entries
+#define NVME_CC_IOCQES       (4u << 20)     ///< 16-byte CQ entries
+
+#define NVME_CSTS_RDY        (1u << 0)
+#define NVME_CSTS_CFS        (1u << 1)
+
+// Admin command opcodes
+#define NVME_ADMIN_CREATE_SQ 0x01
+#define NVME_ADMIN_CREATE_CQ 0x05
+#define NVME_ADMIN_IDENTIFY  0x06
+#define NVME_ADMIN_SET_FEAT  0x09
+
+#define NVME_FEAT_NUM_QUEUES 0x07
+#define NVME_IDENTIFY_NS     0
+#define NVME_IDENTIFY_CTRL   1
+
+// I/O command opcodes
+#define NVME_CMD_FLUSH       0x00
+#define NVME_CMD_WRITE       0x01
+#define NVME_CMD_READ        0x02
+
+// Queue creation flags
+#define NVME_QUEUE_PC        (1u << 0)      ///< Physically contiguous
+#define NVME_CQ_IEN          (1u << 1)      ///< Interrupts enabled
+
+struct sqe
+{
+    uint8_t  opcode;
+    uint8_t  flags;
+    uint16_t cid;
+    uint32_t nsid;
+    uint64_t reserved;
+    uint64_t mptr;
+    uint64_t prp1;
+    uint64_t prp2;
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+};
+
+struct cqe
+{
+    uint32_t result;
+    uint32_t reserved;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t cid;
+    uint16_t status;            ///< Bit 0 is the phase tag
+};
+
+STATIC_ASSERT(sizeof(struct sqe) == 64, "Unexpected NVMe SQE size");
+STATIC_ASSERT(sizeof(struct cqe) == 16, "Unexpected NVMe CQE size");
+STATIC_ASSERT(NVME_IO_DEPTH * NVME_PRP_ENTRIES * 8 % PAGE_SIZE == 0,
+              "PRP lists must fill whole pages");
+
+struct ctrl;
+
+// A submission/completion queue pair. I/O pairs are owned by one CPU and
+// only used with interrupts disabled, so they need no lock.
+struct qpair
+{
+    struct ctrl       *ctrl;
+    uint16_t           qid;
+    uint16_t           depth;
+    uint16_t           vector;      ///< Interrupt vector index
+    struct sqe        *sq;
+    volatile struct cqe *cq;
+    volatile uint32_t *sq_db;
+    volatile uint32_t *cq_db;
+    uint16_t           sq_tail;
+    uint16_t           sq_head;     ///< Last head reported by the device
+    uint16_t           sq_kicked;   ///< sq_tail at the last doorbell write
+    uint16_t           cq_head;
+    uint8_t            phase;
+    uint64_t          *prp;         ///< One PRP list per command ID
+    blkreq_t          *req[NVME_IO_DEPTH];
+    uint64_t           busy;        ///< Command IDs in use
+};
+
+struct ctrl
+{
+    pcidev_t          *pci;
+    volatile uint8_t  *regs;
+    uint32_t           dstrd;
+    uint32_t           nsid;
+    int                nvec;
+    struct qpair       admin;
+    struct qpair       io[MAX_BLK_QUEUES];
+    blkdev_t           blk;
+    char               name[8];
+};
+
+static struct ctrl ctrls[MAX_NVME_CTRLS];
+static int         ctrl_count;
+
+static inline uint32_t
+reg_read32(const struct ctrl *c, uint32_t reg)
+{
+    return *(volatile uint32_t *)(c->regs + reg);
+}
+
+static inline void
+reg_write32(struct ctrl *c, uint32_t reg, uint32_t value)
+{
+    *(volatile uint32_t *)(c->regs + reg) = value;
+}
+
+static inline uint64_t
+reg_read64(const struct ctrl *c, uint32_t reg)
+{
+    return reg_read32(c, reg) | (uint64_t)reg_read32(c, reg + 4) << 32;
+}
+
+static inline void
+reg_write64(struct ctrl *c, uint32_t reg, uint64_t value)
+{
+    reg_write32(c, reg, (uint32_t)value);
+    reg_write32(c, reg + 4, (uint32_t)(value >> 32));
+}
+
+static bool
+wait_ready(const struct ctrl *c, bool ready)
+{
+    for (int i = 0; i < NVME_TIMEOUT; i++) {
+        uint32_t csts = reg_read32(c, NVME_REG_CSTS);
+        if (csts & NVME_CSTS_CFS)
+            return false;
+        if (!!(csts & NVME_CSTS_RDY) == ready)
+            return true;
+    }
+    return false;
+}
+
+static bool
+qpair_alloc(struct ctrl *c, struct qpair *q, uint16_t qid, uint16_t depth)
+{
+    memzero(q, sizeof(*q));
+    q->ctrl  = c;
+    q->qid   = qid;
+    q->depth = depth;
+    q->phase = 1;
+    q->sq    = kpage_alloc(div_up(depth * sizeof(struct sqe), PAGE_SIZE));
+    q->cq    = kpage_alloc(div_up(depth * sizeof(struct cqe), PAGE_SIZE));
+    if (qid != 0)
+        q->prp = kpage_alloc(NVME_IO_DEPTH * NVME_PRP_ENTRIES * 8 /
+                             PAGE_SIZE);
+
+    uint32_t stride = 4u << c->dstrd;
+    q->sq_db = (volatile uint32_t *)(c->regs + NVME_REG_DBS +
+                                     (2 * qid) * stride);
+    q->cq_db = (volatile uint32_t *)(c->regs + NVME_REG_DBS +
+                                     (2 * qid + 1) * stride);
+
+    return q->sq != NULL && q->cq != NULL && (qid == 0 || q->prp != NULL);
+}
+
+// Copy a command into the submission queue without ringing the doorbell.
+static bool
+sq_push(struct qpair *q, const struct sqe *cmd)
+{
+    uint16_t next = (uint16_t)((q->sq_tail + 1) % q->depth);
+    if (next == q->sq_head)
+        return false;
+
+    q->sq[q->sq_tail] = *cmd;
+    q->sq_tail = next;
+    return true;
+}
+
+static void
+sq_kick(struct qpair *q)
+{
+    if (q->sq_kicked == q->sq_tail)
+        return;
+    atomic_thread_fence(memory_order_release);
+    *q->sq_db     = q->sq_tail;
+    q->sq_kicked  = q->sq_tail;
+}
+
+// Pop the next completion, or return NULL if the device hasn't posted one.
+static volatile struct cqe *
+cq_pop(struct qpair *q)
+{
+    volatile struct cqe *cqe = &q->cq[q->cq_head];
+    if ((cqe->status & 1) != q->phase)
+        return NULL;
+    atomic_thread_fence(memory_order_acquire);
+
+    q->sq_head = cqe->sq_head;
+    if (++q->cq_head == q->depth) {
+        q->cq_head = 0;
+        q->phase  ^= 1;
+    }
+    return cqe;
+}
+
+// Run an admin command synchronously, polling for its completion.
+static int
+admin_cmd(struct ctrl *c, struct sqe *cmd, uint32_t *result)
+{
+    struct qpair *q = &c->admin;
+    cmd->cid = q->sq_tail;
+    if (!sq_push(q, cmd))
+        return -1;
+    sq_kick(q);
+
+    for (int i = 0; i < NVME_TIMEOUT; i++) {
+        volatile struct cqe *cqe = cq_pop(q);
+        if (cqe == NULL)
+            continue;
+
+        *q->cq_db = q->cq_head;
+        if (result != NULL)
+            *result = cqe->result;
+        return cqe->status >> 1;
+    }
+    return -1;
+}
+
+static bool
+identify(struct ctrl *c, uint32_t cns, uint32_t nsid, void *buf)
+{
+    struct sqe cmd;
+    memzero(&cmd, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_IDENTIFY;
+    cmd.nsid   = nsid;
+    cmd.prp1   = (uint64_t)buf;
+    cmd.cdw10  = cns;
+    return admin_cmd(c, &cmd, NULL) == 0;
+}
+
+static bool
+create_qpair(struct ctrl *c, struct qpair *q, bool irq)
+{
+    struct sqe cmd;
+    memzero(&cmd, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_CREATE_CQ;
+    cmd.prp1   = (uint64_t)q->cq;
+    cmd.cdw10  = (uint32_t)(q->depth - 1) << 16 | q->qid;
+    cmd.cdw11  = (uint32_t)q->vector << 16 | NVME_QUEUE_PC |
+                 (irq ? NVME_CQ_IEN : 0);
+    if (admin_cmd(c, &cmd, NULL) != 0)
+        return false;
+
+    memzero(&cmd, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_CREATE_SQ;
+    cmd.prp1   = (uint64_t)q->sq;
+    cmd.cdw10  = (uint32_t)(q->depth - 1) << 16 | q->qid;
+    cmd.cdw11  = (uint32_t)q->qid << 16 | NVME_QUEUE_PC;
+    return admin_cmd(c, &cmd, NULL) == 0;
+}
+
+// Describe a request's data with PRP1/PRP2, spilling into the command's
+// PRP list when it spans more than two pages. Every page boundary inside
+// the transfer must also be a segment boundary.
+static bool
+build_prps(struct qpair *q, uint16_t cid, const blkreq_t *req,
+           struct sqe *cmd)
+{
+    blkseg_t        single;
+    int             nsegs;
+    const blkseg_t *segs = blkreq_segs(&q->ctrl->blk, req, &single, &nsegs);
+
+    uint64_t pages[NVME_PRP_ENTRIES + 1];
+    int      n = 0;
+    for (int i = 0; i < nsegs; i++) {
+        uint64_t addr = (uint64_t)segs[i].addr;
+        uint64_t end  = addr + segs[i].len;
+
+        // Only the first page may start mid-page, and only the last may
+        // end mid-page.
+        if (n > 0 && (addr & (PAGE_SIZE - 1)))
+            return false;
+        if (i < nsegs - 1 && (end & (PAGE_SIZE - 1)))
+            return false;
+
+        while (addr < end) {
+            if (n == arrsize(pages))
+                return false;
+            pages[n++] = addr;
+            addr = align_dn(addr, PAGE_SIZE) + PAGE_SIZE;
+        }
+    }
+
+    cmd->prp1 = (n > 0) ? pages[0] : 0;
+    if (n == 2) {
+        cmd->prp2 = pages[1];
+    }
+    else if (n > 2) {
+        uint64_t *list = q->prp + cid * NVME_PRP_ENTRIES;
+        for (int i = 1; i < n; i++)
+            list[i - 1] = pages[i];
+        cmd->prp2 = (uint64_t)list;
+    }
+    return true;
+}
+
+static bool
+nvme_submit(blkdev_t *dev, int queue, blkreq_t *req)
+{
+    struct ctrl  *c = (struct ctrl *)dev->drvdata;
+    struct qpair *q = &c->io[queue];
+
+    uint64_t avail = ~q->busy & (((uint64_t)1 << (q->depth - 1)) - 1);
+    if (avail == 0)
+        return false;
+    uint16_t cid = (uint16_t)__builtin_ctzll(avail);
+
+    struct sqe cmd;
+    memzero(&cmd, sizeof(cmd));
+    cmd.cid  = cid;
+    cmd.nsid = c->nsid;
+    switch (req->op) {
+        case BLK_OP_READ:  cmd.opcode = NVME_CMD_READ;  break;
+        case BLK_OP_WRITE: cmd.opcode = NVME_CMD_WRITE; break;
+        default:           cmd.opcode = NVME_CMD_FLUSH; break;
+    }
+
+    if (req->op != BLK_OP_FLUSH) {
+        if (!build_prps(q, cid, req, &cmd)) {
+            req->status = BLK_STATUS_ERROR;
+            if (req->done != NULL)
+                req->done(req);
+            return true;
+        }
+        cmd.cdw10 = (uint32_t)req->sector;
+        cmd.cdw11 = (uint32_t)(req->sector >> 32);
+        cmd.cdw12 = req->count - 1;
+    }
+
+    if (!sq_push(q, &cmd))
+        return false;
+
+    q->req[cid] = req;
+    q->busy    |= (uint64_t)1 << cid;
+    return true;
+}
+
+static void
+nvme_kick(blkdev_t *dev, int queue)
+{
+    struct ctrl *c = (struct ctrl *)dev->drvdata;
+    sq_kick(&c->io[queue]);
+}
+
+static void
+complete(struct qpair *q)
+{
+    blkreq_t *done = NULL;
+
+    volatile struct cqe *cqe;
+    bool                 any = false;
+    while ((cqe = cq_pop(q)) != NULL) {
+        uint16_t cid = cqe->cid;
+        if (cid >= NVME_IO_DEPTH || q->req[cid] == NULL)
+            continue;
+
+        blkreq_t *req = q->req[cid];
+        q->req[cid] = NULL;
+        q->busy    &= ~((uint64_t)1 << cid);
+
+        req->status = (cqe->status >> 1) ? BLK_STATUS_ERROR : BLK_STATUS_OK;
+        req->next   = done;
+        done        = req;
+        any         = true;
+    }
+
+    // One head doorbell write covers the whole batch.
+    if (any)
+        *q->cq_db = q->cq_head;
+
+    while (done != NULL) {
+        blkreq_t *req = done;
+        done = req->next;
+        if (req->done != NULL)
+            req->done(req);
+    }
+}
+
+static void
+nvme_poll(blkdev_t *dev, int queue)
+{
+    struct ctrl *c = (struct ctrl *)dev->drvdata;
+    complete(&c->io[queue]);
+}
+
+static const blkdev_ops_t nvme_ops =
+{
+    .submit = nvme_submit,
+    .kick   = nvme_kick,
+    .poll   = nvme_poll,
+};
+
+static void
+isr_vector(void *data)
+{
+    // With fewer vectors than queues, queues share vectors round-robin.
+    struct qpair *first = (struct qpair *)data;
+    struct ctrl  *c     = first->ctrl;
+
+    uint64_t flags = save_interrupts();
+    for (int i = 0; i < c->blk.nr_queues; i++) {
+        if (c->io[i].vector == first->vector)
+            complete(&c->io[i]);
+    }
+    restore_interrupts(flags);
+}
+
+static bool
+probe(pcidev_t *pci)
+{
+    if (ctrl_count == MAX_NVME_CTRLS)
+        return false;
+
+    struct ctrl *c = &ctrls[ctrl_count];
+    memzero(c, sizeof(*c));
+    c->pci  = pci;
+    c->regs = pci_map_bar(pci, 0);
+    if (c->regs == NULL)
+        return false;
+
+    pci_enable(pci, PCI_CMD_MEMORY | PCI_CMD_MASTER);
+
+    uint64_t cap = reg_read64(c, NVME_REG_CAP);
+    c->dstrd = NVME_CAP_DSTRD(cap);
+
+    // Disable the controller before programming the admin queues.
+    reg_write32(c, NVME_REG_CC, reg_read32(c, NVME_REG_CC) & ~NVME_CC_EN);
+    if (!wait_ready(c, false))
+        return false;
+
+    if (!qpair_alloc(c, &c->admin, 0, NVME_ADMIN_DEPTH))
+        return false;
+    reg_write32(c, NVME_REG_AQA,
+                (NVME_ADMIN_DEPTH - 1) << 16 | (NVME_ADMIN_DEPTH - 1));
+    reg_write64(c, NVME_REG_ASQ, (uint64_t)c->admin.sq);
+    reg_write64(c, NVME_REG_ACQ, (uint64_t)c->admin.cq);
+
+    // 4KiB memory pages, NVM command set.
+    reg_write32(c, NVME_REG_CC, NVME_CC_IOSQES | NVME_CC_IOCQES | NVME_CC_EN);
+    if (!wait_ready(c, true)) {
+        logf(LOG_WARNING, "[nvme] Controller failed to start.");
+        return false;
+    }
+
+    uint8_t *id = kpage_alloc(1);
+    if (id == NULL)
+        return false;
+
+    // Controller: maximum data transfer size (byte 77, in 4KiB units).
+    uint32_t max_bytes = NVME_MAX_BYTES;
+    if (!identify(c, NVME_IDENTIFY_CTRL, 0, id))
+        goto fail;
+    if (id[77] != 0)
+        max_bytes = min(max_bytes, (uint32_t)PAGE_SIZE << id[77]);
+
+    // Namespace 1: size (bytes 0-7) and the formatted LBA size.
+    c->nsid = 1;
+    if (!identify(c, NVME_IDENTIFY_NS, c->nsid, id))
+        goto fail;
+    uint64_t nsze   = *(uint64_t *)id;
+    uint8_t  flbas  = id[26] & 0xf;
+    uint8_t  lbads  = id[128 + flbas * 4 + 2];
+    uint32_t sector = 1u << lbads;
+    kpage_free(id, 1);
+    id = NULL;
+
+    // One queue pair per CPU, limited by the controller.
+    int nq = min(lapic_cpu_count(), MAX_BLK_QUEUES);
+
+    struct sqe cmd;
+    memzero(&cmd, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_SET_FEAT;
+    cmd.cdw10  = NVME_FEAT_NUM_QUEUES;
+    cmd.cdw11  = (uint32_t)(nq - 1) << 16 | (uint32_t)(nq - 1);
+    uint32_t granted;
+    if (admin_cmd(c, &cmd, &granted) != 0)
+        goto fail;
+    nq = min(nq, (int)(granted & 0xffff) + 1);
+    nq = min(nq, (int)(granted >> 16) + 1);
+
+    c->nvec = msi_alloc(pci, nq);
+    uint16_t depth = (uint16_t)min(NVME_IO_DEPTH, (int)NVME_CAP_MQES(cap));
+
+    int ready = 0;
+    for (; ready < nq; ready++) {
+        struct qpair *q = &c->io[ready];
+        if (!qpair_alloc(c, q, (uint16_t)(ready + 1), depth))
+            break;
+        q->vector = (uint16_t)(c->nvec > 0 ? ready % c->nvec : 0);
+        if (!create_qpair(c, q, c->nvec > 0))
+            break;
+        if (c->nvec > 0 && ready < c->nvec) {
+            msi_set_handler(pci, ready, isr_vector, q);
+            msi_mask(pci, ready, false);
+        }
+    }
+    if (ready == 0)
+        return false;
+
+    c->name[0] = 'n';
+    c->name[1] = 'v';
+    c->name[2] = 'm';
+    c->name[3] = 'e';
+    c->name[4] = (char)('0' + ctrl_count);
+    c->name[5] = 'n';
+    c->name[6] = '1';
+    c->name[7] = 0;
+
+    blkdev_t *blk = &c->blk;
+    memcpy(blk->name, c->name, sizeof(blk->name));
+    blk->sector_size = sector;
+    blk->sectors     = nsze;
+    blk->max_sectors = max_bytes / sector;
+    blk->nr_queues   = ready;
+    blk->ops         = &nvme_ops;
+    blk->drvdata     = c;
+
+    pci->drvdata = c;
+    ctrl_count++;
+
+    logf(LOG_INFO, "[nvme] %s: %d I/O queue pair(s) of depth %u, %s.",
+         blk->name, ready, depth, c->nvec > 0 ? "interrupts" : "polled");
+    return blkdev_register(blk);
+
+fail:
+    if (id != NULL)
+        kpage_free(id, 1);
+    logf(LOG_WARNING, "[nvme] Controller identification failed.");
+    return false;
+}
+
+static const pciid_t nvme_ids[] =
+{
+    { PCI_ANY, PCI_ANY, 0x01, 0x08 },   // Mass storage, non-volatile memory
+    { 0 }
+};
+
+static const pcidrv_t nvme_driver =
+{
+    .name  = "nvme",
+    .ids   = nvme_ids,
+    .probe = probe,
+};
+
+void
+nvme_init()
+{
+    pci_register_driver(&nvme_driver);
+}
@@ -4,8 +4,11 @@
 //============================================================================
 
 #include <core.h>
+#include <kernel/debug/log.h>
 #include <kernel/device/pci.h>
-#include <kernel/device/tty.h>
+#include <kernel/mem/acpi.h>
+#include <kernel/mem/paging.h>
+#include <kernel/spinlock.h>
 #include <kernel/x86/cpu.h>
 
 #define DEBUG_PCI        1
@@ -13,59 +16,292 @@
 #define PCI_CONFIG_ADDR  0x0cf8
 #define PCI_CONFIG_DATA  0x0cfc
 
-static inline uint32_t
-read(uint32_t bus, uint32_t device, uint32_t func, uint32_t offset)
+// Maximum number of MCFG entries tracked for ECAM access.
+#define MAX_ECAM         4
+
+/// A memory-mapped configuration region described by one MCFG entry.
+struct ecam
+{
+    uint8_t *base;           ///< Address of bus 0 within the region.
+    uint8_t  bus_start;      ///< First bus decoded by the region.
+    uint8_t  bus_end;        ///< Last bus decoded by the region.
+};
+
+/// Configuration space access state.
+struct config
+{
+    bool        initialized;
+    int         ecam_count;         ///< Number of valid ecam entries.
+    struct ecam ecam[MAX_ECAM];     ///< ECAM regions for segment group 0.
+    spin_lock_t lock;               ///< Serializes the 0xCF8/0xCFC pair.
+};
+
+static struct config config;
+
+static void
+config_init()
+{
+    if (config.initialized)
+        return;
+
+    // Record every segment group 0 MCFG entry. The regions were mapped
+    // uncached into the kernel page table by acpi_init.
+    const struct acpi_mcfg_addr *addr = NULL;
+    while ((addr = acpi_next_mcfg_addr(addr)) != NULL &&
+           config.ecam_count < MAX_ECAM) {
+        if (addr->seg_group != 0)
+            continue;
+        struct ecam *e = &config.ecam[config.ecam_count++];
+        e->base      = (uint8_t *)addr->base;
+        e->bus_start = addr->bus_start;
+        e->bus_end   = addr->bus_end;
+    }
+
+    config.initialized = true;
+}
+
+/// Return a pointer to the memory-mapped configuration register, or NULL if
+/// the bus is not decoded by any ECAM region.
+static inline volatile void *
+ecam_ptr(uint32_t bus, uint32_t device, uint32_t func, uint32_t offset)
+{
+    for (int i = 0; i < config.ecam_count; i++) {
+        const struct ecam *e = &config.ecam[i];
+        if (bus < e->bus_start || bus > e->bus_end)
+            continue;
+        return e->base + ((bus << 20) | (device << 15) | (func << 12) |
+                          (offset & 0xfff));
+    }
+    return NULL;
+}
+
+/// Select a register through the legacy address port. The caller must hold
+/// config.lock until the data port has been accessed.
+static inline void
+legacy_select(uint32_t bus, uint32_t device, uint32_t func, uint32_t offset)
 {
     uint32_t addr = (1u << 31) |
                     (bus << 16) |
                     (device << 11) |
                     (func << 8) |
-                    offset;
+                    (offset & 0xfc);
 
     io_outd(PCI_CONFIG_ADDR, addr);
-    return io_ind(PCI_CONFIG_DATA);
 }
 
-static inline uint32_t
-read_hdrtype(uint32_t bus, uint32_t device, uint32_t func)
+static uint32_t
+legacy_read(uint32_t bus, uint32_t device, uint32_t func, uint32_t offset)
 {
-    uint32_t value = read(bus, device, func, 0x0c);
-    return (value >> 16) & 0xff;
+    if (offset >= PCI_CONFIG_SIZE)
+        return 0xffffffff;
+
+    spin_lock(config.lock);
+    legacy_select(bus, device, func, offset);
+    uint32_t value = io_ind(PCI_CONFIG_DATA);
+    spin_unlock(config.lock);
+
+    // Shift the requested bytes down to bit 0.
+    return value >> ((offset & 3) * 8);
 }
 
-static inline uint32_t
-read_deviceid(uint32_t bus, uint32_t device, uint32_t func)
+enum pci_access
+pci_access()
 {
-    uint32_t value = read(bus, device, func, 0x00);
-    return (value >> 16) & 0xffff;
+    config_init();
+    return config.ecam_count > 0 ? PCI_ACCESS_ECAM : PCI_ACCESS_LEGACY;
 }
 
-static inline uint32_t
-read_vendor(uint32_t bus, uint32_t device, uint32_t func)
+uint32_t
+pci_config_read32(uint32_t bus, uint32_t device, uint32_t func,
+                  uint32_t offset)
 {
-    uint32_t value = read(bus, device, func, 0x00);
-    return value & 0xffff;
+    volatile uint32_t *ptr = ecam_ptr(bus, device, func, offset);
+    if (ptr != NULL)
+        return *ptr;
+    return legacy_read(bus, device, func, offset);
 }
 
-static inline uint32_t
-read_class(uint32_t bus, uint32_t device, uint32_t func)
+uint16_t
+pci_config_read16(uint32_t bus, uint32_t device, uint32_t func,
+                  uint32_t offset)
 {
-    uint32_t value = read(bus, device, func, 0x08);
-    return value >> 24;
+    volatile uint16_t *ptr = ecam_ptr(bus, device, func, offset);
+    if (ptr != NULL)
+        return *ptr;
+    return (uint16_t)legacy_read(bus, device, func, offset);
 }
 
-static inline uint32_t
-read_subclass(uint32_t bus, uint32_t device, uint32_t func)
+uint8_t
+pci_config_read8(uint32_t bus, uint32_t device, uint32_t func,
+                 uint32_t offset)
 {
-    uint32_t value = read(bus, device, func, 0x08);
-    return (value >> 16) & 0xff;
+    volatile uint8_t *ptr = ecam_ptr(bus, device, func, offset);
+    if (ptr != NULL)
+        return *ptr;
+    return (uint8_t)legacy_read(bus, device, func, offset);
 }
 
-static inline uint32_t
-read_secondary_bus(uint32_t bus, uint32_t device, uint32_t func)
+void
+pci_config_write32(uint32_t bus, uint32_t device, uint32_t func,
+                   uint32_t offset, uint32_t value)
 {
-    uint32_t value = read(bus, device, func, 0x18);
-    return (value >> 8) & 0xff;
+    volatile uint32_t *ptr = ecam_ptr(bus, device, func, offset);
+    if (ptr != NULL) {
+        *ptr = value;
+        return;
+    }
+    if (offset >= PCI_CONFIG_SIZE)
+        return;
+
+    spin_lock(config.lock);
+    legacy_select(bus, device, func, offset);
+    io_outd(PCI_CONFIG_DATA, value);
+    spin_unlock(config.lock);
+}
+
+void
+pci_config_write16(uint32_t bus, uint32_t device, uint32_t func,
+                   uint32_t offset, uint16_t value)
+{
+    volatile uint16_t *ptr = ecam_ptr(bus, device, func, offset);
+    if (ptr != NULL) {
+        *ptr = value;
+        return;
+    }
+    if (offset >= PCI_CONFIG_SIZE)
+        return;
+
+    // Sub-dword writes go through the data port at the byte offset, so
+    // neighboring registers are not disturbed.
+    spin_lock(config.lock);
+    legacy_select(bus, device, func, offset);
+    io_outw(PCI_CONFIG_DATA + (offset & 2), value);
+    spin_unlock(config.lock);
+}
+
+void
+pci_config_write8(uint32_t bus, uint32_t device, uint32_t func,
+                  uint32_t offset, uint8_t value)
+{
+    volatile uint8_t *ptr = ecam_ptr(bus, device, func, offset);
+    if (ptr != NULL) {
+        *ptr = value;
+        return;
+    }
+    if (offset >= PCI_CONFIG_SIZE)
+        return;
+
+    spin_lock(config.lock);
+    legacy_select(bus, device, func, offset);
+    io_outb(PCI_CONFIG_DATA + (offset & 3), value);
+    spin_unlock(config.lock);
+}
+
+/// The PCI device table.
+struct table
+{
+    bool     scanned;
+    int      count;                      ///< Number of devices.
+    pcidev_t dev[MAX_PCI_DEVICES];       ///< Cached devices.
+    uint32_t visited[256 / 32];          ///< Bitmask of scanned buses.
+};
+
+static struct table table;
+
+/// Size a single BAR and return the number of BAR slots it occupies.
+static int
+read_bar(pcidev_t *dev, int index)
+{
+    pcibar_t *bar = &dev->bar[index];
+    uint32_t  reg = PCI_REG_BAR0 + index * 4;
+
+    uint32_t lo = pci_config_read32(dev->bus, dev->device, dev->func, reg);
+    pci_config_write32(dev->bus, dev->device, dev->func, reg, 0xffffffff);
+    uint32_t lomask = pci_config_read32(dev->bus, dev->device, dev->func, reg);
+    pci_config_write32(dev->bus, dev->device, dev->func, reg, lo);
+
+    // I/O BAR
+    if (lo & 1) {
+        bar->flags = PCI_BAR_IO;
+        bar->addr  = lo & ~3u;
+        bar->size  = (uint16_t)(~(lomask & ~3u) + 1);
+        if (lomask == 0)
+            bar->size = 0;
+        return 1;
+    }
+
+    bar->addr = lo & ~0xfu;
+    if (lo & (1 << 3))
+        bar->flags |= PCI_BAR_PREFETCH;
+
+    uint64_t mask = (uint64_t)(lomask & ~0xfu) | 0xffffffff00000000ull;
+    int      slots = 1;
+
+    // 64-bit memory BAR: the next slot holds the upper half.
+    if (((lo >> 1) & 3) == 2 && index < 5) {
+        uint32_t hreg = reg + 4;
+        uint32_t hi   = pci_config_read32(dev->bus, dev->device, dev->func,
+                                          hreg);
+        pci_config_write32(dev->bus, dev->device, dev->func, hreg,
+                           0xffffffff);
+        uint32_t himask = pci_config_read32(dev->bus, dev->device,
+                                            dev->func, hreg);
+        pci_config_write32(dev->bus, dev->device, dev->func, hreg, hi);
+
+        bar->flags |= PCI_BAR_MEM64;
+        bar->addr  |= (uint64_t)hi << 32;
+        mask        = ((uint64_t)himask << 32) | (lomask & ~0xfu);
+        slots       = 2;
+    }
+
+    bar->size = (lomask & ~0xfu) == 0 ? 0 : ~mask + 1;
+    return slots;
+}
+
+/// Size all BARs of a function. Decoding is disabled while the BARs are
+/// probed so that the all-ones sizing pattern is never decoded.
+static void
+read_bars(pcidev_t *dev)
+{
+    int bars = (dev->hdrtype == 0) ? 6 : (dev->hdrtype == 1) ? 2 : 0;
+    if (bars == 0)
+        return;
+
+    uint16_t cmd = pci_config_read16(dev->bus, dev->device, dev->func,
+                                     PCI_REG_COMMAND);
+    pci_config_write16(dev->bus, dev->device, dev->func, PCI_REG_COMMAND,
+                       cmd & ~(PCI_CMD_IO | PCI_CMD_MEMORY));
+
+    for (int i = 0; i < bars; )
+        i += read_bar(dev, i);
+
+    pci_config_write16(dev->bus, dev->device, dev->func, PCI_REG_COMMAND,
+                       cmd);
+}
+
+/// Walk the capability list and cache each entry.
+static void
+read_caps(pcidev_t *dev)
+{
+    uint16_t status = pci_config_read16(dev->bus, dev->device, dev->func,
+                                        PCI_REG_STATUS);
+    if (!(status & PCI_STATUS_CAPS))
+        return;
+
+    uint8_t ptr = pci_config_read8(dev->bus, dev->device, dev->func,
+                                   PCI_REG_CAPPTR) & ~3;
+
+    // Bound the walk in case of a malformed (looping) list.
+    for (int n = 0; ptr != 0 && n < 48; n++) {
+        uint16_t hdr = pci_config_read16(dev->bus, dev->device, dev->func,
+                                         ptr);
+        if (dev->caps_count < MAX_PCI_CAPS) {
+            pcicap_t *cap = &dev->caps[dev->caps_count++];
+            cap->id     = (uint8_t)hdr;
+            cap->offset = ptr;
+        }
+        ptr = (uint8_t)(hdr >> 8) & ~3;
+    }
 }
 
 static void probe_bus(uint32_t bus);
@@ -74,32 +310,57 @@ static bool
 probe_function(uint32_t bus, uint32_t device, uint32_t func)
 {
     // Validate the function
-    uint32_t vendor = read_vendor(bus, device, func);
+    uint32_t vendor = pci_config_read16(bus, device, func, PCI_REG_VENDOR);
     if (vendor == 0xffff)
         return false;
 
-    // Read the device's class/subclass
-    uint32_t class    = read_class(bus, device, func);
-    uint32_t subclass = read_subclass(bus, device, func);
+    if (table.count == MAX_PCI_DEVICES) {
+        logf(LOG_WARNING, "[pci] Device table full; ignoring %u/%u/%u.",
+             bus, device, func);
+        return true;
+    }
 
-    // Is this a PCI-to-PCI bridge device? If so, recursively scan the
-    // bridge's secondary bus.
-    if (class == 6 && subclass == 4) {
-        uint32_t bus2 = read_secondary_bus(bus, device, func);
-        probe_bus(bus2);
+    // Cache the function's identification registers.
+    pcidev_t *dev = &table.dev[table.count++];
+    dev->bus       = (uint8_t)bus;
+    dev->device    = (uint8_t)device;
+    dev->func      = (uint8_t)func;
+    dev->vendor    = (uint16_t)vendor;
+    dev->devid     = pci_config_read16(bus, device, func, PCI_REG_DEVICE);
+    dev->revision  = pci_config_read8(bus, device, func, PCI_REG_REVISION);
+    dev->progif    = pci_config_read8(bus, device, func, PCI_REG_PROGIF);
+    dev->subclass  = pci_config_read8(bus, device, func, PCI_REG_SUBCLASS);
+    dev->class     = pci_config_read8(bus, device, func, PCI_REG_CLASS);
+    dev->hdrtype   = pci_config_read8(bus, device, func, PCI_REG_HDRTYPE) &
+                     0x7f;
+    dev->irq_line  = pci_config_read8(bus, device, func, PCI_REG_IRQLINE);
+    dev->irq_pin   = pci_config_read8(bus, device, func, PCI_REG_IRQPIN);
+    if (dev->hdrtype == 0) {
+        dev->subvendor = pci_config_read16(bus, device, func,
+                                           PCI_REG_SUBVENDOR);
+        dev->subsys = pci_config_read16(bus, device, func,
+                                        PCI_REG_SUBSYSTEM);
     }
 
+    read_bars(dev);
+    read_caps(dev);
+
 #if DEBUG_PCI
-    else {
-        uint32_t devid = read_deviceid(bus, device, func);
-        tty_printf(
-            0,
-            "[pci] %u/%u/%u vendor=0x%04x devid=0x%04x "
-            "class=%02x subclass=%02x\n",
-            bus, device, func, vendor, devid, class, subclass);
-    }
+    logf(LOG_INFO,
+         "[pci] %u/%u/%u vendor=0x%04x devid=0x%04x "
+         "class=%02x subclass=%02x",
+         bus, device, func, dev->vendor, dev->devid, dev->class,
+         dev->subclass);
 #endif
 
+    // Is this a PCI-to-PCI bridge device? If so, recursively scan the
+    // bridge's secondary bus.
+    if (dev->class == 6 && dev->subclass == 4 && dev->hdrtype == 1) {
+        dev->secondary = pci_config_read8(bus, device, func,
+                                          PCI_REG_SECONDARY);
+        probe_bus(dev->secondary);
+    }
+
     return true;
 }
 
@@ -111,7 +372,7 @@ probe_device(uint32_t bus, uint32_t device)
         return;
 
     // Probe functions 1 through 8 if the device is multi-function.
-    uint32_t hdrtype = read_hdrtype(bus, device, 0);
+    uint8_t hdrtype = pci_config_read8(bus, device, 0, PCI_REG_HDRTYPE);
     if (hdrtype & 0x80) {
         for (uint32_t func = 1; func < 8; ++func)
             probe_function(bus, device, func);
@@ -121,24 +382,123 @@ probe_device(uint32_t bus, uint32_t device)
 static void
 probe_bus(uint32_t bus)
 {
+    // Never scan a bus twice, even if a misconfigured bridge points back
+    // at a bus that was already visited.
+    uint32_t bit = 1u << (bus & 31);
+    if (table.visited[bus >> 5] & bit)
+        return;
+    table.visited[bus >> 5] |= bit;
+
     // Probe all possible devices on the bus.
     for (uint32_t device = 0; device < 32; ++device)
         probe_device(bus, device);
 }
 
+static bool
+match(const pcidrv_t *drv, const pcidev_t *dev)
+{
+    for (const pciid_t *id = drv->ids; id->vendor != 0; id++) {
+        if (id->vendor != PCI_ANY && id->vendor != dev->vendor)
+            continue;
+        if (id->devid != PCI_ANY && id->devid != dev->devid)
+            continue;
+        if (id->class != PCI_ANY && id->class != dev->class)
+            continue;
+        if (id->subclass != PCI_ANY && id->subclass != dev->subclass)
+            continue;
+        return true;
+    }
+    return false;
+}
+
+static int
+bind(const pcidrv_t *drv)
+{
+    int bound = 0;
+    for (int i = 0; i < table.count; i++) {
+        pcidev_t *dev = &table.dev[i];
+        if (dev->driver != NULL || !match(drv, dev))
+            continue;
+        if (drv->probe(dev)) {
+            dev->driver = drv;
+            bound++;
+            logf(LOG_INFO, "[pci] %u/%u/%u bound to %s.",
+                 dev->bus, dev->device, dev->func, drv->name);
+        }
+    }
+    return bound;
+}
+
 void
 pci_init()
 {
+    if (table.scanned)
+        return;
+
+    config_init();
+
     // Always probe bus 0.
     probe_bus(0);
 
-    // If bus 0 device 0 is multi-function, probe remaining 7 buses.
-    uint32_t hdrtype = read_hdrtype(0, 0, 0);
+    // If bus 0 device 0 is multi-function, each function is a separate
+    // host controller responsible for the bus with the same number.
+    uint8_t hdrtype = pci_config_read8(0, 0, 0, PCI_REG_HDRTYPE);
     if (hdrtype & 0x80) {
         for (uint32_t bus = 1; bus < 8; ++bus) {
-            uint32_t vendor = read_vendor(0, 0, bus); // func = bus #
+            uint32_t vendor = pci_config_read16(0, 0, bus, PCI_REG_VENDOR);
             if (vendor != 0xffff)
                 probe_bus(bus);
         }
     }
+
+    table.scanned = true;
+    logf(LOG_INFO, "[pci] Found %d functions (%s access).", table.count,
+         config.ecam_count > 0 ? "ECAM" : "legacy");
+}
+
+pcidev_t *
+pci_next_device(const pcidev_t *prev)
+{
+    pcidev_t *next = (prev == NULL) ? table.dev : (pcidev_t *)prev + 1;
+    if (next < table.dev + table.count)
+        return next;
+    return NULL;
+}
+
+uint8_t
+pci_find_cap(const pcidev_t *dev, uint8_t id)
+{
+    for (int i = 0; i < dev->caps_count; i++) {
+        if (dev->caps[i].id == id)
+            return dev->caps[i].offset;
+    }
+    return 0;
+}
+
+int
+pci_register_driver(const pcidrv_t *drv)
+{
+    return bind(drv);
+}
+
+void
+pci_enable(const pcidev_t *dev, uint16_t cmd)
+{
+    uint16_t value = pci_config_read16(dev->bus, dev->device, dev->func,
+                                       PCI_REG_COMMAND);
+    pci_config_write16(dev->bus, dev->device, dev->func, PCI_REG_COMMAND,
+                       value | cmd);
+}
+
+void *
+pci_map_bar(const pcidev_t *dev, int index)
+{
+    if (index < 0 || index >= 6)
+        return NULL;
+
+    const pcibar_t *bar = &dev->bar[index];
+    if (bar->size == 0 || (bar->flags & PCI_BAR_IO))
+        return NULL;
+
+    return page_map_mmio(bar->addr, bar->size);
 }
@@ -1,71 +1,415 @@
-#include <stdint.h>
+//============================================================================
+/// @file       serial.c
+/// @brief      Interrupt-driven 16550 UART (COM1/COM2) driver.
+//============================================================================
 
+#include <core.h>
+#include <libc/stdio.h>
 #include <kernel/device/serial.h>
+#include <kernel/device/timer.h>
+#include <kernel/errno.h>
+#include <kernel/interrupt/interrupt.h>
+#include <kernel/spinlock.h>
 #include <kernel/x86/cpu.h>
 
-#define COM1_PORT 0x3F8
-#define COM2_PORT 0x2F8
+#define COM1_PORT        0x3F8
+#define COM2_PORT        0x2F8
 
-#ifdef SERIAL_DISABLE
-#include "util.h"
-void serial_init(void) {}
-void serial_write_com(int UNUSED(com), unsigned char UNUSED(data)) {}
-#else
+// UART registers, as offsets from the port base
+#define UART_DATA        0      ///< Receive buffer / transmit holding (r/w)
+#define UART_IER         1      ///< Interrupt enable
+#define UART_DLL         0      ///< Divisor latch low (DLAB=1)
+#define UART_DLH         1      ///< Divisor latch high (DLAB=1)
+#define UART_IIR         2      ///< Interrupt identification (read)
+#define UART_FCR         2      ///< FIFO control (write)
+#define UART_LCR         3      ///< Line control
+#define UART_MCR         4      ///< Modem control
+#define UART_LSR         5      ///< Line status
+#define UART_MSR         6      ///< Modem status
+#define UART_SCRATCH     7      ///< Scratch
 
-static inline void pause(void)
+// IER bits
+#define IER_RX           0x01   ///< Received data available
+#define IER_THRE         0x02   ///< Transmit holding register empty
+#define IER_LINE         0x04   ///< Receiver line status
+
+// IIR values
+#define IIR_NONE         0x01   ///< No interrupt pending
+#define IIR_ID_MASK      0x0E
+#define IIR_MODEM        0x00
+#define IIR_THRE         0x02
+#define IIR_RX           0x04
+#define IIR_LINE         0x06
+#define IIR_TIMEOUT      0x0C   ///< Data in the receive FIFO, line idle
+
+// FCR, LCR and MCR values
+#define FCR_ENABLE_14    0xC7   ///< Enable and clear FIFOs, 14-byte trigger
+#define LCR_8N1          0x03
+#define LCR_DLAB         0x80
+#define MCR_DTR_RTS_OUT2 0x0B   ///< OUT2 gates the UART's IRQ line.
+
+// LSR bits
+#define LSR_DATA         0x01   ///< Received data ready
+#define LSR_THRE         0x20   ///< Transmit FIFO empty
+#define LSR_TEMT         0x40   ///< Transmitter completely idle
+
+// Bytes the transmit FIFO takes each time it empties.
+#define UART_FIFO_SIZE   16
+
+/// Per-port state. Ring indices run freely and are masked on use.
+struct serial_port
+{
+    uint16_t    io;                     ///< I/O port base.
+    bool        present;                ///< Responded to the probe.
+    bool        irq;                    ///< Interrupts installed.
+    spin_lock_t lock;
+    uint32_t    tx_head;                ///< Next byte to send.
+    uint32_t    tx_tail;                ///< Next free slot.
+    uint32_t    rx_head;
+    uint32_t    rx_tail;
+    uint64_t    tx_dropped;             ///< Bytes lost to a full ring.
+    uint64_t    rx_dropped;
+    uint8_t     tx[SERIAL_TX_RING];
+    uint8_t     rx[SERIAL_RX_RING];
+};
+
+typedef struct serial_port serial_port_t;
+
+static serial_port_t ports[2] =
+{
+    { .io = COM1_PORT },
+    { .io = COM2_PORT },
+};
+
+static bool initialized;
+static int  log_com;
+
+static inline serial_port_t *
+port_get(int com)
+{
+    if (com != COM1 && com != COM2)
+        return NULL;
+    serial_port_t *p = &ports[com - 1];
+    return p->present ? p : NULL;
+}
+
+// Move up to one FIFO's worth of queued bytes into the UART, if it has
+// room. Called with the port locked.
+static void
+tx_fill(serial_port_t *p)
+{
+    if (!(io_inb(p->io + UART_LSR) & LSR_THRE))
+        return;
+
+    for (int i = 0; i < UART_FIFO_SIZE && p->tx_head != p->tx_tail; i++)
+        io_outb(p->io + UART_DATA,
+                p->tx[p->tx_head++ & (SERIAL_TX_RING - 1)]);
+}
+
+// Collect everything in the receive FIFO. Called with the port locked.
+static void
+rx_drain(serial_port_t *p)
+{
+    while (io_inb(p->io + UART_LSR) & LSR_DATA) {
+        uint8_t ch = io_inb(p->io + UART_DATA);
+        if (p->rx_tail - p->rx_head == SERIAL_RX_RING)
+            p->rx_dropped++;
+        else
+            p->rx[p->rx_tail++ & (SERIAL_RX_RING - 1)] = ch;
+    }
+}
+
+static void
+isr_serial(serial_port_t *p)
 {
-	__builtin_ia32_pause();
+    spin_lock(p->lock);
+    for (;;) {
+        uint8_t iir = io_inb(p->io + UART_IIR);
+        if (iir & IIR_NONE)
+            break;
+
+        switch (iir & IIR_ID_MASK)
+        {
+            case IIR_LINE:
+                io_inb(p->io + UART_LSR);
+                break;
+
+            case IIR_RX:
+            case IIR_TIMEOUT:
+                rx_drain(p);
+                break;
+
+            case IIR_THRE:
+                tx_fill(p);
+                break;
+
+            default:
+                io_inb(p->io + UART_MSR);
+                break;
+        }
+    }
+    spin_unlock(p->lock);
+
+    // Send the end-of-interrupt signal.
+    io_outb(PIC_PORT_CMD_MASTER, PIC_CMD_EOI);
 }
 
-void serial_init(void)
+static void
+isr_com1(const interrupt_context_t *context)
 {
-	// Init COM1 and COM2
-	io_outb(COM1_PORT + 1, 0x00);    // Disable all interrupts
-	io_outb(COM1_PORT + 3, 0x80);    // Enable DLAB (set baud rate divisor)
-	io_outb(COM1_PORT + 0, 0x03);    // Set divisor to 3 (lo byte) 38400 baud
-	io_outb(COM1_PORT + 1, 0x00);    //                  (hi byte)
-	io_outb(COM1_PORT + 3, 0x02);    // 7 bits, no parity, one stop bit
-	io_outb(COM1_PORT + 2, 0xC7);    // Enable FIFO, clear them, with 14-byte threshold
-	io_outb(COM1_PORT + 4, 0x0B);    // IRQs enabled, RTS/DSR set
+    (void)context;
+    isr_serial(&ports[0]);
+}
 
-	io_outb(COM2_PORT + 1, 0x00);    // Disable all interrupts
-	io_outb(COM2_PORT + 3, 0x80);    // Enable DLAB (set baud rate divisor)
-	io_outb(COM2_PORT + 0, 0x03);    // Set divisor to 3 (lo byte) 38400 baud
-	io_outb(COM2_PORT + 1, 0x00);    //                  (hi byte)
-	io_outb(COM2_PORT + 3, 0x02);    // 7 bits, no parity, one stop bit
-	io_outb(COM2_PORT + 2, 0xC7);    // Enable FIFO, clear them, with 14-byte threshold
-	io_outb(COM2_PORT + 4, 0x0B);    // IRQs enabled, RTS/DSR set
+static void
+isr_com2(const interrupt_context_t *context)
+{
+    (void)context;
+    isr_serial(&ports[1]);
+}
 
-	// Print a small separator so we can see output clearly
-	const char *msg = "-----------------------------------\n";
-	while (*msg)
-		serial_write_com(1, *msg++);
+// Check that a UART answers at the port by round-tripping the scratch
+// register.
+static bool
+probe(uint16_t io)
+{
+    io_outb(io + UART_SCRATCH, 0xA5);
+    if (io_inb(io + UART_SCRATCH) != 0xA5)
+        return false;
+    io_outb(io + UART_SCRATCH, 0x5A);
+    return io_inb(io + UART_SCRATCH) == 0x5A;
 }
 
-static inline int serial_transmit_empty(uint16_t port)
+int
+serial_configure(int com, uint32_t baud)
 {
-	return io_inb(port + 5) & 0x20;
+    serial_port_t *p = port_get(com);
+    if (p == NULL)
+        return -ENODEV;
+
+    // The divisor latch is 16 bits wide.
+    if (baud == 0 || baud > SERIAL_BAUD_MAX ||
+        SERIAL_BAUD_MAX / baud > 0xFFFF)
+        return -EINVAL;
+    uint16_t divisor = (uint16_t)(SERIAL_BAUD_MAX / baud);
+
+    uint64_t flags = save_interrupts();
+    spin_lock(p->lock);
+
+    io_outb(p->io + UART_IER, 0);
+    io_outb(p->io + UART_LCR, LCR_DLAB);
+    io_outb(p->io + UART_DLL, divisor & 0xFF);
+    io_outb(p->io + UART_DLH, divisor >> 8);
+    io_outb(p->io + UART_LCR, LCR_8N1);
+    io_outb(p->io + UART_FCR, FCR_ENABLE_14);
+    io_outb(p->io + UART_MCR, MCR_DTR_RTS_OUT2);
+    if (p->irq)
+        io_outb(p->io + UART_IER, IER_RX | IER_THRE | IER_LINE);
+
+    // Clearing the FIFO may have discarded bytes; restart transmission
+    // from the ring.
+    tx_fill(p);
+
+    spin_unlock(p->lock);
+    restore_interrupts(flags);
+    return 0;
 }
 
-void serial_write_com(int com, unsigned char data)
+void
+serial_init(void)
 {
-	uint16_t port;
-	switch (com) {
-		case 1:
-			port = COM1_PORT;
-			break;
-		case 2:
-			port = COM2_PORT;
-			break;
-		// TODO: COM3 and COM4
-		default:
-			return;
-	}
+    if (initialized)
+        return;
+    initialized = true;
 
-	while (serial_transmit_empty(port) == 0)
-		pause();
+    for (int i = 0; i < arrsize(ports); i++) {
+        serial_port_t *p = &ports[i];
+        p->present = probe(p->io);
+        if (!p->present)
+            continue;
+        p->irq = true;
+        serial_configure(i + 1, SERIAL_BAUD_DEFAULT);
+    }
 
-	io_outb(port, data);
+    isr_set(TRAP_IRQ_COM1, isr_com1);
+    isr_set(TRAP_IRQ_COM2, isr_com2);
+    if (ports[0].present)
+        irq_enable(IRQ_COM1);
+    if (ports[1].present)
+        irq_enable(IRQ_COM2);
+
+    // Print a small separator so we can see output clearly
+    static const char msg[] = "-----------------------------------\r\n";
+    serial_write(COM1, msg, sizeof(msg) - 1);
 }
 
-#endif
+// Queue bytes on a locked port. `flags' are the caller's saved interrupt
+// flags.
+static size_t
+tx_queue(serial_port_t *p, const void *buf, size_t len, uint64_t flags)
+{
+    const uint8_t *src  = (const uint8_t *)buf;
+    size_t         done = 0;
+
+    for (;;) {
+        uint32_t room = SERIAL_TX_RING - (p->tx_tail - p->tx_head);
+        size_t   n    = min(len - done, (size_t)room);
+        for (size_t i = 0; i < n; i++)
+            p->tx[p->tx_tail++ & (SERIAL_TX_RING - 1)] = src[done + i];
+        done += n;
+
+        // Start the transmitter if it's idle; after that, the THR-empty
+        // interrupt keeps it fed.
+        tx_fill(p);
+        if (done == len)
+            break;
+
+        // The ring is full. With interrupts off nothing else will drain
+        // it, so wait for the FIFO here rather than lose the output.
+        if (p->irq && (flags & CPU_EFLAGS_INTERRUPT)) {
+            p->tx_dropped += len - done;
+            break;
+        }
+        while (!(io_inb(p->io + UART_LSR) & LSR_THRE))
+            __builtin_ia32_pause();
+    }
+    return done;
+}
+
+size_t
+serial_write(int com, const void *buf, size_t len)
+{
+    serial_port_t *p = port_get(com);
+    if (p == NULL)
+        return 0;
+
+    uint64_t flags = save_interrupts();
+    spin_lock(p->lock);
+    size_t done = tx_queue(p, buf, len, flags);
+    spin_unlock(p->lock);
+    restore_interrupts(flags);
+    return done;
+}
+
+/// A locked port receiving formatted output.
+struct sink
+{
+    serial_port_t *port;
+    uint64_t       flags;        ///< The caller's saved interrupt flags.
+};
+
+// Queue a piece of formatted output. Serial terminals need a carriage
+// return before each line feed.
+static void
+serial_sink(void *arg, const char *buf, size_t n)
+{
+    struct sink *sink  = (struct sink *)arg;
+    size_t       start = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (buf[i] == '\n') {
+            tx_queue(sink->port, buf + start, i - start, sink->flags);
+            tx_queue(sink->port, "\r\n", 2, sink->flags);
+            start = i + 1;
+        }
+    }
+    tx_queue(sink->port, buf + start, n - start, sink->flags);
+}
+
+int
+serial_vprintf(int com, const char *format, va_list args)
+{
+    serial_port_t *p = port_get(com);
+    if (p == NULL)
+        return 0;
+
+    // The port stays locked while the output is formatted, so output from
+    // interrupt handlers can't land in the middle of it.
+    struct sink sink = { .port = p, .flags = save_interrupts() };
+    spin_lock(p->lock);
+    int result = vcbprintf(serial_sink, &sink, format, args);
+    spin_unlock(p->lock);
+    restore_interrupts(sink.flags);
+    return result;
+}
+
+int
+serial_printf(int com, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int result = serial_vprintf(com, format, args);
+    va_end(args);
+    return result;
+}
+
+void
+serial_write_com(int com, unsigned char data)
+{
+    serial_write(com, &data, 1);
+}
+
+void
+serial_flush(int com)
+{
+    serial_port_t *p = port_get(com);
+    if (p == NULL)
+        return;
+
+    uint64_t flags = save_interrupts();
+    spin_lock(p->lock);
+    for (;;) {
+        tx_fill(p);
+        if (p->tx_head == p->tx_tail &&
+            (io_inb(p->io + UART_LSR) & LSR_TEMT))
+            break;
+        __builtin_ia32_pause();
+    }
+    spin_unlock(p->lock);
+    restore_interrupts(flags);
+}
+
+size_t
+serial_read(int com, void *buf, size_t len)
+{
+    serial_port_t *p = port_get(com);
+    if (p == NULL)
+        return 0;
+
+    uint8_t *dst   = (uint8_t *)buf;
+    size_t   n     = 0;
+    uint64_t flags = save_interrupts();
+    spin_lock(p->lock);
+
+    // Pick up anything the receive interrupt hasn't delivered yet.
+    rx_drain(p);
+    while (n < len && p->rx_head != p->rx_tail)
+        dst[n++] = p->rx[p->rx_head++ & (SERIAL_RX_RING - 1)];
+
+    spin_unlock(p->lock);
+    restore_interrupts(flags);
+    return n;
+}
+
+// Queue a log message as one line stamped with the time and level.
+static void
+serial_log(loglevel_t level, const char *msg)
+{
+    static const char tags[] = "CEWIDD";
+
+    uint32_t rate = timer_rate();
+    uint64_t ms   = rate ? timer_ticks() * 1000 / rate : 0;
+
+    serial_printf(log_com, "[%5lu.%03u] %c %s\n",
+                  ms / 1000, (unsigned)(ms % 1000), tags[level], msg);
+}
+
+void
+serial_log_init(int com, loglevel_t maxlevel)
+{
+    if (port_get(com) == NULL || log_com != 0)
+        return;
+
+    log_com = com;
+    log_replay(maxlevel, serial_log);
+    log_addcallback(maxlevel, serial_log);
+}
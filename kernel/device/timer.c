@@ -21,12 +21,29 @@
 #define MIN_FREQUENCY        19
 #define MAX_FREQUENCY        1193181
 
+// Callback registrations
+// 回调函数注册数量上限
+#define MAX_CALLBACKS        4
+
+// Interrupts since timer_init, and the rate they arrive at.
+// 自 timer_init 以来的中断次数及其频率
+static volatile uint64_t ticks;
+static uint32_t          tick_rate;
+
+// Functions called on every tick.
+// 每次定时器中断时调用的函数
+static timer_callback callbacks[MAX_CALLBACKS];
+static int            callbacks_size;
+
 static void
 isr_timer(const interrupt_context_t *context)
 {
     (void)context;
 
-    // Do nothing for now.
+    ticks++;
+
+    for (int i = 0; i < callbacks_size; i++)
+        callbacks[i]();
 
     // Send the end-of-interrupt signal.
     // 发送中断结束信号
@@ -48,6 +65,7 @@ timer_init(uint32_t frequency)
     // Compute the clock count value.
     // 计算时钟计数值
     uint16_t count = (uint16_t)(MAX_FREQUENCY / frequency);
+    tick_rate = MAX_FREQUENCY / count;
 
     // Channel=0, AccessMode=lo/hi, OperatingMode=rate-generator
     io_outb(TIMER_PORT_CMD, 0x34);
@@ -80,3 +98,22 @@ timer_disable()
     // 关闭定时器中断
     irq_disable(0);
 }
+
+void
+timer_addcallback(timer_callback cb)
+{
+    if (callbacks_size < MAX_CALLBACKS)
+        callbacks[callbacks_size++] = cb;
+}
+
+uint64_t
+timer_ticks()
+{
+    return ticks;
+}
+
+uint32_t
+timer_rate()
+{
+    return tick_rate;
+}
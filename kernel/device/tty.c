@@ -7,6 +7,7 @@
 #include <libc/stdio.h>
 #include <libc/string.h>
 #include <kernel/x86/cpu.h>
+#include <kernel/device/timer.h>
 #include <kernel/device/tty.h>
 
 // CRTC ports
@@ -27,21 +28,77 @@
 #define SCREEN_SIZE             (SCREEN_ROWS * SCREEN_COLS)
 #define SCREEN_BUFFER           0x000B8000
 
-/// Virtual console state.
+// Escape sequence parse states
+#define ESC_NONE                0   ///< Not in a sequence.
+#define ESC_START               1   ///< Seen \033.
+#define ESC_OPEN                2   ///< Seen \033[.
+#define ESC_CODE                3   ///< Seen \033[ and a color code.
+#define ESC_CSI                 4   ///< In a control sequence.
+#define ESC_BRACE               5   ///< Seen \033{.
+#define ESC_BRACE_CODE          6   ///< Seen \033{ and a color code.
+
+// Control sequence limits
+#define ESC_MAX_PARAMS          8
+#define ESC_MAX_PARAM           9999
+
+// Tab stops are every 8 columns.
+#define TAB_WIDTH               8
+
+// Dirty row mask covering the whole screen.
+#define DIRTY_ALL               ((1u << SCREEN_ROWS) - 1)
+
+/// Virtual console state. Consoles render into a ring of rows in normal
+/// memory holding the screen and the scrollback history above it, so
+/// scrolling just advances the ring index of the top screen row. Rows that
+/// change are marked dirty and copied to VGA memory in batches.
 struct tty
 {
     uint16_t    textcolor;       ///< Current fg/bg color (shifted).
     uint16_t    textcolor_orig;  ///< Original, non-override text color.
     screenpos_t pos;             ///< Current screen position.
-    uint8_t     ybuf;            ///< Virtual buffer y position.
-    uint16_t   *screen;          ///< Virtual screen buffer for 50 rows.
-    uint16_t   *tlcorner;        ///< Points to char in top-left corner.
+    int         top;             ///< Ring index of the top screen row.
+    int         history;         ///< Rows of scrollback above the screen.
+    int         back;            ///< Rows the view is scrolled back.
+    uint32_t    dirty;           ///< View rows changed since the last flush.
+    uint8_t     region_top;      ///< First row of the scroll region.
+    uint8_t     region_bottom;   ///< Last row of the scroll region.
+    bool        wrap;            ///< Last column written; wrap is pending.
+    bool        bold;            ///< Bright foreground colors selected.
+    bool        reverse;         ///< Foreground and background swapped.
+    bool        cursor_hidden;   ///< Cursor turned off.
+    screenpos_t saved_pos;       ///< Position saved by \033[s or \0337.
+    uint16_t    saved_color;     ///< Text color saved with it.
+    uint8_t     esc;             ///< Escape sequence parse state.
+    char        esc_code;        ///< Escape sequence's color code.
+    char        esc_private;     ///< Control sequence's private marker.
+    uint8_t     esc_nparams;     ///< Index of the current parameter.
+    uint16_t    esc_param[ESC_MAX_PARAMS]; ///< Control sequence parameters.
+    uint16_t    rows[TTY_HISTORY_ROWS][SCREEN_COLS]; ///< Row ring.
 };
 
 typedef struct tty tty_t;
 
 static tty_t  tty[MAX_TTYS];     ///< All virtual consoles.
 static tty_t *active_tty;        ///< The currently visible console.
+static uint64_t flush_tick;      ///< Timer tick of the last flush.
+static int      hw_cursor;       ///< Cursor offset last sent to the CRTC.
+
+static uint16_t *const vga = (uint16_t *)SCREEN_BUFFER;
+
+// ANSI color numbers 0-7 in VGA order.
+static const uint8_t ansi_color[8] = {
+    TEXTCOLOR_BLACK, TEXTCOLOR_RED,     TEXTCOLOR_GREEN, TEXTCOLOR_BROWN,
+    TEXTCOLOR_BLUE,  TEXTCOLOR_MAGENTA, TEXTCOLOR_CYAN,  TEXTCOLOR_LTGRAY,
+};
+
+// Return screen row y of a console, or with `back' rows of scrollback, the
+// row that many rows above it.
+static inline uint16_t *
+row(const tty_t *cons, int y, int back)
+{
+    return (uint16_t *)cons->rows[(cons->top + TTY_HISTORY_ROWS + y - back) %
+                                  TTY_HISTORY_ROWS];
+}
 
 static inline uint16_t
 color(textcolor_t fg, textcolor_t bg)
@@ -50,55 +107,114 @@ color(textcolor_t fg, textcolor_t bg)
 }
 
 static void
-update_buffer_offset()
+update_cursor()
 {
-    // Calculate top-left corner offset from the start of the first screen
-    // buffer.
-    int offset = (int)(active_tty->tlcorner - (uint16_t *)SCREEN_BUFFER);
+    // Reprogramming the CRTC takes several port writes, so skip it when the
+    // cursor hasn't moved. When the cursor's row is scrolled out of view,
+    // park it past the end of the screen to hide it.
+    int y      = active_tty->pos.y + active_tty->back;
+    int offset = y < SCREEN_ROWS && !active_tty->cursor_hidden
+                     ? y * SCREEN_COLS + active_tty->pos.x
+                     : SCREEN_SIZE;
+    if (offset == hw_cursor)
+        return;
+    hw_cursor = offset;
 
     uint8_t save = io_inb(CRTC_PORT_CMD);
 
-    io_outb(CRTC_PORT_CMD, CRTC_CMD_STARTADDR_LO);
+    io_outb(CRTC_PORT_CMD, CRTC_CMD_CURSORADDR_LO);
     io_outb(CRTC_PORT_DATA, (uint8_t)offset);
-    io_outb(CRTC_PORT_CMD, CRTC_CMD_STARTADDR_HI);
+    io_outb(CRTC_PORT_CMD, CRTC_CMD_CURSORADDR_HI);
     io_outb(CRTC_PORT_DATA, (uint8_t)(offset >> 8));
 
     io_outb(CRTC_PORT_CMD, save);
 }
 
+// Copy the active console's dirty rows to VGA memory and move the hardware
+// cursor. Called with interrupts disabled.
 static void
-update_cursor()
+flush()
 {
-    // Calculate cursor offset from the start of the first screen buffer.
-    int offset = active_tty->ybuf * SCREEN_COLS + active_tty->pos.x +
-                 (int)(active_tty->screen - (uint16_t *)SCREEN_BUFFER);
-
-    uint8_t save = io_inb(CRTC_PORT_CMD);
+    tty_t *cons = active_tty;
+    for (uint32_t dirty = cons->dirty; dirty != 0; dirty &= dirty - 1) {
+        int y = __builtin_ctz(dirty);
+        memcpy(vga + y * SCREEN_COLS, row(cons, y, cons->back),
+               SCREEN_COLS * sizeof(uint16_t));
+    }
+    cons->dirty = 0;
+    update_cursor();
+    flush_tick  = timer_ticks();
+}
 
-    io_outb(CRTC_PORT_CMD, CRTC_CMD_CURSORADDR_LO);
-    io_outb(CRTC_PORT_DATA, (uint8_t)offset);
-    io_outb(CRTC_PORT_CMD, CRTC_CMD_CURSORADDR_HI);
-    io_outb(CRTC_PORT_DATA, (uint8_t)(offset >> 8));
+// Finish a batch of updates to a console. The screen is refreshed at once
+// if it hasn't been refreshed during the current timer tick, so that
+// interactive output appears immediately; otherwise the batch is left for
+// the timer, which coalesces bursts of output into one refresh per tick.
+// With interrupts disabled the timer can't run, so refresh now.
+static void
+finish(tty_t *cons, uint64_t flags)
+{
+    if (cons == active_tty &&
+        (!(flags & CPU_EFLAGS_INTERRUPT) || timer_ticks() != flush_tick))
+        flush();
+    restore_interrupts(flags);
+}
 
-    io_outb(CRTC_PORT_CMD, save);
+static void
+tty_tick()
+{
+    if (active_tty->dirty != 0)
+        flush();
+    else
+        update_cursor();
 }
 
 void
 tty_init()
 {
-    uint16_t *screenptr = (uint16_t *)SCREEN_BUFFER;
-
     for (int id = 0; id < MAX_TTYS; id++) {
         tty[id].textcolor      = color(TEXTCOLOR_WHITE, TEXTCOLOR_BLACK);
         tty[id].textcolor_orig = tty[id].textcolor;
         tty[id].pos.x          = 0;
         tty[id].pos.y          = 0;
-        tty[id].ybuf           = 0;
-        tty[id].screen         = screenptr;
-        tty[id].tlcorner       = screenptr;
-        screenptr             += 0x1000; // each screen is 4K words.
+        tty[id].top            = 0;
+        tty[id].history        = 0;
+        tty[id].back           = 0;
+        tty[id].dirty          = 0;
+        tty[id].region_top     = 0;
+        tty[id].region_bottom  = SCREEN_ROWS - 1;
+        tty[id].wrap           = false;
+        tty[id].bold           = false;
+        tty[id].reverse        = false;
+        tty[id].cursor_hidden  = false;
+        tty[id].saved_pos      = tty[id].pos;
+        tty[id].saved_color    = tty[id].textcolor;
+        tty[id].esc            = ESC_NONE;
+        memsetw(tty[id].rows, tty[id].textcolor | ' ', SCREEN_SIZE);
     }
     active_tty = &tty[0];
+    hw_cursor  = -1;
+
+    // Keep whatever the boot loader left on the screen.
+    memcpy(tty[0].rows, vga, SCREEN_SIZE * sizeof(uint16_t));
+
+    // Consoles are drawn at the start of VGA memory.
+    uint8_t save = io_inb(CRTC_PORT_CMD);
+    io_outb(CRTC_PORT_CMD, CRTC_CMD_STARTADDR_LO);
+    io_outb(CRTC_PORT_DATA, 0);
+    io_outb(CRTC_PORT_CMD, CRTC_CMD_STARTADDR_HI);
+    io_outb(CRTC_PORT_DATA, 0);
+    io_outb(CRTC_PORT_CMD, save);
+
+    timer_addcallback(tty_tick);
+}
+
+void
+tty_flush()
+{
+    uint64_t flags = save_interrupts();
+    flush();
+    restore_interrupts(flags);
 }
 
 void
@@ -111,9 +227,11 @@ tty_activate(int id)
         return;
     }
 
-    active_tty = &tty[id];
-    update_buffer_offset();
-    update_cursor();
+    uint64_t flags = save_interrupts();
+    active_tty        = &tty[id];
+    active_tty->dirty = DIRTY_ALL;
+    flush();
+    restore_interrupts(flags);
 }
 
 void
@@ -169,23 +287,39 @@ tty_get_textcolor_bg(int id)
 }
 
 void
-tty_clear(int id)
+tty_scroll(int id, int rows)
 {
     if ((id < 0) || (id >= MAX_TTYS)) {
         id = 0;
     }
 
-    memsetw(tty[id].screen,
-            tty[id].textcolor | ' ', SCREEN_SIZE * 2);
-    tty[id].pos.x    = 0;
-    tty[id].pos.y    = 0;
-    tty[id].ybuf     = 0;
-    tty[id].tlcorner = tty[id].screen;
+    uint64_t flags = save_interrupts();
+    tty_t   *cons  = &tty[id];
+    int      back  = max(0, min(cons->back + rows, cons->history));
+    if (back != cons->back) {
+        cons->back  = back;
+        cons->dirty = DIRTY_ALL;
+    }
+    finish(cons, flags);
+}
 
-    if (active_tty == &tty[id]) {
-        update_buffer_offset();
-        update_cursor();
+void
+tty_clear(int id)
+{
+    if ((id < 0) || (id >= MAX_TTYS)) {
+        id = 0;
     }
+
+    // The scrollback history is kept.
+    uint64_t flags = save_interrupts();
+    for (int y = 0; y < SCREEN_ROWS; y++)
+        memsetw(row(&tty[id], y, 0), tty[id].textcolor | ' ', SCREEN_COLS);
+    tty[id].pos.x = 0;
+    tty[id].pos.y = 0;
+    tty[id].wrap  = false;
+    tty[id].back  = 0;
+    tty[id].dirty = DIRTY_ALL;
+    finish(&tty[id], flags);
 }
 
 void
@@ -195,12 +329,10 @@ tty_setpos(int id, screenpos_t pos)
         id = 0;
     }
 
-    int diff = (int)pos.y - (int)tty[id].pos.y;
+    uint64_t flags = save_interrupts();
     tty[id].pos  = pos;
-    tty[id].ybuf = (uint8_t)((int)tty[id].ybuf + diff);
-    if (active_tty == &tty[id]) {
-        update_cursor();
-    }
+    tty[id].wrap = false;
+    finish(&tty[id], flags);
 }
 
 void
@@ -212,6 +344,186 @@ tty_getpos(int id, screenpos_t *pos)
     *pos = tty[id].pos;
 }
 
+// Return the attribute for newly written text.
+static inline uint16_t
+attr(const tty_t *cons)
+{
+    uint16_t c = cons->textcolor;
+    return cons->reverse ? (uint16_t)((c & 0x0f00) << 4 | (c & 0xf000) >> 4)
+                         : c;
+}
+
+// Return a mask of the screen rows from top to bottom.
+static inline uint32_t
+rowmask(int top, int bottom)
+{
+    return ((2u << bottom) - 1) & ~((1u << top) - 1);
+}
+
+// Store a character cell. The row is marked dirty only if the cell
+// changes, so text rewritten unchanged costs no screen refresh.
+static inline void
+put(tty_t *cons, int x, int y, uint16_t value)
+{
+    uint16_t *cell = &row(cons, y, 0)[x];
+    if (*cell != value) {
+        *cell        = value;
+        cons->dirty |= 1u << y;
+    }
+}
+
+// Blank columns [x0, x1) of screen row y.
+static void
+erase(tty_t *cons, int y, int x0, int x1)
+{
+    uint16_t blank = cons->textcolor | ' ';
+    for (int x = x0; x < x1; x++)
+        put(cons, x, y, blank);
+}
+
+// Scroll rows top through bottom up by n rows, blanking the rows left at
+// the bottom. When the whole screen scrolls, the top of the screen just
+// advances through the ring, pushing the top rows into the history and
+// recycling the oldest history rows as the new bottom rows.
+static void
+scroll_up(tty_t *cons, int top, int bottom, int n)
+{
+    uint16_t blank = cons->textcolor | ' ';
+    n = min(n, bottom - top + 1);
+
+    if ((top == 0) && (bottom == SCREEN_ROWS - 1)) {
+        for (int i = 0; i < n; i++) {
+            cons->top = (cons->top + 1) % TTY_HISTORY_ROWS;
+            if (cons->history < TTY_HISTORY_ROWS - SCREEN_ROWS)
+                cons->history++;
+            memsetw(row(cons, SCREEN_ROWS - 1, 0), blank, SCREEN_COLS);
+        }
+        cons->dirty = DIRTY_ALL;
+        return;
+    }
+
+    for (int y = top; y + n <= bottom; y++)
+        memcpy(row(cons, y, 0), row(cons, y + n, 0),
+               SCREEN_COLS * sizeof(uint16_t));
+    for (int y = bottom - n + 1; y <= bottom; y++)
+        memsetw(row(cons, y, 0), blank, SCREEN_COLS);
+    cons->dirty |= rowmask(top, bottom);
+}
+
+// Scroll rows top through bottom down by n rows, blanking the rows left at
+// the top.
+static void
+scroll_down(tty_t *cons, int top, int bottom, int n)
+{
+    uint16_t blank = cons->textcolor | ' ';
+    n = min(n, bottom - top + 1);
+
+    for (int y = bottom; y - n >= top; y--)
+        memcpy(row(cons, y, 0), row(cons, y - n, 0),
+               SCREEN_COLS * sizeof(uint16_t));
+    for (int y = top; y < top + n; y++)
+        memsetw(row(cons, y, 0), blank, SCREEN_COLS);
+    cons->dirty |= rowmask(top, bottom);
+}
+
+// Move down a row, scrolling the scroll region if the cursor is on its
+// bottom row.
+static void
+linefeed(tty_t *cons)
+{
+    cons->wrap = false;
+    if (cons->pos.y == cons->region_bottom)
+        scroll_up(cons, cons->region_top, cons->region_bottom, 1);
+    else if (cons->pos.y < SCREEN_ROWS - 1)
+        cons->pos.y++;
+}
+
+// Move up a row, scrolling the scroll region if the cursor is on its top
+// row.
+static void
+reverse_linefeed(tty_t *cons)
+{
+    cons->wrap = false;
+    if (cons->pos.y == cons->region_top)
+        scroll_down(cons, cons->region_top, cons->region_bottom, 1);
+    else if (cons->pos.y > 0)
+        cons->pos.y--;
+}
+
+// Move the cursor, keeping it on the screen.
+static void
+move(tty_t *cons, int x, int y)
+{
+    cons->pos.x = (uint8_t)max(0, min(x, SCREEN_COLS - 1));
+    cons->pos.y = (uint8_t)max(0, min(y, SCREEN_ROWS - 1));
+    cons->wrap  = false;
+}
+
+static void
+save_cursor(tty_t *cons)
+{
+    cons->saved_pos   = cons->pos;
+    cons->saved_color = cons->textcolor;
+}
+
+static void
+restore_cursor(tty_t *cons)
+{
+    cons->textcolor = cons->saved_color;
+    move(cons, cons->saved_pos.x, cons->saved_pos.y);
+}
+
+static void
+tty_printchar(tty_t *cons, char ch)
+{
+    switch (ch)
+    {
+        // A newline does a carriage return + line feed.
+        case '\n':
+            cons->pos.x = 0;
+            linefeed(cons);
+            break;
+
+        case '\r':
+            cons->pos.x = 0;
+            cons->wrap  = false;
+            break;
+
+        case '\t':
+            move(cons, (cons->pos.x / TAB_WIDTH + 1) * TAB_WIDTH,
+                 cons->pos.y);
+            break;
+
+        // A backspace erases the character before the cursor, or the one
+        // under it when the last column was just written.
+        case '\b':
+            if (cons->wrap)
+                cons->wrap = false;
+            else if (cons->pos.x > 0)
+                --cons->pos.x;
+            else
+                break;
+            put(cons, cons->pos.x, cons->pos.y, cons->textcolor | ' ');
+            break;
+
+        default:
+            // Writing the last column of a row leaves the cursor there, and
+            // the line wraps when the next character arrives. This way the
+            // bottom right corner can be written without scrolling.
+            if (cons->wrap) {
+                cons->pos.x = 0;
+                linefeed(cons);
+            }
+            put(cons, cons->pos.x, cons->pos.y,
+                attr(cons) | (uint8_t)ch);
+            if (cons->pos.x == SCREEN_COLS - 1)
+                cons->wrap = true;
+            else
+                cons->pos.x++;
+            break;
+    }
+}
+
 static int
 colorcode(char x, int orig)
 {
@@ -234,107 +546,382 @@ colorcode(char x, int orig)
     }
 }
 
+static inline void
+set_fg(tty_t *cons, int fg)
+{
+    cons->textcolor = (cons->textcolor & 0xf000) | (uint16_t)(fg << 8);
+}
+
+static inline void
+set_bg(tty_t *cons, int bg)
+{
+    cons->textcolor = (cons->textcolor & 0x0f00) | (uint16_t)(bg << 12);
+}
+
+// Return control sequence parameter i, or def if it's missing or 0.
+static inline int
+param(const tty_t *cons, int i, int def)
+{
+    if ((i > cons->esc_nparams) || (cons->esc_param[i] == 0))
+        return def;
+    return cons->esc_param[i];
+}
+
+// Select graphic rendition (\033[...m).
 static void
-tty_printchar(tty_t *cons, const char **strptr)
-{
-    bool linefeed = false;
-
-    const char *str = *strptr;
-    char        ch  = *str;
-
-    // If the newline character is encountered, do a line feed + carriage
-    // return.
-    if (ch == '\n') {
-        cons->pos.x = 0;
-        linefeed    = true;
-    }
-    // Handle color codes, e.g. "\033[#]".
-    else if (ch == '\033') {
-        if ((str[1] == '[') && str[2] && (str[3] == ']')) {
-            int code = colorcode(str[2], (cons->textcolor_orig >> 8) & 0x0f);
-            if (code != -1) {
-                cons->textcolor = (cons->textcolor & 0xf000) |
-                                  (uint16_t)(code << 8);
-                *strptr += 3;
-            }
+sgr(tty_t *cons)
+{
+    int orig_fg = (cons->textcolor_orig >> 8) & 0x0f;
+    int orig_bg = (cons->textcolor_orig >> 12) & 0x0f;
+
+    for (int i = 0; i <= cons->esc_nparams; i++) {
+        int p = cons->esc_param[i];
+        if (p == 0) {
+            cons->textcolor = cons->textcolor_orig;
+            cons->bold      = false;
+            cons->reverse   = false;
+        }
+        else if (p == 1) {
+            cons->bold       = true;
+            cons->textcolor |= 0x0800;
+        }
+        else if (p == 22) {
+            cons->bold       = false;
+            cons->textcolor &= ~0x0800;
+        }
+        else if (p == 7 || p == 27) {
+            cons->reverse = (p == 7);
+        }
+        else if (p >= 30 && p <= 37) {
+            set_fg(cons, ansi_color[p - 30] | (cons->bold ? 8 : 0));
+        }
+        else if (p >= 40 && p <= 47) {
+            set_bg(cons, ansi_color[p - 40]);
         }
-        else if ((str[1] == '{') && str[2] && (str[3] == '}')) {
-            int code = colorcode(str[2], (cons->textcolor_orig >> 12));
-            if (code != -1) {
-                cons->textcolor = (cons->textcolor & 0x0f00) |
-                                  (uint16_t)(code << 12);
-                *strptr += 3;
+        else if (p >= 90 && p <= 97) {
+            set_fg(cons, ansi_color[p - 90] | 8);
+        }
+        else if (p >= 100 && p <= 107) {
+            set_bg(cons, ansi_color[p - 100] | 8);
+        }
+        else if (p == 39) {
+            set_fg(cons, orig_fg);
+        }
+        else if (p == 49) {
+            set_bg(cons, orig_bg);
+        }
+        else if ((p == 38 || p == 48) && (i + 1 <= cons->esc_nparams)) {
+            // Extended colors: 5;n selects from a palette, whose first 16
+            // entries are the ANSI colors, and 2;r;g;b a true color. Only
+            // the first 16 palette entries can be shown.
+            int kind = cons->esc_param[++i];
+            if ((kind == 5) && (i + 1 <= cons->esc_nparams)) {
+                int n = cons->esc_param[++i];
+                if (n < 16) {
+                    int c = ansi_color[n & 7] | (n & 8);
+                    if (p == 38)
+                        set_fg(cons, c);
+                    else
+                        set_bg(cons, c);
+                }
+            }
+            else if (kind == 2) {
+                i += 3;
             }
         }
-        return;
     }
-    else if (ch == '\b') {
-        if (cons->pos.x > 0) {
-            int offset = cons->ybuf * SCREEN_COLS + --cons->pos.x;
-            cons->screen[offset] = cons->textcolor | ' ';
+}
+
+// Carry out a control sequence, given its final character.
+static void
+csi_dispatch(tty_t *cons, char final)
+{
+    int x = cons->pos.x;
+    int y = cons->pos.y;
+    int n = param(cons, 0, 1);
+
+    // Of the private sequences, only cursor visibility is supported.
+    if (cons->esc_private) {
+        if ((cons->esc_private == '?') && (final == 'h' || final == 'l')) {
+            for (int i = 0; i <= cons->esc_nparams; i++)
+                if (cons->esc_param[i] == 25)
+                    cons->cursor_hidden = (final == 'l');
         }
+        return;
     }
-    else {
-        // Use the current foreground and background color.
-        uint16_t value = cons->textcolor | ch;
-
-        // Calculate the buffer offset using the virtual row.
-        int offset = cons->ybuf * SCREEN_COLS + cons->pos.x;
 
-        // Update the visible screen buffer.
-        cons->screen[offset] = value;
+    switch (final)
+    {
+        // Cursor movement
+        case 'A':
+            move(cons, x, y - n);
+            break;
+
+        case 'B':
+            move(cons, x, y + n);
+            break;
+
+        case 'C':
+            move(cons, x + n, y);
+            break;
+
+        case 'D':
+            move(cons, x - n, y);
+            break;
+
+        case 'E':
+            move(cons, 0, y + n);
+            break;
+
+        case 'F':
+            move(cons, 0, y - n);
+            break;
+
+        case 'G':
+            move(cons, n - 1, y);
+            break;
+
+        case 'd':
+            move(cons, x, n - 1);
+            break;
+
+        case 'H':
+        case 'f':
+            move(cons, param(cons, 1, 1) - 1, n - 1);
+            break;
+
+        // Erase in display: 0 = to end, 1 = to cursor, 2/3 = all.
+        case 'J':
+            switch (param(cons, 0, 0))
+            {
+                case 0:
+                    erase(cons, y, x, SCREEN_COLS);
+                    for (int i = y + 1; i < SCREEN_ROWS; i++)
+                        erase(cons, i, 0, SCREEN_COLS);
+                    break;
+
+                case 1:
+                    for (int i = 0; i < y; i++)
+                        erase(cons, i, 0, SCREEN_COLS);
+                    erase(cons, y, 0, x + 1);
+                    break;
+
+                default:
+                    for (int i = 0; i < SCREEN_ROWS; i++)
+                        erase(cons, i, 0, SCREEN_COLS);
+                    break;
+            }
+            break;
+
+        // Erase in line: 0 = to end, 1 = to cursor, 2 = all.
+        case 'K':
+            switch (param(cons, 0, 0))
+            {
+                case 0:
+                    erase(cons, y, x, SCREEN_COLS);
+                    break;
+
+                case 1:
+                    erase(cons, y, 0, x + 1);
+                    break;
+
+                default:
+                    erase(cons, y, 0, SCREEN_COLS);
+                    break;
+            }
+            break;
+
+        // Insert and delete lines within the scroll region.
+        case 'L':
+            if ((y >= cons->region_top) && (y <= cons->region_bottom))
+                scroll_down(cons, y, cons->region_bottom, n);
+            break;
+
+        case 'M':
+            if ((y >= cons->region_top) && (y <= cons->region_bottom))
+                scroll_up(cons, y, cons->region_bottom, n);
+            break;
+
+        // Scroll the scroll region.
+        case 'S':
+            scroll_up(cons, cons->region_top, cons->region_bottom, n);
+            break;
+
+        case 'T':
+            scroll_down(cons, cons->region_top, cons->region_bottom, n);
+            break;
+
+        // Set the scroll region and home the cursor.
+        case 'r':
+            {
+                int top    = param(cons, 0, 1) - 1;
+                int bottom = min(param(cons, 1, SCREEN_ROWS), SCREEN_ROWS) - 1;
+                if (top < bottom) {
+                    cons->region_top    = (uint8_t)top;
+                    cons->region_bottom = (uint8_t)bottom;
+                    move(cons, 0, 0);
+                }
+            }
+            break;
 
-        // If the right side of the screen was reached, we need a linefeed.
-        if (++cons->pos.x == SCREEN_COLS) {
-            cons->pos.x = 0;
-            linefeed    = true;
-        }
-    }
+        case 'm':
+            sgr(cons);
+            break;
 
-    // A linefeed causes a hardware scroll of one row. If we reach the end of
-    // the virtual buffer, wrap it back one screen.
-    if (linefeed) {
+        case 's':
+            save_cursor(cons);
+            break;
 
-        // Copy the last line of the screen to a virtual row one screen
-        // away. This way, when we reach the end of the virtual buffer,
-        // we'll have another shifted copy of the screen ready to display.
-        // This is better than copying the entire screen whenever we reach
-        // the end of the virtual buffer, because it amortizes the cost
-        // of copying.
-        memcpy(cons->screen + cons->ybuf * SCREEN_COLS - SCREEN_SIZE,
-               cons->screen + cons->ybuf * SCREEN_COLS,
-               SCREEN_COLS * sizeof(uint16_t));
+        case 'u':
+            restore_cursor(cons);
+            break;
 
-        // Increment row (on screen and in the virtual buffer).
-        ++cons->pos.y;
-        ++cons->ybuf;
+        default:
+            break;
+    }
+}
 
-        // If we're at the bottom of the screen, we need to scroll a line.
-        if (cons->pos.y == SCREEN_ROWS) {
+// Add a character to a control sequence. A character that can't be part
+// of one ends the sequence and is then handled as ordinary output.
+static void
+csi(tty_t *cons, char ch)
+{
+    if ((ch >= '0') && (ch <= '9')) {
+        uint16_t *p = &cons->esc_param[cons->esc_nparams];
+        *p = (uint16_t)min(*p * 10 + (ch - '0'), ESC_MAX_PARAM);
+    }
+    else if ((ch == ';') || (ch == ':')) {
+        if (cons->esc_nparams < ESC_MAX_PARAMS - 1)
+            cons->esc_nparams++;
+    }
+    else if ((ch >= '<') && (ch <= '?')) {
+        cons->esc_private = ch;
+    }
+    else if ((ch >= ' ') && (ch <= '/')) {
+        // Intermediate characters select sequences that aren't supported.
+        cons->esc_private = ch;
+    }
+    else if ((ch >= '@') && (ch <= '~')) {
+        cons->esc = ESC_NONE;
+        csi_dispatch(cons, ch);
+    }
+    else {
+        cons->esc = ESC_NONE;
+        tty_printchar(cons, ch);
+    }
+}
 
-            --cons->pos.y;
+// Print a character, carrying out ANSI escape sequences and the color codes
+// "\033[x]" and "\033{x}". The parse state is kept in the console, so a
+// sequence may be split across calls.
+static void
+tty_putc(tty_t *cons, char ch)
+{
+    // Output returns a scrolled-back view to the bottom.
+    if (cons->back != 0) {
+        cons->back  = 0;
+        cons->dirty = DIRTY_ALL;
+    }
 
-            // If we're at the end of the virtual buffer, we need to
-            // wrap back a screen.
-            if (cons->ybuf == SCREEN_ROWS * 2) {
-                cons->ybuf -= SCREEN_ROWS;
+    switch (cons->esc)
+    {
+        case ESC_NONE:
+            if (ch == '\033')
+                cons->esc = ESC_START;
+            else
+                tty_printchar(cons, ch);
+            return;
+
+        case ESC_START:
+            cons->esc = ESC_NONE;
+            switch (ch)
+            {
+                case '[':
+                    memzero(cons->esc_param, sizeof(cons->esc_param));
+                    cons->esc_nparams = 0;
+                    cons->esc_private = 0;
+                    cons->esc         = ESC_OPEN;
+                    return;
+
+                case '{':
+                    cons->esc = ESC_BRACE;
+                    return;
+
+                case '7':
+                    save_cursor(cons);
+                    return;
+
+                case '8':
+                    restore_cursor(cons);
+                    return;
+
+                case 'D':
+                    linefeed(cons);
+                    return;
+
+                case 'E':
+                    cons->pos.x = 0;
+                    linefeed(cons);
+                    return;
+
+                case 'M':
+                    reverse_linefeed(cons);
+                    return;
             }
 
-            // Clear the row at the bottom of the screen.
-            memsetw(cons->screen + cons->ybuf * SCREEN_COLS,
-                    cons->textcolor | ' ',
-                    SCREEN_COLS * sizeof(uint16_t));
-
-            // Adjust the offset of the top-left corner of the screen.
-            cons->tlcorner = cons->screen + (cons->ybuf + 1) * SCREEN_COLS -
-                             SCREEN_SIZE;
+            // Anything else ends the sequence: the \033 is dropped and the
+            // character is printed.
+            break;
 
-            // Do a hardware scroll if this console is currently active.
-            if (cons == active_tty) {
-                update_buffer_offset();
+        // A color code might also begin a control sequence, so wait for
+        // the closing bracket before deciding which it is.
+        case ESC_OPEN:
+            if (colorcode(ch, 0) != -1) {
+                cons->esc_code = ch;
+                cons->esc      = ESC_CODE;
             }
-        }
+            else {
+                cons->esc = ESC_CSI;
+                csi(cons, ch);
+            }
+            return;
+
+        case ESC_CODE:
+            if (ch == ']') {
+                cons->esc = ESC_NONE;
+                set_fg(cons, colorcode(cons->esc_code,
+                                       (cons->textcolor_orig >> 8) & 0x0f));
+                return;
+            }
+            cons->esc = ESC_CSI;
+            csi(cons, cons->esc_code);
+            break;
+
+        case ESC_CSI:
+            csi(cons, ch);
+            return;
+
+        case ESC_BRACE:
+            cons->esc_code = ch;
+            cons->esc      = ESC_BRACE_CODE;
+            return;
+
+        case ESC_BRACE_CODE:
+            cons->esc = ESC_NONE;
+            if (ch == '}') {
+                int code = colorcode(cons->esc_code,
+                                     (cons->textcolor_orig >> 12));
+                if (code != -1) {
+                    set_bg(cons, code);
+                    return;
+                }
+            }
+            tty_printchar(cons, '{');
+            tty_printchar(cons, cons->esc_code);
+            break;
     }
+
+    tty_putc(cons, ch);
 }
 
 void
@@ -343,12 +930,11 @@ tty_print(int id, const char *str)
     if ((id < 0) || (id >= MAX_TTYS))
         id = 0;
 
-    tty_t *cons = &tty[id];
+    tty_t   *cons  = &tty[id];
+    uint64_t flags = save_interrupts();
     for (; *str; ++str)
-        tty_printchar(cons, &str);
-
-    if (cons == active_tty)
-        update_cursor();
+        tty_putc(cons, *str);
+    finish(cons, flags);
 }
 
 void
@@ -357,13 +943,20 @@ tty_printc(int id, char ch)
     if ((id < 0) || (id >= MAX_TTYS))
         id = 0;
 
-    const char  str[2] = { ch, 0 };
-    const char *ptr    = str;
-    tty_t      *cons   = &tty[id];
-    tty_printchar(cons, &ptr);
+    tty_t   *cons  = &tty[id];
+    uint64_t flags = save_interrupts();
+    tty_putc(cons, ch);
+    finish(cons, flags);
+}
 
-    if (cons == active_tty)
-        update_cursor();
+// Sink for tty_printf: print each piece of formatted output as it's
+// produced, and refresh the screen once at the end.
+static void
+tty_sink(void *arg, const char *buf, size_t n)
+{
+    tty_t *cons = (tty_t *)arg;
+    for (size_t i = 0; i < n; i++)
+        tty_putc(cons, buf[i]);
 }
 
 int
@@ -372,13 +965,14 @@ tty_printf(int id, const char *format, ...)
     if ((id < 0) || (id >= MAX_TTYS))
         id = 0;
 
+    tty_t   *cons  = &tty[id];
+    uint64_t flags = save_interrupts();
+
     va_list args;
     va_start(args, format);
-    char buffer[8 * 1024];
-    int  result = vsnprintf(buffer, sizeof(buffer), format, args);
+    int result = vcbprintf(tty_sink, cons, format, args);
     va_end(args);
 
-    tty_print(id, buffer);
-
+    finish(cons, flags);
     return result;
 }
@@ -0,0 +1,706 @@
+//============================================================================
+/// @file       virtio.c
+/// @brief      Virtio 1.x PCI transport and virtqueues.
+//============================================================================
+
+#include <core.h>
+#include <libc/string.h>
+#include <kernel/debug/log.h>
+#include <kernel/device/virtio.h>
+#include <kernel/mem/paging.h>
+
+// Virtio PCI capability configuration types
+#define VIRTIO_PCI_CAP_COMMON   1
+#define VIRTIO_PCI_CAP_NOTIFY   2
+#define VIRTIO_PCI_CAP_ISR      3
+#define VIRTIO_PCI_CAP_DEVICE   4
+
+// Virtio PCI capability field offsets
+#define VIRTIO_CAP_TYPE         3
+#define VIRTIO_CAP_BAR          4
+#define VIRTIO_CAP_OFFSET       8
+#define VIRTIO_CAP_NOTIFY_MULT  16
+
+// Common configuration structure offsets
+#define COMMON_DFSELECT         0x00
+#define COMMON_DF               0x04
+#define COMMON_GFSELECT         0x08
+#define COMMON_GF               0x0c
+#define COMMON_MSIX             0x10
+#define COMMON_NUMQ             0x12
+#define COMMON_STATUS           0x14
+#define COMMON_CFGGENERATION    0x15
+#define COMMON_Q_SELECT         0x16
+#define COMMON_Q_SIZE           0x18
+#define COMMON_Q_MSIX           0x1a
+#define COMMON_Q_ENABLE         0x1c
+#define COMMON_Q_NOFF           0x1e
+#define COMMON_Q_DESCLO         0x20
+#define COMMON_Q_DESCHI         0x24
+#define COMMON_Q_AVAILLO        0x28
+#define COMMON_Q_AVAILHI        0x2c
+#define COMMON_Q_USEDLO         0x30
+#define COMMON_Q_USEDHI         0x34
+
+#define VIRTIO_MSI_NO_VECTOR    0xffff
+
+// Split virtqueue layout
+#define VRING_DESC_F_NEXT       (1 << 0)
+#define VRING_DESC_F_WRITE      (1 << 1)
+#define VRING_AVAIL_F_NO_INTERRUPT  (1 << 0)
+#define VRING_USED_F_NO_NOTIFY      (1 << 0)
+
+struct vring_desc
+{
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct vring_avail
+{
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];        // followed by used_event
+};
+
+struct vring_used_elem
+{
+    uint32_t id;
+    uint32_t len;
+};
+
+struct vring_used
+{
+    uint16_t               flags;
+    uint16_t               idx;
+    struct vring_used_elem ring[];  // followed by avail_event
+};
+
+// Packed virtqueue layout
+#define VRING_PACKED_F_AVAIL    (1 << 7)
+#define VRING_PACKED_F_USED     (1 << 15)
+#define VRING_EVENT_F_ENABLE    0
+#define VRING_EVENT_F_DISABLE   1
+#define VRING_EVENT_F_DESC      2
+#define VRING_EVENT_WRAP        (1 << 15)
+
+struct vring_packed_desc
+{
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+};
+
+struct vring_packed_event
+{
+    uint16_t off_wrap;
+    uint16_t flags;
+};
+
+// Memory barriers between ring updates and index/flag updates.
+#define mb()    atomic_thread_fence(memory_order_seq_cst)
+#define wmb()   atomic_thread_fence(memory_order_release)
+#define rmb()   atomic_thread_fence(memory_order_acquire)
+
+#define VQ_SPLIT_DESC(vq)   ((struct vring_desc *)(vq)->desc)
+#define VQ_AVAIL(vq)        ((volatile struct vring_avail *)(vq)->avail)
+#define VQ_USED(vq)         ((volatile struct vring_used *)(vq)->used)
+#define VQ_PACKED_DESC(vq)  ((volatile struct vring_packed_desc *)(vq)->desc)
+#define VQ_DRIVER_EVENT(vq) ((volatile struct vring_packed_event *)(vq)->avail)
+#define VQ_DEVICE_EVENT(vq) ((volatile struct vring_packed_event *)(vq)->used)
+
+//----------------------------------------------------------------------------
+// Transport helpers
+//----------------------------------------------------------------------------
+
+static inline uint8_t
+common_read8(const virtio_dev_t *vdev, uint32_t off)
+{
+    return *(volatile uint8_t *)(vdev->common + off);
+}
+
+static inline uint16_t
+common_read16(const virtio_dev_t *vdev, uint32_t off)
+{
+    return *(volatile uint16_t *)(vdev->common + off);
+}
+
+static inline uint32_t
+common_read32(const virtio_dev_t *vdev, uint32_t off)
+{
+    return *(volatile uint32_t *)(vdev->common + off);
+}
+
+static inline void
+common_write8(virtio_dev_t *vdev, uint32_t off, uint8_t value)
+{
+    *(volatile uint8_t *)(vdev->common + off) = value;
+}
+
+static inline void
+common_write16(virtio_dev_t *vdev, uint32_t off, uint16_t value)
+{
+    *(volatile uint16_t *)(vdev->common + off) = value;
+}
+
+static inline void
+common_write32(virtio_dev_t *vdev, uint32_t off, uint32_t value)
+{
+    *(volatile uint32_t *)(vdev->common + off) = value;
+}
+
+static inline void
+common_write64(virtio_dev_t *vdev, uint32_t off, uint64_t value)
+{
+    common_write32(vdev, off, (uint32_t)value);
+    common_write32(vdev, off + 4, (uint32_t)(value >> 32));
+}
+
+// Map the structure described by a virtio vendor capability.
+static volatile uint8_t *
+map_cap(const pcidev_t *pci, uint8_t cap)
+{
+    uint8_t  bar    = pci_config_read8(pci->bus, pci->device, pci->func,
+                                       cap + VIRTIO_CAP_BAR);
+    uint32_t offset = pci_config_read32(pci->bus, pci->device, pci->func,
+                                        cap + VIRTIO_CAP_OFFSET);
+
+    uint8_t *base = pci_map_bar(pci, bar);
+    if (base == NULL)
+        return NULL;
+    return base + offset;
+}
+
+static bool
+find_caps(virtio_dev_t *vdev)
+{
+    const pcidev_t *pci = vdev->pci;
+    for (int i = 0; i < pci->caps_count; i++) {
+        if (pci->caps[i].id != PCI_CAP_VENDOR)
+            continue;
+
+        uint8_t cap  = pci->caps[i].offset;
+        uint8_t type = pci_config_read8(pci->bus, pci->device, pci->func,
+                                        cap + VIRTIO_CAP_TYPE);
+
+        // Use the first capability of each type, as the spec recommends.
+        switch (type) {
+            case VIRTIO_PCI_CAP_COMMON:
+                if (vdev->common == NULL)
+                    vdev->common = map_cap(pci, cap);
+                break;
+            case VIRTIO_PCI_CAP_NOTIFY:
+                if (vdev->notify_base == NULL) {
+                    vdev->notify_base = map_cap(pci, cap);
+                    vdev->notify_mult = pci_config_read32(
+                        pci->bus, pci->device, pci->func,
+                        cap + VIRTIO_CAP_NOTIFY_MULT);
+                }
+                break;
+            case VIRTIO_PCI_CAP_ISR:
+                if (vdev->isr == NULL)
+                    vdev->isr = map_cap(pci, cap);
+                break;
+            case VIRTIO_PCI_CAP_DEVICE:
+                if (vdev->device == NULL)
+                    vdev->device = map_cap(pci, cap);
+                break;
+        }
+    }
+
+    return vdev->common != NULL && vdev->notify_base != NULL;
+}
+
+bool
+virtio_init(virtio_dev_t *vdev, pcidev_t *pci, uint64_t features)
+{
+    memzero(vdev, sizeof(*vdev));
+    vdev->pci = pci;
+
+    if (!find_caps(vdev)) {
+        logf(LOG_WARNING, "[virtio] %u/%u/%u has no modern interface.",
+             pci->bus, pci->device, pci->func);
+        return false;
+    }
+
+    pci_enable(pci, PCI_CMD_MEMORY | PCI_CMD_MASTER);
+
+    // Reset the device and wait for the reset to complete.
+    common_write8(vdev, COMMON_STATUS, 0);
+    while (common_read8(vdev, COMMON_STATUS) != 0)
+        ;
+
+    uint8_t status = VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER;
+    common_write8(vdev, COMMON_STATUS, status);
+
+    // Negotiate features.
+    common_write32(vdev, COMMON_DFSELECT, 0);
+    uint64_t offered = common_read32(vdev, COMMON_DF);
+    common_write32(vdev, COMMON_DFSELECT, 1);
+    offered |= (uint64_t)common_read32(vdev, COMMON_DF) << 32;
+
+    features |= VIRTIO_FEATURE(VIRTIO_F_VERSION_1) |
+                VIRTIO_FEATURE(VIRTIO_F_EVENT_IDX) |
+                VIRTIO_FEATURE(VIRTIO_F_RING_PACKED);
+    vdev->features = offered & features;
+    if (!virtio_has_feature(vdev, VIRTIO_F_VERSION_1))
+        goto fail;
+
+    common_write32(vdev, COMMON_GFSELECT, 0);
+    common_write32(vdev, COMMON_GF, (uint32_t)vdev->features);
+    common_write32(vdev, COMMON_GFSELECT, 1);
+    common_write32(vdev, COMMON_GF, (uint32_t)(vdev->features >> 32));
+
+    status |= VIRTIO_STATUS_FEATURES_OK;
+    common_write8(vdev, COMMON_STATUS, status);
+    if (!(common_read8(vdev, COMMON_STATUS) & VIRTIO_STATUS_FEATURES_OK))
+        goto fail;
+
+    // No configuration change interrupts.
+    common_write16(vdev, COMMON_MSIX, VIRTIO_MSI_NO_VECTOR);
+    return true;
+
+fail:
+    logf(LOG_WARNING, "[virtio] %u/%u/%u rejected features %#lx.",
+         pci->bus, pci->device, pci->func, vdev->features);
+    common_write8(vdev, COMMON_STATUS, status | VIRTIO_STATUS_FAILED);
+    return false;
+}
+
+int
+virtio_max_queues(const virtio_dev_t *vdev)
+{
+    return common_read16(vdev, COMMON_NUMQ);
+}
+
+bool
+virtio_alloc_vectors(virtio_dev_t *vdev, int nqueues)
+{
+    if (msi_alloc(vdev->pci, nqueues) <= 0)
+        return false;
+
+    // Modern virtio devices only signal through MSI-X (or INTx).
+    if (vdev->pci->msi_mode != PCI_MSI_MSIX) {
+        msi_free(vdev->pci);
+        return false;
+    }
+
+    vdev->msix = true;
+    return true;
+}
+
+static bool
+alloc_split(virtq_t *vq)
+{
+    // Descriptor table, driver area and device area each fit in one page.
+    uint8_t *mem = kpage_alloc(3);
+    if (mem == NULL)
+        return false;
+
+    vq->desc  = mem;
+    vq->avail = mem + PAGE_SIZE;
+    vq->used  = mem + 2 * PAGE_SIZE;
+
+    for (uint16_t i = 0; i < vq->size; i++)
+        vq->next[i] = (uint16_t)(i + 1);
+    vq->free_head = 0;
+    return true;
+}
+
+static bool
+alloc_packed(virtq_t *vq)
+{
+    // The descriptor ring takes one page; both event structures share the
+    // second.
+    uint8_t *mem = kpage_alloc(2);
+    if (mem == NULL)
+        return false;
+
+    vq->desc  = mem;
+    vq->avail = mem + PAGE_SIZE;
+    vq->used  = mem + PAGE_SIZE + 64;
+
+    // In a packed queue, next[] is a stack of free buffer IDs.
+    for (uint16_t i = 0; i < vq->size; i++)
+        vq->next[i] = (uint16_t)(i + 1);
+    vq->free_head  = 0;
+    vq->free_id    = 0;
+    vq->avail_wrap = true;
+    vq->used_wrap  = true;
+    return true;
+}
+
+virtq_t *
+virtio_setup_queue(virtio_dev_t *vdev, int index, msi_handler handler,
+                   void *data)
+{
+    if (index >= VIRTIO_MAX_QUEUES || index >= virtio_max_queues(vdev))
+        return NULL;
+
+    common_write16(vdev, COMMON_Q_SELECT, (uint16_t)index);
+    uint16_t size = common_read16(vdev, COMMON_Q_SIZE);
+    if (size == 0)
+        return NULL;
+    if (size > VIRTQ_MAX_SIZE) {
+        size = VIRTQ_MAX_SIZE;
+        common_write16(vdev, COMMON_Q_SIZE, size);
+    }
+
+    virtq_t *vq = &vdev->queue[index];
+    memzero(vq, sizeof(*vq));
+    vq->vdev      = vdev;
+    vq->index     = (uint16_t)index;
+    vq->size      = size;
+    vq->num_free  = size;
+    vq->packed    = virtio_has_feature(vdev, VIRTIO_F_RING_PACKED);
+    vq->event_idx = virtio_has_feature(vdev, VIRTIO_F_EVENT_IDX);
+
+    if (!(vq->packed ? alloc_packed(vq) : alloc_split(vq)))
+        return NULL;
+
+    // Bind the queue to its own MSI-X vector.
+    if (vdev->msix && msi_vector(vdev->pci, index) != 0) {
+        common_write16(vdev, COMMON_Q_MSIX, (uint16_t)index);
+        if (common_read16(vdev, COMMON_Q_MSIX) == (uint16_t)index) {
+            msi_set_handler(vdev->pci, index, handler, data);
+            msi_mask(vdev->pci, index, false);
+        }
+    }
+    else {
+        common_write16(vdev, COMMON_Q_MSIX, VIRTIO_MSI_NO_VECTOR);
+    }
+
+    common_write64(vdev, COMMON_Q_DESCLO, (uint64_t)vq->desc);
+    common_write64(vdev, COMMON_Q_AVAILLO, (uint64_t)vq->avail);
+    common_write64(vdev, COMMON_Q_USEDLO, (uint64_t)vq->used);
+
+    uint16_t off = common_read16(vdev, COMMON_Q_NOFF);
+    vq->notify = (volatile uint16_t *)(vdev->notify_base +
+                                       off * vdev->notify_mult);
+
+    common_write16(vdev, COMMON_Q_ENABLE, 1);
+
+    if (index >= vdev->num_queues)
+        vdev->num_queues = index + 1;
+    return vq;
+}
+
+void
+virtio_ready(virtio_dev_t *vdev)
+{
+    uint8_t status = common_read8(vdev, COMMON_STATUS);
+    common_write8(vdev, COMMON_STATUS, status | VIRTIO_STATUS_DRIVER_OK);
+}
+
+bool
+virtio_has_feature(const virtio_dev_t *vdev, int bit)
+{
+    return (vdev->features & VIRTIO_FEATURE(bit)) != 0;
+}
+
+uint8_t
+virtio_config_read8(const virtio_dev_t *vdev, uint32_t offset)
+{
+    return *(volatile uint8_t *)(vdev->device + offset);
+}
+
+uint16_t
+virtio_config_read16(const virtio_dev_t *vdev, uint32_t offset)
+{
+    return *(volatile uint16_t *)(vdev->device + offset);
+}
+
+uint32_t
+virtio_config_read32(const virtio_dev_t *vdev, uint32_t offset)
+{
+    return *(volatile uint32_t *)(vdev->device + offset);
+}
+
+uint64_t
+virtio_config_read64(const virtio_dev_t *vdev, uint32_t offset)
+{
+    // 64-bit fields may change between the two halves; retry until the
+    // configuration generation is stable.
+    uint64_t value;
+    uint8_t  gen;
+    do {
+        gen   = common_read8(vdev, COMMON_CFGGENERATION);
+        value = virtio_config_read32(vdev, offset) |
+                (uint64_t)virtio_config_read32(vdev, offset + 4) << 32;
+    } while (gen != common_read8(vdev, COMMON_CFGGENERATION));
+    return value;
+}
+
+//----------------------------------------------------------------------------
+// Virtqueues
+//----------------------------------------------------------------------------
+
+// Return true if the device asked to be notified when the ring index moves
+// from old to new_idx, given its event index.
+static inline bool
+need_event(uint16_t event, uint16_t new_idx, uint16_t old)
+{
+    return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old);
+}
+
+static bool
+add_split(virtq_t *vq, const virtq_buf_t *bufs, int out, int in,
+          void *cookie)
+{
+    struct vring_desc *desc = VQ_SPLIT_DESC(vq);
+    int                n    = out + in;
+
+    uint16_t head = vq->free_head;
+    uint16_t i    = head;
+    for (int k = 0; k < n; k++) {
+        desc[i].addr  = (uint64_t)bufs[k].addr;
+        desc[i].len   = bufs[k].len;
+        desc[i].flags = (k >= out ? VRING_DESC_F_WRITE : 0) |
+                        (k < n - 1 ? VRING_DESC_F_NEXT : 0);
+        desc[i].next  = vq->next[i];
+        i = vq->next[i];
+    }
+    vq->free_head = i;
+
+    vq->cookie[head] = cookie;
+    vq->chain[head]  = (uint16_t)n;
+
+    // The ring entry is written now, but the index that publishes it is
+    // only advanced by virtq_kick.
+    VQ_AVAIL(vq)->ring[vq->avail_idx & (vq->size - 1)] = head;
+    vq->avail_idx++;
+    return true;
+}
+
+static bool
+add_packed(virtq_t *vq, const virtq_buf_t *bufs, int out, int in,
+           void *cookie)
+{
+    volatile struct vring_packed_desc *desc = VQ_PACKED_DESC(vq);
+    int                                n    = out + in;
+
+    uint16_t id = vq->free_id;
+    vq->free_id = vq->next[id];
+
+    uint16_t head      = vq->free_head;
+    uint16_t head_flags = 0;
+    uint16_t slot      = head;
+    bool     wrap      = vq->avail_wrap;
+    for (int k = 0; k < n; k++) {
+        uint16_t flags = (k >= out ? VRING_DESC_F_WRITE : 0) |
+                         (k < n - 1 ? VRING_DESC_F_NEXT : 0);
+        flags |= wrap ? VRING_PACKED_F_AVAIL : VRING_PACKED_F_USED;
+
+        desc[slot].addr = (uint64_t)bufs[k].addr;
+        desc[slot].len  = bufs[k].len;
+        desc[slot].id   = id;
+        if (k == 0)
+            head_flags = flags;
+        else
+            desc[slot].flags = flags;
+
+        if (++slot == vq->size) {
+            slot = 0;
+            wrap = !wrap;
+        }
+    }
+    vq->free_head  = slot;
+    vq->avail_wrap = wrap;
+
+    vq->cookie[id] = cookie;
+    vq->chain[id]  = (uint16_t)n;
+
+    // Writing the head descriptor's flags makes the whole chain available.
+    wmb();
+    desc[head].flags = head_flags;
+    return true;
+}
+
+bool
+virtq_add(virtq_t *vq, const virtq_buf_t *bufs, int out, int in,
+          void *cookie)
+{
+    int n = out + in;
+    if (n == 0 || n > vq->num_free || cookie == NULL)
+        return false;
+
+    bool ok = vq->packed ? add_packed(vq, bufs, out, in, cookie)
+                         : add_split(vq, bufs, out, in, cookie);
+    if (ok) {
+        vq->num_free -= (uint16_t)n;
+        vq->pending  += (uint16_t)(vq->packed ? n : 1);
+    }
+    return ok;
+}
+
+void
+virtq_kick(virtq_t *vq)
+{
+    if (vq->pending == 0)
+        return;
+
+    bool notify;
+    if (vq->packed) {
+        mb();
+        volatile struct vring_packed_event *event = VQ_DEVICE_EVENT(vq);
+        uint16_t flags = event->flags;
+        if (flags == VRING_EVENT_F_DESC) {
+            uint16_t off_wrap = event->off_wrap;
+            uint16_t off      = off_wrap & ~VRING_EVENT_WRAP;
+            bool     wrap     = (off_wrap & VRING_EVENT_WRAP) != 0;
+            if (wrap != vq->avail_wrap)
+                off -= vq->size;
+            notify = need_event(off, vq->free_head,
+                                (uint16_t)(vq->free_head - vq->pending));
+        }
+        else {
+            notify = (flags != VRING_EVENT_F_DISABLE);
+        }
+    }
+    else {
+        // Publish the batch of chains with a single index update.
+        wmb();
+        VQ_AVAIL(vq)->idx = vq->avail_idx;
+        mb();
+        if (vq->event_idx) {
+            volatile uint16_t *avail_event =
+                (volatile uint16_t *)&VQ_USED(vq)->ring[vq->size];
+            notify = need_event(*avail_event, vq->avail_idx,
+                                (uint16_t)(vq->avail_idx - vq->pending));
+        }
+        else {
+            notify = !(VQ_USED(vq)->flags & VRING_USED_F_NO_NOTIFY);
+        }
+    }
+
+    vq->pending = 0;
+    if (notify)
+        *vq->notify = vq->index;
+}
+
+static void *
+get_split(virtq_t *vq, uint32_t *len)
+{
+    volatile struct vring_used *used = VQ_USED(vq);
+    if (vq->last_used == used->idx)
+        return NULL;
+    rmb();
+
+    volatile struct vring_used_elem *elem =
+        &used->ring[vq->last_used & (vq->size - 1)];
+    uint16_t id = (uint16_t)elem->id;
+    if (len != NULL)
+        *len = elem->len;
+    vq->last_used++;
+
+    // Return the chain to the free list.
+    uint16_t last = id;
+    for (uint16_t k = 1; k < vq->chain[id]; k++)
+        last = vq->next[last];
+    vq->next[last] = vq->free_head;
+    vq->free_head  = id;
+    vq->num_free  += vq->chain[id];
+
+    // Tell the device which completion should raise the next interrupt.
+    if (vq->event_idx && !vq->cb_disabled) {
+        volatile uint16_t *used_event =
+            (volatile uint16_t *)&VQ_AVAIL(vq)->ring[vq->size];
+        *used_event = vq->last_used;
+    }
+
+    void *cookie = vq->cookie[id];
+    vq->cookie[id] = NULL;
+    return cookie;
+}
+
+static inline bool
+packed_used(const virtq_t *vq, uint16_t slot, bool wrap)
+{
+    uint16_t flags = VQ_PACKED_DESC(vq)[slot].flags;
+    bool     avail = (flags & VRING_PACKED_F_AVAIL) != 0;
+    bool     used  = (flags & VRING_PACKED_F_USED) != 0;
+    return avail == used && used == wrap;
+}
+
+static void *
+get_packed(virtq_t *vq, uint32_t *len)
+{
+    if (!packed_used(vq, vq->last_used, vq->used_wrap))
+        return NULL;
+    rmb();
+
+    volatile struct vring_packed_desc *desc = &VQ_PACKED_DESC(vq)[vq->last_used];
+    uint16_t id = desc->id;
+    if (len != NULL)
+        *len = desc->len;
+
+    uint16_t n = vq->chain[id];
+    vq->last_used += n;
+    if (vq->last_used >= vq->size) {
+        vq->last_used -= vq->size;
+        vq->used_wrap  = !vq->used_wrap;
+    }
+    vq->num_free += n;
+
+    vq->next[id] = vq->free_id;
+    vq->free_id  = id;
+
+    if (vq->event_idx && !vq->cb_disabled) {
+        VQ_DRIVER_EVENT(vq)->off_wrap =
+            vq->last_used | (vq->used_wrap ? VRING_EVENT_WRAP : 0);
+    }
+
+    void *cookie = vq->cookie[id];
+    vq->cookie[id] = NULL;
+    return cookie;
+}
+
+void *
+virtq_get(virtq_t *vq, uint32_t *len)
+{
+    return vq->packed ? get_packed(vq, len) : get_split(vq, len);
+}
+
+void
+virtq_disable_cb(virtq_t *vq)
+{
+    vq->cb_disabled = true;
+    if (vq->packed)
+        VQ_DRIVER_EVENT(vq)->flags = VRING_EVENT_F_DISABLE;
+    else if (!vq->event_idx)
+        VQ_AVAIL(vq)->flags = VRING_AVAIL_F_NO_INTERRUPT;
+}
+
+bool
+virtq_enable_cb(virtq_t *vq)
+{
+    vq->cb_disabled = false;
+    if (vq->packed) {
+        volatile struct vring_packed_event *event = VQ_DRIVER_EVENT(vq);
+        if (vq->event_idx) {
+            event->off_wrap = vq->last_used |
+                              (vq->used_wrap ? VRING_EVENT_WRAP : 0);
+            wmb();
+            event->flags = VRING_EVENT_F_DESC;
+        }
+        else {
+            event->flags = VRING_EVENT_F_ENABLE;
+        }
+        mb();
+        return !packed_used(vq, vq->last_used, vq->used_wrap);
+    }
+
+    if (vq->event_idx) {
+        volatile uint16_t *used_event =
+            (volatile uint16_t *)&VQ_AVAIL(vq)->ring[vq->size];
+        *used_event = vq->last_used;
+    }
+    else {
+        VQ_AVAIL(vq)->flags = 0;
+    }
+    mb();
+    return vq->last_used == VQ_USED(vq)->idx;
+}
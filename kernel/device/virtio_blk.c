@@ -0,0 +1,347 @@
+//============================================================================
+/// @file       virtio_blk.c
+/// @brief      Virtio block device driver.
+//============================================================================
+
+#include <core.h>
+#include <libc/string.h>
+#include <kernel/block/blkdev.h>
+#include <kernel/debug/log.h>
+#include <kernel/device/virtio.h>
+#include <kernel/device/virtio_blk.h>
+#include <kernel/interrupt/lapic.h>
+#include <kernel/mem/paging.h>
+#include <kernel/x86/cpu.h>
+
+// Maximum number of virtio block devices.
+#define MAX_VBLK_DEVICES     4
+
+// In-flight requests per queue. Each takes three descriptors.
+#define VBLK_SLOTS           64
+
+// Default request size limit, in 512-byte sectors.
+#define VBLK_MAX_SECTORS     256
+
+// Feature bits
+#define VIRTIO_BLK_F_SIZE_MAX    1
+#define VIRTIO_BLK_F_SEG_MAX     2
+#define VIRTIO_BLK_F_BLK_SIZE    6
+#define VIRTIO_BLK_F_FLUSH       9
+#define VIRTIO_BLK_F_MQ          12
+
+// Device configuration offsets
+#define VBLK_CFG_CAPACITY    0
+#define VBLK_CFG_SIZE_MAX    8
+#define VBLK_CFG_SEG_MAX     12
+#define VBLK_CFG_BLK_SIZE    20
+#define VBLK_CFG_NUM_QUEUES  34
+
+// Request types
+#define VIRTIO_BLK_T_IN      0
+#define VIRTIO_BLK_T_OUT     1
+#define VIRTIO_BLK_T_FLUSH   4
+
+// Request status values
+#define VIRTIO_BLK_S_OK      0
+#define VIRTIO_BLK_S_IOERR   1
+#define VIRTIO_BLK_S_UNSUPP  2
+
+// Sector size used by virtio-blk request headers.
+#define VBLK_SECTOR_SIZE     512
+
+struct vblk_hdr
+{
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+};
+
+// Per-request DMA state: the header and status byte live in a page owned by
+// the queue, indexed by slot.
+struct vblk_slot
+{
+    blkreq_t *req;
+    int       next_free;
+};
+
+struct vblk_queue
+{
+    virtq_t          *vq;
+    struct vblk_hdr  *hdr;          ///< VBLK_SLOTS request headers
+    uint8_t          *status;       ///< VBLK_SLOTS status bytes
+    struct vblk_slot  slot[VBLK_SLOTS];
+    int               free_slot;
+};
+
+struct vblk
+{
+    virtio_dev_t      vdev;
+    blkdev_t          blk;
+    struct vblk_queue queue[MAX_BLK_QUEUES];
+};
+
+STATIC_ASSERT(VBLK_SLOTS * (sizeof(struct vblk_hdr) + 1) <= PAGE_SIZE,
+              "virtio-blk slot page overflow");
+
+static struct vblk vblks[MAX_VBLK_DEVICES];
+static int         vblk_count;
+
+static void
+complete(struct vblk_queue *q)
+{
+    // Collect finished requests under the queue lock, then run their
+    // callbacks after dropping it.
+    blkreq_t *done = NULL;
+
+    spin_lock(q->vq->lock);
+    do {
+        virtq_disable_cb(q->vq);
+
+        struct vblk_slot *slot;
+        while ((slot = virtq_get(q->vq, NULL)) != NULL) {
+            int       i   = (int)(slot - q->slot);
+            blkreq_t *req = slot->req;
+
+            switch (q->status[i]) {
+                case VIRTIO_BLK_S_OK:     req->status = BLK_STATUS_OK; break;
+                case VIRTIO_BLK_S_UNSUPP: req->status = BLK_STATUS_UNSUPP; break;
+                default:                  req->status = BLK_STATUS_ERROR; break;
+            }
+
+            slot->req       = NULL;
+            slot->next_free = q->free_slot;
+            q->free_slot    = i;
+
+            req->next = done;
+            done      = req;
+        }
+    } while (!virtq_enable_cb(q->vq));
+    spin_unlock(q->vq->lock);
+
+    while (done != NULL) {
+        blkreq_t *req = done;
+        done = req->next;
+        if (req->done != NULL)
+            req->done(req);
+    }
+}
+
+static void
+isr_queue(void *data)
+{
+    struct vblk_queue *q = (struct vblk_queue *)data;
+
+    uint64_t flags = save_interrupts();
+    complete(q);
+    restore_interrupts(flags);
+}
+
+static bool
+vblk_submit(blkdev_t *dev, int queue, blkreq_t *req)
+{
+    struct vblk       *vb = (struct vblk *)dev->drvdata;
+    struct vblk_queue *q  = &vb->queue[queue];
+
+    if (req->op == BLK_OP_FLUSH &&
+        !virtio_has_feature(&vb->vdev, VIRTIO_BLK_F_FLUSH)) {
+        // Without a volatile write cache there is nothing to flush.
+        req->status = BLK_STATUS_OK;
+        if (req->done != NULL)
+            req->done(req);
+        return true;
+    }
+
+    spin_lock(q->vq->lock);
+
+    int i = q->free_slot;
+    if (i < 0) {
+        spin_unlock(q->vq->lock);
+        return false;
+    }
+
+    struct vblk_hdr *hdr = &q->hdr[i];
+    hdr->reserved = 0;
+    hdr->sector   = req->sector;
+    switch (req->op) {
+        case BLK_OP_READ:  hdr->type = VIRTIO_BLK_T_IN;    break;
+        case BLK_OP_WRITE: hdr->type = VIRTIO_BLK_T_OUT;   break;
+        default:           hdr->type = VIRTIO_BLK_T_FLUSH; break;
+    }
+    q->status[i] = 0xff;
+
+    // Chain: header (out), data segments (out for writes, in for reads),
+    // status (in).
+    blkseg_t        single;
+    int             nsegs;
+    const blkseg_t *segs = blkreq_segs(dev, req, &single, &nsegs);
+
+    virtq_buf_t bufs[MAX_BLK_SEGS + 2];
+    int         n = 0;
+    bufs[n].addr = hdr;
+    bufs[n].len  = sizeof(*hdr);
+    n++;
+    for (int k = 0; k < nsegs && k < MAX_BLK_SEGS; k++, n++) {
+        bufs[n].addr = segs[k].addr;
+        bufs[n].len  = segs[k].len;
+    }
+    bufs[n].addr = &q->status[i];
+    bufs[n].len  = 1;
+    n++;
+
+    int out = (req->op == BLK_OP_WRITE) ? n - 1 : 1;
+    int in  = n - out;
+
+    bool ok = virtq_add(q->vq, bufs, out, in, &q->slot[i]);
+    if (ok) {
+        q->free_slot   = q->slot[i].next_free;
+        q->slot[i].req = req;
+    }
+
+    spin_unlock(q->vq->lock);
+    return ok;
+}
+
+static void
+vblk_kick(blkdev_t *dev, int queue)
+{
+    struct vblk       *vb = (struct vblk *)dev->drvdata;
+    struct vblk_queue *q  = &vb->queue[queue];
+
+    spin_lock(q->vq->lock);
+    virtq_kick(q->vq);
+    spin_unlock(q->vq->lock);
+}
+
+static void
+vblk_poll(blkdev_t *dev, int queue)
+{
+    struct vblk *vb = (struct vblk *)dev->drvdata;
+    complete(&vb->queue[queue]);
+}
+
+static const blkdev_ops_t vblk_ops =
+{
+    .submit = vblk_submit,
+    .kick   = vblk_kick,
+    .poll   = vblk_poll,
+};
+
+static bool
+setup_queue(struct vblk *vb, int index)
+{
+    struct vblk_queue *q = &vb->queue[index];
+
+    q->vq = virtio_setup_queue(&vb->vdev, index, isr_queue, q);
+    if (q->vq == NULL)
+        return false;
+
+    uint8_t *page = kpage_alloc(1);
+    if (page == NULL)
+        return false;
+    q->hdr    = (struct vblk_hdr *)page;
+    q->status = page + VBLK_SLOTS * sizeof(struct vblk_hdr);
+
+    for (int i = 0; i < VBLK_SLOTS; i++)
+        q->slot[i].next_free = (i + 1 < VBLK_SLOTS) ? i + 1 : -1;
+    q->free_slot = 0;
+    return true;
+}
+
+static bool
+probe(pcidev_t *pci)
+{
+    if (vblk_count == MAX_VBLK_DEVICES)
+        return false;
+
+    struct vblk  *vb   = &vblks[vblk_count];
+    virtio_dev_t *vdev = &vb->vdev;
+
+    uint64_t features = VIRTIO_FEATURE(VIRTIO_BLK_F_SIZE_MAX) |
+                        VIRTIO_FEATURE(VIRTIO_BLK_F_SEG_MAX) |
+                        VIRTIO_FEATURE(VIRTIO_BLK_F_BLK_SIZE) |
+                        VIRTIO_FEATURE(VIRTIO_BLK_F_FLUSH) |
+                        VIRTIO_FEATURE(VIRTIO_BLK_F_MQ);
+    if (!virtio_init(vdev, pci, features))
+        return false;
+
+    // One queue per CPU, limited by what the device offers.
+    int nq = 1;
+    if (virtio_has_feature(vdev, VIRTIO_BLK_F_MQ))
+        nq = virtio_config_read16(vdev, VBLK_CFG_NUM_QUEUES);
+    nq = min(nq, lapic_cpu_count());
+    nq = min(nq, MAX_BLK_QUEUES);
+    nq = min(nq, virtio_max_queues(vdev));
+    nq = max(nq, 1);
+
+    bool irq = virtio_alloc_vectors(vdev, nq);
+
+    int ready = 0;
+    while (ready < nq && setup_queue(vb, ready))
+        ready++;
+    if (ready == 0) {
+        logf(LOG_WARNING, "[vblk] %u/%u/%u: queue setup failed.",
+             pci->bus, pci->device, pci->func);
+        return false;
+    }
+
+    virtio_ready(vdev);
+
+    // The device may limit the number of data descriptors in a request
+    // and the size of each one.
+    int      max_segs     = MAX_BLK_SEGS;
+    uint32_t max_seg_size = 0;
+    if (virtio_has_feature(vdev, VIRTIO_BLK_F_SEG_MAX)) {
+        uint32_t seg_max = virtio_config_read32(vdev, VBLK_CFG_SEG_MAX);
+        if (seg_max > 0)
+            max_segs = (int)min(seg_max, (uint32_t)MAX_BLK_SEGS);
+    }
+    if (virtio_has_feature(vdev, VIRTIO_BLK_F_SIZE_MAX)) {
+        uint32_t size_max = virtio_config_read32(vdev, VBLK_CFG_SIZE_MAX);
+        if (size_max >= VBLK_SECTOR_SIZE)
+            max_seg_size = size_max;
+    }
+
+    // Virtio-blk addresses the disk in 512-byte sectors regardless of the
+    // device's logical block size.
+    blkdev_t *blk = &vb->blk;
+    blk->name[0]      = 'v';
+    blk->name[1]      = 'd';
+    blk->name[2]      = (char)('a' + vblk_count);
+    blk->name[3]      = 0;
+    blk->sector_size  = VBLK_SECTOR_SIZE;
+    blk->sectors      = virtio_config_read64(vdev, VBLK_CFG_CAPACITY);
+    blk->max_sectors  = VBLK_MAX_SECTORS;
+    blk->max_segs     = max_segs;
+    blk->max_seg_size = max_seg_size;
+    blk->nr_queues    = ready;
+    blk->ops          = &vblk_ops;
+    blk->drvdata      = vb;
+
+    pci->drvdata = vb;
+    vblk_count++;
+
+    logf(LOG_INFO, "[vblk] %s: %s ring, %s.", blk->name,
+         virtio_has_feature(vdev, VIRTIO_F_RING_PACKED) ? "packed" : "split",
+         irq ? "MSI-X" : "polled");
+    return blkdev_register(blk);
+}
+
+static const pciid_t vblk_ids[] =
+{
+    { VIRTIO_PCI_VENDOR, 0x1001, PCI_ANY, PCI_ANY },  // transitional
+    { VIRTIO_PCI_VENDOR, 0x1042, PCI_ANY, PCI_ANY },  // modern
+    { 0 }
+};
+
+static const pcidrv_t vblk_driver =
+{
+    .name  = "virtio-blk",
+    .ids   = vblk_ids,
+    .probe = probe,
+};
+
+void
+virtio_blk_init()
+{
+    pci_register_driver(&vblk_driver);
+}
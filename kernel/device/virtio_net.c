@@ -0,0 +1,579 @@
+//============================================================================
+/// @file       virtio_net.c
+/// @brief      Virtio network device driver.
+//============================================================================
+
+#include <core.h>
+#include <libc/string.h>
+#include <kernel/debug/log.h>
+#include <kernel/device/virtio.h>
+#include <kernel/device/virtio_net.h>
+#include <kernel/interrupt/lapic.h>
+#include <kernel/mem/paging.h>
+#include <kernel/net/netdev.h>
+#include <kernel/x86/cpu.h>
+
+// Maximum number of virtio network devices.
+#define MAX_VNET_DEVICES     2
+
+// Queue pairs are limited by the virtqueue table, which also needs room for
+// the control queue.
+#define VNET_MAX_PAIRS       min(MAX_NET_QUEUES, (VIRTIO_MAX_QUEUES - 1) / 2)
+
+// Receive buffers kept posted on each queue. They are taken from the
+// packet buffer pool, which is allocated at boot.
+#define VNET_RX_BUFS         128
+
+// Receive buffers are returned to the ring in batches of at least this many,
+// so the device is notified once per batch rather than once per packet.
+#define VNET_RX_REFILL       32
+
+// Received packets reaped from the ring before they are delivered.
+#define VNET_RX_BATCH        16
+
+// In-flight transmits per queue. Each takes one descriptor for the header
+// plus one per pbuf.
+#define VNET_TX_SLOTS        128
+
+// Feature bits
+#define VIRTIO_NET_F_CSUM        0
+#define VIRTIO_NET_F_GUEST_CSUM  1
+#define VIRTIO_NET_F_MAC         5
+#define VIRTIO_NET_F_HOST_TSO4   11
+#define VIRTIO_NET_F_STATUS      16
+#define VIRTIO_NET_F_CTRL_VQ     17
+#define VIRTIO_NET_F_MQ          22
+
+// Device configuration offsets
+#define VNET_CFG_MAC         0
+#define VNET_CFG_STATUS      6
+#define VNET_CFG_MAX_PAIRS   8
+
+// Configuration status bits
+#define VIRTIO_NET_S_LINK_UP 1
+
+// Header flags
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM  1
+#define VIRTIO_NET_HDR_F_DATA_VALID  2
+
+// Header segmentation types
+#define VIRTIO_NET_HDR_GSO_NONE      0
+#define VIRTIO_NET_HDR_GSO_TCPV4     1
+
+// Iterations to wait for a control queue command.
+#define VNET_CTRL_TIMEOUT    1000000
+
+// Control queue commands
+#define VIRTIO_NET_CTRL_MQ           4
+#define VIRTIO_NET_CTRL_MQ_PAIRS_SET 0
+#define VIRTIO_NET_OK                0
+
+struct vnet_hdr
+{
+    uint8_t  flags;
+    uint8_t  gso_type;
+    uint16_t hdr_len;
+    uint16_t gso_size;
+    uint16_t csum_start;
+    uint16_t csum_offset;
+    uint16_t num_buffers;
+};
+
+struct vnet_ctrl
+{
+    uint8_t  class;
+    uint8_t  cmd;
+    uint16_t pairs;
+    uint8_t  ack;
+};
+
+struct vnet_txslot
+{
+    pbuf_t *pb;
+    int     next_free;
+};
+
+struct vnet_queue
+{
+    struct vnet       *vn;
+    int                index;       ///< Queue pair number.
+    virtq_t           *rxq;
+    virtq_t           *txq;
+
+    int                rxbufs;      ///< Receive buffers to keep posted
+    int                rxposted;    ///< Receive buffers on the ring
+    napi_t             napi;        ///< Receive polling context
+
+    struct vnet_hdr   *txhdr;       ///< VNET_TX_SLOTS transmit headers
+    struct vnet_txslot txslot[VNET_TX_SLOTS];
+    int                free_slot;
+};
+
+struct vnet
+{
+    virtio_dev_t      vdev;
+    netdev_t          net;
+    struct vnet_queue queue[VNET_MAX_PAIRS];
+};
+
+STATIC_ASSERT(sizeof(struct vnet_hdr) == 12, "virtio-net header size");
+STATIC_ASSERT(VNET_TX_SLOTS * sizeof(struct vnet_hdr) <= PAGE_SIZE,
+              "virtio-net slot page overflow");
+STATIC_ASSERT(PBUF_SIZE >= sizeof(struct vnet_hdr) + ETH_HLEN + ETH_MTU,
+              "virtio-net receive buffer too small");
+
+static struct vnet vnets[MAX_VNET_DEVICES];
+static int         vnet_count;
+
+static void
+rx_refill(struct vnet_queue *q, bool force)
+{
+    // Called with the queue lock held. Post new buffers only once enough
+    // have been consumed, unless the ring is running dry.
+    int want = q->rxbufs - q->rxposted;
+    if (want == 0)
+        return;
+    if (!force && want < VNET_RX_REFILL && q->rxposted >= VNET_RX_REFILL)
+        return;
+
+    int added = 0;
+    while (q->rxposted < q->rxbufs) {
+        pbuf_t *pb = pbuf_alloc(0, 0);
+        if (pb == NULL)
+            break;
+        virtq_buf_t b = { pb->data, PBUF_SIZE };
+        if (!virtq_add(q->rxq, &b, 0, 1, pb)) {
+            pbuf_free(pb);
+            break;
+        }
+        q->rxposted++;
+        added++;
+    }
+    if (added > 0)
+        virtq_kick(q->rxq);
+}
+
+// Receive polling: deliver up to `budget' packets, then go back to
+// interrupts if the ring has drained.
+static int
+rx_poll(napi_t *napi, int budget)
+{
+    struct vnet_queue *q    = (struct vnet_queue *)
+        ((uint8_t *)napi - offsetof(struct vnet_queue, napi));
+    netdev_t          *dev  = &q->vn->net;
+    int                done = 0;
+
+    while (done < budget) {
+        pbuf_t  *pbs[VNET_RX_BATCH];
+        uint32_t lens[VNET_RX_BATCH];
+        int      max = min(VNET_RX_BATCH, budget - done);
+        int      n   = 0;
+
+        spin_lock(q->rxq->lock);
+        while (n < max && (pbs[n] = virtq_get(q->rxq, &lens[n])) != NULL) {
+            q->rxposted--;
+            n++;
+        }
+        if (n > 0)
+            rx_refill(q, false);
+        spin_unlock(q->rxq->lock);
+
+        if (n == 0)
+            break;
+        done += n;
+
+        // Hand the batch to the stack without the lock held; it may
+        // transmit in response.
+        for (int i = 0; i < n; i++) {
+            pbuf_t                *pb  = pbs[i];
+            const struct vnet_hdr *hdr = (const struct vnet_hdr *)pb->data;
+            if (lens[i] <= sizeof(*hdr) + ETH_HLEN) {
+                dev->stats[q->index].rx_dropped++;
+                pbuf_free(pb);
+                continue;
+            }
+
+            pb->len     = lens[i];
+            pb->tot_len = lens[i];
+            if (hdr->flags & VIRTIO_NET_HDR_F_DATA_VALID)
+                pb->flags |= PBUF_CSUM_VALID;
+            pbuf_pull(pb, sizeof(*hdr));
+
+            netdev_receive(dev, q->index, pb);
+        }
+    }
+
+    // Drained: re-enable the interrupt, unless packets slipped in while it
+    // was off, in which case keep polling.
+    if (done < budget) {
+        napi_complete(napi);
+
+        spin_lock(q->rxq->lock);
+        bool idle = virtq_enable_cb(q->rxq);
+        if (!idle)
+            virtq_disable_cb(q->rxq);
+        spin_unlock(q->rxq->lock);
+
+        if (!idle)
+            napi_schedule(napi);
+    }
+
+    // Send any replies as one burst.
+    netdev_flush();
+    return done;
+}
+
+// Switch a receive queue to polling mode.
+static void
+rx_schedule(struct vnet_queue *q)
+{
+    spin_lock(q->rxq->lock);
+    virtq_disable_cb(q->rxq);
+    spin_unlock(q->rxq->lock);
+
+    napi_schedule(&q->napi);
+}
+
+static void
+tx_complete(struct vnet_queue *q)
+{
+    // Collect finished transmits under the queue lock, then free them after
+    // dropping it.
+    pbuf_t *done = NULL;
+
+    spin_lock(q->txq->lock);
+    do {
+        virtq_disable_cb(q->txq);
+
+        struct vnet_txslot *slot;
+        while ((slot = virtq_get(q->txq, NULL)) != NULL) {
+            pbuf_t *pb = slot->pb;
+
+            slot->pb        = NULL;
+            slot->next_free = q->free_slot;
+            q->free_slot    = (int)(slot - q->txslot);
+
+            pb->nextpkt = done;
+            done        = pb;
+        }
+    } while (!virtq_enable_cb(q->txq));
+    spin_unlock(q->txq->lock);
+
+    while (done != NULL) {
+        pbuf_t *pb = done;
+        done = pb->nextpkt;
+        pbuf_free(pb);
+    }
+}
+
+static void
+isr_rx(void *data)
+{
+    struct vnet_queue *q = (struct vnet_queue *)data;
+
+    // Mask the queue and poll it with a budget. Whatever the budget does
+    // not cover is left to the idle loop, with the interrupt still off.
+    uint64_t flags = save_interrupts();
+    rx_schedule(q);
+    napi_run();
+    restore_interrupts(flags);
+}
+
+static void
+isr_tx(void *data)
+{
+    struct vnet_queue *q = (struct vnet_queue *)data;
+
+    uint64_t flags = save_interrupts();
+    tx_complete(q);
+    restore_interrupts(flags);
+}
+
+static bool
+vnet_xmit(netdev_t *dev, int queue, pbuf_t *pb)
+{
+    struct vnet       *vn = (struct vnet *)dev->drvdata;
+    struct vnet_queue *q  = &vn->queue[queue];
+
+    spin_lock(q->txq->lock);
+
+    int i = q->free_slot;
+    if (i < 0) {
+        spin_unlock(q->txq->lock);
+        return false;
+    }
+
+    struct vnet_hdr *hdr = &q->txhdr[i];
+    memzero(hdr, sizeof(*hdr));
+    if (pb->flags & PBUF_CSUM_PARTIAL) {
+        hdr->flags       = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr->csum_start  = pb->csum_start;
+        hdr->csum_offset = pb->csum_offset;
+    }
+    if (pb->flags & PBUF_GSO_TCPV4) {
+        hdr->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        hdr->hdr_len  = pb->hdr_len;
+        hdr->gso_size = pb->gso_size;
+    }
+
+    // Chain: header, then each pbuf of the packet, all device-readable.
+    virtq_buf_t bufs[MAX_NET_SEGS + 1];
+    int         n = 0;
+    bufs[n].addr = hdr;
+    bufs[n].len  = sizeof(*hdr);
+    n++;
+    for (const pbuf_t *p = pb; p != NULL; p = p->next) {
+        if (p->len == 0)
+            continue;
+        if (n == arrsize(bufs)) {
+            spin_unlock(q->txq->lock);
+            return false;
+        }
+        bufs[n].addr = p->data;
+        bufs[n].len  = p->len;
+        n++;
+    }
+
+    bool ok = virtq_add(q->txq, bufs, n, 0, &q->txslot[i]);
+    if (ok) {
+        q->free_slot     = q->txslot[i].next_free;
+        q->txslot[i].pb  = pb;
+        dev->stats[queue].tx_packets++;
+        dev->stats[queue].tx_bytes += pb->tot_len;
+    }
+
+    spin_unlock(q->txq->lock);
+    return ok;
+}
+
+static void
+vnet_kick(netdev_t *dev, int queue)
+{
+    struct vnet       *vn = (struct vnet *)dev->drvdata;
+    struct vnet_queue *q  = &vn->queue[queue];
+
+    spin_lock(q->txq->lock);
+    virtq_kick(q->txq);
+    spin_unlock(q->txq->lock);
+}
+
+static void
+vnet_poll(netdev_t *dev, int queue)
+{
+    struct vnet       *vn = (struct vnet *)dev->drvdata;
+    struct vnet_queue *q  = &vn->queue[queue];
+
+    tx_complete(q);
+    rx_schedule(q);
+}
+
+static const netdev_ops_t vnet_ops =
+{
+    .xmit = vnet_xmit,
+    .kick = vnet_kick,
+    .poll = vnet_poll,
+};
+
+static bool
+setup_pair(struct vnet *vn, int index)
+{
+    struct vnet_queue *q = &vn->queue[index];
+    q->vn    = vn;
+    q->index = index;
+
+    q->rxq = virtio_setup_queue(&vn->vdev, 2 * index, isr_rx, q);
+    q->txq = virtio_setup_queue(&vn->vdev, 2 * index + 1, isr_tx, q);
+    if (q->rxq == NULL || q->txq == NULL)
+        return false;
+
+    q->rxbufs     = min(VNET_RX_BUFS, (int)q->rxq->size);
+    q->rxposted   = 0;
+    q->napi.poll  = rx_poll;
+    q->napi.dev   = &vn->net;
+    q->napi.queue = index;
+    q->txhdr    = kpage_alloc(1);
+    if (q->txhdr == NULL)
+        return false;
+
+    for (int i = 0; i < VNET_TX_SLOTS; i++)
+        q->txslot[i].next_free = (i + 1 < VNET_TX_SLOTS) ? i + 1 : -1;
+    q->free_slot = 0;
+    return true;
+}
+
+static bool
+set_pairs(virtq_t *ctrl, int pairs)
+{
+    // The control queue is only used during probe, so the command is polled
+    // to completion.
+    struct vnet_ctrl *cmd = kpage_alloc(1);
+    if (cmd == NULL)
+        return false;
+
+    cmd->class = VIRTIO_NET_CTRL_MQ;
+    cmd->cmd   = VIRTIO_NET_CTRL_MQ_PAIRS_SET;
+    cmd->pairs = (uint16_t)pairs;
+    cmd->ack   = 0xff;
+
+    virtq_buf_t bufs[3] =
+    {
+        { &cmd->class, 2 },
+        { &cmd->pairs, 2 },
+        { &cmd->ack, 1 },
+    };
+
+    bool ok = false;
+    spin_lock(ctrl->lock);
+    if (virtq_add(ctrl, bufs, 2, 1, cmd)) {
+        virtq_kick(ctrl);
+        for (int i = 0; i < VNET_CTRL_TIMEOUT; i++) {
+            if (virtq_get(ctrl, NULL) != NULL) {
+                ok = (cmd->ack == VIRTIO_NET_OK);
+                break;
+            }
+        }
+    }
+    spin_unlock(ctrl->lock);
+
+    // A command the device never completed still owns its buffer.
+    if (ok)
+        kpage_free(cmd, 1);
+    return ok;
+}
+
+static bool
+probe(pcidev_t *pci)
+{
+    if (vnet_count == MAX_VNET_DEVICES)
+        return false;
+
+    struct vnet  *vn   = &vnets[vnet_count];
+    virtio_dev_t *vdev = &vn->vdev;
+
+    uint64_t features = VIRTIO_FEATURE(VIRTIO_NET_F_CSUM) |
+                        VIRTIO_FEATURE(VIRTIO_NET_F_GUEST_CSUM) |
+                        VIRTIO_FEATURE(VIRTIO_NET_F_MAC) |
+                        VIRTIO_FEATURE(VIRTIO_NET_F_HOST_TSO4) |
+                        VIRTIO_FEATURE(VIRTIO_NET_F_STATUS) |
+                        VIRTIO_FEATURE(VIRTIO_NET_F_CTRL_VQ) |
+                        VIRTIO_FEATURE(VIRTIO_NET_F_MQ);
+    if (!virtio_init(vdev, pci, features))
+        return false;
+
+    // One queue pair per CPU, limited by what the device offers. Extra
+    // pairs must be enabled through the control queue, which sits after
+    // the device's last pair.
+    int max_pairs = 1;
+    int ctrl_idx  = -1;
+    if (virtio_has_feature(vdev, VIRTIO_NET_F_CTRL_VQ)) {
+        if (virtio_has_feature(vdev, VIRTIO_NET_F_MQ))
+            max_pairs = virtio_config_read16(vdev, VNET_CFG_MAX_PAIRS);
+        max_pairs = max(max_pairs, 1);
+        if (2 * max_pairs < VIRTIO_MAX_QUEUES)
+            ctrl_idx = 2 * max_pairs;
+    }
+
+    int np = 1;
+    if (ctrl_idx >= 0) {
+        np = min(max_pairs, lapic_cpu_count());
+        np = min(np, VNET_MAX_PAIRS);
+        np = max(np, 1);
+    }
+
+    bool irq = virtio_alloc_vectors(vdev, 2 * np);
+
+    int ready = 0;
+    while (ready < np && setup_pair(vn, ready))
+        ready++;
+    if (ready == 0) {
+        logf(LOG_WARNING, "[vnet] %u/%u/%u: queue setup failed.",
+             pci->bus, pci->device, pci->func);
+        return false;
+    }
+
+    virtq_t *ctrl = NULL;
+    if (ctrl_idx >= 0)
+        ctrl = virtio_setup_queue(vdev, ctrl_idx, NULL, NULL);
+
+    virtio_ready(vdev);
+
+    if (ready > 1 && (ctrl == NULL || !set_pairs(ctrl, ready)))
+        ready = 1;
+
+    // Fill every receive ring before traffic can arrive.
+    for (int i = 0; i < ready; i++) {
+        struct vnet_queue *q = &vn->queue[i];
+        spin_lock(q->rxq->lock);
+        rx_refill(q, true);
+        spin_unlock(q->rxq->lock);
+    }
+
+    netdev_t *net = &vn->net;
+    net->name[0]   = 'e';
+    net->name[1]   = 't';
+    net->name[2]   = 'h';
+    net->name[3]   = (char)('0' + vnet_count);
+    net->name[4]   = 0;
+    net->mtu       = ETH_MTU;
+    net->nr_queues = ready;
+    net->ops       = &vnet_ops;
+    net->drvdata   = vn;
+
+    if (virtio_has_feature(vdev, VIRTIO_NET_F_MAC)) {
+        for (int i = 0; i < ETH_ALEN; i++)
+            net->mac[i] = virtio_config_read8(vdev, VNET_CFG_MAC + i);
+    }
+    else {
+        // Locally administered address in QEMU's default range.
+        static const uint8_t base[ETH_ALEN] = { 0x52, 0x54, 0, 0x12, 0x34 };
+        memcpy(net->mac, base, ETH_ALEN);
+        net->mac[5] = (uint8_t)(0x56 + vnet_count);
+    }
+
+    net->link_up = true;
+    if (virtio_has_feature(vdev, VIRTIO_NET_F_STATUS)) {
+        uint16_t status = virtio_config_read16(vdev, VNET_CFG_STATUS);
+        net->link_up = (status & VIRTIO_NET_S_LINK_UP) != 0;
+    }
+
+    if (virtio_has_feature(vdev, VIRTIO_NET_F_CSUM)) {
+        net->features |= NETDEV_F_TX_CSUM;
+        if (virtio_has_feature(vdev, VIRTIO_NET_F_HOST_TSO4)) {
+            net->features |= NETDEV_F_TSO;
+            net->gso_max   = 0xffff;
+        }
+    }
+    if (virtio_has_feature(vdev, VIRTIO_NET_F_GUEST_CSUM))
+        net->features |= NETDEV_F_RX_CSUM;
+
+    pci->drvdata = vn;
+    vnet_count++;
+
+    logf(LOG_INFO, "[vnet] %s: %s ring, %s, offloads:%s%s%s.", net->name,
+         virtio_has_feature(vdev, VIRTIO_F_RING_PACKED) ? "packed" : "split",
+         irq ? "MSI-X" : "polled",
+         (net->features & NETDEV_F_TX_CSUM) ? " tx-csum" : "",
+         (net->features & NETDEV_F_RX_CSUM) ? " rx-csum" : "",
+         (net->features & NETDEV_F_TSO) ? " tso" : "");
+    return netdev_register(net);
+}
+
+static const pciid_t vnet_ids[] =
+{
+    { VIRTIO_PCI_VENDOR, 0x1000, PCI_ANY, PCI_ANY },  // transitional
+    { VIRTIO_PCI_VENDOR, 0x1041, PCI_ANY, PCI_ANY },  // modern
+    { 0 }
+};
+
+static const pcidrv_t vnet_driver =
+{
+    .name  = "virtio-net",
+    .ids   = vnet_ids,
+    .probe = probe,
+};
+
+void
+virtio_net_init()
+{
+    pci_register_driver(&vnet_driver);
+}
@@ -0,0 +1,1389 @@
+//============================================================================
+/// @file       ext2.c
+/// @brief      Second extended filesystem.
+//============================================================================
+
+#include <core.h>
+#include <libc/string.h>
+#include <kernel/block/pcache.h>
+#include <kernel/debug/log.h>
+#include <kernel/errno.h>
+#include <kernel/fs/ext2.h>
+#include <kernel/fs/vfs.h>
+#include <kernel/mem/paging.h>
+#include <kernel/spinlock.h>
+
+#define EXT2_SUPER_OFFSET    1024
+#define EXT2_MAGIC           0xef53
+#define EXT2_ROOT_INO        2
+#define EXT2_MAX_BLOCK_SIZE  4096
+#define EXT2_MAX_INODE_SIZE  1024
+#define EXT2_MAX_FILE_SIZE   0xffffffffull
+
+// Block pointers in an inode
+#define EXT2_NDIR_BLOCKS     12
+#define EXT2_IND_BLOCK       12
+#define EXT2_DIND_BLOCK      13
+#define EXT2_TIND_BLOCK      14
+#define EXT2_N_BLOCKS        15
+
+// Revision 0 defaults
+#define EXT2_OLD_INODE_SIZE  128
+#define EXT2_OLD_FIRST_INO   11
+
+// Features this driver handles
+#define INCOMPAT_FILETYPE    0x0002
+#define RO_COMPAT_SPARSE     0x0001
+#define RO_COMPAT_LARGE_FILE 0x0002
+#define RO_COMPAT_SUPPORTED  (RO_COMPAT_SPARSE | RO_COMPAT_LARGE_FILE)
+
+// Inode mode bits
+#define EXT2_S_IFMT          0xf000
+#define EXT2_S_IFDIR         0x4000
+#define EXT2_S_IFREG         0x8000
+
+// Directory entry file types
+#define EXT2_FT_REG_FILE     1
+#define EXT2_FT_DIR          2
+
+// Slots in a directory index. It is dropped when more than 3/4 are used.
+#define DINDEX_SLOTS         511
+#define DINDEX_MAX_USED      (DINDEX_SLOTS * 3 / 4)
+#define DINDEX_EMPTY         0
+#define DINDEX_DELETED       0xffffffff
+
+struct ext2_super
+{
+    uint32_t inodes_count;
+    uint32_t blocks_count;
+    uint32_t r_blocks_count;
+    uint32_t free_blocks_count;
+    uint32_t free_inodes_count;
+    uint32_t first_data_block;
+    uint32_t log_block_size;
+    uint32_t log_frag_size;
+    uint32_t blocks_per_group;
+    uint32_t frags_per_group;
+    uint32_t inodes_per_group;
+    uint32_t mtime;
+    uint32_t wtime;
+    uint16_t mnt_count;
+    uint16_t max_mnt_count;
+    uint16_t magic;
+    uint16_t state;
+    uint16_t errors;
+    uint16_t minor_rev_level;
+    uint32_t lastcheck;
+    uint32_t checkinterval;
+    uint32_t creator_os;
+    uint32_t rev_level;
+    uint16_t def_resuid;
+    uint16_t def_resgid;
+    uint32_t first_ino;             // Revision 1 fields
+    uint16_t inode_size;
+    uint16_t block_group_nr;
+    uint32_t feature_compat;
+    uint32_t feature_incompat;
+    uint32_t feature_ro_compat;
+};
+
+struct ext2_group
+{
+    uint32_t block_bitmap;
+    uint32_t inode_bitmap;
+    uint32_t inode_table;
+    uint16_t free_blocks_count;
+    uint16_t free_inodes_count;
+    uint16_t used_dirs_count;
+    uint16_t pad;
+    uint32_t reserved[3];
+};
+
+struct ext2_inode
+{
+    uint16_t mode;
+    uint16_t uid;
+    uint32_t size;
+    uint32_t atime;
+    uint32_t ctime;
+    uint32_t mtime;
+    uint32_t dtime;
+    uint16_t gid;
+    uint16_t links_count;
+    uint32_t blocks;                // In 512-byte units
+    uint32_t flags;
+    uint32_t osd1;
+    uint32_t block[EXT2_N_BLOCKS];
+    uint32_t generation;
+    uint32_t file_acl;
+    uint32_t size_high;
+    uint32_t faddr;
+    uint8_t  osd2[12];
+};
+
+struct ext2_dirent
+{
+    uint32_t inode;
+    uint16_t rec_len;
+    uint8_t  name_len;
+    uint8_t  file_type;
+    char     name[];
+};
+
+STATIC_ASSERT(sizeof(struct ext2_group) == 32, "Bad ext2 group size");
+STATIC_ASSERT(sizeof(struct ext2_inode) == 128, "Bad ext2 inode size");
+
+// A hashed index of a directory's entries: name hash -> entry offset + 1.
+struct dindex
+{
+    uint32_t used;                  ///< Slots in use, including deleted
+    uint32_t pad;
+    struct
+    {
+        uint32_t hash;
+        uint32_t off;               ///< Entry offset + 1, or DINDEX_*
+    } slot[DINDEX_SLOTS];
+};
+
+STATIC_ASSERT(sizeof(struct dindex) <= PAGE_SIZE, "Directory index too big");
+
+// Per-inode data kept in inode_t::fsdata.
+struct einfo
+{
+    uint32_t       block[EXT2_N_BLOCKS];
+    uint32_t       blocks;          ///< i_blocks
+    uint32_t       goal;            ///< Block to try first when extending
+    uint16_t       mode;
+    bool           noindex;         ///< Too many entries for an index
+    struct dindex *index;           ///< Directory index, or NULL
+};
+
+STATIC_ASSERT(sizeof(struct einfo) <= INODE_FSDATA_SIZE, "einfo too big");
+
+// A mounted filesystem.
+struct ext2fs
+{
+    blkdev_t          *dev;
+    spin_lock_t        lock;
+    struct ext2_super  sb;          ///< Primary superblock (first fields)
+    struct ext2_group *gd;          ///< Group descriptor table
+    uint64_t           gd_offset;   ///< Device offset of the table
+    uint32_t           groups;
+    uint32_t           block_size;
+    uint32_t           inode_size;
+    uint32_t           first_ino;
+    bool               filetype;    ///< Entries carry a file type
+};
+
+static struct ext2fs mounts[MAX_MOUNTS];
+static int           mount_count;
+static uint8_t       zeros[EXT2_MAX_BLOCK_SIZE];
+
+static inline struct ext2fs *
+ext2fs(const inode_t *inode)
+{
+    return (struct ext2fs *)inode->sb->private;
+}
+
+static inline struct einfo *
+einfo(inode_t *inode)
+{
+    return (struct einfo *)inode->fsdata;
+}
+
+static inline uint32_t
+rec_size(int name_len)
+{
+    return align_up(8 + (uint32_t)name_len, 4);
+}
+
+static uint32_t
+name_hash(const char *name, int len)
+{
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; i++)
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    return h;
+}
+
+//----------------------------------------------------------------------------
+// Block I/O
+//----------------------------------------------------------------------------
+
+static int
+bread(struct ext2fs *fs, uint32_t block, uint32_t off, void *buf,
+      uint32_t len)
+{
+    uint64_t addr = (uint64_t)block * fs->block_size + off;
+    return pcache_read(fs->dev, addr, buf, len) == BLK_STATUS_OK ? 0 : -EIO;
+}
+
+static int
+bwrite(struct ext2fs *fs, uint32_t block, uint32_t off, const void *buf,
+       uint32_t len)
+{
+    uint64_t addr = (uint64_t)block * fs->block_size + off;
+    return pcache_write(fs->dev, addr, buf, len) == BLK_STATUS_OK ? 0 : -EIO;
+}
+
+// Write back a group descriptor and the superblock's free counts.
+static int
+sync_group(struct ext2fs *fs, uint32_t g)
+{
+    int err = pcache_write(fs->dev, fs->gd_offset + g * sizeof(*fs->gd),
+                           &fs->gd[g], sizeof(*fs->gd));
+    if (err == BLK_STATUS_OK)
+        err = pcache_write(fs->dev, EXT2_SUPER_OFFSET +
+                           offsetof(struct ext2_super, free_blocks_count),
+                           &fs->sb.free_blocks_count, 8);
+    return err == BLK_STATUS_OK ? 0 : -EIO;
+}
+
+//----------------------------------------------------------------------------
+// Bitmaps and allocation
+//----------------------------------------------------------------------------
+
+// Find a clear bit at or after `start' in a bitmap block and set it.
+// Returns the bit, or -1 if bits [start, nbits) are all set.
+static int64_t
+bitmap_alloc(struct ext2fs *fs, uint32_t block, uint32_t start,
+             uint32_t nbits)
+{
+    uint64_t addr = (uint64_t)block * fs->block_size;
+    cpage_t *page = pcache_get(fs->dev, addr / PAGE_SIZE);
+    if (page == NULL)
+        return -1;
+    const uint8_t *map = (const uint8_t *)page->data + (addr % PAGE_SIZE);
+
+    int64_t bit = -1;
+    for (uint32_t i = start; i < nbits; i++) {
+        // Skip full bytes quickly.
+        if ((i & 7) == 0 && map[i / 8] == 0xff && i + 8 <= nbits) {
+            i += 7;
+            continue;
+        }
+        if (!(map[i / 8] & (1 << (i & 7)))) {
+            bit = i;
+            break;
+        }
+    }
+
+    uint8_t byte = 0;
+    if (bit >= 0)
+        byte = map[bit / 8] | (uint8_t)(1 << (bit & 7));
+    pcache_put(page);
+
+    if (bit >= 0 && bwrite(fs, block, (uint32_t)bit / 8, &byte, 1) < 0)
+        return -1;
+    return bit;
+}
+
+static int
+bitmap_clear(struct ext2fs *fs, uint32_t block, uint32_t bit)
+{
+    uint8_t byte;
+    int     err = bread(fs, block, bit / 8, &byte, 1);
+    if (err == 0) {
+        byte &= (uint8_t)~(1 << (bit & 7));
+        err   = bwrite(fs, block, bit / 8, &byte, 1);
+    }
+    return err;
+}
+
+static inline uint32_t
+group_blocks(const struct ext2fs *fs, uint32_t g)
+{
+    uint32_t first = fs->sb.first_data_block + g * fs->sb.blocks_per_group;
+    return min(fs->sb.blocks_per_group, fs->sb.blocks_count - first);
+}
+
+// Allocate a block, trying `goal' first and then the rest of its group, so
+// that consecutive allocations for a file land next to each other. Returns
+// 0 if the disk is full.
+static uint32_t
+balloc(struct ext2fs *fs, uint32_t goal)
+{
+    const struct ext2_super *sb = &fs->sb;
+    if (sb->free_blocks_count == 0)
+        return 0;
+    if (goal < sb->first_data_block || goal >= sb->blocks_count)
+        goal = sb->first_data_block;
+
+    // The goal group is visited twice: from the goal onwards first, and
+    // from its start once every other group has been tried.
+    uint32_t g0 = (goal - sb->first_data_block) / sb->blocks_per_group;
+    for (uint32_t i = 0; i <= fs->groups; i++) {
+        uint32_t g = (g0 + i) % fs->groups;
+        if (fs->gd[g].free_blocks_count == 0)
+            continue;
+
+        uint32_t start = (i == 0)
+                         ? (goal - sb->first_data_block) %
+                           sb->blocks_per_group : 0;
+        int64_t  bit   = bitmap_alloc(fs, fs->gd[g].block_bitmap, start,
+                                      group_blocks(fs, g));
+        if (bit < 0)
+            continue;
+
+        fs->gd[g].free_blocks_count--;
+        fs->sb.free_blocks_count--;
+        if (sync_group(fs, g) < 0)
+            return 0;
+        return sb->first_data_block + g * sb->blocks_per_group +
+               (uint32_t)bit;
+    }
+    return 0;
+}
+
+static void
+bfree(struct ext2fs *fs, uint32_t block)
+{
+    uint32_t rel = block - fs->sb.first_data_block;
+    uint32_t g   = rel / fs->sb.blocks_per_group;
+    if (block < fs->sb.first_data_block || g >= fs->groups)
+        return;
+    if (bitmap_clear(fs, fs->gd[g].block_bitmap,
+                     rel % fs->sb.blocks_per_group) == 0) {
+        fs->gd[g].free_blocks_count++;
+        fs->sb.free_blocks_count++;
+        sync_group(fs, g);
+    }
+}
+
+// Allocate an inode. Directories go to the group with the most free blocks
+// so the tree spreads over the disk; files stay in their parent's group.
+// Returns 0 if no inode is free.
+static uint32_t
+ialloc(struct ext2fs *fs, uint32_t parent_group, bool dir)
+{
+    uint32_t first = parent_group;
+    if (dir) {
+        for (uint32_t g = 0; g < fs->groups; g++) {
+            if (fs->gd[g].free_inodes_count != 0 &&
+                fs->gd[g].free_blocks_count >
+                fs->gd[first].free_blocks_count)
+                first = g;
+        }
+    }
+
+    for (uint32_t i = 0; i < fs->groups; i++) {
+        uint32_t g = (first + i) % fs->groups;
+        if (fs->gd[g].free_inodes_count == 0)
+            continue;
+        int64_t bit = bitmap_alloc(fs, fs->gd[g].inode_bitmap, 0,
+                                   fs->sb.inodes_per_group);
+        if (bit < 0)
+            continue;
+
+        fs->gd[g].free_inodes_count--;
+        fs->sb.free_inodes_count--;
+        if (dir)
+            fs->gd[g].used_dirs_count++;
+        if (sync_group(fs, g) < 0)
+            return 0;
+        return g * fs->sb.inodes_per_group + (uint32_t)bit + 1;
+    }
+    return 0;
+}
+
+static void
+ifree(struct ext2fs *fs, uint32_t ino, bool dir)
+{
+    uint32_t g = (ino - 1) / fs->sb.inodes_per_group;
+    if (bitmap_clear(fs, fs->gd[g].inode_bitmap,
+                     (ino - 1) % fs->sb.inodes_per_group) == 0) {
+        fs->gd[g].free_inodes_count++;
+        fs->sb.free_inodes_count++;
+        if (dir)
+            fs->gd[g].used_dirs_count--;
+        sync_group(fs, g);
+    }
+}
+
+//----------------------------------------------------------------------------
+// Inodes
+//----------------------------------------------------------------------------
+
+static inline uint32_t
+inode_group(const struct ext2fs *fs, uint64_t ino)
+{
+    return (uint32_t)((ino - 1) / fs->sb.inodes_per_group);
+}
+
+static inline uint64_t
+inode_offset(const struct ext2fs *fs, uint64_t ino)
+{
+    uint32_t g = inode_group(fs, ino);
+    uint32_t i = (uint32_t)((ino - 1) % fs->sb.inodes_per_group);
+    return (uint64_t)fs->gd[g].inode_table * fs->block_size +
+           (uint64_t)i * fs->inode_size;
+}
+
+// Write an inode's VFS and einfo state back to its on-disk copy.
+static int
+inode_store(struct ext2fs *fs, inode_t *inode)
+{
+    struct einfo     *ei = einfo(inode);
+    struct ext2_inode raw;
+    uint64_t          off = inode_offset(fs, inode->ino);
+    if (pcache_read(fs->dev, off, &raw, sizeof(raw)) != BLK_STATUS_OK)
+        return -EIO;
+
+    raw.mode        = ei->mode;
+    raw.links_count = inode->nlink;
+    raw.size        = (uint32_t)inode->size;
+    raw.blocks      = ei->blocks;
+    memcpy(raw.block, ei->block, sizeof(raw.block));
+
+    return pcache_write(fs->dev, off, &raw, sizeof(raw)) == BLK_STATUS_OK
+           ? 0 : -EIO;
+}
+
+// Resolve the block pointer path for file block `lblock': the inode slot
+// it starts from and the index to follow at each indirect level. Returns
+// the number of indirect levels, or -1 if the block is out of range.
+static int
+block_path(const struct ext2fs *fs, uint32_t lblock, int *slot,
+           uint32_t idx[3])
+{
+    uint32_t per = fs->block_size / 4;
+    if (lblock < EXT2_NDIR_BLOCKS) {
+        *slot = (int)lblock;
+        return 0;
+    }
+    lblock -= EXT2_NDIR_BLOCKS;
+    if (lblock < per) {
+        *slot  = EXT2_IND_BLOCK;
+        idx[0] = lblock;
+        return 1;
+    }
+    lblock -= per;
+    if (lblock < per * per) {
+        *slot  = EXT2_DIND_BLOCK;
+        idx[0] = lblock / per;
+        idx[1] = lblock % per;
+        return 2;
+    }
+    lblock -= per * per;
+    if ((uint64_t)lblock < (uint64_t)per * per * per) {
+        *slot  = EXT2_TIND_BLOCK;
+        idx[0] = lblock / (per * per);
+        idx[1] = (lblock / per) % per;
+        idx[2] = lblock % per;
+        return 3;
+    }
+    return -1;
+}
+
+// Allocate a block for an inode near its goal and account for it.
+// Indirect blocks are zeroed. Returns 0 if the disk is full.
+static uint32_t
+inode_balloc(struct ext2fs *fs, inode_t *inode, bool indirect)
+{
+    struct einfo *ei   = einfo(inode);
+    uint32_t      goal = ei->goal;
+    if (goal == 0) {
+        // Start a new file in its inode's group.
+        goal = fs->sb.first_data_block +
+               inode_group(fs, inode->ino) * fs->sb.blocks_per_group;
+    }
+
+    uint32_t block = balloc(fs, goal);
+    if (block == 0)
+        return 0;
+    if (indirect && bwrite(fs, block, 0, zeros, fs->block_size) < 0) {
+        bfree(fs, block);
+        return 0;
+    }
+    ei->goal    = block + 1;
+    ei->blocks += fs->block_size / 512;
+    return block;
+}
+
+// Map file block `lblock' to a device block, returning 0 in `out' for a
+// hole. With `alloc' set, missing data and indirect blocks are allocated
+// and `fresh' reports whether the data block is new.
+static int
+bmap(struct ext2fs *fs, inode_t *inode, uint32_t lblock, bool alloc,
+     uint32_t *out, bool *fresh)
+{
+    struct einfo *ei = einfo(inode);
+    uint32_t      idx[3];
+    int           slot;
+    int           depth = block_path(fs, lblock, &slot, idx);
+    if (depth < 0)
+        return -EFBIG;
+    if (fresh != NULL)
+        *fresh = false;
+
+    uint32_t block = ei->block[slot];
+    if (block == 0) {
+        if (!alloc) {
+            *out = 0;
+            return 0;
+        }
+        if ((block = inode_balloc(fs, inode, depth > 0)) == 0)
+            return -ENOSPC;
+        ei->block[slot] = block;
+        if (depth == 0 && fresh != NULL)
+            *fresh = true;
+    }
+
+    for (int level = 0; level < depth; level++) {
+        uint32_t next;
+        int      err = bread(fs, block, idx[level] * 4, &next, 4);
+        if (err < 0)
+            return err;
+        if (next == 0) {
+            if (!alloc) {
+                *out = 0;
+                return 0;
+            }
+            bool leaf = (level == depth - 1);
+            if ((next = inode_balloc(fs, inode, !leaf)) == 0)
+                return -ENOSPC;
+            if ((err = bwrite(fs, block, idx[level] * 4, &next, 4)) < 0)
+                return err;
+            if (leaf && fresh != NULL)
+                *fresh = true;
+        }
+        block = next;
+    }
+    *out = block;
+    return 0;
+}
+
+// Free the tree of blocks below an indirect block, then the block itself.
+static void
+free_tree(struct ext2fs *fs, uint32_t block, int depth)
+{
+    if (depth > 0) {
+        uint32_t per = fs->block_size / 4;
+        for (uint32_t i = 0; i < per; i++) {
+            uint32_t child;
+            if (bread(fs, block, i * 4, &child, 4) == 0 && child != 0)
+                free_tree(fs, child, depth - 1);
+        }
+    }
+    bfree(fs, block);
+}
+
+// Release every block of an inode.
+static void
+truncate_all(struct ext2fs *fs, inode_t *inode)
+{
+    struct einfo *ei = einfo(inode);
+    for (int i = 0; i < EXT2_N_BLOCKS; i++) {
+        if (ei->block[i] == 0)
+            continue;
+        int depth = (i < EXT2_NDIR_BLOCKS) ? 0 : i - EXT2_NDIR_BLOCKS + 1;
+        free_tree(fs, ei->block[i], depth);
+        ei->block[i] = 0;
+    }
+    ei->blocks  = 0;
+    ei->goal    = 0;
+    inode->size = 0;
+}
+
+//----------------------------------------------------------------------------
+// Directories
+//----------------------------------------------------------------------------
+
+// A cursor over the entries of a directory. The cache page holding the
+// current block stays referenced until the cursor moves off it.
+struct dscan
+{
+    struct ext2fs  *fs;
+    inode_t        *dir;
+    uint64_t        pos;            ///< Offset of the next entry
+    uint32_t        lblock;         ///< File block of `data'
+    uint32_t        pblock;         ///< Device block of `data'
+    const uint8_t  *data;           ///< Current block, or NULL
+    cpage_t        *page;
+};
+
+static void
+dscan_init(struct dscan *s, struct ext2fs *fs, inode_t *dir, uint64_t pos)
+{
+    memzero(s, sizeof(*s));
+    s->fs  = fs;
+    s->dir = dir;
+    s->pos = pos;
+}
+
+static void
+dscan_done(struct dscan *s)
+{
+    if (s->page != NULL)
+        pcache_put(s->page);
+}
+
+// Return the next entry (including unused ones) and its offset in `off',
+// or NULL at the end of the directory or if it is damaged.
+static const struct ext2_dirent *
+dscan_next(struct dscan *s, uint64_t *off)
+{
+    uint32_t bs = s->fs->block_size;
+    while (s->pos < s->dir->size) {
+        uint32_t lblock = (uint32_t)(s->pos / bs);
+        uint32_t inblk  = (uint32_t)(s->pos % bs);
+        if (s->data == NULL || s->lblock != lblock) {
+            if (s->page != NULL)
+                pcache_put(s->page);
+            s->page = NULL;
+            s->data = NULL;
+
+            uint32_t pblock;
+            if (bmap(s->fs, s->dir, lblock, false, &pblock, NULL) < 0)
+                return NULL;
+            if (pblock == 0) {
+                s->pos = (uint64_t)(lblock + 1) * bs;   // Skip a hole
+                continue;
+            }
+            uint64_t addr = (uint64_t)pblock * bs;
+            if ((s->page = pcache_get(s->fs->dev, addr / PAGE_SIZE)) == NULL)
+                return NULL;
+            s->data   = (const uint8_t *)s->page->data + addr % PAGE_SIZE;
+            s->lblock = lblock;
+            s->pblock = pblock;
+        }
+
+        const struct ext2_dirent *d =
+            (const struct ext2_dirent *)(s->data + inblk);
+        if (inblk + 8 > bs || d->rec_len < 8 || (d->rec_len & 3) ||
+            inblk + d->rec_len > bs || 8u + d->name_len > d->rec_len)
+            return NULL;
+
+        *off    = s->pos;
+        s->pos += d->rec_len;
+        return d;
+    }
+    return NULL;
+}
+
+static inline bool
+dirent_is(const struct ext2_dirent *d, const char *name, int len)
+{
+    return d->inode != 0 && d->name_len == len &&
+           !memcmp(d->name, name, len);
+}
+
+static inline bool
+dirent_dots(const struct ext2_dirent *d)
+{
+    return dirent_is(d, ".", 1) || dirent_is(d, "..", 2);
+}
+
+static void
+dindex_drop(struct einfo *ei)
+{
+    if (ei->index != NULL)
+        kpage_free(ei->index, 1);
+    ei->index = NULL;
+}
+
+// Add an entry to a directory's index, dropping the index if it fills up.
+static void
+dindex_add(struct einfo *ei, const char *name, int len, uint64_t off)
+{
+    struct dindex *ix = ei->index;
+    if (ix == NULL)
+        return;
+    if (ix->used == DINDEX_MAX_USED) {
+        // The next lookup rebuilds it without the deleted slots, or gives
+        // up if the directory is too big.
+        dindex_drop(ei);
+        return;
+    }
+
+    uint32_t h = name_hash(name, len);
+    uint32_t i = h % DINDEX_SLOTS;
+    while (ix->slot[i].off != DINDEX_EMPTY)
+        i = (i + 1) % DINDEX_SLOTS;
+    ix->slot[i].hash = h;
+    ix->slot[i].off  = (uint32_t)off + 1;
+    ix->used++;
+}
+
+static void
+dindex_remove(struct einfo *ei, const char *name, int len, uint64_t off)
+{
+    struct dindex *ix = ei->index;
+    if (ix == NULL)
+        return;
+    uint32_t h = name_hash(name, len);
+    for (uint32_t i = h % DINDEX_SLOTS; ix->slot[i].off != DINDEX_EMPTY;
+         i = (i + 1) % DINDEX_SLOTS) {
+        if (ix->slot[i].off == (uint32_t)off + 1) {
+            ix->slot[i].off = DINDEX_DELETED;
+            return;
+        }
+    }
+}
+
+// Index every live entry of a directory.
+static void
+dindex_build(struct ext2fs *fs, inode_t *dir)
+{
+    struct einfo *ei = einfo(dir);
+    if ((ei->index = kpage_alloc(1)) == NULL)
+        return;
+    memzero(ei->index, sizeof(*ei->index));
+
+    struct dscan s;
+    dscan_init(&s, fs, dir, 0);
+    const struct ext2_dirent *d;
+    uint64_t                  off;
+    while ((d = dscan_next(&s, &off)) != NULL) {
+        if (d->inode == 0)
+            continue;
+        if (ei->index->used == DINDEX_MAX_USED) {
+            dindex_drop(ei);
+            ei->noindex = true;
+            break;
+        }
+        dindex_add(ei, d->name, d->name_len, off);
+    }
+    dscan_done(&s);
+}
+
+// Find `name' in a directory, returning its inode number and entry offset.
+static int
+dir_find(struct ext2fs *fs, inode_t *dir, const char *name, int len,
+         uint32_t *ino, uint64_t *entry)
+{
+    struct einfo *ei = einfo(dir);
+    if (ei->index == NULL && !ei->noindex)
+        dindex_build(fs, dir);
+
+    struct dscan s;
+    const struct ext2_dirent *d;
+    uint64_t off;
+
+    if (ei->index != NULL) {
+        // Only entries whose hash matches are read.
+        struct dindex *ix = ei->index;
+        uint32_t       h  = name_hash(name, len);
+        for (uint32_t i = h % DINDEX_SLOTS; ix->slot[i].off != DINDEX_EMPTY;
+             i = (i + 1) % DINDEX_SLOTS) {
+            if (ix->slot[i].off == DINDEX_DELETED || ix->slot[i].hash != h)
+                continue;
+            dscan_init(&s, fs, dir, ix->slot[i].off - 1);
+            d = dscan_next(&s, &off);
+            bool match = (d != NULL && dirent_is(d, name, len));
+            if (match) {
+                *ino   = d->inode;
+                *entry = off;
+            }
+            dscan_done(&s);
+            if (match)
+                return 0;
+        }
+        return -ENOENT;
+    }
+
+    int err = -ENOENT;
+    dscan_init(&s, fs, dir, 0);
+    while ((d = dscan_next(&s, &off)) != NULL) {
+        if (dirent_is(d, name, len)) {
+            *ino   = d->inode;
+            *entry = off;
+            err    = 0;
+            break;
+        }
+    }
+    dscan_done(&s);
+    return err;
+}
+
+// Add the entry `name' -> `ino' to a directory, reusing slack space in an
+// existing block or appending a new one.
+static int
+dir_add(struct ext2fs *fs, inode_t *dir, const char *name, int len,
+        uint32_t ino, int type)
+{
+    uint32_t need = rec_size(len);
+    uint8_t  buf[8 + NAME_MAX + 1 + 4];
+    struct ext2_dirent *e = (struct ext2_dirent *)buf;
+    memzero(buf, sizeof(buf));
+    e->inode     = ino;
+    e->name_len  = (uint8_t)len;
+    e->file_type = !fs->filetype ? 0 :
+                   (type == T_DIR) ? EXT2_FT_DIR : EXT2_FT_REG_FILE;
+    memcpy(e->name, name, len);
+
+    struct dscan s;
+    const struct ext2_dirent *d;
+    uint64_t off;
+    int      err = -ENOSPC;
+    dscan_init(&s, fs, dir, 0);
+    while ((d = dscan_next(&s, &off)) != NULL) {
+        uint32_t used = d->inode ? rec_size(d->name_len) : 0;
+        if (d->rec_len - used < need)
+            continue;
+
+        uint32_t inblk = (uint32_t)(off % fs->block_size);
+        if (used == 0) {
+            // Take over an unused entry.
+            e->rec_len = d->rec_len;
+            err = bwrite(fs, s.pblock, inblk, e, 8 + len);
+        }
+        else {
+            // Split the entry's slack off into the new one.
+            uint16_t shrunk = (uint16_t)used;
+            e->rec_len = (uint16_t)(d->rec_len - used);
+            err = bwrite(fs, s.pblock, inblk + used, e, 8 + len);
+            if (err == 0)
+                err = bwrite(fs, s.pblock, inblk + 4, &shrunk, 2);
+            off += used;
+        }
+        break;
+    }
+    dscan_done(&s);
+
+    if (err == -ENOSPC) {
+        // Append a block holding just this entry.
+        uint32_t lblock = (uint32_t)(dir->size / fs->block_size);
+        uint32_t pblock;
+        if ((err = bmap(fs, dir, lblock, true, &pblock, NULL)) < 0)
+            return err;
+        e->rec_len = (uint16_t)fs->block_size;
+        if ((err = bwrite(fs, pblock, 0, zeros, fs->block_size)) < 0 ||
+            (err = bwrite(fs, pblock, 0, e, 8 + len)) < 0)
+            return err;
+        off        = dir->size;
+        dir->size += fs->block_size;
+        if ((err = inode_store(fs, dir)) < 0)
+            return err;
+    }
+    if (err == 0)
+        dindex_add(einfo(dir), name, len, off);
+    return err;
+}
+
+// Remove the entry `name' from a directory by merging it into the entry
+// before it in the same block, or by marking it unused.
+static int
+dir_remove(struct ext2fs *fs, inode_t *dir, const char *name, int len)
+{
+    struct dscan s;
+    const struct ext2_dirent *d;
+    uint64_t off;
+    uint64_t prev     = UINT64_MAX;
+    uint16_t prev_len = 0;
+    int      err      = -ENOENT;
+
+    dscan_init(&s, fs, dir, 0);
+    while ((d = dscan_next(&s, &off)) != NULL) {
+        uint32_t inblk = (uint32_t)(off % fs->block_size);
+        if (inblk == 0)
+            prev = UINT64_MAX;
+        if (dirent_is(d, name, len)) {
+            if (prev != UINT64_MAX) {
+                uint16_t merged = (uint16_t)(prev_len + d->rec_len);
+                err = bwrite(fs, s.pblock,
+                             (uint32_t)(prev % fs->block_size) + 4,
+                             &merged, 2);
+            }
+            else {
+                uint32_t zero = 0;
+                err = bwrite(fs, s.pblock, inblk, &zero, 4);
+            }
+            if (err == 0)
+                dindex_remove(einfo(dir), name, len, off);
+            break;
+        }
+        prev     = off;
+        prev_len = d->rec_len;
+    }
+    dscan_done(&s);
+    return err;
+}
+
+static bool
+dir_empty(struct ext2fs *fs, inode_t *dir)
+{
+    struct dscan s;
+    const struct ext2_dirent *d;
+    uint64_t off;
+    bool     empty = true;
+
+    dscan_init(&s, fs, dir, 0);
+    while (empty && (d = dscan_next(&s, &off)) != NULL) {
+        if (d->inode != 0 && !dirent_dots(d))
+            empty = false;
+    }
+    dscan_done(&s);
+    return empty;
+}
+
+//----------------------------------------------------------------------------
+// Inode operations
+//----------------------------------------------------------------------------
+
+static int
+ext2_lookup(inode_t *dir, const char *name, int len, uint64_t *ino)
+{
+    struct ext2fs *fs = ext2fs(dir);
+    uint32_t       n;
+    uint64_t       off;
+
+    spin_lock(fs->lock);
+    int err = dir_find(fs, dir, name, len, &n, &off);
+    spin_unlock(fs->lock);
+
+    if (err == 0)
+        *ino = n;
+    return err;
+}
+
+static int
+ext2_create(inode_t *dir, const char *name, int len, int type,
+            uint64_t *ino)
+{
+    struct ext2fs *fs = ext2fs(dir);
+    bool           isdir = (type == T_DIR);
+    uint32_t       n;
+    uint64_t       off;
+    int            err;
+
+    spin_lock(fs->lock);
+
+    if (dir_find(fs, dir, name, len, &n, &off) == 0) {
+        err = -EEXIST;
+        goto done;
+    }
+    if ((n = ialloc(fs, inode_group(fs, dir->ino), isdir)) == 0) {
+        err = -ENOSPC;
+        goto done;
+    }
+
+    // Build the new inode in a scratch VFS inode so the normal helpers can
+    // allocate its first block and write it out.
+    uint8_t raw[EXT2_MAX_INODE_SIZE];
+    memzero(raw, fs->inode_size);
+    struct ext2_inode *ri = (struct ext2_inode *)raw;
+    ri->mode        = isdir ? (EXT2_S_IFDIR | 0755) : (EXT2_S_IFREG | 0644);
+    ri->links_count = isdir ? 2 : 1;
+    if (pcache_write(fs->dev, inode_offset(fs, n), raw, fs->inode_size) !=
+        BLK_STATUS_OK) {
+        err = -EIO;
+        goto undo_inode;
+    }
+
+    inode_t tmp;
+    memzero(&tmp, sizeof(tmp));
+    tmp.sb    = dir->sb;
+    tmp.ino   = n;
+    tmp.nlink = ri->links_count;
+    einfo(&tmp)->mode = ri->mode;
+
+    if (isdir) {
+        // A new directory holds "." and "..".
+        uint32_t block;
+        if ((err = bmap(fs, &tmp, 0, true, &block, NULL)) < 0)
+            goto undo_inode;
+
+        uint8_t dots[24];
+        memzero(dots, sizeof(dots));
+        struct ext2_dirent *dot    = (struct ext2_dirent *)dots;
+        struct ext2_dirent *dotdot = (struct ext2_dirent *)(dots + 12);
+        dot->inode        = n;
+        dot->rec_len      = 12;
+        dot->name_len     = 1;
+        dot->name[0]      = '.';
+        dotdot->inode     = (uint32_t)dir->ino;
+        dotdot->rec_len   = (uint16_t)(fs->block_size - 12);
+        dotdot->name_len  = 2;
+        dotdot->name[0]   = '.';
+        dotdot->name[1]   = '.';
+        if (fs->filetype)
+            dot->file_type = dotdot->file_type = EXT2_FT_DIR;
+
+        tmp.size = fs->block_size;
+        if ((err = bwrite(fs, block, 0, zeros, fs->block_size)) < 0 ||
+            (err = bwrite(fs, block, 0, dots, sizeof(dots))) < 0)
+            goto undo_blocks;
+    }
+    if ((err = inode_store(fs, &tmp)) < 0)
+        goto undo_blocks;
+
+    if ((err = dir_add(fs, dir, name, len, n, type)) < 0)
+        goto undo_blocks;
+
+    if (isdir) {
+        // The new directory's ".." links to its parent.
+        dir->nlink++;
+        inode_store(fs, dir);
+    }
+    *ino = n;
+    goto done;
+
+undo_blocks:
+    truncate_all(fs, &tmp);
+undo_inode:
+    ifree(fs, n, isdir);
+done:
+    spin_unlock(fs->lock);
+    return err;
+}
+
+static int
+ext2_unlink(inode_t *dir, const char *name, int len, inode_t *inode)
+{
+    struct ext2fs *fs = ext2fs(dir);
+    int            err;
+
+    spin_lock(fs->lock);
+
+    if (inode->type == T_DIR && !dir_empty(fs, inode)) {
+        err = -ENOTEMPTY;
+        goto done;
+    }
+    if ((err = dir_remove(fs, dir, name, len)) < 0)
+        goto done;
+
+    // The inode and its blocks are freed when the VFS evicts it.
+    if (inode->type == T_DIR) {
+        inode->nlink = 0;
+        dir->nlink--;
+        inode_store(fs, dir);
+    }
+    else {
+        inode->nlink--;
+    }
+    err = inode_store(fs, inode);
+
+done:
+    spin_unlock(fs->lock);
+    return err;
+}
+
+static int64_t
+ext2_read(inode_t *inode, uint64_t off, void *buf, uint64_t len)
+{
+    struct ext2fs *fs = ext2fs(inode);
+    uint32_t       bs = fs->block_size;
+    if (off >= inode->size)
+        return 0;
+    len = min(len, inode->size - off);
+
+    spin_lock(fs->lock);
+
+    uint8_t *dst  = (uint8_t *)buf;
+    int      err  = 0;
+    uint64_t done = 0;
+    while (done < len) {
+        uint64_t pos   = off + done;
+        uint32_t inblk = (uint32_t)(pos % bs);
+        uint32_t n     = (uint32_t)min(len - done, (uint64_t)(bs - inblk));
+
+        uint32_t block;
+        if ((err = bmap(fs, inode, (uint32_t)(pos / bs), false, &block,
+                        NULL)) < 0)
+            break;
+        if (block == 0)
+            memzero(dst + done, n);     // A hole reads as zeros
+        else if ((err = bread(fs, block, inblk, dst + done, n)) < 0)
+            break;
+        done += n;
+    }
+
+    spin_unlock(fs->lock);
+    return (done > 0 || err == 0) ? (int64_t)done : err;
+}
+
+static int64_t
+ext2_write(inode_t *inode, uint64_t off, const void *buf, uint64_t len)
+{
+    struct ext2fs *fs = ext2fs(inode);
+    uint32_t       bs = fs->block_size;
+    if (off >= EXT2_MAX_FILE_SIZE)
+        return -EFBIG;
+    len = min(len, EXT2_MAX_FILE_SIZE - off);
+
+    spin_lock(fs->lock);
+
+    const uint8_t *src  = (const uint8_t *)buf;
+    int            err  = 0;
+    uint64_t       done = 0;
+    while (done < len) {
+        uint64_t pos   = off + done;
+        uint32_t inblk = (uint32_t)(pos % bs);
+        uint32_t n     = (uint32_t)min(len - done, (uint64_t)(bs - inblk));
+
+        uint32_t block;
+        bool     fresh;
+        if ((err = bmap(fs, inode, (uint32_t)(pos / bs), true, &block,
+                        &fresh)) < 0)
+            break;
+
+        // A new block may hold stale data, so clear what the write misses.
+        if (fresh && n < bs && (err = bwrite(fs, block, 0, zeros, bs)) < 0)
+            break;
+        if ((err = bwrite(fs, block, inblk, src + done, n)) < 0)
+            break;
+        done += n;
+    }
+
+    if (off + done > inode->size)
+        inode->size = off + done;
+    int serr = inode_store(fs, inode);
+
+    spin_unlock(fs->lock);
+    if (done == 0 && len > 0)
+        return err < 0 ? err : serr;
+    return (int64_t)done;
+}
+
+static int
+ext2_readdir(inode_t *dir, uint64_t *pos, dirent_t *ent)
+{
+    struct ext2fs *fs    = ext2fs(dir);
+    int            found = 0;
+
+    spin_lock(fs->lock);
+
+    struct dscan s;
+    const struct ext2_dirent *d;
+    uint64_t off;
+    dscan_init(&s, fs, dir, *pos);
+    while ((d = dscan_next(&s, &off)) != NULL) {
+        if (d->inode == 0 || dirent_dots(d) || d->name_len > NAME_MAX)
+            continue;
+
+        int type = T_FILE;
+        if (fs->filetype) {
+            if (d->file_type == EXT2_FT_DIR)
+                type = T_DIR;
+        }
+        else {
+            struct ext2_inode raw;
+            if (pcache_read(fs->dev, inode_offset(fs, d->inode), &raw,
+                            sizeof(raw)) == BLK_STATUS_OK &&
+                (raw.mode & EXT2_S_IFMT) == EXT2_S_IFDIR)
+                type = T_DIR;
+        }
+
+        ent->ino  = d->inode;
+        ent->type = type;
+        memcpy(ent->name, d->name, d->name_len);
+        ent->name[d->name_len] = 0;
+        found = 1;
+        break;
+    }
+    *pos = s.pos;
+    dscan_done(&s);
+
+    spin_unlock(fs->lock);
+    return found;
+}
+
+static int
+ext2_getpage(inode_t *inode, uint64_t index, bool write, void **page)
+{
+    struct ext2fs *fs = ext2fs(inode);
+    if (!write && index >= div_up(inode->size, PAGE_SIZE))
+        return -EINVAL;
+
+    // With page-sized blocks a file page is exactly one cache page, which
+    // is mapped directly. Smaller blocks can only be mapped as a copy.
+    if (fs->block_size != PAGE_SIZE) {
+        if (write)
+            return -EINVAL;
+        uint8_t *frame = kpage_alloc(1);
+        if (frame == NULL)
+            return -ENOMEM;
+        memzero(frame, PAGE_SIZE);
+        int64_t n = ext2_read(inode, index * PAGE_SIZE, frame, PAGE_SIZE);
+        if (n < 0) {
+            kpage_free(frame, 1);
+            return (int)n;
+        }
+        *page = frame;
+        return 0;
+    }
+
+    spin_lock(fs->lock);
+    uint32_t block;
+    bool     fresh;
+    int      err = bmap(fs, inode, (uint32_t)index, write, &block, &fresh);
+    if (err == 0 && fresh)
+        err = bwrite(fs, block, 0, zeros, PAGE_SIZE);
+    if (err == 0 && write && (index + 1) * PAGE_SIZE > inode->size) {
+        inode->size = (index + 1) * PAGE_SIZE;
+        err         = inode_store(fs, inode);
+    }
+    spin_unlock(fs->lock);
+    if (err < 0)
+        return err;
+
+    if (block == 0) {
+        // A hole: hand out a private zero page.
+        uint8_t *frame = kpage_alloc(1);
+        if (frame == NULL)
+            return -ENOMEM;
+        memzero(frame, PAGE_SIZE);
+        *page = frame;
+        return 0;
+    }
+
+    cpage_t *cp = pcache_get(fs->dev, block);
+    if (cp == NULL)
+        return -EIO;
+    kpage_ref(cp->data);
+    *page = cp->data;
+    pcache_put(cp);
+    return 0;
+}
+
+static const inode_ops_t ext2_iops =
+{
+    .lookup  = ext2_lookup,
+    .create  = ext2_create,
+    .unlink  = ext2_unlink,
+    .read    = ext2_read,
+    .write   = ext2_write,
+    .readdir = ext2_readdir,
+    .getpage = ext2_getpage,
+};
+
+//----------------------------------------------------------------------------
+// Superblock operations
+//----------------------------------------------------------------------------
+
+static int
+ext2_read_inode(inode_t *inode)
+{
+    struct ext2fs    *fs = ext2fs(inode);
+    struct ext2_inode raw;
+    if (inode->ino == 0 || inode->ino > fs->sb.inodes_count)
+        return -EINVAL;
+    if (pcache_read(fs->dev, inode_offset(fs, inode->ino), &raw,
+                    sizeof(raw)) != BLK_STATUS_OK)
+        return -EIO;
+
+    struct einfo *ei = einfo(inode);
+    memcpy(ei->block, raw.block, sizeof(ei->block));
+    ei->blocks = raw.blocks;
+    ei->mode   = raw.mode;
+
+    inode->type  = ((raw.mode & EXT2_S_IFMT) == EXT2_S_IFDIR) ? T_DIR
+                                                             : T_FILE;
+    inode->nlink = raw.links_count;
+    inode->size  = raw.size;
+    inode->ops   = &ext2_iops;
+    return 0;
+}
+
+static void
+ext2_evict_inode(inode_t *inode)
+{
+    struct ext2fs *fs = ext2fs(inode);
+    struct einfo  *ei = einfo(inode);
+
+    spin_lock(fs->lock);
+    dindex_drop(ei);
+    if (inode->nlink == 0) {
+        // Nothing refers to it any more: give back its blocks and number.
+        struct ext2_inode raw;
+        uint64_t          off = inode_offset(fs, inode->ino);
+        truncate_all(fs, inode);
+        if (pcache_read(fs->dev, off, &raw, sizeof(raw)) == BLK_STATUS_OK) {
+            memzero(raw.block, sizeof(raw.block));
+            raw.links_count = 0;
+            raw.size        = 0;
+            raw.blocks      = 0;
+            // Without a clock, stamp the deletion with the last time the
+            // superblock was written. Small values mark orphan list links.
+            raw.dtime       = fs->sb.wtime;
+            pcache_write(fs->dev, off, &raw, sizeof(raw));
+        }
+        ifree(fs, (uint32_t)inode->ino, inode->type == T_DIR);
+    }
+    spin_unlock(fs->lock);
+}
+
+static const super_ops_t ext2_sops =
+{
+    .read_inode  = ext2_read_inode,
+    .evict_inode = ext2_evict_inode,
+};
+
+static int
+ext2_mount(superblock_t *sb, blkdev_t *dev)
+{
+    if (dev == NULL)
+        return -ENODEV;
+    if (mount_count == MAX_MOUNTS)
+        return -ENOMEM;
+
+    struct ext2fs *fs = &mounts[mount_count];
+    memzero(fs, sizeof(*fs));
+    fs->dev = dev;
+    if (pcache_read(dev, EXT2_SUPER_OFFSET, &fs->sb, sizeof(fs->sb)) !=
+        BLK_STATUS_OK || fs->sb.magic != EXT2_MAGIC)
+        return -EINVAL;
+
+    const struct ext2_super *s = &fs->sb;
+    if (s->log_block_size > 2 || s->blocks_per_group == 0 ||
+        s->inodes_per_group == 0) {
+        logf(LOG_WARNING, "[ext2] %s: unsupported geometry.", dev->name);
+        return -EINVAL;
+    }
+    fs->block_size = 1024u << s->log_block_size;
+    fs->inode_size = EXT2_OLD_INODE_SIZE;
+    fs->first_ino  = EXT2_OLD_FIRST_INO;
+    if (s->rev_level > 0) {
+        fs->inode_size = s->inode_size;
+        fs->first_ino  = s->first_ino;
+        if (s->feature_incompat & ~INCOMPAT_FILETYPE) {
+            logf(LOG_WARNING, "[ext2] %s: unsupported features %#x.",
+                 dev->name, s->feature_incompat);
+            return -EINVAL;
+        }
+        fs->filetype = (s->feature_incompat & INCOMPAT_FILETYPE) != 0;
+
+        // Features we can't keep consistent only allow reading.
+        if (s->feature_ro_compat & ~RO_COMPAT_SUPPORTED)
+            sb->readonly = true;
+    }
+    if (fs->inode_size < EXT2_OLD_INODE_SIZE ||
+        fs->inode_size > EXT2_MAX_INODE_SIZE)
+        return -EINVAL;
+
+    fs->groups = div_up(s->blocks_count - s->first_data_block,
+                        s->blocks_per_group);
+    uint64_t gdsize = (uint64_t)fs->groups * sizeof(struct ext2_group);
+    int      pages  = (int)div_up(gdsize, PAGE_SIZE);
+    if ((fs->gd = kpage_alloc(pages)) == NULL)
+        return -ENOMEM;
+
+    // The descriptor table starts in the block after the superblock.
+    fs->gd_offset = (uint64_t)(s->first_data_block + 1) * fs->block_size;
+    if (pcache_read(dev, fs->gd_offset, fs->gd, gdsize) != BLK_STATUS_OK) {
+        kpage_free(fs->gd, pages);
+        return -EIO;
+    }
+    mount_count++;
+
+    logf(LOG_INFO, "[ext2] %s: %u blocks of %u bytes in %u group(s).",
+         dev->name, s->blocks_count, fs->block_size, fs->groups);
+
+    sb->ops      = &ext2_sops;
+    sb->root_ino = EXT2_ROOT_INO;
+    sb->private  = fs;
+    return 0;
+}
+
+static const fstype_t ext2_type =
+{
+    .name  = "ext2",
+    .mount = ext2_mount,
+};
+
+void
+ext2_init()
+{
+    vfs_register_fs(&ext2_type);
+}
@@ -0,0 +1,329 @@
+//============================================================================
+/// @file       initrd.c
+/// @brief      Filesystem over the initial RAM disk.
+//============================================================================
+
+#include <core.h>
+#include <libc/string.h>
+#include <kernel/debug/log.h>
+#include <kernel/errno.h>
+#include <kernel/fs/initrd.h>
+#include <kernel/fs/vfs.h>
+#include <kernel/mem/paging.h>
+#include <kernel/mem/pmap.h>
+
+// cpio "newc" header: a magic number followed by 13 eight-digit hex fields.
+#define CPIO_HEADER_SIZE     110
+#define CPIO_MODE            14
+#define CPIO_FILESIZE        54
+#define CPIO_NAMESIZE        94
+
+#define CPIO_S_IFMT          0170000
+#define CPIO_S_IFDIR         0040000
+#define CPIO_S_IFREG         0100000
+
+// A file or directory in the archive. Its address is its inode number.
+struct rnode
+{
+    const char    *name;        ///< Points into the archive
+    uint8_t        len;
+    int            type;        ///< T_FILE or T_DIR
+    uint64_t       size;
+    const uint8_t *data;        ///< File contents in the archive
+    struct rnode  *children;
+    struct rnode  *next;        ///< Next sibling
+};
+
+static struct rnode *free_nodes;
+static int           free_count;
+
+static struct rnode *
+node_alloc(const char *name, int len, int type)
+{
+    // Nodes live as long as the kernel, so they're carved from pages and
+    // never returned.
+    if (free_count == 0) {
+        free_nodes = kpage_alloc(1);
+        if (free_nodes == NULL)
+            return NULL;
+        free_count = (int)(PAGE_SIZE / sizeof(struct rnode));
+    }
+    struct rnode *node = free_nodes++;
+    free_count--;
+
+    memzero(node, sizeof(*node));
+    node->name = name;
+    node->len  = (uint8_t)len;
+    node->type = type;
+    return node;
+}
+
+static inline struct rnode *
+rnode(const inode_t *inode)
+{
+    return (struct rnode *)inode->ino;
+}
+
+static struct rnode *
+find(const struct rnode *dir, const char *name, int len)
+{
+    struct rnode *n = dir->children;
+    while (n != NULL && (n->len != len || memcmp(n->name, name, len)))
+        n = n->next;
+    return n;
+}
+
+//----------------------------------------------------------------------------
+// Archive parsing
+//----------------------------------------------------------------------------
+
+// Parse an eight-digit hex header field. Returns false if it is malformed.
+static bool
+hex8(const char *p, uint32_t *value)
+{
+    uint32_t v = 0;
+    for (int i = 0; i < 8; i++) {
+        char c = p[i];
+        int  d;
+        if (c >= '0' && c <= '9')
+            d = c - '0';
+        else if (c >= 'A' && c <= 'F')
+            d = c - 'A' + 10;
+        else if (c >= 'a' && c <= 'f')
+            d = c - 'a' + 10;
+        else
+            return false;
+        v = v << 4 | (uint32_t)d;
+    }
+    *value = v;
+    return true;
+}
+
+// Add an archive entry under `root', creating any missing parent
+// directories. Entries whose names are too long are skipped.
+static int
+add_entry(struct rnode *root, const char *path, int pathlen, int type,
+          const uint8_t *data, uint64_t size)
+{
+    struct rnode *dir = root;
+    while (pathlen > 0) {
+        // Split off the next component.
+        while (pathlen > 0 && *path == '/') {
+            path++;
+            pathlen--;
+        }
+        int len = 0;
+        while (len < pathlen && path[len] != '/')
+            len++;
+        if (len == 0 || (len == 1 && path[0] == '.')) {
+            path    += len;
+            pathlen -= len;
+            continue;
+        }
+        if (len > NAME_MAX)
+            return 0;
+
+        bool          last = (len == pathlen);
+        struct rnode *node = find(dir, path, len);
+        if (node == NULL) {
+            node = node_alloc(path, len, last ? type : T_DIR);
+            if (node == NULL)
+                return -ENOMEM;
+            node->next    = dir->children;
+            dir->children = node;
+        }
+        if (last) {
+            node->type = type;
+            node->data = data;
+            node->size = size;
+        }
+        else if (node->type != T_DIR) {
+            return 0;
+        }
+
+        dir      = node;
+        path    += len;
+        pathlen -= len;
+    }
+    return 0;
+}
+
+// Index every entry of the archive at `base'.
+static int
+parse(struct rnode *root, const uint8_t *base, uint64_t size)
+{
+    uint64_t off = 0;
+    while (off + CPIO_HEADER_SIZE <= size) {
+        const char *hdr = (const char *)base + off;
+        uint32_t    mode, filesize, namesize;
+        if (memcmp(hdr, "07070", 5) || (hdr[5] != '1' && hdr[5] != '2') ||
+            !hex8(hdr + CPIO_MODE, &mode) ||
+            !hex8(hdr + CPIO_FILESIZE, &filesize) ||
+            !hex8(hdr + CPIO_NAMESIZE, &namesize) || namesize == 0)
+            return -EINVAL;
+
+        // The name may carry extra NUL padding after its terminator.
+        uint64_t    dataoff = align_up(off + CPIO_HEADER_SIZE + namesize, 4);
+        const char *name    = hdr + CPIO_HEADER_SIZE;
+        if (dataoff + filesize > size)
+            return -EINVAL;
+        int len = 0;
+        while (len < (int)namesize && name[len] != 0)
+            len++;
+        if (len == 10 && !memcmp(name, "TRAILER!!!", 10))
+            return 0;
+
+        int err = 0;
+        if ((mode & CPIO_S_IFMT) == CPIO_S_IFDIR)
+            err = add_entry(root, name, len, T_DIR, NULL, 0);
+        else if ((mode & CPIO_S_IFMT) == CPIO_S_IFREG)
+            err = add_entry(root, name, len, T_FILE, base + dataoff, filesize);
+        if (err < 0)
+            return err;
+
+        off = align_up(dataoff + filesize, 4);
+    }
+    return -EINVAL;     // No trailer
+}
+
+//----------------------------------------------------------------------------
+// Inode operations
+//----------------------------------------------------------------------------
+
+static int
+initrd_lookup(inode_t *dir, const char *name, int len, uint64_t *ino)
+{
+    struct rnode *node = find(rnode(dir), name, len);
+    if (node == NULL)
+        return -ENOENT;
+    *ino = (uint64_t)node;
+    return 0;
+}
+
+static int64_t
+initrd_read(inode_t *inode, uint64_t off, void *buf, uint64_t len)
+{
+    struct rnode *node = rnode(inode);
+    if (off >= node->size)
+        return 0;
+    len = min(len, node->size - off);
+    memcpy(buf, node->data + off, len);
+    return (int64_t)len;
+}
+
+static int
+initrd_readdir(inode_t *dir, uint64_t *pos, dirent_t *ent)
+{
+    struct rnode *n = rnode(dir)->children;
+    for (uint64_t i = 0; n != NULL && i < *pos; i++)
+        n = n->next;
+    if (n == NULL)
+        return 0;
+
+    ent->ino  = (uint64_t)n;
+    ent->type = n->type;
+    memcpy(ent->name, n->name, n->len);
+    ent->name[n->len] = 0;
+    (*pos)++;
+    return 1;
+}
+
+static int
+initrd_getpage(inode_t *inode, uint64_t index, bool write, void **page)
+{
+    struct rnode *node = rnode(inode);
+    if (write)
+        return -EROFS;
+    if (index >= div_up(node->size, PAGE_SIZE))
+        return -EINVAL;
+
+    // Whole pages of page-aligned data are mapped where they lie in the
+    // archive. Only a partial last page is copied, so that the bytes after
+    // the file aren't exposed.
+    const uint8_t *src = node->data + index * PAGE_SIZE;
+    if (((uint64_t)src & (PAGE_SIZE - 1)) == 0 &&
+        (index + 1) * PAGE_SIZE <= node->size) {
+        kpage_ref((void *)src);
+        *page = (void *)src;
+        return 0;
+    }
+
+    uint8_t *frame = kpage_alloc(1);
+    if (frame == NULL)
+        return -ENOMEM;
+    memzero(frame, PAGE_SIZE);
+    memcpy(frame, src, min(PAGE_SIZE, node->size - index * PAGE_SIZE));
+    *page = frame;
+    return 0;
+}
+
+static const inode_ops_t initrd_iops =
+{
+    .lookup  = initrd_lookup,
+    .read    = initrd_read,
+    .readdir = initrd_readdir,
+    .getpage = initrd_getpage,
+};
+
+//----------------------------------------------------------------------------
+// Superblock operations
+//----------------------------------------------------------------------------
+
+static int
+initrd_read_inode(inode_t *inode)
+{
+    struct rnode *node = rnode(inode);
+    inode->type  = node->type;
+    inode->nlink = 1;
+    inode->size  = node->size;
+    inode->ops   = &initrd_iops;
+    return 0;
+}
+
+static const super_ops_t initrd_sops =
+{
+    .read_inode = initrd_read_inode,
+};
+
+static struct rnode *root;
+
+static int
+initrd_mount(superblock_t *sb, blkdev_t *dev)
+{
+    (void)dev;
+
+    uint64_t       size;
+    const uint8_t *base = pmap_initrd(&size);
+    if (base == NULL)
+        return -ENODEV;
+
+    // The archive never changes, so every mount shares one index.
+    if (root == NULL) {
+        struct rnode *r = node_alloc("/", 1, T_DIR);
+        if (r == NULL)
+            return -ENOMEM;
+        int err = parse(r, base, size);
+        if (err < 0)
+            return err;
+        root = r;
+        logf(LOG_INFO, "[initrd] %lu bytes at %#lx.", size,
+             (uint64_t)base);
+    }
+
+    sb->ops      = &initrd_sops;
+    sb->root_ino = (uint64_t)root;
+    sb->readonly = true;
+    return 0;
+}
+
+static const fstype_t initrd_type =
+{
+    .name  = "initrd",
+    .mount = initrd_mount,
+};
+
+void
+initrd_init()
+{
+    vfs_register_fs(&initrd_type);
+}
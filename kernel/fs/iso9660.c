@@ -0,0 +1,529 @@
+//============================================================================
+/// @file       iso9660.c
+/// @brief      ISO 9660 CD-ROM filesystem.
+//============================================================================
+
+#include <core.h>
+#include <libc/string.h>
+#include <kernel/block/pcache.h>
+#include <kernel/debug/log.h>
+#include <kernel/errno.h>
+#include <kernel/fs/iso9660.h>
+#include <kernel/fs/vfs.h>
+#include <kernel/mem/paging.h>
+
+#define ISO_BLOCK            2048       // Logical block size
+#define ISO_VD_START         16         // First volume descriptor block
+#define ISO_VD_MAX           32         // Volume descriptors to examine
+
+// Volume descriptor types
+#define VD_PRIMARY           1
+#define VD_SUPPLEMENTARY     2
+#define VD_TERMINATOR        255
+
+// Volume descriptor fields
+#define VD_ID                1          // "CD001"
+#define VD_ESCAPES           88         // Joliet UCS-2 escape sequence
+#define VD_BLOCK_SIZE        128
+#define VD_ROOT              156        // Root directory record
+
+// Directory record fields
+#define DR_LEN               0
+#define DR_EXT_LEN           1          // Extended attribute blocks
+#define DR_EXTENT            2
+#define DR_SIZE              10
+#define DR_FLAGS             25
+#define DR_NAME_LEN          32
+#define DR_NAME              33
+#define DR_MIN_LEN           34
+
+#define DR_FLAG_DIR          (1 << 1)
+
+// Rock Ridge NM flags
+#define NM_CURRENT           (1 << 1)
+#define NM_PARENT            (1 << 2)
+
+// Continuation areas to follow for one record's system use entries.
+#define SUSP_MAX_AREAS       4
+
+// How names are stored on a mounted disc.
+enum
+{
+    NAMES_PLAIN,        ///< Upper-case 8.3 names with versions
+    NAMES_JOLIET,       ///< UCS-2 names in the supplementary descriptor
+    NAMES_ROCKRIDGE,    ///< POSIX names in system use entries
+};
+
+struct isofs
+{
+    blkdev_t *dev;
+    int       names;        ///< NAMES_*
+    int       susp_skip;    ///< Bytes before each record's SUSP entries
+};
+
+static struct isofs mounts[MAX_MOUNTS];
+static int          mount_count;
+
+static inline uint16_t
+get16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static inline uint32_t
+get32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+           (uint32_t)p[3] << 24;
+}
+
+static inline char
+lower(char c)
+{
+    return (c >= 'A' && c <= 'Z') ? (char)(c + 'a' - 'A') : c;
+}
+
+static inline struct isofs *
+isofs(const inode_t *inode)
+{
+    return (struct isofs *)inode->sb->private;
+}
+
+// Device byte offset of a record's data extent.
+static inline uint64_t
+record_extent(const uint8_t *rec)
+{
+    return ((uint64_t)get32(rec + DR_EXTENT) + rec[DR_EXT_LEN]) * ISO_BLOCK;
+}
+
+//----------------------------------------------------------------------------
+// Directory scanning
+//----------------------------------------------------------------------------
+
+// A cursor over the records of a directory extent. The cache page holding
+// the current record stays referenced until the cursor moves off it.
+struct dscan
+{
+    blkdev_t *dev;
+    uint64_t  start;        ///< Device offset of the extent
+    uint64_t  size;
+    uint64_t  pos;          ///< Offset of the next record in the extent
+    cpage_t  *page;
+};
+
+static void
+dscan_init(struct dscan *s, const inode_t *dir, uint64_t pos)
+{
+    s->dev   = isofs(dir)->dev;
+    s->start = dir->fsdata[0];
+    s->size  = dir->size;
+    s->pos   = pos;
+    s->page  = NULL;
+}
+
+static void
+dscan_done(struct dscan *s)
+{
+    if (s->page != NULL)
+        pcache_put(s->page);
+}
+
+// Return the next record and its device offset in `addr', or NULL at the
+// end of the directory or on a read error.
+static const uint8_t *
+dscan_next(struct dscan *s, uint64_t *addr)
+{
+    while (s->pos < s->size) {
+        uint64_t a     = s->start + s->pos;
+        uint64_t index = a / PAGE_SIZE;
+        if (s->page == NULL || s->page->index != index) {
+            if (s->page != NULL)
+                pcache_put(s->page);
+            if ((s->page = pcache_get(s->dev, index)) == NULL)
+                return NULL;
+        }
+
+        // Records never cross a block. A zero length pads to the next one.
+        const uint8_t *rec  = (const uint8_t *)s->page->data +
+                              (a & (PAGE_SIZE - 1));
+        uint64_t       room = ISO_BLOCK - (a & (ISO_BLOCK - 1));
+        if (rec[DR_LEN] == 0) {
+            s->pos += room;
+            continue;
+        }
+        if (rec[DR_LEN] < DR_MIN_LEN || rec[DR_LEN] > room ||
+            DR_NAME + rec[DR_NAME_LEN] > rec[DR_LEN])
+            return NULL;
+
+        s->pos += rec[DR_LEN];
+        *addr   = a;
+        return rec;
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+// Names
+//----------------------------------------------------------------------------
+
+// Collect a record's Rock Ridge name from its system use entries, following
+// continuation areas. Returns the name length, 0 if it has no NM entry, or
+// -1 if the record is a relocated directory that should stay hidden. A
+// child link (CL) entry replaces `ino' with the relocated directory's "."
+// record.
+static int
+rr_name(const struct isofs *fs, const uint8_t *rec, char *name,
+        uint64_t *ino)
+{
+    int            off  = DR_NAME + rec[DR_NAME_LEN] +
+                          !(rec[DR_NAME_LEN] & 1) + fs->susp_skip;
+    const uint8_t *su   = rec + off;
+    int            left = rec[DR_LEN] - off;
+
+    cpage_t *ce     = NULL;
+    uint64_t ce_at  = 0;
+    uint32_t ce_len = 0;
+    bool     nm     = false;
+    bool     hidden = false;
+    int      len    = 0;
+
+    for (int area = 0; area < SUSP_MAX_AREAS; area++) {
+        bool stop = false;
+        while (!stop && left >= 4 && su[2] >= 4 && su[2] <= left) {
+            int elen = su[2];
+            if (su[0] == 'N' && su[1] == 'M' && elen > 5) {
+                // Names may be split across several NM entries.
+                int n = min(elen - 5, NAME_MAX - len);
+                if (!(su[4] & (NM_CURRENT | NM_PARENT))) {
+                    memcpy(name + len, su + 5, n);
+                    len += n;
+                    nm   = true;
+                }
+            }
+            else if (su[0] == 'R' && su[1] == 'E') {
+                hidden = true;
+            }
+            else if (su[0] == 'C' && su[1] == 'L' && elen >= 12) {
+                *ino = (uint64_t)get32(su + 4) * ISO_BLOCK;
+            }
+            else if (su[0] == 'C' && su[1] == 'E' && elen >= 28) {
+                ce_at  = (uint64_t)get32(su + 4) * ISO_BLOCK + get32(su + 12);
+                ce_len = get32(su + 20);
+            }
+            else if (su[0] == 'S' && su[1] == 'T') {
+                stop = true;
+            }
+            su   += elen;
+            left -= elen;
+        }
+        if (stop || ce_len == 0)
+            break;
+
+        // Continue in the area the CE entry named. It lies within a block.
+        if (ce != NULL)
+            pcache_put(ce);
+        ce = pcache_get(fs->dev, ce_at / PAGE_SIZE);
+        if (ce == NULL || (ce_at & (ISO_BLOCK - 1)) + ce_len > ISO_BLOCK)
+            break;
+        su     = (const uint8_t *)ce->data + (ce_at & (PAGE_SIZE - 1));
+        left   = (int)ce_len;
+        ce_len = 0;
+    }
+    if (ce != NULL)
+        pcache_put(ce);
+
+    if (hidden)
+        return -1;
+    return nm ? len : 0;
+}
+
+// Decode the name of the record at device offset `addr' into `name' and
+// return its length, or 0 if the record should not be listed ("." and
+// "..", or a relocated directory). `ino' receives the inode number the
+// name refers to.
+static int
+record_name(const struct isofs *fs, const uint8_t *rec, uint64_t addr,
+            char *name, uint64_t *ino)
+{
+    const uint8_t *id    = rec + DR_NAME;
+    int            idlen = rec[DR_NAME_LEN];
+    int            n     = 0;
+
+    *ino = addr;
+    if (idlen == 1 && (id[0] == 0 || id[0] == 1))
+        return 0;
+
+    if (fs->names == NAMES_ROCKRIDGE) {
+        n = rr_name(fs, rec, name, ino);
+        if (n < 0)
+            return 0;
+    }
+
+    if (n == 0 && fs->names == NAMES_JOLIET) {
+        // UCS-2 big-endian, stored here as UTF-8.
+        for (int i = 0; i + 1 < idlen; i += 2) {
+            uint16_t c = (uint16_t)(id[i] << 8 | id[i + 1]);
+            int      w = (c < 0x80) ? 1 : (c < 0x800) ? 2 : 3;
+            if (c == ';' || n + w > NAME_MAX)
+                break;
+            if (w == 1) {
+                name[n++] = (char)c;
+            }
+            else if (w == 2) {
+                name[n++] = (char)(0xc0 | c >> 6);
+                name[n++] = (char)(0x80 | (c & 0x3f));
+            }
+            else {
+                name[n++] = (char)(0xe0 | c >> 12);
+                name[n++] = (char)(0x80 | ((c >> 6) & 0x3f));
+                name[n++] = (char)(0x80 | (c & 0x3f));
+            }
+        }
+    }
+    else if (n == 0) {
+        // Drop the version and the dot of names without an extension.
+        for (int i = 0; i < idlen && id[i] != ';' && n < NAME_MAX; i++)
+            name[n++] = lower((char)id[i]);
+        if (n > 1 && name[n - 1] == '.')
+            n--;
+    }
+
+    name[n] = 0;
+    return n;
+}
+
+static bool
+name_equal(const struct isofs *fs, const char *a, const char *b, int len)
+{
+    // Plain names are upper case on disc, so match them in any case.
+    if (fs->names != NAMES_PLAIN)
+        return !memcmp(a, b, len);
+    for (int i = 0; i < len; i++) {
+        if (lower(a[i]) != lower(b[i]))
+            return false;
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// Inode operations
+//----------------------------------------------------------------------------
+
+static int
+iso_lookup(inode_t *dir, const char *name, int len, uint64_t *ino)
+{
+    const struct isofs *fs = isofs(dir);
+    char                found[NAME_MAX + 1];
+    int                 err = -ENOENT;
+
+    struct dscan s;
+    dscan_init(&s, dir, 0);
+    const uint8_t *rec;
+    uint64_t       addr;
+    while ((rec = dscan_next(&s, &addr)) != NULL) {
+        int n = record_name(fs, rec, addr, found, ino);
+        if (n == len && name_equal(fs, found, name, len)) {
+            err = 0;
+            break;
+        }
+    }
+    dscan_done(&s);
+    return err;
+}
+
+static int64_t
+iso_read(inode_t *inode, uint64_t off, void *buf, uint64_t len)
+{
+    if (off >= inode->size)
+        return 0;
+    len = min(len, inode->size - off);
+
+    // The extent is contiguous, so this is a straight page cache copy.
+    if (pcache_read(isofs(inode)->dev, inode->fsdata[0] + off, buf, len) !=
+        BLK_STATUS_OK)
+        return -EIO;
+    return (int64_t)len;
+}
+
+static int
+iso_readdir(inode_t *dir, uint64_t *pos, dirent_t *ent)
+{
+    const struct isofs *fs    = isofs(dir);
+    int                 found = 0;
+
+    struct dscan s;
+    dscan_init(&s, dir, *pos);
+    const uint8_t *rec;
+    uint64_t       addr;
+    while ((rec = dscan_next(&s, &addr)) != NULL) {
+        if (record_name(fs, rec, addr, ent->name, &ent->ino) > 0) {
+            // A child link stands in for a relocated directory.
+            bool dir = (rec[DR_FLAGS] & DR_FLAG_DIR) || ent->ino != addr;
+            ent->type = dir ? T_DIR : T_FILE;
+            found     = 1;
+            break;
+        }
+    }
+    *pos = s.pos;
+    dscan_done(&s);
+    return found;
+}
+
+static int
+iso_getpage(inode_t *inode, uint64_t index, bool write, void **page)
+{
+    if (write)
+        return -EROFS;
+    if (index >= div_up(inode->size, PAGE_SIZE))
+        return -EINVAL;
+
+    // Map the cached frame itself when the file page lines up with a cache
+    // page and doesn't end early, so no bytes past the file are exposed.
+    uint64_t off = inode->fsdata[0] + index * PAGE_SIZE;
+    if ((off & (PAGE_SIZE - 1)) == 0 &&
+        (index + 1) * PAGE_SIZE <= inode->size) {
+        cpage_t *cp = pcache_get(isofs(inode)->dev, off / PAGE_SIZE);
+        if (cp == NULL)
+            return -EIO;
+        kpage_ref(cp->data);
+        *page = cp->data;
+        pcache_put(cp);
+        return 0;
+    }
+
+    uint8_t *frame = kpage_alloc(1);
+    if (frame == NULL)
+        return -ENOMEM;
+    memzero(frame, PAGE_SIZE);
+    int64_t n = iso_read(inode, index * PAGE_SIZE, frame, PAGE_SIZE);
+    if (n < 0) {
+        kpage_free(frame, 1);
+        return (int)n;
+    }
+    *page = frame;
+    return 0;
+}
+
+static const inode_ops_t iso_iops =
+{
+    .lookup  = iso_lookup,
+    .read    = iso_read,
+    .readdir = iso_readdir,
+    .getpage = iso_getpage,
+};
+
+//----------------------------------------------------------------------------
+// Superblock operations
+//----------------------------------------------------------------------------
+
+// An inode number is the device offset of the directory record describing
+// the file.
+static int
+iso_read_inode(inode_t *inode)
+{
+    uint8_t rec[DR_MIN_LEN];
+    if (pcache_read(isofs(inode)->dev, inode->ino, rec, sizeof(rec)) !=
+        BLK_STATUS_OK)
+        return -EIO;
+    if (rec[DR_LEN] < DR_MIN_LEN)
+        return -EIO;
+
+    inode->type      = (rec[DR_FLAGS] & DR_FLAG_DIR) ? T_DIR : T_FILE;
+    inode->nlink     = 1;
+    inode->size      = get32(rec + DR_SIZE);
+    inode->ops       = &iso_iops;
+    inode->fsdata[0] = record_extent(rec);
+    return 0;
+}
+
+static const super_ops_t iso_sops =
+{
+    .read_inode = iso_read_inode,
+};
+
+// Return the SUSP skip length if the root directory's "." record starts
+// with an SP entry, or -1 if the disc has no system use entries.
+static int
+susp_detect(blkdev_t *dev, uint64_t root)
+{
+    uint8_t rec[DR_MIN_LEN + 7];
+    if (pcache_read(dev, root, rec, DR_MIN_LEN) != BLK_STATUS_OK ||
+        pcache_read(dev, record_extent(rec), rec, sizeof(rec)) !=
+        BLK_STATUS_OK)
+        return -1;
+
+    // "." has a one-byte name, so its system use area starts right after.
+    const uint8_t *sp = rec + DR_MIN_LEN;
+    if (rec[DR_LEN] < sizeof(rec) || sp[0] != 'S' || sp[1] != 'P' ||
+        sp[4] != 0xbe || sp[5] != 0xef)
+        return -1;
+    return sp[6];
+}
+
+static int
+iso_mount(superblock_t *sb, blkdev_t *dev)
+{
+    if (dev == NULL)
+        return -ENODEV;
+    if (mount_count == MAX_MOUNTS)
+        return -ENOMEM;
+
+    // Find the primary descriptor and any Joliet supplementary one.
+    uint64_t primary = 0, joliet = 0;
+    for (int i = 0; i < ISO_VD_MAX; i++) {
+        uint8_t  vd[VD_ROOT + DR_MIN_LEN];
+        uint64_t addr = (uint64_t)(ISO_VD_START + i) * ISO_BLOCK;
+        if (pcache_read(dev, addr, vd, sizeof(vd)) != BLK_STATUS_OK ||
+            memcmp(vd + VD_ID, "CD001", 5) || vd[0] == VD_TERMINATOR)
+            break;
+        if (get16(vd + VD_BLOCK_SIZE) != ISO_BLOCK)
+            continue;
+
+        const uint8_t *esc = vd + VD_ESCAPES;
+        if (vd[0] == VD_PRIMARY && primary == 0)
+            primary = addr + VD_ROOT;
+        else if (vd[0] == VD_SUPPLEMENTARY && joliet == 0 &&
+                 esc[0] == '%' && esc[1] == '/' &&
+                 (esc[2] == '@' || esc[2] == 'C' || esc[2] == 'E'))
+            joliet = addr + VD_ROOT;
+    }
+    if (primary == 0)
+        return -EINVAL;
+
+    struct isofs *fs = &mounts[mount_count];
+    fs->dev       = dev;
+    fs->names     = NAMES_PLAIN;
+    fs->susp_skip = 0;
+
+    int skip = susp_detect(dev, primary);
+    if (skip >= 0) {
+        fs->names     = NAMES_ROCKRIDGE;
+        fs->susp_skip = skip;
+    }
+    else if (joliet != 0) {
+        fs->names = NAMES_JOLIET;
+        primary   = joliet;
+    }
+    mount_count++;
+
+    static const char *const kinds[] = { "ISO 9660", "Joliet", "Rock Ridge" };
+    logf(LOG_INFO, "[iso9660] %s: %s names.", dev->name, kinds[fs->names]);
+
+    sb->ops      = &iso_sops;
+    sb->root_ino = primary;
+    sb->readonly = true;
+    sb->private  = fs;
+    return 0;
+}
+
+static const fstype_t iso_type =
+{
+    .name  = "iso9660",
+    .mount = iso_mount,
+};
+
+void
+iso9660_init()
+{
+    vfs_register_fs(&iso_type);
+}
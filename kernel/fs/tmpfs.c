@@ -0,0 +1,346 @@
+//============================================================================
+/// @file       tmpfs.c
+/// @brief      In-memory filesystem.
+//============================================================================
+
+#include <core.h>
+#include <libc/string.h>
+#include <kernel/errno.h>
+#include <kernel/fs/tmpfs.h>
+#include <kernel/fs/vfs.h>
+#include <kernel/mem/paging.h>
+#include <kernel/mem/radix.h>
+#include <kernel/spinlock.h>
+
+// Largest file, in bytes.
+#define TMPFS_MAX_SIZE       ((uint64_t)1 << 40)
+
+struct tdirent;
+
+// A file or directory. Its address is its inode number.
+struct tnode
+{
+    int             type;       ///< T_FILE or T_DIR
+    uint16_t        nlink;
+    uint64_t        size;
+    radix_t         pages;      ///< File page index -> frame
+    struct tdirent *entries;    ///< Directory contents
+    struct tnode   *next;       ///< Free list link
+};
+
+struct tdirent
+{
+    char            name[NAME_MAX + 1];
+    uint8_t         len;
+    struct tnode   *node;
+    struct tdirent *next;
+};
+
+static struct tnode   *free_nodes;
+static struct tdirent *free_dirents;
+static spin_lock_t     tmplock;
+
+// Carve a page into objects and push them onto a free list linked through
+// each object's `next' field.
+#define REFILL(list, type)                                          \
+    do {                                                            \
+        type *objs = kpage_alloc(1);                                \
+        int   n    = (int)(PAGE_SIZE / sizeof(type));               \
+        for (int i = 0; objs != NULL && i < n; i++) {               \
+            objs[i].next = (list);                                  \
+            (list)       = &objs[i];                                \
+        }                                                           \
+    } while (0)
+
+static struct tnode *
+node_alloc(int type)
+{
+    if (free_nodes == NULL)
+        REFILL(free_nodes, struct tnode);
+
+    struct tnode *node = free_nodes;
+    if (node != NULL) {
+        free_nodes = node->next;
+        memzero(node, sizeof(*node));
+        node->type  = type;
+        node->nlink = 1;
+    }
+    return node;
+}
+
+static void
+node_free(struct tnode *node)
+{
+    uint64_t index = 0;
+    void    *page;
+    while ((page = radix_next(&node->pages, &index)) != NULL) {
+        radix_delete(&node->pages, index);
+        kpage_free(page, 1);
+    }
+    node->next = free_nodes;
+    free_nodes = node;
+}
+
+static inline struct tnode *
+tnode(const inode_t *inode)
+{
+    return (struct tnode *)inode->ino;
+}
+
+static struct tdirent *
+find(struct tnode *dir, const char *name, int len, struct tdirent ***link)
+{
+    struct tdirent **l = &dir->entries;
+    for (; *l != NULL; l = &(*l)->next) {
+        if ((*l)->len == len && !memcmp((*l)->name, name, len))
+            break;
+    }
+    if (link != NULL)
+        *link = l;
+    return *l;
+}
+
+static int
+tmpfs_lookup(inode_t *dir, const char *name, int len, uint64_t *ino)
+{
+    spin_lock(tmplock);
+    struct tdirent *ent = find(tnode(dir), name, len, NULL);
+    if (ent != NULL)
+        *ino = (uint64_t)ent->node;
+    spin_unlock(tmplock);
+    return ent != NULL ? 0 : -ENOENT;
+}
+
+static int
+tmpfs_create(inode_t *dir, const char *name, int len, int type,
+             uint64_t *ino)
+{
+    int err = 0;
+    spin_lock(tmplock);
+
+    struct tnode   *node = NULL;
+    struct tdirent *ent  = NULL;
+    if (find(tnode(dir), name, len, NULL) != NULL) {
+        err = -EEXIST;
+        goto done;
+    }
+
+    if (free_dirents == NULL)
+        REFILL(free_dirents, struct tdirent);
+    if ((ent = free_dirents) == NULL || (node = node_alloc(type)) == NULL) {
+        err = -ENOSPC;
+        goto done;
+    }
+    free_dirents = ent->next;
+
+    memcpy(ent->name, name, len);
+    ent->name[len]      = 0;
+    ent->len            = (uint8_t)len;
+    ent->node           = node;
+    ent->next           = tnode(dir)->entries;
+    tnode(dir)->entries = ent;
+    *ino                = (uint64_t)node;
+
+done:
+    spin_unlock(tmplock);
+    return err;
+}
+
+static int
+tmpfs_unlink(inode_t *dir, const char *name, int len, inode_t *inode)
+{
+    int err = 0;
+    spin_lock(tmplock);
+
+    struct tdirent **link;
+    struct tdirent  *ent = find(tnode(dir), name, len, &link);
+    if (ent == NULL)
+        err = -ENOENT;
+    else if (ent->node->type == T_DIR && ent->node->entries != NULL)
+        err = -ENOTEMPTY;
+    else {
+        *link        = ent->next;
+        ent->next    = free_dirents;
+        free_dirents = ent;
+
+        // The node itself is freed when the VFS evicts its inode.
+        inode->nlink = --tnode(inode)->nlink;
+    }
+
+    spin_unlock(tmplock);
+    return err;
+}
+
+static int64_t
+tmpfs_read(inode_t *inode, uint64_t off, void *buf, uint64_t len)
+{
+    struct tnode *node = tnode(inode);
+    if (off >= node->size)
+        return 0;
+    len = min(len, node->size - off);
+
+    uint8_t *dst = (uint8_t *)buf;
+    for (uint64_t done = 0; done < len;) {
+        uint64_t pos = off + done;
+        uint64_t n   = min(len - done, PAGE_SIZE - (pos & (PAGE_SIZE - 1)));
+
+        spin_lock(tmplock);
+        uint8_t *page = radix_lookup(&node->pages, pos / PAGE_SIZE);
+        if (page != NULL)
+            memcpy(dst + done, page + (pos & (PAGE_SIZE - 1)), n);
+        else
+            memzero(dst + done, n);     // A hole reads as zeros
+        spin_unlock(tmplock);
+
+        done += n;
+    }
+    return (int64_t)len;
+}
+
+// Return the frame for a file page, allocating it if needed. Called with
+// tmplock held.
+static uint8_t *
+page_get(struct tnode *node, uint64_t index)
+{
+    uint8_t *page = radix_lookup(&node->pages, index);
+    if (page == NULL && (page = kpage_alloc(1)) != NULL &&
+        !radix_insert(&node->pages, index, page)) {
+        kpage_free(page, 1);
+        page = NULL;
+    }
+    return page;
+}
+
+static int64_t
+tmpfs_write(inode_t *inode, uint64_t off, const void *buf, uint64_t len)
+{
+    struct tnode *node = tnode(inode);
+    if (off >= TMPFS_MAX_SIZE)
+        return -EFBIG;
+    len = min(len, TMPFS_MAX_SIZE - off);
+
+    const uint8_t *src  = (const uint8_t *)buf;
+    uint64_t       done = 0;
+    while (done < len) {
+        uint64_t pos = off + done;
+        uint64_t n   = min(len - done, PAGE_SIZE - (pos & (PAGE_SIZE - 1)));
+
+        spin_lock(tmplock);
+        uint8_t *page = page_get(node, pos / PAGE_SIZE);
+        if (page != NULL)
+            memcpy(page + (pos & (PAGE_SIZE - 1)), src + done, n);
+        spin_unlock(tmplock);
+        if (page == NULL)
+            break;
+
+        done += n;
+    }
+
+    if (off + done > node->size)
+        node->size = inode->size = off + done;
+    return (done > 0 || len == 0) ? (int64_t)done : -ENOSPC;
+}
+
+static int
+tmpfs_readdir(inode_t *dir, uint64_t *pos, dirent_t *ent)
+{
+    spin_lock(tmplock);
+    struct tdirent *e = tnode(dir)->entries;
+    for (uint64_t i = 0; e != NULL && i < *pos; i++)
+        e = e->next;
+    if (e != NULL) {
+        ent->ino  = (uint64_t)e->node;
+        ent->type = e->node->type;
+        memcpy(ent->name, e->name, e->len + 1);
+        (*pos)++;
+    }
+    spin_unlock(tmplock);
+    return e != NULL ? 1 : 0;
+}
+
+static int
+tmpfs_getpage(inode_t *inode, uint64_t index, bool write, void **page)
+{
+    struct tnode *node = tnode(inode);
+    if (!write && index >= div_up(node->size, PAGE_SIZE))
+        return -EINVAL;
+
+    spin_lock(tmplock);
+    uint8_t *frame = page_get(node, index);
+    if (frame != NULL)
+        kpage_ref(frame);
+    spin_unlock(tmplock);
+
+    if (frame == NULL)
+        return -ENOMEM;
+    *page = frame;
+    return 0;
+}
+
+static const inode_ops_t tmpfs_iops =
+{
+    .lookup  = tmpfs_lookup,
+    .create  = tmpfs_create,
+    .unlink  = tmpfs_unlink,
+    .read    = tmpfs_read,
+    .write   = tmpfs_write,
+    .readdir = tmpfs_readdir,
+    .getpage = tmpfs_getpage,
+};
+
+static int
+tmpfs_read_inode(inode_t *inode)
+{
+    struct tnode *node = tnode(inode);
+    inode->type  = node->type;
+    inode->nlink = node->nlink;
+    inode->size  = node->size;
+    inode->ops   = &tmpfs_iops;
+    return 0;
+}
+
+static void
+tmpfs_evict_inode(inode_t *inode)
+{
+    // Nodes still linked into the tree stay behind for the next lookup.
+    if (inode->nlink != 0)
+        return;
+
+    spin_lock(tmplock);
+    node_free(tnode(inode));
+    spin_unlock(tmplock);
+}
+
+static const super_ops_t tmpfs_sops =
+{
+    .read_inode  = tmpfs_read_inode,
+    .evict_inode = tmpfs_evict_inode,
+};
+
+static int
+tmpfs_mount(superblock_t *sb, blkdev_t *dev)
+{
+    (void)dev;
+
+    spin_lock(tmplock);
+    struct tnode *root = node_alloc(T_DIR);
+    spin_unlock(tmplock);
+    if (root == NULL)
+        return -ENOMEM;
+
+    sb->ops      = &tmpfs_sops;
+    sb->root_ino = (uint64_t)root;
+    return 0;
+}
+
+static const fstype_t tmpfs_type =
+{
+    .name  = "tmpfs",
+    .mount = tmpfs_mount,
+};
+
+void
+tmpfs_init()
+{
+    vfs_register_fs(&tmpfs_type);
+}
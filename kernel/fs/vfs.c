@@ -0,0 +1,842 @@
+//============================================================================
+/// @file       vfs.c
+/// @brief      Virtual file system layer.
+//============================================================================
+
+#include <core.h>
+#include <libc/string.h>
+#include <kernel/debug/log.h>
+#include <kernel/errno.h>
+#include <kernel/fcntl.h>
+#include <kernel/fs/vfs.h>
+#include <kernel/spinlock.h>
+
+#define DHASH_SIZE           256
+#define IHASH_SIZE           128
+
+// A list of unused cache entries, oldest first.
+#define LRU_DECLARE(name, type)  static struct { type *head, *tail; } name
+
+static const fstype_t *fstypes[MAX_FSTYPES];
+static int             fstype_count;
+
+static superblock_t    supers[MAX_MOUNTS];
+static int             super_count;
+static dentry_t       *root;
+
+static dentry_t        dentries[MAX_DENTRIES];
+static dentry_t       *dhash[DHASH_SIZE];
+static dentry_t       *dfree;
+static int             dused;
+LRU_DECLARE(dlru, dentry_t);
+
+static inode_t         inodes[MAX_INODES];
+static inode_t        *ihash[IHASH_SIZE];
+static inode_t        *ifree;
+static int             iused;
+LRU_DECLARE(ilru, inode_t);
+
+static file_t          files[MAX_FILES];
+
+// Protects the dentry and inode caches. Filesystem operations are called
+// without it held.
+static spin_lock_t     vfslock;
+
+//----------------------------------------------------------------------------
+// LRU helpers
+//----------------------------------------------------------------------------
+
+#define LRU_APPEND(list, e)                              \
+    do {                                                 \
+        (e)->lprev = (list).tail;                        \
+        (e)->lnext = NULL;                               \
+        if ((list).tail != NULL)                         \
+            (list).tail->lnext = (e);                    \
+        else                                             \
+            (list).head = (e);                           \
+        (list).tail = (e);                               \
+    } while (0)
+
+#define LRU_REMOVE(list, e)                              \
+    do {                                                 \
+        if ((e)->lprev != NULL)                          \
+            (e)->lprev->lnext = (e)->lnext;              \
+        else                                             \
+            (list).head = (e)->lnext;                    \
+        if ((e)->lnext != NULL)                          \
+            (e)->lnext->lprev = (e)->lprev;              \
+        else                                             \
+            (list).tail = (e)->lprev;                    \
+        (e)->lprev = (e)->lnext = NULL;                  \
+    } while (0)
+
+//----------------------------------------------------------------------------
+// Inode cache
+//----------------------------------------------------------------------------
+
+static dentry_t *
+dreclaim_locked(inode_t **iputs, int *niputs);
+
+static inline uint32_t
+ihash_index(const superblock_t *sb, uint64_t ino)
+{
+    uint64_t h = ((uint64_t)sb >> 4) ^ (ino * 0x9e3779b97f4a7c15ull);
+    return (uint32_t)(h >> 32) % IHASH_SIZE;
+}
+
+static void
+ihash_remove(inode_t *inode)
+{
+    inode_t **link = &ihash[ihash_index(inode->sb, inode->ino)];
+    while (*link != NULL && *link != inode)
+        link = &(*link)->hnext;
+    if (*link != NULL)
+        *link = inode->hnext;
+    inode->hnext = NULL;
+}
+
+static void
+iget_locked(inode_t *inode)
+{
+    if (inode->refcount++ == 0)
+        LRU_REMOVE(ilru, inode);
+}
+
+// Take an inode slot from the free pool or the oldest unused inode. The
+// reclaimed inode is returned in `evict' so its filesystem can release it
+// once vfslock is dropped.
+static inode_t *
+ialloc_locked(inode_t **evict)
+{
+    inode_t *inode;
+    *evict = NULL;
+
+    if (iused < MAX_INODES) {
+        inode = &inodes[iused++];
+    }
+    else if (ifree != NULL) {
+        inode = ifree;
+        ifree = inode->hnext;
+    }
+    else if ((inode = ilru.head) != NULL) {
+        LRU_REMOVE(ilru, inode);
+        ihash_remove(inode);
+        *evict = inode;
+    }
+    return inode;
+}
+
+static void
+evict(inode_t *inode)
+{
+    if (inode->sb->ops->evict_inode != NULL)
+        inode->sb->ops->evict_inode(inode);
+}
+
+int
+vfs_iget(superblock_t *sb, uint64_t ino, inode_t **out)
+{
+    spin_lock(vfslock);
+
+    uint32_t h = ihash_index(sb, ino);
+    for (inode_t *inode = ihash[h]; inode != NULL; inode = inode->hnext) {
+        if (inode->sb == sb && inode->ino == ino) {
+            iget_locked(inode);
+            spin_unlock(vfslock);
+            *out = inode;
+            return 0;
+        }
+    }
+
+    inode_t *old;
+    inode_t *inode;
+    while ((inode = ialloc_locked(&old)) == NULL) {
+        // Every cached inode is pinned by a dentry. Drop the oldest unused
+        // dentries until one of them releases an inode.
+        inode_t  *iputs[1];
+        int       niputs = 0;
+        dentry_t *d      = dreclaim_locked(iputs, &niputs);
+        if (d == NULL)
+            break;
+        d->hnext = dfree;
+        dfree    = d;
+        if (niputs > 0) {
+            spin_unlock(vfslock);
+            vfs_iput(iputs[0]);
+            spin_lock(vfslock);
+        }
+    }
+    spin_unlock(vfslock);
+
+    if (inode == NULL)
+        return -ENOMEM;
+    if (old != NULL)
+        evict(old);
+
+    memzero(inode, sizeof(*inode));
+    inode->sb       = sb;
+    inode->ino      = ino;
+    inode->refcount = 1;
+
+    int err = sb->ops->read_inode(inode);
+
+    spin_lock(vfslock);
+    if (err < 0) {
+        inode->hnext = ifree;
+        ifree        = inode;
+    }
+    else {
+        inode->hnext = ihash[h];
+        ihash[h]     = inode;
+    }
+    spin_unlock(vfslock);
+
+    if (err < 0)
+        return err;
+    *out = inode;
+    return 0;
+}
+
+void
+vfs_iput(inode_t *inode)
+{
+    spin_lock(vfslock);
+    if (--inode->refcount > 0) {
+        spin_unlock(vfslock);
+        return;
+    }
+
+    // An unlinked inode is released as soon as its last user goes.
+    if (inode->nlink == 0) {
+        ihash_remove(inode);
+        spin_unlock(vfslock);
+
+        evict(inode);
+
+        spin_lock(vfslock);
+        inode->hnext = ifree;
+        ifree        = inode;
+        spin_unlock(vfslock);
+        return;
+    }
+
+    LRU_APPEND(ilru, inode);
+    spin_unlock(vfslock);
+}
+
+//----------------------------------------------------------------------------
+// Dentry cache
+//----------------------------------------------------------------------------
+
+// FNV-1a over the parent pointer and the name.
+static uint32_t
+name_hash(const dentry_t *parent, const char *name, int len)
+{
+    uint32_t h = 2166136261u ^ (uint32_t)((uint64_t)parent >> 4);
+    for (int i = 0; i < len; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void
+dget_locked(dentry_t *d)
+{
+    if (d->refcount++ == 0)
+        LRU_REMOVE(dlru, d);
+}
+
+static void
+dhash_remove(dentry_t *d)
+{
+    dentry_t **link = &dhash[d->hash % DHASH_SIZE];
+    while (*link != NULL && *link != d)
+        link = &(*link)->hnext;
+    if (*link != NULL)
+        *link = d->hnext;
+    d->hnext = NULL;
+}
+
+static dentry_t *
+dfind_locked(const dentry_t *parent, const char *name, int len, uint32_t h)
+{
+    for (dentry_t *d = dhash[h % DHASH_SIZE]; d != NULL; d = d->hnext) {
+        if (d->hash == h && d->parent == parent && d->len == len &&
+            !memcmp(d->name, name, len))
+            return d;
+    }
+    return NULL;
+}
+
+static void
+dput_locked(dentry_t *d)
+{
+    if (--d->refcount == 0)
+        LRU_APPEND(dlru, d);
+}
+
+// Reclaim the oldest unused dentry. Its inode reference is returned in
+// `iputs' to be dropped after vfslock is released.
+static dentry_t *
+dreclaim_locked(inode_t **iputs, int *niputs)
+{
+    dentry_t *d = dlru.head;
+    if (d == NULL)
+        return NULL;
+
+    LRU_REMOVE(dlru, d);
+    dhash_remove(d);
+    if (d->inode != NULL)
+        iputs[(*niputs)++] = d->inode;
+
+    dentry_t *parent = d->parent;
+    d->inode  = NULL;
+    d->parent = NULL;
+    if (parent != NULL && parent != d)
+        dput_locked(parent);
+    return d;
+}
+
+// Allocate an unhashed dentry with a reference held.
+static dentry_t *
+dalloc_locked(inode_t **iputs, int *niputs)
+{
+    dentry_t *d;
+    if (dused < MAX_DENTRIES)
+        d = &dentries[dused++];
+    else if (dfree != NULL) {
+        d     = dfree;
+        dfree = d->hnext;
+    }
+    else if ((d = dreclaim_locked(iputs, niputs)) == NULL)
+        return NULL;
+
+    memzero(d, sizeof(*d));
+    d->refcount = 1;
+    return d;
+}
+
+void
+vfs_dput(dentry_t *d)
+{
+    spin_lock(vfslock);
+    dput_locked(d);
+    spin_unlock(vfslock);
+}
+
+static inline dentry_t *
+dget(dentry_t *d)
+{
+    spin_lock(vfslock);
+    dget_locked(d);
+    spin_unlock(vfslock);
+    return d;
+}
+
+// Find the child `name' of a positive directory dentry, asking the
+// filesystem on a cache miss. Misses are cached as negative dentries.
+static int
+dlookup(dentry_t *parent, const char *name, int len, dentry_t **out)
+{
+    if (len > NAME_MAX)
+        return -ENAMETOOLONG;
+
+    uint32_t h = name_hash(parent, name, len);
+
+    spin_lock(vfslock);
+    dentry_t *d = dfind_locked(parent, name, len, h);
+    if (d != NULL) {
+        dget_locked(d);
+        spin_unlock(vfslock);
+        *out = d;
+        return 0;
+    }
+    spin_unlock(vfslock);
+
+    inode_t *dir   = parent->inode;
+    inode_t *inode = NULL;
+    uint64_t ino;
+    int      err   = -ENOENT;
+    if (dir->ops->lookup != NULL)
+        err = dir->ops->lookup(dir, name, len, &ino);
+    if (err == 0)
+        err = vfs_iget(dir->sb, ino, &inode);
+    else if (err == -ENOENT)
+        err = 0;
+    if (err < 0)
+        return err;
+
+    inode_t *iputs[2];
+    int      niputs = 0;
+
+    spin_lock(vfslock);
+    d = dfind_locked(parent, name, len, h);
+    if (d != NULL) {
+        // Someone else cached the name while the filesystem was asked.
+        dget_locked(d);
+        if (inode != NULL)
+            iputs[niputs++] = inode;
+        inode = NULL;
+    }
+    else if ((d = dalloc_locked(iputs, &niputs)) != NULL) {
+        memcpy(d->name, name, len);
+        d->len    = (uint8_t)len;
+        d->hash   = h;
+        d->parent = parent;
+        d->inode  = inode;
+        dget_locked(parent);
+        d->hnext  = dhash[h % DHASH_SIZE];
+        dhash[h % DHASH_SIZE] = d;
+    }
+    spin_unlock(vfslock);
+
+    for (int i = 0; i < niputs; i++)
+        vfs_iput(iputs[i]);
+
+    if (d == NULL) {
+        if (inode != NULL)
+            vfs_iput(inode);
+        return -ENOMEM;
+    }
+    *out = d;
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+// Path resolution
+//----------------------------------------------------------------------------
+
+// Replace a referenced dentry with another, referencing the new one.
+static inline dentry_t *
+dswitch(dentry_t *from, dentry_t *to)
+{
+    dget(to);
+    vfs_dput(from);
+    return to;
+}
+
+// Resolve an absolute path to a referenced dentry, which may be negative.
+static int
+walk(const char *path, dentry_t **out)
+{
+    if (root == NULL)
+        return -ENOENT;
+    if (path[0] != '/')
+        return -EINVAL;
+
+    dentry_t *d = dget(root);
+    while (*path != 0) {
+        while (*path == '/')
+            path++;
+        if (*path == 0)
+            break;
+
+        const char *name = path;
+        while (*path != 0 && *path != '/')
+            path++;
+        int len = (int)(path - name);
+
+        if (d->inode == NULL) {
+            vfs_dput(d);
+            return -ENOENT;
+        }
+        if (d->inode->type != T_DIR) {
+            vfs_dput(d);
+            return -ENOTDIR;
+        }
+
+        if (len == 1 && name[0] == '.')
+            continue;
+
+        if (len == 2 && name[0] == '.' && name[1] == '.') {
+            // Leave any mounts whose root we're at, then go up.
+            while (d == d->inode->sb->root && d->inode->sb->covered != NULL)
+                d = dswitch(d, d->inode->sb->covered);
+            d = dswitch(d, d->parent);
+            continue;
+        }
+
+        dentry_t *child;
+        int       err = dlookup(d, name, len, &child);
+        vfs_dput(d);
+        if (err < 0)
+            return err;
+        d = child;
+
+        // Cross into filesystems mounted here.
+        while (d->mounted != NULL)
+            d = dswitch(d, d->mounted->root);
+    }
+
+    *out = d;
+    return 0;
+}
+
+int
+vfs_lookup(const char *path, dentry_t **out)
+{
+    dentry_t *d;
+    int       err = walk(path, &d);
+    if (err < 0)
+        return err;
+    if (d->inode == NULL) {
+        vfs_dput(d);
+        return -ENOENT;
+    }
+    *out = d;
+    return 0;
+}
+
+// Create the inode for a negative dentry, making it positive.
+static int
+dcreate(dentry_t *d, int type)
+{
+    inode_t *dir = d->parent->inode;
+    if (dir->sb->readonly)
+        return -EROFS;
+    if (dir->ops->create == NULL)
+        return -ENOSYS;
+
+    uint64_t ino;
+    int      err = dir->ops->create(dir, d->name, d->len, type, &ino);
+    if (err < 0)
+        return err;
+
+    inode_t *inode;
+    if ((err = vfs_iget(dir->sb, ino, &inode)) < 0)
+        return err;
+
+    spin_lock(vfslock);
+    d->inode = inode;
+    spin_unlock(vfslock);
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+// Filesystems and mounts
+//----------------------------------------------------------------------------
+
+int
+vfs_register_fs(const fstype_t *type)
+{
+    if (fstype_count == MAX_FSTYPES)
+        return -ENOMEM;
+    fstypes[fstype_count++] = type;
+    return 0;
+}
+
+int
+vfs_mount(const char *path, const char *fsname, blkdev_t *dev,
+          bool readonly)
+{
+    const fstype_t *type = NULL;
+    for (int i = 0; i < fstype_count; i++) {
+        if (!strcmp(fstypes[i]->name, fsname))
+            type = fstypes[i];
+    }
+    if (type == NULL)
+        return -ENODEV;
+    if (super_count == MAX_MOUNTS)
+        return -ENOMEM;
+
+    // Find the directory to cover, unless this is the root mount.
+    dentry_t *covered = NULL;
+    if (root != NULL) {
+        int err = vfs_lookup(path, &covered);
+        if (err < 0)
+            return err;
+        int busy = (covered->mounted != NULL) ? -EBUSY : 0;
+        if (covered->inode->type != T_DIR)
+            busy = -ENOTDIR;
+        if (busy < 0) {
+            vfs_dput(covered);
+            return busy;
+        }
+    }
+    else if (strcmp(path, "/")) {
+        return -ENOENT;
+    }
+
+    superblock_t *sb = &supers[super_count];
+    memzero(sb, sizeof(*sb));
+    sb->type     = type;
+    sb->dev      = dev;
+    sb->readonly = readonly;
+
+    inode_t *inode;
+    int      err = type->mount(sb, dev);
+    if (err == 0)
+        err = vfs_iget(sb, sb->root_ino, &inode);
+    if (err < 0) {
+        if (covered != NULL)
+            vfs_dput(covered);
+        // -EINVAL means the device doesn't hold this filesystem, which
+        // callers probing several devices expect.
+        if (err != -EINVAL)
+            logf(LOG_WARNING, "[vfs] Mounting %s at %s failed (%d).",
+                 fsname, path, err);
+        return err;
+    }
+
+    inode_t *iputs[2];
+    int      niputs = 0;
+
+    spin_lock(vfslock);
+    dentry_t *d = dalloc_locked(iputs, &niputs);
+    if (d != NULL) {
+        d->name[0] = '/';
+        d->len     = 1;
+        d->parent  = d;
+        d->inode   = inode;
+        sb->root   = d;
+
+        // The mount keeps its root and the covered directory referenced.
+        sb->covered = covered;
+        if (covered != NULL)
+            covered->mounted = sb;
+        else
+            root = d;
+        super_count++;
+    }
+    spin_unlock(vfslock);
+
+    for (int i = 0; i < niputs; i++)
+        vfs_iput(iputs[i]);
+
+    if (d == NULL) {
+        vfs_iput(inode);
+        if (covered != NULL)
+            vfs_dput(covered);
+        return -ENOMEM;
+    }
+
+    logf(LOG_INFO, "[vfs] Mounted %s%s%s at %s%s.", fsname,
+         dev != NULL ? " on " : "", dev != NULL ? dev->name : "", path,
+         readonly ? " (read-only)" : "");
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+// Files
+//----------------------------------------------------------------------------
+
+int
+vfs_open(const char *path, int flags, file_t **out)
+{
+    dentry_t *d;
+    int       err = walk(path, &d);
+    if (err < 0)
+        return err;
+
+    if (d->inode == NULL) {
+        err = (flags & O_CREATE) ? dcreate(d, T_FILE) : -ENOENT;
+        if (err < 0) {
+            vfs_dput(d);
+            return err;
+        }
+    }
+
+    inode_t *inode = d->inode;
+    bool     write = (flags & (O_WRONLY | O_RDWR)) != 0;
+    if (write && inode->type == T_DIR)
+        err = -EISDIR;
+    else if (write && inode->sb->readonly)
+        err = -EROFS;
+    if (err < 0) {
+        vfs_dput(d);
+        return err;
+    }
+
+    spin_lock(vfslock);
+    file_t *file = NULL;
+    for (int i = 0; i < MAX_FILES && file == NULL; i++) {
+        if (files[i].refcount == 0)
+            file = &files[i];
+    }
+    if (file != NULL) {
+        file->dentry   = d;
+        file->inode    = inode;
+        file->flags    = flags;
+        file->pos      = 0;
+        file->refcount = 1;
+        iget_locked(inode);
+    }
+    spin_unlock(vfslock);
+
+    if (file == NULL) {
+        vfs_dput(d);
+        return -ENFILE;
+    }
+    *out = file;
+    return 0;
+}
+
+void
+vfs_close(file_t *file)
+{
+    spin_lock(vfslock);
+    bool last = (--file->refcount == 0);
+    spin_unlock(vfslock);
+
+    if (last) {
+        vfs_iput(file->inode);
+        vfs_dput(file->dentry);
+    }
+}
+
+int64_t
+vfs_read(file_t *file, void *buf, uint64_t len)
+{
+    inode_t *inode = file->inode;
+    if ((file->flags & (O_WRONLY | O_RDWR)) == O_WRONLY)
+        return -EBADF;
+    if (inode->type == T_DIR)
+        return -EISDIR;
+    if (inode->ops->read == NULL)
+        return -EINVAL;
+
+    int64_t n = inode->ops->read(inode, file->pos, buf, len);
+    if (n > 0)
+        file->pos += n;
+    return n;
+}
+
+int64_t
+vfs_write(file_t *file, const void *buf, uint64_t len)
+{
+    inode_t *inode = file->inode;
+    if ((file->flags & (O_WRONLY | O_RDWR)) == 0)
+        return -EBADF;
+    if (inode->ops->write == NULL)
+        return -EINVAL;
+
+    int64_t n = inode->ops->write(inode, file->pos, buf, len);
+    if (n > 0)
+        file->pos += n;
+    return n;
+}
+
+int
+vfs_seek(file_t *file, uint64_t pos)
+{
+    if (file->inode->type == T_DIR)
+        return -EISDIR;
+    file->pos = pos;
+    return 0;
+}
+
+int
+vfs_readdir(file_t *file, dirent_t *ent)
+{
+    inode_t *inode = file->inode;
+    if (inode->type != T_DIR)
+        return -ENOTDIR;
+    if (inode->ops->readdir == NULL)
+        return -EINVAL;
+    return inode->ops->readdir(inode, &file->pos, ent);
+}
+
+int
+vfs_mmap(file_t *file, pagetable_t *pt, void *vaddr, uint64_t off,
+         uint64_t len)
+{
+    inode_t *inode = file->inode;
+    if (inode->ops->getpage == NULL)
+        return -ENOSYS;
+    if (((uint64_t)vaddr | off) & (PAGE_SIZE - 1))
+        return -EINVAL;
+
+    bool     write = (file->flags & (O_WRONLY | O_RDWR)) != 0;
+    uint8_t *va    = (uint8_t *)vaddr;
+    uint64_t count = div_up(len, PAGE_SIZE);
+    for (uint64_t i = 0; i < count; i++) {
+        void *page;
+        int   err = inode->ops->getpage(inode, off / PAGE_SIZE + i, write,
+                                        &page);
+        if (err < 0) {
+            if (i > 0)
+                page_free(pt, vaddr, (int)i);
+            return err;
+        }
+        page_map(pt, va + i * PAGE_SIZE, page, write);
+        kpage_free(page, 1);
+    }
+
+    // Writable pages of a disk filesystem are page cache frames, which
+    // the cache writes back once it sees the mapping has dirtied them.
+    // Without tracking, writes through the mapping would never reach the
+    // disk, so refuse the mapping instead.
+    if (write && inode->sb->dev != NULL &&
+        !page_track_dirty(pt, vaddr, (int)count)) {
+        page_free(pt, vaddr, (int)count);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+// Namespace operations
+//----------------------------------------------------------------------------
+
+int
+vfs_stat(const char *path, struct stat *st)
+{
+    dentry_t *d;
+    int       err = vfs_lookup(path, &d);
+    if (err < 0)
+        return err;
+
+    inode_t *inode = d->inode;
+    st->type  = (short)inode->type;
+    st->dev   = (int)(inode->sb - supers);
+    st->ino   = (unsigned int)inode->ino;
+    st->nlink = (short)inode->nlink;
+    st->size  = (unsigned int)inode->size;
+
+    vfs_dput(d);
+    return 0;
+}
+
+int
+vfs_mkdir(const char *path)
+{
+    dentry_t *d;
+    int       err = walk(path, &d);
+    if (err < 0)
+        return err;
+
+    err = (d->inode != NULL) ? -EEXIST : dcreate(d, T_DIR);
+    vfs_dput(d);
+    return err;
+}
+
+int
+vfs_unlink(const char *path)
+{
+    dentry_t *d;
+    int       err = vfs_lookup(path, &d);
+    if (err < 0)
+        return err;
+
+    inode_t *inode = d->inode;
+    inode_t *dir   = d->parent->inode;
+    if (d == d->parent || d->mounted != NULL)
+        err = -EBUSY;
+    else if (dir->sb->readonly)
+        err = -EROFS;
+    else if (dir->ops->unlink == NULL)
+        err = -ENOSYS;
+    else
+        err = dir->ops->unlink(dir, d->name, d->len, inode);
+
+    if (err == 0) {
+        // The name now caches as negative; the inode lives on while open.
+        spin_lock(vfslock);
+        d->inode = NULL;
+        spin_unlock(vfslock);
+        vfs_iput(inode);
+    }
+    vfs_dput(d);
+    return err;
+}
@@ -41,11 +41,11 @@ dump_context(int id, const interrupt_context_t *context)
 {
     tty_printf(
         id,
-        "INT: %02x   Error: %08x\n\n",
+        "INT: %02lx   Error: %08lx\n\n",
         context->interrupt, context->error);
     tty_printf(
         id,
-        "CS:RIP: %04x:%016lx             SS:RSP: %04x:%016lx\n\n",
+        "CS:RIP: %04lx:%016lx             SS:RSP: %04lx:%016lx\n\n",
         context->cs, context->retaddr, context->ss, context->rsp);
 
     char buf[640];
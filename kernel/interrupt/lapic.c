@@ -0,0 +1,91 @@
+//============================================================================
+/// @file       lapic.c
+/// @brief      Local advanced programmable interrupt controller (APIC).
+//============================================================================
+
+#include <core.h>
+#include <kernel/debug/log.h>
+#include <kernel/interrupt/interrupt.h>
+#include <kernel/interrupt/lapic.h>
+#include <kernel/mem/acpi.h>
+
+// Local APIC register offsets
+#define LAPIC_REG_ID   0x020   ///< Local APIC ID
+#define LAPIC_REG_EOI  0x0b0   ///< End of interrupt
+#define LAPIC_REG_SVR  0x0f0   ///< Spurious interrupt vector
+
+// Spurious interrupt vector register bits
+#define LAPIC_SVR_ENABLE  (1 << 8)
+
+static volatile uint8_t *lapic;
+
+static inline uint32_t
+read_reg(uint32_t reg)
+{
+    return *(volatile uint32_t *)(lapic + reg);
+}
+
+static inline void
+write_reg(uint32_t reg, uint32_t value)
+{
+    *(volatile uint32_t *)(lapic + reg) = value;
+}
+
+static void
+isr_spurious(const interrupt_context_t *context)
+{
+    (void)context;
+
+    // Spurious interrupts must not be acknowledged with an EOI.
+}
+
+bool
+lapic_init()
+{
+    // The local APIC registers were mapped uncached by acpi_init.
+    const struct acpi_madt *madt = acpi_madt();
+    if (madt == NULL || madt->ptr_local_apic == 0) {
+        logf(LOG_WARNING, "[lapic] No local APIC found.");
+        return false;
+    }
+
+    lapic = (volatile uint8_t *)(uintptr_t)madt->ptr_local_apic;
+
+    isr_set(TRAP_LAPIC_SPURIOUS, isr_spurious);
+    write_reg(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | TRAP_LAPIC_SPURIOUS);
+
+    logf(LOG_INFO, "[lapic] Local APIC %u enabled at %#x.", lapic_id(),
+         madt->ptr_local_apic);
+    return true;
+}
+
+bool
+lapic_present()
+{
+    return lapic != NULL;
+}
+
+uint8_t
+lapic_id()
+{
+    return (uint8_t)(read_reg(LAPIC_REG_ID) >> 24);
+}
+
+int
+lapic_cpu_count()
+{
+    int count = 0;
+
+    const struct acpi_madt_local_apic *entry = NULL;
+    while ((entry = acpi_next_local_apic(entry)) != NULL) {
+        if (entry->flags & 1)
+            count++;
+    }
+    return count > 0 ? count : 1;
+}
+
+void
+lapic_eoi()
+{
+    write_reg(LAPIC_REG_EOI, 0);
+}
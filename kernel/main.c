@@ -5,15 +5,28 @@
 ///             function called by the kernel's start code in start.asm.
 //============================================================================
 
+#include <kernel/device/ahci.h>
 #include <kernel/device/keyboard.h>
+#include <kernel/device/nvme.h>
 #include <kernel/device/pci.h>
+#include <kernel/device/serial.h>
 #include <kernel/device/timer.h>
 #include <kernel/device/tty.h>
+#include <kernel/device/virtio_blk.h>
+#include <kernel/device/virtio_net.h>
+#include <kernel/fs/ext2.h>
+#include <kernel/fs/initrd.h>
+#include <kernel/fs/iso9660.h>
+#include <kernel/fs/tmpfs.h>
+#include <kernel/fs/vfs.h>
 #include <kernel/interrupt/exception.h>
 #include <kernel/interrupt/interrupt.h>
+#include <kernel/interrupt/lapic.h>
 #include <kernel/mem/acpi.h>
 #include <kernel/mem/paging.h>
 #include <kernel/mem/pmap.h>
+#include <kernel/net/net.h>
+#include <kernel/net/netdev.h>
 #include <kernel/syscall/syscall.h>
 #include <kernel/x86/cpu.h>
 #include <kernel/spinlock.h>
@@ -67,8 +80,8 @@ void cpu_init(void)
 
     // get linear/physical address size
     get_cpuid(0x80000008, 0, &CpuFacName[0], &CpuFacName[1], &CpuFacName[2], &CpuFacName[3]);
-    tty_printf(TTY_CONSOLE, "Physical Address size:%#08d\n", (CpuFacName[0] & 0xFF));
-    tty_printf(TTY_CONSOLE, "Linear Address size:%#08d\n", (CpuFacName[0] >> 8 & 0xFF));
+    tty_printf(TTY_CONSOLE, "Physical Address size:%08d\n", (CpuFacName[0] & 0xFF));
+    tty_printf(TTY_CONSOLE, "Linear Address size:%08d\n", (CpuFacName[0] >> 8 & 0xFF));
 
     // max cpuid operation code
     get_cpuid(0, 0, &CpuFacName[0], &CpuFacName[1], &CpuFacName[2], &CpuFacName[3]);
@@ -88,11 +101,54 @@ void kmain()
     // Interrupt initialization
     interrupts_init();
     exceptions_init();
+    lapic_init();
 
     // Device initialization
+    serial_init();
+    serial_log_init(COM1, LOG_DEFAULT);
     tty_init();
     kb_init();
     timer_init(20); // 20Hz
+    net_init();
+    pci_init();
+    virtio_blk_init();
+    virtio_net_init();
+    ahci_init();
+    nvme_init();
+
+    // Filesystem initialization
+    tmpfs_init();
+    iso9660_init();
+    initrd_init();
+    ext2_init();
+    vfs_mount("/", "tmpfs", NULL, false);
+
+    // Expose the initrd the boot loader left in memory, if there is one.
+    uint64_t initrd_size;
+    if (pmap_initrd(&initrd_size) != NULL) {
+        vfs_mkdir("/initrd");
+        vfs_mount("/initrd", "initrd", NULL, true);
+    }
+
+    // Mount the first device holding a CD-ROM filesystem.
+    vfs_mkdir("/cdrom");
+    for (blkdev_t *dev = blkdev_next(NULL); dev; dev = blkdev_next(dev)) {
+        if (vfs_mount("/cdrom", "iso9660", dev, true) == 0)
+            break;
+    }
+
+    // Mount the first disk holding an ext2 filesystem.
+    vfs_mkdir("/mnt");
+    for (blkdev_t *dev = blkdev_next(NULL); dev; dev = blkdev_next(dev)) {
+        if (vfs_mount("/mnt", "ext2", dev, false) == 0)
+            break;
+    }
+
+    // Give the first network interface QEMU's user-mode network address.
+    netdev_t *eth0 = netdev_find("eth0");
+    if (eth0 != NULL)
+        net_config(eth0, IP4_ADDR(10, 0, 2, 15), IP4_ADDR(255, 255, 255, 0),
+                   IP4_ADDR(10, 0, 2, 2));
 
     // System call initialization
     syscall_init();
@@ -108,12 +164,12 @@ void kmain()
 
     spin_lock(test_lock);
     tty_print(TTY_CONSOLE, "page region\n");
-    tty_printf(TTY_CONSOLE, "cr3: %#016X\n", read_cr3());
+    tty_printf(TTY_CONSOLE, "cr3: %#016lX\n", read_cr3());
     const pmap_t *map = pmap();
     for (int i = 0; i < 3; i++) {
         tty_printf(TTY_CONSOLE, "Region %d Type: %d\n", (i), (map->region[i].type));
-        tty_printf(TTY_CONSOLE, "Region %d Base Address: %#016X\n", (i), (map->region[i].addr));
-        tty_printf(TTY_CONSOLE, "Region %d Size: %#016X\n", (i), (map->region[i].size));
+        tty_printf(TTY_CONSOLE, "Region %d Base Address: %#016lX\n", (i), (map->region[i].addr));
+        tty_printf(TTY_CONSOLE, "Region %d Size: %#016lX\n", (i), (map->region[i].size));
     }
     spin_unlock(test_lock);
 
@@ -354,6 +354,15 @@ acpi_init()
         pmap_add(PAGE_ALIGN_DOWN(io->ptr_io_apic), PAGE_SIZE,
                  PMEMTYPE_UNCACHED);
     }
+
+    // 保留 PCIe ECAM 内存映射配置空间，每条总线占用 1MiB。
+    // 这样内核页表会以不可缓存的方式映射这些区域，PCI 驱动可以直接访问。
+    const struct acpi_mcfg_addr *mcfg = NULL;
+    while ((mcfg = acpi_next_mcfg_addr(mcfg)) != NULL) {
+        uint64_t first = mcfg->base + ((uint64_t)mcfg->bus_start << 20);
+        uint64_t buses = (uint64_t)(mcfg->bus_end - mcfg->bus_start) + 1;
+        pmap_add(first, buses << 20, PMEMTYPE_UNCACHED);
+    }
 }
 
 int
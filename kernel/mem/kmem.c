@@ -216,3 +216,31 @@ kmem_init(pagetable_t *pt)
     for (uint64_t r = 0; r < map->count; r++)
         map_region(pt, map, &map->region[r]);
 }
+
+void
+kmem_map(pagetable_t *pt, uint64_t addr, uint64_t size, uint32_t memtype)
+{
+    uint64_t term = (addr + size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    addr &= ~(uint64_t)(PAGE_SIZE - 1);
+
+    for (; addr < term; addr += PAGE_SIZE) {
+
+        // Skip addresses already covered by a large or huge page. These were
+        // created by kmem_init and already carry the region's cache flags.
+        // 跳过已经被大页或者巨页覆盖的地址
+        page_t *pml4t = (page_t *)pt->proot;
+        uint64_t pml4e = pml4t->entry[PML4E(addr)];
+        if (pml4e != 0) {
+            uint64_t pdpte = PGPTR(pml4e)->entry[PDPTE(addr)];
+            if (pdpte & PF_PS)
+                continue;
+            if (pdpte != 0) {
+                uint64_t pde = PGPTR(pdpte)->entry[PDE(addr)];
+                if (pde & PF_PS)
+                    continue;
+            }
+        }
+
+        create_small_page(pt, addr, memtype);
+    }
+}
@@ -34,12 +34,26 @@
 #define KMEM_KERNEL_IMAGE            0x00300000
 #define KMEM_KERNEL_ENTRYPOINT       0x00301000
 #define KMEM_KERNEL_IMAGE_END        0x00a00000
+#define KMEM_INITRD                  0x00a00000
 
 #define KMEM_EXTENDED_BIOS_SIZE      0x00000800
 #define KMEM_VIDEO_SIZE              0x00020000
 #define KMEM_SYSTEM_ROM_SIZE         0x00040000
 #define KMEM_KERNEL_PAGETABLE_SIZE   0x00050000
 
+// boot loader留在KMEM_GLOBALS的全局变量(boot/include/globals.inc中的Globals)
+typedef struct kmem_globals
+{
+    uint32_t drive_number;
+    uint16_t root_directory_sector;
+    uint16_t kernel_sector;
+    uint32_t kernel_size;
+    uint32_t cpu_feature_bits_ecx;
+    uint32_t cpu_feature_bits_edx;
+    uint32_t initrd_address;        ///< initrd的物理地址
+    uint32_t initrd_size;           ///< initrd的大小，没有加载initrd时为0
+} kmem_globals_t;
+
 //----------------------------------------------------------------------------
 //  @function       kmem_init
 /// @brief          Using the contents of the physical memory map, identity
@@ -49,3 +63,17 @@
 //----------------------------------------------------------------------------
 void
 kmem_init(pagetable_t *pt);
+
+//----------------------------------------------------------------------------
+//  @function       kmem_map
+/// @brief          Identity map a physical address range into the kernel's
+///                 page table after kmem_init has run.
+/// @details        Pages already covered by a large or huge page mapping are
+///                 left untouched.
+/// @param[inout]   pt      The kernel page table.
+/// @param[in]      addr    Physical address of the range.
+/// @param[in]      size    Size of the range in bytes.
+/// @param[in]      memtype The pmemtype used to select page flags.
+//----------------------------------------------------------------------------
+void
+kmem_map(pagetable_t *pt, uint64_t addr, uint64_t size, uint32_t memtype);
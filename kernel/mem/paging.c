@@ -10,6 +10,7 @@
 #include <kernel/interrupt/interrupt.h>
 #include <kernel/mem/pmap.h>
 #include <kernel/mem/paging.h>
+#include <kernel/spinlock.h>
 #include "kmem.h"
 
 // add_pte addflags
@@ -22,6 +23,12 @@
 // 物理页编号常量(Page frame number constants)
 #define PFN_INVALID        ((uint32_t)-1)
 
+// 物理页标志(Page frame flags)
+#define PFF_DIRTY          (1 << 0)   // 通过映射被写过(Written through a mapping)
+
+// 被收集脏位的可写映射的最大数量(Max writable mappings with collected dirty bits)
+#define MAX_TRACKED        32
+
 // 一些辅助的宏
 #define PADDR_TO_PF(a)     ((pf_t *)(pfdb.pf + ((a) >> PAGE_SHIFT)))
 #define PF_TO_PADDR(pf)    ((uint64_t)((pf) - pfdb.pf) << PAGE_SHIFT)
@@ -63,9 +70,20 @@ struct pfdb
     uint32_t tail;        ///< 可用物理页列表尾部的索引(Index of available frame list tail)
 };
 
-static struct pfdb  pfdb;      // 全局物理页数据库(Global page frame database)
-static pagetable_t  kpt;       // 内核页表(所有物理内存)
-static pagetable_t *active_pt; // 当前活跃的页表(Currently active page table)
+/// 一段需要收集脏位的可写映射(A writable mapping whose dirty bits are collected)
+struct tracked
+{
+    pagetable_t *pt;      ///< 映射所在的页表，空闲时为NULL
+    uint64_t     vaddr;   ///< 第一页的虚拟地址
+    int          count;   ///< 页数
+};
+
+static struct pfdb    pfdb;      // 全局物理页数据库(Global page frame database)
+static spin_lock_t    pflock;    // 保护kpage_*对物理页数据库的访问
+static pagetable_t    kpt;       // 内核页表(所有物理内存)
+static pagetable_t   *active_pt; // 当前活跃的页表(Currently active page table)
+static struct tracked tracked[MAX_TRACKED];
+static uint32_t       dirty_frames; // 带有PFF_DIRTY的物理页数量
 
 // TODO: 支持多核
 
@@ -191,6 +209,9 @@ pfalloc()
     pfdb.head = pfdb.pf[pfdb.head].next;
     if (pfdb.head != PFN_INVALID)
         pfdb.pf[pfdb.head].prev = PFN_INVALID;
+    else
+        pfdb.tail = PFN_INVALID;
+    pfdb.avail--;
 
     // 初始化然后返回物理页
     memzero(pf, sizeof(pf_t));
@@ -204,6 +225,8 @@ pffree(pf_t *pf)
 {
     if (pf->type != PFTYPE_ALLOCATED)
         fatal();
+    if (pf->flags & PFF_DIRTY)
+        dirty_frames--;
 
     // 重新初始化物理页记录
     memzero(pf, sizeof(pf_t));
@@ -213,12 +236,35 @@ pffree(pf_t *pf)
 
     // 更新数据库中的可用物理页列表
     uint32_t pfn = PF_TO_PFN(pf);
-    pfdb.pf[pfdb.head].prev = pfn;
-    pfdb.head               = pfn;
+    if (pfdb.head != PFN_INVALID)
+        pfdb.pf[pfdb.head].prev = pfn;
+    else
+        pfdb.tail = pfn;
+    pfdb.head = pfn;
 
     pfdb.avail++;
 }
 
+// 从可用物理页列表中摘除一个物理页(Unlink a frame from the available list)
+static void
+pfunlink(pf_t *pf)
+{
+    if (pf->prev != PFN_INVALID)
+        pfdb.pf[pf->prev].next = pf->next;
+    else
+        pfdb.head = pf->next;
+
+    if (pf->next != PFN_INVALID)
+        pfdb.pf[pf->next].prev = pf->prev;
+    else
+        pfdb.tail = pf->prev;
+
+    memzero(pf, sizeof(pf_t));
+    pf->refcount = 1;
+    pf->type     = PFTYPE_ALLOCATED;
+    pfdb.avail--;
+}
+
 static uint64_t
 pgalloc()
 {
@@ -233,9 +279,35 @@ pgalloc()
     return paddr;
 }
 
+/// 保留内存(例如initrd)中的物理页不属于物理页数据库，不做引用计数
+static bool
+pfreserved(uint64_t paddr)
+{
+    return (paddr >> PAGE_SHIFT) >= pfdb.count ||
+           PADDR_TO_PF(paddr)->type == PFTYPE_RESERVED;
+}
+
+/// 将页表项的脏位转移到它映射的物理页上(Move a PTE's dirty bit to its frame)
+static void
+pfdirty(uint64_t pte)
+{
+    uint64_t paddr = PTE_TO_PADDR(pte);
+    if (!(pte & PF_DIRTY) || pfreserved(paddr))
+        return;
+
+    pf_t *pf = PADDR_TO_PF(paddr);
+    if (pf->type == PFTYPE_ALLOCATED && !(pf->flags & PFF_DIRTY)) {
+        pf->flags |= PFF_DIRTY;
+        dirty_frames++;
+    }
+}
+
 static void
 pgfree(uint64_t paddr)
 {
+    if (pfreserved(paddr))
+        return;
+
     pf_t *pf = PADDR_TO_PF(paddr);
     if (--pf->refcount == 0)
         pffree(pf);
@@ -251,8 +323,10 @@ pgfree_recurse(page_t *page, int level)
             if (paddr == 0)
                 continue;
             pf_t *pf = PADDR_TO_PF(paddr);
-            if (pf->type == PFTYPE_ALLOCATED)
+            if (pf->type == PFTYPE_ALLOCATED) {
+                pfdirty(page->entry[e]);
                 pgfree(paddr);
+            }
         }
     }
 
@@ -343,7 +417,8 @@ remove_pte(pagetable_t *pt, uint64_t vaddr)
     page_t *ptt   = PGPTR(pdt->entry[pde]);
     page_t *pg    = PGPTR(ptt->entry[pte]);
 
-    // 清除虚拟地址的页表项
+    // 清除虚拟地址的页表项，映射期间的写入记录到物理页上
+    pfdirty(ptt->entry[pte]);
     ptt->entry[pte] = 0;
 
     // 将删除的物理页对应的TLB项置为无效
@@ -385,6 +460,16 @@ pagetable_destroy(pagetable_t *pt)
     if (pt->proot == 0)
         fatal();
 
+    // 停止收集这个页表中映射的脏位(Stop collecting its dirty bits)
+    uint64_t flags = save_interrupts();
+    spin_lock(pflock);
+    for (int i = 0; i < MAX_TRACKED; i++) {
+        if (tracked[i].pt == pt)
+            tracked[i].pt = NULL;
+    }
+    spin_unlock(pflock);
+    restore_interrupts(flags);
+
     // 从PML4表中递归的删除所有物理页
     pgfree_recurse((page_t *)pt->proot, 4);
 
@@ -421,11 +506,242 @@ page_alloc(pagetable_t *pt, void *vaddr_in, int count)
     return vaddr_in;
 }
 
+// 停止收集[start, end)中的脏位，释放完全被覆盖的跟踪槽
+// (Stop tracking [start, end), releasing slots it covers completely)
+static void
+untrack(pagetable_t *pt, uint64_t start, uint64_t end)
+{
+    uint64_t flags = save_interrupts();
+    spin_lock(pflock);
+
+    for (int i = 0; i < MAX_TRACKED; i++) {
+        if (tracked[i].pt != pt)
+            continue;
+
+        uint64_t first = tracked[i].vaddr;
+        uint64_t last  = first + (uint64_t)tracked[i].count * PAGE_SIZE;
+        if (end <= first || start >= last)
+            continue;
+
+        // 只裁剪两端；中间的空洞由page_harvest_dirty跳过
+        // (Only the ends are trimmed; page_harvest_dirty skips holes)
+        if (start <= first && end >= last) {
+            tracked[i].pt = NULL;
+            continue;
+        }
+        if (start <= first)
+            first = end;
+        else if (end >= last)
+            last = start;
+        tracked[i].vaddr = first;
+        tracked[i].count = (int)((last - first) / PAGE_SIZE);
+    }
+
+    spin_unlock(pflock);
+    restore_interrupts(flags);
+}
+
 void
 page_free(pagetable_t *pt, void *vaddr_in, int count)
 {
-    for (uint64_t vaddr = (uint64_t)vaddr_in; count--; vaddr += PAGE_SIZE) {
+    uint64_t start = (uint64_t)vaddr_in;
+    uint64_t end   = start + (uint64_t)count * PAGE_SIZE;
+    for (uint64_t vaddr = start; vaddr < end; vaddr += PAGE_SIZE) {
         uint64_t paddr = remove_pte(pt, vaddr);
         pgfree(paddr);
     }
+    untrack(pt, start, end);
+}
+
+void
+page_map(pagetable_t *pt, void *vaddr, void *page, bool writable)
+{
+    kpage_ref(page);
+    add_pte(pt, (uint64_t)vaddr, (uint64_t)page,
+            PF_PRESENT | (writable ? PF_RW : 0), 0);
+}
+
+// 查找虚拟地址的页表项，不创建页表。不存在时返回NULL
+// (Find the PTE for a virtual address without creating tables)
+static uint64_t *
+find_pte(pagetable_t *pt, uint64_t vaddr)
+{
+    uint32_t index[3] = { PML4E(vaddr), PDPTE(vaddr), PDE(vaddr) };
+    page_t  *table    = (page_t *)pt->proot;
+    for (int level = 0; level < 3; level++) {
+        uint64_t entry = table->entry[index[level]];
+        if (!(entry & PF_PRESENT) || (entry & PF_PS))
+            return NULL;
+        table = PGPTR(entry);
+    }
+    return &table->entry[PTE(vaddr)];
+}
+
+bool
+page_track_dirty(pagetable_t *pt, void *vaddr, int count)
+{
+    bool     added = false;
+    uint64_t flags = save_interrupts();
+    spin_lock(pflock);
+
+    for (int i = 0; i < MAX_TRACKED && !added; i++) {
+        if (tracked[i].pt == NULL) {
+            tracked[i].pt    = pt;
+            tracked[i].vaddr = (uint64_t)vaddr;
+            tracked[i].count = count;
+            added            = true;
+        }
+    }
+
+    spin_unlock(pflock);
+    restore_interrupts(flags);
+    return added;
+}
+
+uint32_t
+page_harvest_dirty()
+{
+    uint64_t flags = save_interrupts();
+    spin_lock(pflock);
+
+    for (int i = 0; i < MAX_TRACKED; i++) {
+        pagetable_t *pt = tracked[i].pt;
+        if (pt == NULL)
+            continue;
+
+        for (int j = 0; j < tracked[i].count; j++) {
+            uint64_t  vaddr = tracked[i].vaddr + (uint64_t)j * PAGE_SIZE;
+            uint64_t *pte   = find_pte(pt, vaddr);
+            if (pte == NULL || !(*pte & PF_PRESENT) || !(*pte & PF_DIRTY))
+                continue;
+
+            // 清除脏位，之后的写入会让CPU重新设置它
+            pfdirty(*pte);
+            *pte &= ~(uint64_t)PF_DIRTY;
+            if (pt == active_pt)
+                invalidate_page((void *)vaddr);
+        }
+    }
+    uint32_t count = dirty_frames;
+
+    spin_unlock(pflock);
+    restore_interrupts(flags);
+    return count;
+}
+
+void *
+page_map_mmio(uint64_t paddr, uint64_t size)
+{
+    kmem_map(&kpt, paddr, size, PMEMTYPE_UNCACHED);
+    return (void *)paddr;
+}
+
+void *
+kpage_alloc(int count)
+{
+    if (count < 1)
+        return NULL;
+
+    uint64_t flags = save_interrupts();
+    spin_lock(pflock);
+
+    // 单个页直接从可用列表头部分配，否则线性搜索一段连续的可用物理页
+    uint32_t first = PFN_INVALID;
+    if (count == 1) {
+        if (pfdb.avail > 0)
+            first = pfdb.head;
+    }
+    else if (pfdb.avail >= (uint32_t)count) {
+        uint32_t run = 0;
+        for (uint32_t pfn = 1; pfn < pfdb.count; pfn++) {
+            if (pfdb.pf[pfn].type != PFTYPE_AVAILABLE) {
+                run = 0;
+                continue;
+            }
+            if (++run == (uint32_t)count) {
+                first = pfn + 1 - count;
+                break;
+            }
+        }
+    }
+
+    if (first != PFN_INVALID) {
+        for (int i = 0; i < count; i++)
+            pfunlink(PFN_TO_PF(first + i));
+    }
+
+    spin_unlock(pflock);
+    restore_interrupts(flags);
+
+    if (first == PFN_INVALID)
+        return NULL;
+
+    // 物理内存是恒等映射的，所以物理地址就是内核虚拟地址
+    void *addr = (void *)((uint64_t)first << PAGE_SHIFT);
+    memzero(addr, (uint64_t)count * PAGE_SIZE);
+    return addr;
+}
+
+void
+kpage_free(void *addr, int count)
+{
+    uint64_t flags = save_interrupts();
+    spin_lock(pflock);
+
+    for (int i = 0; i < count; i++)
+        pgfree((uint64_t)addr + (uint64_t)i * PAGE_SIZE);
+
+    spin_unlock(pflock);
+    restore_interrupts(flags);
+}
+
+void
+kpage_ref(void *addr)
+{
+    if (pfreserved((uint64_t)addr))
+        return;
+
+    uint64_t flags = save_interrupts();
+    spin_lock(pflock);
+
+    pf_t *pf = PADDR_TO_PF((uint64_t)addr);
+    if (pf->type != PFTYPE_ALLOCATED)
+        fatal();
+    pf->refcount++;
+
+    spin_unlock(pflock);
+    restore_interrupts(flags);
+}
+
+int
+kpage_refcount(void *addr)
+{
+    return PADDR_TO_PF((uint64_t)addr)->refcount;
+}
+
+bool
+kpage_clear_dirty(void *addr)
+{
+    if (pfreserved((uint64_t)addr))
+        return false;
+
+    uint64_t flags = save_interrupts();
+    spin_lock(pflock);
+
+    pf_t *pf    = PADDR_TO_PF((uint64_t)addr);
+    bool  dirty = (pf->flags & PFF_DIRTY) != 0;
+    if (dirty) {
+        pf->flags &= ~PFF_DIRTY;
+        dirty_frames--;
+    }
+
+    spin_unlock(pflock);
+    restore_interrupts(flags);
+    return dirty;
+}
+
+uint32_t
+kpage_avail()
+{
+    return pfdb.avail;
 }
@@ -335,6 +335,14 @@ pmap_init()
     // 0 ~ 10M
     add_region(0, KMEM_KERNEL_IMAGE_END, PMEMTYPE_RESERVED);
 
+    // boot loader加载的initrd也是保留内存，这样它的物理页不会被分配出去，
+    // 文件系统可以直接映射这些页
+    const kmem_globals_t *g = (const kmem_globals_t *)KMEM_GLOBALS;
+    if (g->initrd_size != 0) {
+        add_region(g->initrd_address, align_up(g->initrd_size, PAGE_SIZE),
+                   PMEMTYPE_RESERVED);
+    }
+
     // 将内存的第一页标记为未映射的，这样解引用一个null指针永远报错
     // 0 ~ 4KB
     add_region(0, 0x1000, PMEMTYPE_UNMAPPED);
@@ -351,6 +359,15 @@ pmap()
     return map;
 }
 
+const void *
+pmap_initrd(uint64_t *size)
+{
+    const kmem_globals_t *g = (const kmem_globals_t *)KMEM_GLOBALS;
+    *size = g->initrd_size;
+    return g->initrd_size != 0 ? (const void *)(uint64_t)g->initrd_address
+                               : NULL;
+}
+
 void
 pmap_add(uint64_t addr, uint64_t size, enum pmemtype type)
 {
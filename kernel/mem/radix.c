@@ -0,0 +1,192 @@
+//============================================================================
+/// @file       radix.c
+/// @brief      Radix tree mapping 64-bit indexes to pointers.
+//============================================================================
+
+#include <core.h>
+#include <libc/string.h>
+#include <kernel/mem/paging.h>
+#include <kernel/mem/radix.h>
+#include <kernel/spinlock.h>
+#include <kernel/x86/cpu.h>
+
+#define RADIX_MASK           (RADIX_SLOTS - 1)
+#define RADIX_MAX_HEIGHT     div_up(64, RADIX_SHIFT)
+
+struct radix_node
+{
+    void         *slot[RADIX_SLOTS];
+    uint32_t      count;        ///< Number of occupied slots
+    radix_node_t *next;         ///< Free list link
+};
+
+static radix_node_t *free_nodes;
+static spin_lock_t   node_lock;
+
+static radix_node_t *
+node_alloc()
+{
+    uint64_t flags = save_interrupts();
+    spin_lock(node_lock);
+
+    if (free_nodes == NULL) {
+        // Carve a fresh page into nodes.
+        uint8_t *page = kpage_alloc(1);
+        int      n    = PAGE_SIZE / sizeof(radix_node_t);
+        for (int i = 0; page != NULL && i < n; i++) {
+            radix_node_t *node = (radix_node_t *)page + i;
+            node->next = free_nodes;
+            free_nodes = node;
+        }
+    }
+
+    radix_node_t *node = free_nodes;
+    if (node != NULL)
+        free_nodes = node->next;
+
+    spin_unlock(node_lock);
+    restore_interrupts(flags);
+
+    if (node != NULL)
+        memzero(node, sizeof(*node));
+    return node;
+}
+
+static void
+node_free(radix_node_t *node)
+{
+    uint64_t flags = save_interrupts();
+    spin_lock(node_lock);
+    node->next = free_nodes;
+    free_nodes = node;
+    spin_unlock(node_lock);
+    restore_interrupts(flags);
+}
+
+static inline uint64_t
+max_index(int height)
+{
+    if (height * RADIX_SHIFT >= 64)
+        return ~(uint64_t)0;
+    return ((uint64_t)1 << (height * RADIX_SHIFT)) - 1;
+}
+
+void *
+radix_lookup(const radix_t *tree, uint64_t index)
+{
+    if (tree->height == 0 || index > max_index(tree->height))
+        return NULL;
+
+    radix_node_t *node = tree->root;
+    for (int level = tree->height - 1; level > 0 && node != NULL; level--)
+        node = node->slot[(index >> (level * RADIX_SHIFT)) & RADIX_MASK];
+
+    return node != NULL ? node->slot[index & RADIX_MASK] : NULL;
+}
+
+bool
+radix_insert(radix_t *tree, uint64_t index, void *item)
+{
+    // Add levels on top until the index fits.
+    while (tree->height == 0 || index > max_index(tree->height)) {
+        radix_node_t *node = node_alloc();
+        if (node == NULL)
+            return false;
+        if (tree->root != NULL) {
+            node->slot[0] = tree->root;
+            node->count   = 1;
+        }
+        tree->root = node;
+        tree->height++;
+    }
+
+    radix_node_t *node = tree->root;
+    for (int level = tree->height - 1; level > 0; level--) {
+        void **slot = &node->slot[(index >> (level * RADIX_SHIFT)) &
+                                  RADIX_MASK];
+        if (*slot == NULL) {
+            radix_node_t *child = node_alloc();
+            if (child == NULL)
+                return false;
+            *slot = child;
+            node->count++;
+        }
+        node = (radix_node_t *)*slot;
+    }
+
+    void **slot = &node->slot[index & RADIX_MASK];
+    if (*slot != NULL)
+        return false;
+    *slot = item;
+    node->count++;
+    return true;
+}
+
+void *
+radix_delete(radix_t *tree, uint64_t index)
+{
+    if (tree->height == 0 || index > max_index(tree->height))
+        return NULL;
+
+    // Record the path so empty nodes can be freed on the way back up.
+    radix_node_t *path[RADIX_MAX_HEIGHT];
+    radix_node_t *node = tree->root;
+    for (int level = tree->height - 1; level > 0; level--) {
+        path[level] = node;
+        node = node->slot[(index >> (level * RADIX_SHIFT)) & RADIX_MASK];
+        if (node == NULL)
+            return NULL;
+    }
+
+    void *item = node->slot[index & RADIX_MASK];
+    if (item == NULL)
+        return NULL;
+    node->slot[index & RADIX_MASK] = NULL;
+    node->count--;
+
+    for (int level = 1; level < tree->height && node->count == 0; level++) {
+        node_free(node);
+        node = path[level];
+        node->slot[(index >> (level * RADIX_SHIFT)) & RADIX_MASK] = NULL;
+        node->count--;
+    }
+    if (node == tree->root && node->count == 0) {
+        node_free(node);
+        tree->root   = NULL;
+        tree->height = 0;
+    }
+    return item;
+}
+
+static void *
+next_in(const radix_node_t *node, int level, uint64_t *index)
+{
+    int      shift = level * RADIX_SHIFT;
+    uint64_t span  = (uint64_t)1 << shift;
+    uint64_t base  = *index & ~(span * RADIX_SLOTS - 1);
+
+    for (uint64_t i = (*index >> shift) & RADIX_MASK; i < RADIX_SLOTS; i++) {
+        void *slot = node->slot[i];
+        if (slot != NULL) {
+            if (level == 0) {
+                *index = base + i;
+                return slot;
+            }
+            void *item = next_in((const radix_node_t *)slot, level - 1, index);
+            if (item != NULL)
+                return item;
+        }
+
+        // Continue from the start of the next slot at this level.
+        *index = base + (i + 1) * span;
+    }
+    return NULL;
+}
+
+void *
+radix_next(const radix_t *tree, uint64_t *index)
+{
+    if (tree->height == 0 || *index > max_index(tree->height))
+        return NULL;
+    return next_in(tree->root, tree->height - 1, index);
+}
@@ -0,0 +1,275 @@
+//============================================================================
+/// @file       arp.c
+/// @brief      Address Resolution Protocol for IPv4 over Ethernet.
+//============================================================================
+
+#include <core.h>
+#include <libc/string.h>
+#include <kernel/spinlock.h>
+#include "proto.h"
+
+// Number of neighbour cache entries.
+#define ARP_ENTRIES          32
+
+// Packets held per entry while its address is being resolved.
+#define ARP_QUEUE_LEN        8
+
+// Lifetime of a resolved entry, in milliseconds.
+#define ARP_TTL_MS           (5 * 60 * 1000)
+
+// Interval between requests for an unresolved entry, and how many are
+// sent before its queued packets are dropped.
+#define ARP_RETRY_MS         1000
+#define ARP_RETRIES          3
+
+#define ARP_HTYPE_ETHER      1
+#define ARP_OP_REQUEST       1
+#define ARP_OP_REPLY         2
+
+struct arp_pkt
+{
+    uint16_t   htype;
+    uint16_t   ptype;
+    uint8_t    hlen;
+    uint8_t    plen;
+    uint16_t   op;
+    uint8_t    sha[ETH_ALEN];
+    ip4_addr_t spa;
+    uint8_t    tha[ETH_ALEN];
+    ip4_addr_t tpa;
+} PACKSTRUCT;
+
+enum arp_state
+{
+    ARP_FREE,
+    ARP_PENDING,
+    ARP_VALID,
+};
+
+struct arp_entry
+{
+    enum arp_state state;
+    ip4_addr_t     addr;
+    uint8_t        mac[ETH_ALEN];
+    netif_t       *netif;
+    uint64_t       time;        ///< Expiry (valid) or last request (pending)
+    int            retries;
+    pbuf_t        *queue;       ///< Packets awaiting resolution
+    int            queued;
+};
+
+static struct arp_entry table[ARP_ENTRIES];
+static spin_lock_t      lock;
+
+static struct arp_entry *
+lookup(ip4_addr_t addr)
+{
+    for (int i = 0; i < ARP_ENTRIES; i++) {
+        if (table[i].state != ARP_FREE && table[i].addr == addr)
+            return &table[i];
+    }
+    return NULL;
+}
+
+static void
+drop_queue(struct arp_entry *e)
+{
+    while (e->queue != NULL) {
+        pbuf_t *pb = e->queue;
+        e->queue = pb->nextpkt;
+        pbuf_free(pb);
+    }
+    e->queued = 0;
+}
+
+static struct arp_entry *
+entry_alloc(ip4_addr_t addr, netif_t *netif)
+{
+    // Take a free entry, or else recycle the one closest to expiring.
+    struct arp_entry *victim = NULL;
+    for (int i = 0; i < ARP_ENTRIES; i++) {
+        struct arp_entry *e = &table[i];
+        if (e->state == ARP_FREE) {
+            victim = e;
+            break;
+        }
+        if (victim == NULL || e->time < victim->time)
+            victim = e;
+    }
+
+    drop_queue(victim);
+    victim->state   = ARP_PENDING;
+    victim->addr    = addr;
+    victim->netif   = netif;
+    victim->time    = 0;
+    victim->retries = 0;
+    return victim;
+}
+
+static void
+send_request(netif_t *netif, ip4_addr_t addr)
+{
+    pbuf_t *pb = pbuf_alloc(ETH_HLEN, sizeof(struct arp_pkt));
+    if (pb == NULL)
+        return;
+
+    struct arp_pkt *arp = (struct arp_pkt *)pb->data;
+    arp->htype = htons(ARP_HTYPE_ETHER);
+    arp->ptype = htons(ETH_TYPE_IP);
+    arp->hlen  = ETH_ALEN;
+    arp->plen  = sizeof(ip4_addr_t);
+    arp->op    = htons(ARP_OP_REQUEST);
+    memcpy(arp->sha, netif->dev->mac, ETH_ALEN);
+    arp->spa   = netif->addr;
+    memzero(arp->tha, ETH_ALEN);
+    arp->tpa   = addr;
+
+    eth_output(netif, pb, NULL, ETH_TYPE_ARP);
+}
+
+static void
+send_queue(netif_t *netif, pbuf_t *queue, const uint8_t *mac)
+{
+    while (queue != NULL) {
+        pbuf_t *pb = queue;
+        queue       = pb->nextpkt;
+        pb->nextpkt = NULL;
+        eth_output(netif, pb, mac, ETH_TYPE_IP);
+    }
+}
+
+void
+arp_input(netif_t *netif, pbuf_t *pb)
+{
+    struct arp_pkt *arp = (struct arp_pkt *)pb->data;
+    if (pb->len < sizeof(*arp) ||
+        arp->htype != htons(ARP_HTYPE_ETHER) ||
+        arp->ptype != htons(ETH_TYPE_IP) ||
+        arp->hlen != ETH_ALEN || arp->plen != sizeof(ip4_addr_t)) {
+        pbuf_free(pb);
+        return;
+    }
+
+    bool for_us = (arp->tpa == netif->addr);
+
+    // Learn the sender's address if it is already cached or is talking to
+    // us, and release any packets that were waiting for it.
+    uint8_t  mac[ETH_ALEN];
+    pbuf_t  *queue = NULL;
+
+    spin_lock(lock);
+    struct arp_entry *e = lookup(arp->spa);
+    if (e == NULL && for_us && arp->spa != IP4_ANY)
+        e = entry_alloc(arp->spa, netif);
+    if (e != NULL) {
+        memcpy(e->mac, arp->sha, ETH_ALEN);
+        e->state  = ARP_VALID;
+        e->netif  = netif;
+        e->time   = net_time() + ARP_TTL_MS;
+        queue     = e->queue;
+        e->queue  = NULL;
+        e->queued = 0;
+        memcpy(mac, e->mac, ETH_ALEN);
+    }
+    spin_unlock(lock);
+
+    if (queue != NULL)
+        send_queue(netif, queue, mac);
+
+    if (!for_us || arp->op != htons(ARP_OP_REQUEST)) {
+        pbuf_free(pb);
+        return;
+    }
+
+    // Turn the request around in place.
+    pbuf_trim(pb, sizeof(*arp));
+    arp->op  = htons(ARP_OP_REPLY);
+    memcpy(arp->tha, arp->sha, ETH_ALEN);
+    arp->tpa = arp->spa;
+    memcpy(arp->sha, netif->dev->mac, ETH_ALEN);
+    arp->spa = netif->addr;
+    eth_output(netif, pb, arp->tha, ETH_TYPE_ARP);
+}
+
+void
+arp_output(netif_t *netif, pbuf_t *pb, ip4_addr_t nexthop)
+{
+    if (netif->dev->features & NETDEV_F_LOOPBACK) {
+        eth_output(netif, pb, netif->dev->mac, ETH_TYPE_IP);
+        return;
+    }
+    if (nexthop == IP4_BROADCAST ||
+        nexthop == (netif->addr | ~netif->mask)) {
+        eth_output(netif, pb, NULL, ETH_TYPE_IP);
+        return;
+    }
+
+    uint64_t now = net_time();
+
+    spin_lock(lock);
+    struct arp_entry *e = lookup(nexthop);
+    if (e != NULL && e->state == ARP_VALID && e->netif == netif) {
+        uint8_t mac[ETH_ALEN];
+        memcpy(mac, e->mac, ETH_ALEN);
+        spin_unlock(lock);
+        eth_output(netif, pb, mac, ETH_TYPE_IP);
+        return;
+    }
+
+    if (e == NULL || e->state == ARP_VALID)
+        e = entry_alloc(nexthop, netif);
+
+    // Hold the packet until the reply arrives, dropping the oldest one if
+    // the queue is full.
+    if (e->queued == ARP_QUEUE_LEN) {
+        pbuf_t *old = e->queue;
+        e->queue = old->nextpkt;
+        e->queued--;
+        pbuf_free(old);
+    }
+    pb->nextpkt = NULL;
+    pbuf_t **tail = &e->queue;
+    while (*tail != NULL)
+        tail = &(*tail)->nextpkt;
+    *tail = pb;
+    e->queued++;
+
+    bool request = (now >= e->time + ARP_RETRY_MS || e->time == 0);
+    if (request)
+        e->time = now;
+    spin_unlock(lock);
+
+    if (request)
+        send_request(netif, nexthop);
+}
+
+void
+arp_tick(uint64_t now)
+{
+    spin_lock(lock);
+    for (int i = 0; i < ARP_ENTRIES; i++) {
+        struct arp_entry *e = &table[i];
+        switch (e->state) {
+            case ARP_VALID:
+                if (now >= e->time)
+                    e->state = ARP_FREE;
+                break;
+
+            case ARP_PENDING:
+                if (now < e->time + ARP_RETRY_MS)
+                    break;
+                if (++e->retries >= ARP_RETRIES) {
+                    drop_queue(e);
+                    e->state = ARP_FREE;
+                    break;
+                }
+                e->time = now;
+                send_request(e->netif, e->addr);
+                break;
+
+            default:
+                break;
+        }
+    }
+    spin_unlock(lock);
+}
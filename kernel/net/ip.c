@@ -0,0 +1,139 @@
+//============================================================================
+/// @file       ip.c
+/// @brief      Internet Protocol version 4 and ICMP echo.
+//============================================================================
+
+#include <core.h>
+#include <libc/string.h>
+#include <kernel/errno.h>
+#include "proto.h"
+
+#define ICMP_ECHO_REPLY      0
+#define ICMP_ECHO_REQUEST    8
+
+struct icmp_hdr
+{
+    uint8_t  type;
+    uint8_t  code;
+    uint16_t csum;
+    uint16_t id;
+    uint16_t seq;
+} PACKSTRUCT;
+
+static atomic_ushort ip_id;
+
+static void
+icmp_input(pbuf_t *pb, const struct ip_hdr *ip)
+{
+    struct icmp_hdr *icmp = (struct icmp_hdr *)pb->data;
+    if (pb->len < sizeof(*icmp) || icmp->type != ICMP_ECHO_REQUEST ||
+        net_csum_fold(net_csum_pbuf(pb, 0, pb->tot_len, 0)) != 0) {
+        pbuf_free(pb);
+        return;
+    }
+
+    // Reply from the buffer the request arrived in. Replies to broadcast
+    // pings come from the receiving interface's own address.
+    ip4_addr_t dst = ip->src;
+    ip4_addr_t src = ip->dst;
+    if (net_netif_addr(src) == NULL)
+        src = IP4_ANY;
+
+    icmp->type = ICMP_ECHO_REPLY;
+    icmp->csum = 0;
+    icmp->csum = net_csum_fold(net_csum_pbuf(pb, 0, pb->tot_len, 0));
+    ip_output(pb, src, dst, IP_PROTO_ICMP);
+}
+
+void
+ip_input(netif_t *netif, pbuf_t *pb)
+{
+    const struct ip_hdr *ip = (const struct ip_hdr *)pb->data;
+    if (pb->len < IP_HLEN || (ip->vhl >> 4) != 4)
+        goto drop;
+
+    uint32_t hlen = (ip->vhl & 0xf) * 4;
+    uint32_t len  = ntohs(ip->len);
+    if (hlen < IP_HLEN || hlen > pb->len || len < hlen || len > pb->tot_len)
+        goto drop;
+    if (net_csum_fold(net_csum(ip, hlen, 0)) != 0)
+        goto drop;
+
+    // Fragments are not reassembled.
+    if (ntohs(ip->off) & (IP_MF | IP_OFFMASK))
+        goto drop;
+
+    // This host does not forward. Loopback carries traffic for any of our
+    // addresses.
+    bool local = (ip->dst == netif->addr) ||
+                 ((netif->dev->features & NETDEV_F_LOOPBACK) &&
+                  net_netif_addr(ip->dst) != NULL);
+    if (!local && ip->dst != IP4_BROADCAST &&
+        ip->dst != (netif->addr | ~netif->mask))
+        goto drop;
+
+    // Drop any link-layer padding, then strip the header. It stays in the
+    // fragment's headroom, where the transports can still read it.
+    if (len < pb->tot_len)
+        pbuf_trim(pb, len);
+    pbuf_pull(pb, hlen);
+
+    switch (ip->proto) {
+        case IP_PROTO_ICMP: icmp_input(pb, ip);        return;
+        case IP_PROTO_UDP:  udp_input(pb, ip);         return;
+        case IP_PROTO_TCP:  tcp_input(netif, pb, ip);  return;
+        default:            break;
+    }
+
+drop:
+    pbuf_free(pb);
+}
+
+int
+ip_output(pbuf_t *pb, ip4_addr_t src, ip4_addr_t dst, uint8_t proto)
+{
+    ip4_addr_t nexthop;
+    netif_t   *netif = net_route(dst, &nexthop);
+    if (netif == NULL) {
+        pbuf_free(pb);
+        return -ENETUNREACH;
+    }
+    if (src == IP4_ANY)
+        src = netif->addr;
+
+    if (pb->tot_len + IP_HLEN > netif->dev->mtu &&
+        !(pb->flags & PBUF_GSO_TCPV4)) {
+        pbuf_free(pb);
+        return -EMSGSIZE;
+    }
+
+    // Callers leave headroom for the IP and link headers.
+    struct ip_hdr *ip = pbuf_push(pb, IP_HLEN);
+    if (ip == NULL) {
+        pbuf_free(pb);
+        return -ENOBUFS;
+    }
+
+    ip->vhl   = 0x45;
+    ip->tos   = 0;
+    ip->len   = htons((uint16_t)pb->tot_len);
+    ip->id    = htons(atomic_fetch_add(&ip_id, 1));
+    ip->off   = htons(IP_DF);
+    ip->ttl   = IP_TTL;
+    ip->proto = proto;
+    ip->csum  = 0;
+    ip->src   = src;
+    ip->dst   = dst;
+    ip->csum  = net_csum_fold(net_csum(ip, IP_HLEN, 0));
+
+    arp_output(netif, pb, nexthop);
+    return 0;
+}
+
+ip4_addr_t
+ip_source(ip4_addr_t dst)
+{
+    ip4_addr_t nexthop;
+    netif_t   *netif = net_route(dst, &nexthop);
+    return netif ? netif->addr : IP4_ANY;
+}
@@ -0,0 +1,284 @@
+//============================================================================
+/// @file       net.c
+/// @brief      IPv4 network stack: interfaces, Ethernet and checksums.
+//============================================================================
+
+#include <core.h>
+#include <libc/string.h>
+#include <kernel/debug/log.h>
+#include <kernel/errno.h>
+#include <kernel/x86/cpu.h>
+#include "proto.h"
+
+static const uint8_t eth_broadcast[ETH_ALEN] =
+{
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+static netif_t  netifs[MAX_NETDEVS];
+static uint64_t next_tick;
+
+//----------------------------------------------------------------------------
+// Checksums
+//----------------------------------------------------------------------------
+
+static inline uint32_t
+fold16(uint64_t sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return (uint32_t)sum;
+}
+
+uint32_t
+net_csum(const void *data, uint32_t len, uint32_t sum)
+{
+    const uint8_t *p   = (const uint8_t *)data;
+    uint64_t       acc = sum;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        acc += (w & 0xffffffff) + (w >> 32);
+    }
+    for (; len >= 2; p += 2, len -= 2) {
+        uint16_t w;
+        memcpy(&w, p, 2);
+        acc += w;
+    }
+    if (len)
+        acc += *p;
+
+    return fold16(acc);
+}
+
+uint32_t
+net_csum_pbuf(const pbuf_t *pb, uint32_t off, uint32_t len, uint32_t sum)
+{
+    while (pb != NULL && off >= pb->len) {
+        off -= pb->len;
+        pb   = pb->next;
+    }
+
+    // A piece that starts at an odd offset into the summed range has its
+    // bytes in the opposite halves of each 16-bit word.
+    bool odd = false;
+    for (; pb != NULL && len > 0; pb = pb->next) {
+        uint32_t n = min(pb->len - off, len);
+        uint32_t s = net_csum(pb->data + off, n, 0);
+        if (odd)
+            s = ((s & 0xff) << 8) | (s >> 8);
+        sum  = fold16((uint64_t)sum + s);
+        odd ^= (n & 1);
+        len -= n;
+        off  = 0;
+    }
+    return sum;
+}
+
+uint16_t
+net_csum_fold(uint32_t sum)
+{
+    return (uint16_t)~fold16(sum);
+}
+
+uint32_t
+net_csum_pseudo(ip4_addr_t src, ip4_addr_t dst, uint8_t proto, uint32_t len)
+{
+    uint64_t sum = (src & 0xffff) + (src >> 16) +
+                   (dst & 0xffff) + (dst >> 16) +
+                   htons(proto) + htons((uint16_t)len);
+    return fold16(sum);
+}
+
+//----------------------------------------------------------------------------
+// Interfaces
+//----------------------------------------------------------------------------
+
+int
+net_config(netdev_t *dev, ip4_addr_t addr, ip4_addr_t mask, ip4_addr_t gw)
+{
+    netif_t *netif = (netif_t *)dev->private;
+    if (netif == NULL) {
+        for (int i = 0; i < arrsize(netifs) && netif == NULL; i++) {
+            if (netifs[i].dev == NULL)
+                netif = &netifs[i];
+        }
+        if (netif == NULL)
+            return -ENOMEM;
+    }
+
+    uint64_t flags = save_interrupts();
+    netif->dev   = dev;
+    netif->addr  = addr;
+    netif->mask  = mask;
+    netif->gw    = gw;
+    netif->up    = true;
+    dev->private = netif;
+    restore_interrupts(flags);
+
+    logf(LOG_INFO, "[net] %s: %u.%u.%u.%u/%u.%u.%u.%u gw %u.%u.%u.%u",
+         dev->name, IP4_BYTES(addr), IP4_BYTES(mask), IP4_BYTES(gw));
+    return 0;
+}
+
+netif_t *
+net_netif(const netdev_t *dev)
+{
+    return (netif_t *)dev->private;
+}
+
+netif_t *
+net_netif_addr(ip4_addr_t addr)
+{
+    for (int i = 0; i < arrsize(netifs); i++) {
+        if (netifs[i].up && netifs[i].addr == addr)
+            return &netifs[i];
+    }
+    return NULL;
+}
+
+netif_t *
+net_route(ip4_addr_t dst, ip4_addr_t *nexthop)
+{
+    // Traffic to one of our own addresses is looped back.
+    if (net_netif_addr(dst) != NULL) {
+        for (int i = 0; i < arrsize(netifs); i++) {
+            netif_t *netif = &netifs[i];
+            if (netif->up && (netif->dev->features & NETDEV_F_LOOPBACK)) {
+                *nexthop = dst;
+                return netif;
+            }
+        }
+    }
+
+    // Directly attached subnets first, then the first default gateway.
+    for (int i = 0; i < arrsize(netifs); i++) {
+        netif_t *netif = &netifs[i];
+        if (netif->up && ((dst ^ netif->addr) & netif->mask) == 0) {
+            *nexthop = dst;
+            return netif;
+        }
+    }
+    for (int i = 0; i < arrsize(netifs); i++) {
+        netif_t *netif = &netifs[i];
+        if (netif->up && netif->gw != IP4_ANY) {
+            *nexthop = netif->gw;
+            return netif;
+        }
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+// Ethernet
+//----------------------------------------------------------------------------
+
+static void
+eth_input(netdev_t *dev, int queue, pbuf_t *pb)
+{
+    (void)queue;
+
+    netif_t *netif = (netif_t *)dev->private;
+    if (netif == NULL || !netif->up || pb->len < ETH_HLEN) {
+        pbuf_free(pb);
+        return;
+    }
+
+    const struct eth_hdr *eth = (const struct eth_hdr *)pb->data;
+    if (memcmp(eth->dst, dev->mac, ETH_ALEN) != 0 &&
+        memcmp(eth->dst, eth_broadcast, ETH_ALEN) != 0) {
+        pbuf_free(pb);
+        return;
+    }
+
+    uint16_t type = ntohs(eth->type);
+    pbuf_pull(pb, ETH_HLEN);
+
+    switch (type) {
+        case ETH_TYPE_IP:  ip_input(netif, pb);  break;
+        case ETH_TYPE_ARP: arp_input(netif, pb); break;
+        default:           pbuf_free(pb);        break;
+    }
+}
+
+void
+eth_output(netif_t *netif, pbuf_t *pb, const uint8_t *dst, uint16_t type)
+{
+    netdev_t       *dev = netif->dev;
+    struct eth_hdr *eth = pbuf_push(pb, ETH_HLEN);
+    if (eth == NULL) {
+        dev->stats[netdev_queue(dev)].tx_dropped++;
+        pbuf_free(pb);
+        return;
+    }
+
+    memcpy(eth->dst, dst ? dst : eth_broadcast, ETH_ALEN);
+    memcpy(eth->src, dev->mac, ETH_ALEN);
+    eth->type = htons(type);
+    netdev_xmit(dev, pb);
+}
+
+//----------------------------------------------------------------------------
+// Setup and polling
+//----------------------------------------------------------------------------
+
+void
+net_init()
+{
+    pbuf_init();
+    netdev_set_rx_handler(eth_input);
+    loopback_init();
+}
+
+bool
+net_poll()
+{
+    // Protocol state is only touched with interrupts disabled.
+    uint64_t flags = save_interrupts();
+
+    // Pick up anything a device finished without raising an interrupt, and
+    // continue polling queues whose interrupt handlers ran out of budget.
+    for (netdev_t *dev = netdev_next(NULL); dev; dev = netdev_next(dev)) {
+        for (int q = 0; q < dev->nr_queues; q++)
+            dev->ops->poll(dev, q);
+    }
+
+    bool busy = napi_run();
+
+    uint64_t now = net_time();
+    if (now >= next_tick) {
+        next_tick = now + NET_TICK_MS;
+        arp_tick(now);
+        tcp_tick(now);
+    }
+
+    netdev_flush();
+    restore_interrupts(flags);
+    return busy;
+}
+
+int
+net_parse_addr(const char *str, ip4_addr_t *addr)
+{
+    const char *s     = str;
+    uint32_t    a     = 0;
+
+    for (int i = 0; i < 4; i++) {
+        if (i > 0 && *s++ != '.')
+            return 0;
+        if (*s < '0' || *s > '9')
+            return 0;
+
+        uint32_t part = 0;
+        while (*s >= '0' && *s <= '9') {
+            part = part * 10 + (uint32_t)(*s++ - '0');
+            if (part > 255)
+                return 0;
+        }
+        a |= part << (8 * i);
+    }
+
+    *addr = a;
+    return (int)(s - str);
+}
@@ -0,0 +1,189 @@
+//============================================================================
+/// @file       netdev.c
+/// @brief      Network device registry and packet interface.
+//============================================================================
+
+#include <core.h>
+#include <libc/string.h>
+#include <kernel/debug/log.h>
+#include <kernel/interrupt/lapic.h>
+#include <kernel/net/netdev.h>
+#include <kernel/x86/cpu.h>
+
+static netdev_t          *devs[MAX_NETDEVS];
+static int                devcount;
+static netdev_rx_handler  rx_handler;
+
+// Per-CPU lists of queues in polling mode.
+struct poll_list
+{
+    napi_t *head;
+    napi_t *tail;
+    bool    running;
+};
+
+static struct poll_list   poll_lists[MAX_NET_QUEUES];
+
+bool
+netdev_register(netdev_t *dev)
+{
+    if (devcount == MAX_NETDEVS) {
+        logf(LOG_WARNING, "[net] Device table full; ignoring %s.", dev->name);
+        return false;
+    }
+
+    if (dev->nr_queues > MAX_NET_QUEUES)
+        dev->nr_queues = MAX_NET_QUEUES;
+
+    dev->id          = devcount;
+    devs[devcount++] = dev;
+
+    const uint8_t *m = dev->mac;
+    logf(LOG_INFO, "[net] %s: %02x:%02x:%02x:%02x:%02x:%02x, mtu %u, "
+         "%d queue(s), link %s.", dev->name, m[0], m[1], m[2], m[3], m[4],
+         m[5], dev->mtu, dev->nr_queues, dev->link_up ? "up" : "down");
+    return true;
+}
+
+netdev_t *
+netdev_find(const char *name)
+{
+    for (int i = 0; i < devcount; i++) {
+        if (!strcmp(devs[i]->name, name))
+            return devs[i];
+    }
+    return NULL;
+}
+
+netdev_t *
+netdev_next(const netdev_t *prev)
+{
+    int i = 0;
+    if (prev != NULL) {
+        while (i < devcount && devs[i] != prev)
+            i++;
+        i++;
+    }
+    return i < devcount ? devs[i] : NULL;
+}
+
+int
+netdev_queue(const netdev_t *dev)
+{
+    // Each CPU gets its own queue pair so transmits never contend.
+    if (dev->nr_queues <= 1 || !lapic_present())
+        return 0;
+    return lapic_id() % dev->nr_queues;
+}
+
+void
+netdev_set_rx_handler(netdev_rx_handler handler)
+{
+    rx_handler = handler;
+}
+
+void
+netdev_receive(netdev_t *dev, int queue, pbuf_t *pb)
+{
+    netdev_stats_t *stats = &dev->stats[queue];
+    if (rx_handler == NULL) {
+        stats->rx_dropped++;
+        pbuf_free(pb);
+        return;
+    }
+    stats->rx_packets++;
+    stats->rx_bytes += pb->tot_len;
+    rx_handler(dev, queue, pb);
+}
+
+bool
+netdev_xmit(netdev_t *dev, pbuf_t *pb)
+{
+    int queue = netdev_queue(dev);
+    if (!dev->ops->xmit(dev, queue, pb)) {
+        dev->stats[queue].tx_dropped++;
+        pbuf_free(pb);
+        return false;
+    }
+    atomic_fetch_or(&dev->kick_pending, 1u << queue);
+    return true;
+}
+
+void
+netdev_flush()
+{
+    for (int i = 0; i < devcount; i++) {
+        netdev_t *dev     = devs[i];
+        uint32_t  pending = atomic_exchange(&dev->kick_pending, 0);
+        for (int q = 0; pending != 0; q++, pending >>= 1) {
+            if (pending & 1)
+                dev->ops->kick(dev, q);
+        }
+    }
+}
+
+static struct poll_list *
+poll_list()
+{
+    return &poll_lists[lapic_present() ? lapic_id() % MAX_NET_QUEUES : 0];
+}
+
+static void
+poll_append(struct poll_list *list, napi_t *napi)
+{
+    napi->next = NULL;
+    if (list->tail != NULL)
+        list->tail->next = napi;
+    else
+        list->head = napi;
+    list->tail = napi;
+}
+
+bool
+napi_schedule(napi_t *napi)
+{
+    if (atomic_exchange(&napi->scheduled, true))
+        return false;
+    poll_append(poll_list(), napi);
+    return true;
+}
+
+void
+napi_complete(napi_t *napi)
+{
+    atomic_store(&napi->scheduled, false);
+}
+
+bool
+napi_run()
+{
+    uint64_t          flags = save_interrupts();
+    struct poll_list *list  = poll_list();
+
+    if (!list->running) {
+        list->running = true;
+
+        int budget = NAPI_BUDGET;
+        while (list->head != NULL && budget > 0) {
+            napi_t *napi = list->head;
+            list->head = napi->next;
+            if (list->head == NULL)
+                list->tail = NULL;
+
+            // A poll that used its whole weight has more to do and goes
+            // to the back of the list; one that did less has completed,
+            // and may already have been rescheduled.
+            int weight = min(NAPI_WEIGHT, budget);
+            int done   = napi->poll(napi, weight);
+            budget    -= done;
+            if (done >= weight)
+                poll_append(list, napi);
+        }
+
+        list->running = false;
+    }
+
+    bool pending = (list->head != NULL);
+    restore_interrupts(flags);
+    return pending;
+}
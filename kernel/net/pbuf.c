@@ -0,0 +1,320 @@
+//============================================================================
+/// @file       pbuf.c
+/// @brief      Reference-counted network packet buffers.
+//============================================================================
+
+#include <core.h>
+#include <libc/string.h>
+#include <kernel/debug/log.h>
+#include <kernel/mem/paging.h>
+#include <kernel/net/pbuf.h>
+#include <kernel/spinlock.h>
+#include <kernel/x86/cpu.h>
+
+// Number of fragments in the pool. Halved until the allocation succeeds.
+#define PBUF_FRAGS           2048
+
+// Number of pbuf descriptors. Clones need descriptors but no fragments, so
+// there are more descriptors than fragments.
+#define PBUF_DESCS           (2 * PBUF_FRAGS)
+
+static pbuf_t      descs[PBUF_DESCS];
+static pbuf_t     *free_descs;
+static uint8_t    *pool;            ///< nfrags * PBUF_SIZE bytes
+static int         nfrags;
+static uint16_t    refs[PBUF_FRAGS];
+static uint16_t    ends[PBUF_FRAGS];   ///< End of the bytes written so far
+static uint16_t    free_frags[PBUF_FRAGS];
+static int         nfree;
+static spin_lock_t lock;
+
+STATIC_ASSERT(PAGE_SIZE % PBUF_SIZE == 0, "pbuf fragments must tile pages");
+
+static inline int
+frag_index(const uint8_t *frag)
+{
+    return (int)((frag - pool) / PBUF_SIZE);
+}
+
+void
+pbuf_init()
+{
+    int n = PBUF_FRAGS;
+    while (n >= PAGE_SIZE / PBUF_SIZE) {
+        pool = kpage_alloc(n * PBUF_SIZE / PAGE_SIZE);
+        if (pool != NULL)
+            break;
+        n /= 2;
+    }
+    if (pool == NULL) {
+        logf(LOG_WARNING, "[net] No memory for packet buffers.");
+        return;
+    }
+
+    nfrags = n;
+    for (int i = 0; i < nfrags; i++)
+        free_frags[i] = (uint16_t)(nfrags - 1 - i);
+    nfree = nfrags;
+
+    for (int i = 0; i < PBUF_DESCS; i++) {
+        descs[i].next = free_descs;
+        free_descs    = &descs[i];
+    }
+
+    logf(LOG_INFO, "[net] %d packet buffers of %u bytes.", nfrags,
+         PBUF_SIZE);
+}
+
+// Take a descriptor from the free list. Called with the lock held.
+static pbuf_t *
+desc_alloc()
+{
+    pbuf_t *pb = free_descs;
+    if (pb != NULL) {
+        free_descs = pb->next;
+        memzero(pb, sizeof(*pb));
+    }
+    return pb;
+}
+
+pbuf_t *
+pbuf_alloc(uint32_t headroom, uint32_t len)
+{
+    if (headroom + len > PBUF_SIZE)
+        return NULL;
+
+    uint64_t flags = save_interrupts();
+    spin_lock(lock);
+
+    pbuf_t *pb = NULL;
+    if (nfree > 0 && (pb = desc_alloc()) != NULL) {
+        int i = free_frags[--nfree];
+        refs[i]  = 1;
+        ends[i]  = (uint16_t)(headroom + len);
+        pb->frag = pool + i * PBUF_SIZE;
+    }
+
+    spin_unlock(lock);
+    restore_interrupts(flags);
+
+    if (pb != NULL) {
+        pb->data    = pb->frag + headroom;
+        pb->len     = len;
+        pb->tot_len = len;
+    }
+    return pb;
+}
+
+void
+pbuf_free(pbuf_t *pb)
+{
+    if (pb == NULL)
+        return;
+
+    uint64_t flags = save_interrupts();
+    spin_lock(lock);
+
+    while (pb != NULL) {
+        pbuf_t *next = pb->next;
+
+        int i = frag_index(pb->frag);
+        if (--refs[i] == 0)
+            free_frags[nfree++] = (uint16_t)i;
+
+        pb->next   = free_descs;
+        free_descs = pb;
+        pb         = next;
+    }
+
+    spin_unlock(lock);
+    restore_interrupts(flags);
+}
+
+pbuf_t *
+pbuf_clone(const pbuf_t *pb, uint32_t off, uint32_t len, int maxbufs)
+{
+    // Skip to the piece containing the first byte.
+    while (pb != NULL && off >= pb->len) {
+        off -= pb->len;
+        pb   = pb->next;
+    }
+
+    pbuf_t  *head = NULL;
+    pbuf_t **link = &head;
+    uint32_t total = 0;
+
+    uint64_t flags = save_interrupts();
+    spin_lock(lock);
+
+    for (int n = 0; pb != NULL && len > 0 && n < maxbufs; n++) {
+        pbuf_t *c = desc_alloc();
+        if (c == NULL)
+            break;
+
+        uint32_t chunk = min(pb->len - off, len);
+        c->frag = pb->frag;
+        c->data = pb->data + off;
+        c->len  = chunk;
+        refs[frag_index(pb->frag)]++;
+
+        *link  = c;
+        link   = &c->next;
+        total += chunk;
+        len   -= chunk;
+        off    = 0;
+        pb     = pb->next;
+    }
+
+    spin_unlock(lock);
+    restore_interrupts(flags);
+
+    if (head != NULL)
+        head->tot_len = total;
+    return head;
+}
+
+void *
+pbuf_push(pbuf_t *pb, uint32_t n)
+{
+    // Writing into the headroom of a shared fragment could overwrite bytes
+    // another pbuf still refers to.
+    if ((uint32_t)(pb->data - pb->frag) < n || refs[frag_index(pb->frag)] > 1)
+        return NULL;
+
+    pb->data    -= n;
+    pb->len     += n;
+    pb->tot_len += n;
+
+    // Offload offsets are relative to the start of the packet.
+    if (pb->flags & PBUF_CSUM_PARTIAL)
+        pb->csum_start += (uint16_t)n;
+    if (pb->flags & PBUF_GSO_TCPV4)
+        pb->hdr_len += (uint16_t)n;
+    return pb->data;
+}
+
+void
+pbuf_pull(pbuf_t *pb, uint32_t n)
+{
+    pb->data    += n;
+    pb->len     -= n;
+    pb->tot_len -= n;
+}
+
+pbuf_t *
+pbuf_drop(pbuf_t *pb, uint32_t n)
+{
+    uint32_t total = pb->tot_len - min(n, pb->tot_len);
+
+    while (pb != NULL && n >= pb->len) {
+        pbuf_t *next = pb->next;
+        n       -= pb->len;
+        pb->next = NULL;
+        pbuf_free(pb);
+        pb = next;
+    }
+    if (pb != NULL) {
+        pb->data   += n;
+        pb->len    -= n;
+        pb->tot_len = total;
+    }
+    return pb;
+}
+
+void
+pbuf_trim(pbuf_t *pb, uint32_t len)
+{
+    pb->tot_len = len;
+    for (;;) {
+        if (len <= pb->len) {
+            pb->len = len;
+            pbuf_free(pb->next);
+            pb->next = NULL;
+            return;
+        }
+        len -= pb->len;
+        pb   = pb->next;
+    }
+}
+
+void
+pbuf_cat(pbuf_t *head, pbuf_t *tail)
+{
+    head->tot_len += tail->tot_len;
+
+    pbuf_t *pb = head;
+    while (pb->next != NULL)
+        pb = pb->next;
+    pb->next = tail;
+}
+
+uint32_t
+pbuf_append(pbuf_t **head, const void *src, uint32_t len)
+{
+    const uint8_t *s     = (const uint8_t *)src;
+    uint32_t       done  = 0;
+    pbuf_t        *first = *head;
+
+    // Fill the last piece's tailroom first, provided nothing has been
+    // written to its fragment beyond the piece's end. Clones of the piece
+    // may share the fragment, but only up to that end.
+    pbuf_t *last = *head;
+    while (last != NULL && last->next != NULL)
+        last = last->next;
+    if (last != NULL) {
+        int      i   = frag_index(last->frag);
+        uint32_t end = (uint32_t)(last->data + last->len - last->frag);
+        if (end == ends[i]) {
+            uint32_t n = min(PBUF_SIZE - end, len);
+            memcpy(last->data + last->len, s, n);
+            last->len += n;
+            ends[i]    = (uint16_t)(end + n);
+            done      += n;
+        }
+    }
+
+    while (done < len) {
+        uint32_t n  = min(len - done, (uint32_t)PBUF_SIZE);
+        pbuf_t  *pb = pbuf_alloc(0, n);
+        if (pb == NULL)
+            break;
+        memcpy(pb->data, s + done, n);
+        if (last == NULL)
+            *head = pb;
+        else
+            last->next = pb;
+        last  = pb;
+        done += n;
+    }
+
+    if (first != NULL)
+        first->tot_len += done;
+    else if (*head != NULL)
+        (*head)->tot_len = done;
+    return done;
+}
+
+uint32_t
+pbuf_copyout(const pbuf_t *pb, uint32_t off, void *dst, uint32_t len)
+{
+    uint8_t *d    = (uint8_t *)dst;
+    uint32_t done = 0;
+
+    while (pb != NULL && off >= pb->len) {
+        off -= pb->len;
+        pb   = pb->next;
+    }
+    for (; pb != NULL && done < len; pb = pb->next) {
+        uint32_t n = min(pb->len - off, len - done);
+        memcpy(d + done, pb->data + off, n);
+        done += n;
+        off   = 0;
+    }
+    return done;
+}
+
+int
+pbuf_avail()
+{
+    return nfree;
+}
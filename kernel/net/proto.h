@@ -0,0 +1,159 @@
+//============================================================================
+/// @file       proto.h
+/// @brief      Network stack internals shared between protocol layers.
+//============================================================================
+
+#pragma once
+
+#include <core.h>
+#include <kernel/device/timer.h>
+#include <kernel/interrupt/lapic.h>
+#include <kernel/net/net.h>
+#include <kernel/net/netdev.h>
+#include <kernel/net/pbuf.h>
+
+// Number of per-CPU connection tables.
+#define NET_CPUS             MAX_NET_QUEUES
+
+// Ethernet types
+#define ETH_TYPE_IP          0x0800
+#define ETH_TYPE_ARP         0x0806
+
+// IP protocol numbers
+#define IP_PROTO_ICMP        1
+#define IP_PROTO_TCP         6
+#define IP_PROTO_UDP         17
+
+#define IP_HLEN              20
+#define IP_TTL               64
+#define IP_DF                0x4000
+#define IP_MF                0x2000
+#define IP_OFFMASK           0x1fff
+
+#define UDP_HLEN             8
+#define TCP_HLEN             20
+
+// Interval between protocol timer runs, in milliseconds.
+#define NET_TICK_MS          50
+
+// Room needed in front of a transport header for the IP and link headers.
+#define NET_LINK_HEADROOM    (ETH_HLEN + IP_HLEN)
+
+struct eth_hdr
+{
+    uint8_t  dst[ETH_ALEN];
+    uint8_t  src[ETH_ALEN];
+    uint16_t type;
+} PACKSTRUCT;
+
+struct ip_hdr
+{
+    uint8_t    vhl;         ///< Version (4) and header length in words.
+    uint8_t    tos;
+    uint16_t   len;
+    uint16_t   id;
+    uint16_t   off;
+    uint8_t    ttl;
+    uint8_t    proto;
+    uint16_t   csum;
+    ip4_addr_t src;
+    ip4_addr_t dst;
+} PACKSTRUCT;
+
+struct udp_hdr
+{
+    uint16_t sport;
+    uint16_t dport;
+    uint16_t len;
+    uint16_t csum;
+} PACKSTRUCT;
+
+struct tcp_hdr
+{
+    uint16_t sport;
+    uint16_t dport;
+    uint32_t seq;
+    uint32_t ack;
+    uint8_t  off;           ///< Header length in words, in the high nibble.
+    uint8_t  flags;
+    uint16_t wnd;
+    uint16_t csum;
+    uint16_t urp;
+} PACKSTRUCT;
+
+STATIC_ASSERT(sizeof(struct eth_hdr) == ETH_HLEN, "ethernet header size");
+STATIC_ASSERT(sizeof(struct ip_hdr) == IP_HLEN, "IP header size");
+STATIC_ASSERT(sizeof(struct tcp_hdr) == TCP_HLEN, "TCP header size");
+
+// The CPU's connection table.
+static inline int
+net_cpu()
+{
+    return lapic_present() ? lapic_id() % NET_CPUS : 0;
+}
+
+// The current time in milliseconds.
+static inline uint64_t
+net_time()
+{
+    uint32_t rate = timer_rate();
+    return rate ? timer_ticks() * 1000 / rate : 0;
+}
+
+// Checksums. Partial sums are 32-bit accumulations of 16-bit words in
+// network byte order; net_csum_fold produces the final complemented value.
+uint32_t
+net_csum(const void *data, uint32_t len, uint32_t sum);
+
+uint32_t
+net_csum_pbuf(const pbuf_t *pb, uint32_t off, uint32_t len, uint32_t sum);
+
+uint16_t
+net_csum_fold(uint32_t sum);
+
+uint32_t
+net_csum_pseudo(ip4_addr_t src, ip4_addr_t dst, uint8_t proto, uint32_t len);
+
+// Link layer (net.c)
+netif_t *
+net_route(ip4_addr_t dst, ip4_addr_t *nexthop);
+
+netif_t *
+net_netif_addr(ip4_addr_t addr);
+
+void
+eth_output(netif_t *netif, pbuf_t *pb, const uint8_t *dst, uint16_t type);
+
+// Loopback device (loopback.c)
+void
+loopback_init();
+
+// ARP (arp.c)
+void
+arp_input(netif_t *netif, pbuf_t *pb);
+
+void
+arp_output(netif_t *netif, pbuf_t *pb, ip4_addr_t nexthop);
+
+void
+arp_tick(uint64_t now);
+
+// IPv4 and ICMP (ip.c)
+void
+ip_input(netif_t *netif, pbuf_t *pb);
+
+int
+ip_output(pbuf_t *pb, ip4_addr_t src, ip4_addr_t dst, uint8_t proto);
+
+ip4_addr_t
+ip_source(ip4_addr_t dst);
+
+// Transports
+void
+udp_input(pbuf_t *pb, const struct ip_hdr *ip);
+
+void
+tcp_input(netif_t *netif, pbuf_t *pb, const struct ip_hdr *ip);
+
+void
+tcp_tick(uint64_t now);
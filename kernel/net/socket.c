@@ -0,0 +1,529 @@
+//============================================================================
+/// @file       socket.c
+/// @brief      BSD-style sockets over the TCP and UDP endpoints.
+//============================================================================
+
+#include <core.h>
+#include <libc/string.h>
+#include <kernel/errno.h>
+#include <kernel/net/socket.h>
+#include <kernel/net/tcp.h>
+#include <kernel/net/udp.h>
+#include <kernel/spinlock.h>
+#include <kernel/x86/cpu.h>
+#include "proto.h"
+
+enum sock_kind
+{
+    SK_FREE,
+    SK_TCP,
+    SK_UDP,
+    SK_EPOLL,
+};
+
+struct socket
+{
+    enum sock_kind kind;
+    bool           nonblock;
+    bool           bound;
+    ip4_addr_t     addr;        ///< Bound local address
+    uint16_t       port;        ///< Bound local port
+    bool           connected;   ///< Has a peer (or default destination)
+    ip4_addr_t     peer;
+    uint16_t       peer_port;
+    tcp_pcb_t     *tcp;         ///< Listener or connection
+    udp_pcb_t     *udp;
+};
+
+struct epoll_item
+{
+    int                epfd;    ///< Owning instance, or -1 if free
+    int                fd;
+    struct epoll_event ev;
+};
+
+static struct socket     socks[MAX_SOCKETS];
+static struct epoll_item items[MAX_EPOLL_ITEMS];
+static bool              items_ready;
+static spin_lock_t       lock;
+
+static int
+sock_alloc(enum sock_kind kind, bool nonblock)
+{
+    int fd = -ENFILE;
+
+    uint64_t flags = save_interrupts();
+    spin_lock(lock);
+    for (int i = 0; i < MAX_SOCKETS; i++) {
+        if (socks[i].kind == SK_FREE) {
+            memzero(&socks[i], sizeof(socks[i]));
+            socks[i].kind     = kind;
+            socks[i].nonblock = nonblock;
+            fd = i;
+            break;
+        }
+    }
+    spin_unlock(lock);
+    restore_interrupts(flags);
+    return fd;
+}
+
+static struct socket *
+sock_get(int fd)
+{
+    if (fd < 0 || fd >= MAX_SOCKETS || socks[fd].kind == SK_FREE)
+        return NULL;
+    return &socks[fd];
+}
+
+// The NET_EV_* events pending on a socket.
+static int
+sock_events(const struct socket *s)
+{
+    switch (s->kind) {
+        case SK_TCP:
+            if (s->tcp != NULL)
+                return tcp_events(s->tcp);
+            return NET_EV_WRITE;
+        case SK_UDP:
+            return s->udp ? udp_events(s->udp) : NET_EV_WRITE;
+        default:
+            return 0;
+    }
+}
+
+// Wait until a socket has any of `ev' (or an error or hangup) pending.
+static void
+sock_wait(const struct socket *s, int ev)
+{
+    for (;;) {
+        bool busy = net_poll();
+        if (sock_events(s) & (ev | NET_EV_ERR | NET_EV_HUP))
+            return;
+        if (!busy)
+            halt();
+    }
+}
+
+static bool
+addr_valid(const struct sockaddr_in *addr, socklen_t len)
+{
+    return addr != NULL && len >= sizeof(*addr) &&
+           addr->sin_family == AF_INET;
+}
+
+static void
+addr_store(struct sockaddr_in *addr, socklen_t *len, ip4_addr_t ip,
+           uint16_t port)
+{
+    if (addr == NULL || len == NULL)
+        return;
+
+    struct sockaddr_in sin;
+    memzero(&sin, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port   = htons(port);
+    sin.sin_addr   = ip;
+    memcpy(addr, &sin, min((size_t)*len, sizeof(sin)));
+    *len = sizeof(sin);
+}
+
+// Open the UDP endpoint of a datagram socket that has not been bound.
+static int
+udp_autobind(struct socket *s)
+{
+    if (s->udp != NULL)
+        return 0;
+    int err = udp_open(IP4_ANY, 0, &s->udp);
+    if (err == 0) {
+        s->bound = true;
+        s->addr  = IP4_ANY;
+        s->port  = udp_local(s->udp);
+    }
+    return err;
+}
+
+int
+sock_socket(int domain, int type, int protocol)
+{
+    if (domain != AF_INET)
+        return -EAFNOSUPPORT;
+
+    bool nonblock = (type & SOCK_NONBLOCK) != 0;
+    switch (type & ~SOCK_NONBLOCK) {
+        case SOCK_STREAM:
+            if (protocol != 0 && protocol != IPPROTO_TCP)
+                return -EPROTONOSUPPORT;
+            return sock_alloc(SK_TCP, nonblock);
+        case SOCK_DGRAM:
+            if (protocol != 0 && protocol != IPPROTO_UDP)
+                return -EPROTONOSUPPORT;
+            return sock_alloc(SK_UDP, nonblock);
+        default:
+            return -EPROTONOSUPPORT;
+    }
+}
+
+int
+sock_bind(int fd, const struct sockaddr_in *addr, socklen_t len)
+{
+    struct socket *s = sock_get(fd);
+    if (s == NULL)
+        return -EBADF;
+    if (s->kind == SK_EPOLL)
+        return -ENOTSOCK;
+    if (!addr_valid(addr, len))
+        return -EINVAL;
+    if (s->bound)
+        return -EINVAL;
+
+    // Stream sockets claim their port when they start listening.
+    if (s->kind == SK_UDP) {
+        int err = udp_open(addr->sin_addr, ntohs(addr->sin_port), &s->udp);
+        if (err < 0)
+            return err;
+    }
+
+    s->bound = true;
+    s->addr  = addr->sin_addr;
+    s->port  = s->udp ? udp_local(s->udp) : ntohs(addr->sin_port);
+    return 0;
+}
+
+int
+sock_listen(int fd, int backlog)
+{
+    struct socket *s = sock_get(fd);
+    if (s == NULL)
+        return -EBADF;
+    if (s->kind != SK_TCP)
+        return -EOPNOTSUPP;
+    if (s->connected)
+        return -EISCONN;
+    if (s->tcp != NULL)
+        return 0;
+    if (!s->bound || s->port == 0)
+        return -EINVAL;
+
+    return tcp_listen(s->addr, s->port, backlog, &s->tcp);
+}
+
+int
+sock_accept(int fd, struct sockaddr_in *addr, socklen_t *len)
+{
+    struct socket *s = sock_get(fd);
+    if (s == NULL)
+        return -EBADF;
+    if (s->kind != SK_TCP)
+        return -EOPNOTSUPP;
+    if (s->tcp == NULL || s->connected)
+        return -EINVAL;
+
+    tcp_pcb_t *conn;
+    int        err;
+    while ((err = tcp_accept(s->tcp, &conn)) == -EAGAIN && !s->nonblock)
+        sock_wait(s, NET_EV_READ);
+    if (err < 0)
+        return err;
+
+    int cfd = sock_alloc(SK_TCP, s->nonblock);
+    if (cfd < 0) {
+        tcp_close(conn);
+        return cfd;
+    }
+
+    struct socket *c = &socks[cfd];
+    c->tcp       = conn;
+    c->connected = true;
+    c->bound     = true;
+    c->addr      = s->addr;
+    c->port      = s->port;
+    tcp_peer(conn, &c->peer, &c->peer_port);
+    addr_store(addr, len, c->peer, c->peer_port);
+    return cfd;
+}
+
+int
+sock_connect(int fd, const struct sockaddr_in *addr, socklen_t len)
+{
+    struct socket *s = sock_get(fd);
+    if (s == NULL)
+        return -EBADF;
+    if (s->kind == SK_EPOLL)
+        return -ENOTSOCK;
+    if (!addr_valid(addr, len))
+        return -EINVAL;
+
+    if (s->kind == SK_UDP) {
+        int err = udp_autobind(s);
+        if (err < 0)
+            return err;
+        s->connected = true;
+        s->peer      = addr->sin_addr;
+        s->peer_port = ntohs(addr->sin_port);
+        return 0;
+    }
+
+    if (s->connected)
+        return (s->tcp && (tcp_events(s->tcp) & NET_EV_WRITE)) ? -EISCONN
+                                                               : -EALREADY;
+    if (s->tcp != NULL)
+        return -EINVAL;     // listening
+
+    // The local port is always ephemeral; a bound address is ignored.
+    int err = tcp_connect(addr->sin_addr, ntohs(addr->sin_port), &s->tcp);
+    if (err < 0)
+        return err;
+    s->connected = true;
+    s->peer      = addr->sin_addr;
+    s->peer_port = ntohs(addr->sin_port);
+
+    if (s->nonblock)
+        return -EINPROGRESS;
+    sock_wait(s, NET_EV_WRITE);
+    return tcp_error(s->tcp);
+}
+
+int64_t
+sock_sendto(int fd, const void *buf, size_t len, int flags,
+            const struct sockaddr_in *addr, socklen_t alen)
+{
+    struct socket *s = sock_get(fd);
+    if (s == NULL)
+        return -EBADF;
+
+    bool    wait = !s->nonblock && !(flags & MSG_DONTWAIT);
+    int64_t n;
+    switch (s->kind) {
+        case SK_TCP:
+            if (!s->connected)
+                return -ENOTCONN;
+            while ((n = tcp_send(s->tcp, buf, len)) == -EAGAIN && wait)
+                sock_wait(s, NET_EV_WRITE);
+            return n;
+
+        case SK_UDP: {
+            ip4_addr_t dst  = s->peer;
+            uint16_t   port = s->peer_port;
+            if (addr != NULL) {
+                if (!addr_valid(addr, alen))
+                    return -EINVAL;
+                dst  = addr->sin_addr;
+                port = ntohs(addr->sin_port);
+            }
+            else if (!s->connected) {
+                return -ENOTCONN;
+            }
+            int err = udp_autobind(s);
+            if (err < 0)
+                return err;
+            return udp_sendto(s->udp, dst, port, buf, len);
+        }
+
+        default:
+            return -ENOTSOCK;
+    }
+}
+
+int64_t
+sock_recvfrom(int fd, void *buf, size_t len, int flags,
+              struct sockaddr_in *addr, socklen_t *alen)
+{
+    struct socket *s = sock_get(fd);
+    if (s == NULL)
+        return -EBADF;
+
+    bool    wait = !s->nonblock && !(flags & MSG_DONTWAIT);
+    int64_t n;
+    switch (s->kind) {
+        case SK_TCP:
+            if (!s->connected)
+                return -ENOTCONN;
+            while ((n = tcp_recv(s->tcp, buf, len)) == -EAGAIN && wait)
+                sock_wait(s, NET_EV_READ);
+            if (n >= 0)
+                addr_store(addr, alen, s->peer, s->peer_port);
+            return n;
+
+        case SK_UDP: {
+            int err = udp_autobind(s);
+            if (err < 0)
+                return err;
+
+            ip4_addr_t from;
+            uint16_t   port;
+            while ((n = udp_recvfrom(s->udp, buf, len, &from, &port)) ==
+                   -EAGAIN && wait)
+                sock_wait(s, NET_EV_READ);
+            if (n >= 0)
+                addr_store(addr, alen, from, port);
+            return n;
+        }
+
+        default:
+            return -ENOTSOCK;
+    }
+}
+
+int
+sock_close(int fd)
+{
+    struct socket *s = sock_get(fd);
+    if (s == NULL)
+        return -EBADF;
+
+    if (s->tcp != NULL)
+        tcp_close(s->tcp);
+    if (s->udp != NULL)
+        udp_close(s->udp);
+
+    // Drop the socket from every epoll instance, and an instance's own
+    // registrations.
+    uint64_t flags = save_interrupts();
+    spin_lock(lock);
+    for (int i = 0; items_ready && i < MAX_EPOLL_ITEMS; i++) {
+        if (items[i].epfd == fd || items[i].fd == fd)
+            items[i].epfd = -1;
+    }
+    s->kind = SK_FREE;
+    spin_unlock(lock);
+    restore_interrupts(flags);
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+// Readiness notification
+//----------------------------------------------------------------------------
+
+static struct epoll_item *
+item_find(int epfd, int fd)
+{
+    for (int i = 0; i < MAX_EPOLL_ITEMS; i++) {
+        if (items[i].epfd == epfd && items[i].fd == fd)
+            return &items[i];
+    }
+    return NULL;
+}
+
+static uint32_t
+epoll_bits(int ev)
+{
+    return ((ev & NET_EV_READ)  ? EPOLLIN  : 0) |
+           ((ev & NET_EV_WRITE) ? EPOLLOUT : 0) |
+           ((ev & NET_EV_ERR)   ? EPOLLERR : 0) |
+           ((ev & NET_EV_HUP)   ? EPOLLHUP : 0);
+}
+
+int
+sock_epoll_create()
+{
+    uint64_t flags = save_interrupts();
+    spin_lock(lock);
+    if (!items_ready) {
+        for (int i = 0; i < MAX_EPOLL_ITEMS; i++)
+            items[i].epfd = -1;
+        items_ready = true;
+    }
+    spin_unlock(lock);
+    restore_interrupts(flags);
+
+    return sock_alloc(SK_EPOLL, false);
+}
+
+int
+sock_epoll_ctl(int epfd, int op, int fd, const struct epoll_event *ev)
+{
+    struct socket *ep = sock_get(epfd);
+    struct socket *s  = sock_get(fd);
+    if (ep == NULL || s == NULL)
+        return -EBADF;
+    if (ep->kind != SK_EPOLL || s->kind == SK_EPOLL || epfd == fd)
+        return -EINVAL;
+    if (op != EPOLL_CTL_DEL && ev == NULL)
+        return -EINVAL;
+
+    int err = 0;
+
+    uint64_t flags = save_interrupts();
+    spin_lock(lock);
+    struct epoll_item *item = item_find(epfd, fd);
+    switch (op) {
+        case EPOLL_CTL_ADD:
+            if (item != NULL) {
+                err = -EEXIST;
+                break;
+            }
+            for (int i = 0; item == NULL && i < MAX_EPOLL_ITEMS; i++) {
+                if (items[i].epfd == -1)
+                    item = &items[i];
+            }
+            if (item == NULL) {
+                err = -ENOMEM;
+                break;
+            }
+            item->epfd = epfd;
+            item->fd   = fd;
+            item->ev   = *ev;
+            break;
+
+        case EPOLL_CTL_MOD:
+            if (item == NULL)
+                err = -ENOENT;
+            else
+                item->ev = *ev;
+            break;
+
+        case EPOLL_CTL_DEL:
+            if (item == NULL)
+                err = -ENOENT;
+            else
+                item->epfd = -1;
+            break;
+
+        default:
+            err = -EINVAL;
+            break;
+    }
+    spin_unlock(lock);
+    restore_interrupts(flags);
+    return err;
+}
+
+int
+sock_epoll_wait(int epfd, struct epoll_event *events, int max, int timeout)
+{
+    struct socket *ep = sock_get(epfd);
+    if (ep == NULL)
+        return -EBADF;
+    if (ep->kind != SK_EPOLL || max <= 0)
+        return -EINVAL;
+
+    uint64_t deadline = (timeout > 0) ? net_time() + (uint64_t)timeout : 0;
+    for (;;) {
+        bool busy = net_poll();
+
+        // Readiness is level-triggered, so a scan of the registrations
+        // finds everything that can make progress.
+        int n = 0;
+        for (int i = 0; i < MAX_EPOLL_ITEMS && n < max; i++) {
+            const struct epoll_item *item = &items[i];
+            if (item->epfd != epfd)
+                continue;
+
+            uint32_t ready = epoll_bits(sock_events(&socks[item->fd])) &
+                             (item->ev.events | EPOLLERR | EPOLLHUP);
+            if (ready) {
+                events[n].events = ready;
+                events[n].data   = item->ev.data;
+                n++;
+            }
+        }
+
+        if (n > 0 || timeout == 0)
+            return n;
+        if (timeout > 0 && net_time() >= deadline)
+            return 0;
+        if (!busy)
+            halt();
+    }
+}
@@ -0,0 +1,1638 @@
+//============================================================================
+/// @file       tcp.c
+/// @brief      Transmission Control Protocol.
+//============================================================================
+
+#include <core.h>
+#include <libc/string.h>
+#include <kernel/errno.h>
+#include <kernel/net/tcp.h>
+#include <kernel/spinlock.h>
+#include <kernel/x86/cpu.h>
+#include "proto.h"
+
+// Number of TCP endpoints, including listeners.
+#define MAX_TCP_PCBS         256
+
+// Hash buckets in each per-CPU connection table.
+#define TCP_HASH             64
+
+// Socket buffer sizes. Without window scaling the receive window is
+// limited to 64KiB.
+#define TCP_SND_BUF          (128 * 1024)
+#define TCP_RCV_BUF          0xffff
+
+// Segment size assumed when the peer sends no MSS option.
+#define TCP_DEFAULT_MSS      536
+
+// Retransmission timeout bounds and limits, in milliseconds.
+#define TCP_RTO_INIT         1000
+#define TCP_RTO_MIN          200
+#define TCP_RTO_MAX          60000
+#define TCP_MAX_RETRIES      8
+#define TCP_SYN_RETRIES      5
+
+// How long closed connections linger. TIME_WAIT is kept short since the
+// stack mostly talks to clients on the same host.
+#define TCP_TIMEWAIT_MS      2000
+#define TCP_FINWAIT_MS       30000
+
+// Ephemeral port range.
+#define TCP_PORT_FIRST       49152
+#define TCP_PORT_LAST        65535
+
+// Header flags
+#define TCP_FIN              0x01
+#define TCP_SYN              0x02
+#define TCP_RST              0x04
+#define TCP_PSH              0x08
+#define TCP_ACK              0x10
+
+// Options
+#define TCP_OPT_END          0
+#define TCP_OPT_NOP          1
+#define TCP_OPT_MSS          2
+
+// Sequence number comparisons
+#define SEQ_LT(a, b)         ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a, b)        ((int32_t)((a) - (b)) <= 0)
+#define SEQ_GT(a, b)         ((int32_t)((a) - (b)) > 0)
+#define SEQ_GEQ(a, b)        ((int32_t)((a) - (b)) >= 0)
+
+enum tcp_state
+{
+    TCP_CLOSED,
+    TCP_LISTEN,
+    TCP_SYN_SENT,
+    TCP_SYN_RCVD,
+    TCP_ESTABLISHED,
+    TCP_FIN_WAIT_1,
+    TCP_FIN_WAIT_2,
+    TCP_CLOSE_WAIT,
+    TCP_CLOSING,
+    TCP_LAST_ACK,
+    TCP_TIME_WAIT,
+};
+
+struct tcp_pcb
+{
+    tcp_pcb_t      *hnext;      ///< Hash chain, listener list or free list
+    enum tcp_state  state;
+    int             cpu;        ///< Connection table, or -1 if unhashed
+    bool            user;       ///< Still referenced by its owner
+    int             error;      ///< Pending -errno for the owner
+    ip4_addr_t      laddr;
+    ip4_addr_t      raddr;
+    uint16_t        lport;
+    uint16_t        rport;
+
+    // Send sequence space
+    uint32_t        iss;
+    uint32_t        snd_una;    ///< Oldest unacknowledged sequence number
+    uint32_t        snd_nxt;    ///< Next sequence number to send
+    uint32_t        snd_max;    ///< Highest sequence number sent
+    uint32_t        snd_wnd;    ///< Peer's receive window
+    uint32_t        snd_wl1;    ///< Segment sequence of last window update
+    uint32_t        snd_wl2;    ///< Segment ack of last window update
+    uint32_t        snd_buf;    ///< Sequence number of sndq's first byte
+    uint32_t        cwnd;
+    uint32_t        ssthresh;
+    uint16_t        mss;        ///< Effective send segment size
+    int             dupacks;
+    pbuf_t         *sndq;       ///< Unacknowledged and unsent data
+    uint32_t        sndq_len;
+    bool            fin_queued; ///< Owner closed; FIN follows the data
+
+    // Receive sequence space
+    uint32_t        irs;
+    uint32_t        rcv_nxt;
+    uint32_t        rcv_adv;    ///< Right edge of the advertised window
+    pbuf_t         *rcvq;       ///< In-order data not yet read
+    pbuf_t         *rcvq_tail;  ///< Last piece of rcvq
+    uint32_t        rcvq_len;
+    bool            fin_rcvd;
+    int             ack_pending;///< Segments received but not acknowledged
+    bool            ack_now;
+
+    // Timers
+    uint64_t        timer;      ///< Retransmit, persist or linger deadline
+    uint32_t        rto;
+    int             retries;
+    uint32_t        srtt;
+    uint32_t        rttvar;
+    bool            rtt_active;
+    uint32_t        rtt_seq;
+    uint64_t        rtt_time;
+
+    // Listener state
+    tcp_pcb_t      *parent;     ///< Listener of a half-open connection
+    tcp_pcb_t      *anext;      ///< Accept queue link
+    tcp_pcb_t      *acceptq;
+    tcp_pcb_t      *acceptq_tail;
+    int             queued;     ///< Connections in acceptq
+    int             pending;    ///< Half-open connections
+    int             backlog;
+};
+
+// A received segment after header parsing.
+struct tcp_seg
+{
+    uint32_t seq;
+    uint32_t ack;
+    uint32_t len;               ///< Payload bytes
+    uint16_t wnd;
+    uint16_t mss;               ///< MSS option, or 0
+    uint8_t  flags;
+};
+
+struct tcp_table
+{
+    spin_lock_t lock;
+    tcp_pcb_t  *hash[TCP_HASH];
+};
+
+static tcp_pcb_t        pool[MAX_TCP_PCBS];
+static tcp_pcb_t       *free_pcbs;
+static bool             pool_ready;
+static spin_lock_t      pool_lock;
+
+static struct tcp_table tables[NET_CPUS];
+
+static tcp_pcb_t       *listeners;
+static spin_lock_t      listen_lock;
+
+static uint16_t         next_port = TCP_PORT_FIRST;
+static uint32_t         iss_seed;
+
+//----------------------------------------------------------------------------
+// Endpoint allocation and connection tables
+//----------------------------------------------------------------------------
+
+static tcp_pcb_t *
+pcb_alloc()
+{
+    spin_lock(pool_lock);
+    if (!pool_ready) {
+        for (int i = 0; i < MAX_TCP_PCBS; i++) {
+            pool[i].hnext = free_pcbs;
+            free_pcbs     = &pool[i];
+        }
+        pool_ready = true;
+    }
+    tcp_pcb_t *pcb = free_pcbs;
+    if (pcb != NULL)
+        free_pcbs = pcb->hnext;
+    spin_unlock(pool_lock);
+
+    if (pcb != NULL) {
+        memzero(pcb, sizeof(*pcb));
+        pcb->cpu      = -1;
+        pcb->mss      = TCP_DEFAULT_MSS;
+        pcb->rto      = TCP_RTO_INIT;
+        pcb->ssthresh = TCP_SND_BUF;
+    }
+    return pcb;
+}
+
+static void
+pcb_release(tcp_pcb_t *pcb)
+{
+    pbuf_free(pcb->sndq);
+    pbuf_free(pcb->rcvq);
+    pcb->sndq = pcb->rcvq = pcb->rcvq_tail = NULL;
+
+    spin_lock(pool_lock);
+    pcb->hnext = free_pcbs;
+    free_pcbs  = pcb;
+    spin_unlock(pool_lock);
+}
+
+static inline int
+hash(ip4_addr_t raddr, uint16_t rport, uint16_t lport)
+{
+    uint32_t h = raddr ^ ((uint32_t)rport << 16) ^ lport;
+    h ^= h >> 16;
+    h ^= h >> 8;
+    return (int)(h % TCP_HASH);
+}
+
+// Insert a connection into the calling CPU's table. Called with the table
+// lock held.
+static void
+pcb_hash(tcp_pcb_t *pcb, int cpu)
+{
+    struct tcp_table *t = &tables[cpu];
+    int               h = hash(pcb->raddr, pcb->rport, pcb->lport);
+    pcb->cpu     = cpu;
+    pcb->hnext   = t->hash[h];
+    t->hash[h]   = pcb;
+}
+
+// Remove a connection from its table. Called with the table lock held.
+static void
+pcb_unhash(tcp_pcb_t *pcb)
+{
+    if (pcb->cpu < 0)
+        return;
+
+    struct tcp_table *t    = &tables[pcb->cpu];
+    tcp_pcb_t       **link = &t->hash[hash(pcb->raddr, pcb->rport,
+                                             pcb->lport)];
+    while (*link != NULL && *link != pcb)
+        link = &(*link)->hnext;
+    if (*link != NULL)
+        *link = pcb->hnext;
+    pcb->hnext = NULL;
+}
+
+static tcp_pcb_t *
+table_find(struct tcp_table *t, ip4_addr_t laddr, uint16_t lport,
+           ip4_addr_t raddr, uint16_t rport)
+{
+    tcp_pcb_t *pcb = t->hash[hash(raddr, rport, lport)];
+    for (; pcb != NULL; pcb = pcb->hnext) {
+        if (pcb->lport == lport && pcb->rport == rport &&
+            pcb->raddr == raddr && pcb->laddr == laddr)
+            return pcb;
+    }
+    return NULL;
+}
+
+// Find a connection, starting with the calling CPU's table. On success the
+// table holding it is returned locked.
+static tcp_pcb_t *
+lookup(ip4_addr_t laddr, uint16_t lport, ip4_addr_t raddr, uint16_t rport,
+       struct tcp_table **table)
+{
+    int cpu = net_cpu();
+    for (int i = 0; i < NET_CPUS; i++) {
+        struct tcp_table *t = &tables[(cpu + i) % NET_CPUS];
+        spin_lock(t->lock);
+        tcp_pcb_t *pcb = table_find(t, laddr, lport, raddr, rport);
+        if (pcb != NULL) {
+            *table = t;
+            return pcb;
+        }
+        spin_unlock(t->lock);
+    }
+    return NULL;
+}
+
+static tcp_pcb_t *
+find_listener(ip4_addr_t addr, uint16_t port)
+{
+    for (tcp_pcb_t *pcb = listeners; pcb != NULL; pcb = pcb->hnext) {
+        if (pcb->lport == port &&
+            (pcb->laddr == IP4_ANY || addr == IP4_ANY || pcb->laddr == addr))
+            return pcb;
+    }
+    return NULL;
+}
+
+static bool
+port_in_use(uint16_t port)
+{
+    if (find_listener(IP4_ANY, port) != NULL)
+        return true;
+
+    for (int i = 0; i < NET_CPUS; i++) {
+        struct tcp_table *t     = &tables[i];
+        bool              found = false;
+        spin_lock(t->lock);
+        for (int h = 0; h < TCP_HASH && !found; h++) {
+            for (tcp_pcb_t *pcb = t->hash[h]; pcb; pcb = pcb->hnext) {
+                if (pcb->lport == port) {
+                    found = true;
+                    break;
+                }
+            }
+        }
+        spin_unlock(t->lock);
+        if (found)
+            return true;
+    }
+    return false;
+}
+
+static uint32_t
+new_iss()
+{
+    // RFC 793's clock-driven ISN: 250,000 increments per second.
+    iss_seed += 64000;
+    return iss_seed + (uint32_t)net_time() * 250;
+}
+
+//----------------------------------------------------------------------------
+// Output
+//----------------------------------------------------------------------------
+
+static inline uint32_t
+rcv_wnd(const tcp_pcb_t *pcb)
+{
+    return min(TCP_RCV_BUF - pcb->rcvq_len, 0xffffu);
+}
+
+static uint16_t
+local_mss(ip4_addr_t raddr)
+{
+    ip4_addr_t nexthop;
+    netif_t   *netif = net_route(raddr, &nexthop);
+    uint32_t   mtu   = netif ? netif->dev->mtu : ETH_MTU;
+    return (uint16_t)(mtu - IP_HLEN - TCP_HLEN);
+}
+
+// Finish a segment's TCP header checksum: left to the device if it can,
+// otherwise computed over the whole chain.
+static void
+set_checksum(pbuf_t *pb, const tcp_pcb_t *pcb, bool offload)
+{
+    struct tcp_hdr *th  = (struct tcp_hdr *)pb->data;
+    uint32_t        sum = net_csum_pseudo(pcb->laddr, pcb->raddr, IP_PROTO_TCP,
+                                          pb->tot_len);
+    if (offload) {
+        th->csum        = (uint16_t)~net_csum_fold(sum);
+        pb->flags      |= PBUF_CSUM_PARTIAL;
+        pb->csum_start  = 0;
+        pb->csum_offset = offsetof(struct tcp_hdr, csum);
+    }
+    else {
+        th->csum = 0;
+        th->csum = net_csum_fold(net_csum_pbuf(pb, 0, pb->tot_len, sum));
+    }
+}
+
+// Send one segment starting at `seq' with up to `len' bytes of queued data.
+// Returns the number of data bytes sent, or -1 if no buffer was available.
+static int
+send_segment(tcp_pcb_t *pcb, uint32_t seq, uint32_t len, uint8_t flags)
+{
+    ip4_addr_t nexthop;
+    netif_t   *netif = net_route(pcb->raddr, &nexthop);
+    if (netif == NULL)
+        return -1;
+    uint32_t features = netif->dev->features;
+
+    uint32_t hlen = TCP_HLEN + ((flags & TCP_SYN) ? 4 : 0);
+    pbuf_t  *pb   = pbuf_alloc(PBUF_HEADROOM, hlen);
+    if (pb == NULL)
+        return -1;
+
+    // The payload is cloned out of the send queue, never copied.
+    if (len > 0) {
+        pbuf_t *data = pbuf_clone(pcb->sndq, seq - pcb->snd_buf, len,
+                                  MAX_NET_SEGS - 1);
+        if (data == NULL) {
+            pbuf_free(pb);
+            return -1;
+        }
+        if (data->tot_len < len && (flags & TCP_FIN))
+            flags &= ~TCP_FIN;
+        len = data->tot_len;
+        pbuf_cat(pb, data);
+    }
+
+    uint32_t        wnd = rcv_wnd(pcb);
+    struct tcp_hdr *th  = (struct tcp_hdr *)pb->data;
+    th->sport = htons(pcb->lport);
+    th->dport = htons(pcb->rport);
+    th->seq   = htonl(seq);
+    th->ack   = (flags & TCP_ACK) ? htonl(pcb->rcv_nxt) : 0;
+    th->off   = (uint8_t)((hlen / 4) << 4);
+    th->flags = flags;
+    th->wnd   = htons((uint16_t)wnd);
+    th->urp   = 0;
+    if (flags & TCP_SYN) {
+        uint8_t  *opt = (uint8_t *)(th + 1);
+        uint16_t  mss = htons(local_mss(pcb->raddr));
+        opt[0] = TCP_OPT_MSS;
+        opt[1] = 4;
+        memcpy(opt + 2, &mss, 2);
+    }
+
+    // Let the device cut large sends into MSS-sized segments.
+    bool offload = (features & NETDEV_F_TX_CSUM) != 0;
+    if (len > pcb->mss) {
+        pb->flags    |= PBUF_GSO_TCPV4;
+        pb->hdr_len   = (uint16_t)hlen;
+        pb->gso_size  = pcb->mss;
+    }
+    set_checksum(pb, pcb, offload);
+
+    if (flags & TCP_ACK) {
+        pcb->rcv_adv     = pcb->rcv_nxt + wnd;
+        pcb->ack_pending = 0;
+        pcb->ack_now     = false;
+    }
+
+    ip_output(pb, pcb->laddr, pcb->raddr, IP_PROTO_TCP);
+    return (int)len;
+}
+
+// Largest payload to hand the device in one segment.
+static uint32_t
+max_segment(const tcp_pcb_t *pcb)
+{
+    ip4_addr_t nexthop;
+    netif_t   *netif = net_route(pcb->raddr, &nexthop);
+    if (netif == NULL)
+        return pcb->mss;
+
+    const netdev_t *dev = netif->dev;
+    uint32_t        req = NETDEV_F_TSO | NETDEV_F_TX_CSUM;
+    if ((dev->features & req) != req)
+        return pcb->mss;
+
+    uint32_t limit = min(dev->gso_max, 0xffffu) - IP_HLEN - TCP_HLEN;
+    return max(align_dn(limit, pcb->mss), pcb->mss);
+}
+
+static void
+arm_timer(tcp_pcb_t *pcb)
+{
+    if (pcb->timer == 0)
+        pcb->timer = net_time() + pcb->rto;
+}
+
+// Send whatever the windows allow, plus any acknowledgement owed.
+static void
+tcp_output(tcp_pcb_t *pcb, bool probe)
+{
+    switch (pcb->state) {
+        case TCP_SYN_SENT:
+        case TCP_SYN_RCVD:
+            if (pcb->snd_nxt == pcb->iss) {
+                uint8_t flags = TCP_SYN;
+                if (pcb->state == TCP_SYN_RCVD)
+                    flags |= TCP_ACK;
+                if (send_segment(pcb, pcb->iss, 0, flags) >= 0) {
+                    pcb->snd_nxt = pcb->iss + 1;
+                    pcb->snd_max = SEQ_GT(pcb->snd_nxt, pcb->snd_max)
+                                   ? pcb->snd_nxt : pcb->snd_max;
+                    arm_timer(pcb);
+                }
+            }
+            return;
+
+        case TCP_ESTABLISHED:
+        case TCP_CLOSE_WAIT:
+        case TCP_FIN_WAIT_1:
+        case TCP_CLOSING:
+        case TCP_LAST_ACK:
+            break;
+
+        default:
+            if (pcb->ack_now && pcb->state != TCP_CLOSED)
+                send_segment(pcb, pcb->snd_nxt, 0, TCP_ACK);
+            return;
+    }
+
+    uint32_t fin_seq = pcb->snd_buf + pcb->sndq_len;
+    uint32_t wnd     = min(pcb->snd_wnd, pcb->cwnd);
+    uint32_t maxseg  = max_segment(pcb);
+    if (probe && wnd == 0)
+        wnd = 1;
+
+    for (;;) {
+        uint32_t off      = pcb->snd_nxt - pcb->snd_buf;
+        uint32_t avail    = SEQ_LT(pcb->snd_nxt, fin_seq)
+                            ? pcb->sndq_len - off : 0;
+        uint32_t inflight = pcb->snd_nxt - pcb->snd_una;
+        uint32_t usable   = (wnd > inflight) ? wnd - inflight : 0;
+        uint32_t len      = min(min(avail, usable), maxseg);
+
+        // Avoid a runt segment when a full one will be possible once
+        // more acknowledgements arrive.
+        if (len < avail && len < pcb->mss && inflight > 0)
+            len = 0;
+
+        bool fin = pcb->fin_queued && len == avail &&
+                   SEQ_LEQ(pcb->snd_nxt, fin_seq) &&
+                   pcb->snd_nxt + len == fin_seq;
+        if (len == 0 && !fin)
+            break;
+
+        uint8_t flags = TCP_ACK | (len ? TCP_PSH : 0) | (fin ? TCP_FIN : 0);
+        int     sent  = send_segment(pcb, pcb->snd_nxt, len, flags);
+        if (sent < 0)
+            break;
+        if ((uint32_t)sent < len)
+            fin = false;
+
+        if (!pcb->rtt_active && sent > 0) {
+            pcb->rtt_active = true;
+            pcb->rtt_seq    = pcb->snd_nxt;
+            pcb->rtt_time   = net_time();
+        }
+
+        pcb->snd_nxt += (uint32_t)sent + (fin ? 1 : 0);
+        if (SEQ_GT(pcb->snd_nxt, pcb->snd_max))
+            pcb->snd_max = pcb->snd_nxt;
+        arm_timer(pcb);
+
+        if (fin)
+            break;
+    }
+
+    // Keep probing a zero window while data is waiting.
+    if (pcb->snd_wnd == 0 && pcb->sndq_len > 0)
+        arm_timer(pcb);
+
+    if (pcb->ack_now)
+        send_segment(pcb, pcb->snd_nxt, 0, TCP_ACK);
+}
+
+// Reply to a segment with a reset, without a connection.
+static void
+send_reset(ip4_addr_t laddr, uint16_t lport, ip4_addr_t raddr,
+           uint16_t rport, uint32_t seq, uint32_t ack, bool with_ack)
+{
+    pbuf_t *pb = pbuf_alloc(PBUF_HEADROOM, TCP_HLEN);
+    if (pb == NULL)
+        return;
+
+    struct tcp_hdr *th = (struct tcp_hdr *)pb->data;
+    th->sport = htons(lport);
+    th->dport = htons(rport);
+    th->seq   = htonl(seq);
+    th->ack   = with_ack ? htonl(ack) : 0;
+    th->off   = (TCP_HLEN / 4) << 4;
+    th->flags = TCP_RST | (with_ack ? TCP_ACK : 0);
+    th->wnd   = 0;
+    th->urp   = 0;
+    th->csum  = 0;
+
+    uint32_t sum = net_csum_pseudo(laddr, raddr, IP_PROTO_TCP, TCP_HLEN);
+    th->csum = net_csum_fold(net_csum(th, TCP_HLEN, sum));
+    ip_output(pb, laddr, raddr, IP_PROTO_TCP);
+}
+
+//----------------------------------------------------------------------------
+// Connection teardown
+//----------------------------------------------------------------------------
+
+static void
+listener_release(tcp_pcb_t *l)
+{
+    // Called with listen_lock held once a closed listener has no half-open
+    // connections left.
+    if (l->state == TCP_CLOSED && !l->user && l->pending == 0)
+        pcb_release(l);
+}
+
+static void
+detach_parent(tcp_pcb_t *pcb)
+{
+    tcp_pcb_t *l = pcb->parent;
+    if (l == NULL)
+        return;
+
+    spin_lock(listen_lock);
+    l->pending--;
+    listener_release(l);
+    spin_unlock(listen_lock);
+    pcb->parent = NULL;
+}
+
+// Move a connection to CLOSED, reporting `err' to its owner. Called with the
+// connection's table lock held. The endpoint is released unless its owner
+// still holds it.
+static void
+tcp_drop(tcp_pcb_t *pcb, int err)
+{
+    pcb_unhash(pcb);
+    detach_parent(pcb);
+    pcb->cpu   = -1;
+    pcb->state = TCP_CLOSED;
+    pcb->timer = 0;
+    if (err != 0)
+        pcb->error = err;
+
+    pbuf_free(pcb->sndq);
+    pcb->sndq     = NULL;
+    pcb->sndq_len = 0;
+
+    if (!pcb->user)
+        pcb_release(pcb);
+}
+
+static void
+enter_time_wait(tcp_pcb_t *pcb)
+{
+    pcb->state = TCP_TIME_WAIT;
+    pcb->timer = net_time() + TCP_TIMEWAIT_MS;
+}
+
+//----------------------------------------------------------------------------
+// Input
+//----------------------------------------------------------------------------
+
+static void
+rtt_sample(tcp_pcb_t *pcb)
+{
+    uint32_t r = (uint32_t)(net_time() - pcb->rtt_time);
+    if (pcb->srtt == 0) {
+        pcb->srtt   = max(r, 1u);
+        pcb->rttvar = r / 2;
+    }
+    else {
+        uint32_t delta = (pcb->srtt > r) ? pcb->srtt - r : r - pcb->srtt;
+        pcb->rttvar = (3 * pcb->rttvar + delta) / 4;
+        pcb->srtt   = (7 * pcb->srtt + r) / 8;
+    }
+    uint32_t rto = pcb->srtt + max(4 * pcb->rttvar, (uint32_t)NET_TICK_MS);
+    pcb->rto        = min(max(rto, (uint32_t)TCP_RTO_MIN), TCP_RTO_MAX);
+    pcb->rtt_active = false;
+}
+
+static void
+process_ack(tcp_pcb_t *pcb, const struct tcp_seg *seg)
+{
+    if (SEQ_LT(pcb->snd_una, seg->ack) && SEQ_LEQ(seg->ack, pcb->snd_max)) {
+        uint32_t acked = seg->ack - pcb->snd_una;
+
+        // Release acknowledged data from the send queue.
+        if (SEQ_GT(seg->ack, pcb->snd_buf)) {
+            uint32_t n = min(seg->ack - pcb->snd_buf, pcb->sndq_len);
+            if (n > 0) {
+                pcb->sndq      = pbuf_drop(pcb->sndq, n);
+                pcb->sndq_len -= n;
+                pcb->snd_buf  += n;
+            }
+        }
+
+        pcb->snd_una = seg->ack;
+        if (SEQ_LT(pcb->snd_nxt, pcb->snd_una))
+            pcb->snd_nxt = pcb->snd_una;
+
+        if (pcb->rtt_active && SEQ_GT(seg->ack, pcb->rtt_seq))
+            rtt_sample(pcb);
+
+        // Slow start, then congestion avoidance. Leaving fast recovery
+        // deflates the window back to the threshold.
+        if (pcb->dupacks >= 3)
+            pcb->cwnd = pcb->ssthresh;
+        else if (pcb->cwnd < pcb->ssthresh)
+            pcb->cwnd += min(acked, (uint32_t)pcb->mss);
+        else
+            pcb->cwnd += max((uint32_t)pcb->mss * pcb->mss / pcb->cwnd, 1u);
+        pcb->dupacks = 0;
+        pcb->retries = 0;
+
+        pcb->timer = 0;
+        if (pcb->snd_una != pcb->snd_max)
+            arm_timer(pcb);
+    }
+    else if (seg->ack == pcb->snd_una && seg->len == 0 &&
+             seg->wnd == pcb->snd_wnd && pcb->snd_una != pcb->snd_max) {
+        // Three duplicate acknowledgements: resend the missing segment
+        // without waiting for the timer.
+        if (++pcb->dupacks == 3) {
+            uint32_t flight = pcb->snd_max - pcb->snd_una;
+            pcb->ssthresh = max(flight / 2, 2u * pcb->mss);
+            pcb->cwnd     = pcb->ssthresh + 3u * pcb->mss;
+            uint32_t len  = min((uint32_t)pcb->mss,
+                                pcb->sndq_len -
+                                (pcb->snd_una - pcb->snd_buf));
+            if (len > 0)
+                send_segment(pcb, pcb->snd_una, len, TCP_ACK);
+            pcb->rtt_active = false;
+        }
+        else if (pcb->dupacks > 3) {
+            pcb->cwnd += pcb->mss;
+        }
+    }
+
+    // Take window updates only from segments newer than the last one.
+    if (SEQ_LT(pcb->snd_wl1, seg->seq) ||
+        (pcb->snd_wl1 == seg->seq && SEQ_LEQ(pcb->snd_wl2, seg->ack))) {
+        pcb->snd_wnd = seg->wnd;
+        pcb->snd_wl1 = seg->seq;
+        pcb->snd_wl2 = seg->ack;
+    }
+}
+
+static void
+establish(tcp_pcb_t *pcb, const struct tcp_seg *seg)
+{
+    pcb->state   = TCP_ESTABLISHED;
+    pcb->snd_wnd = seg->wnd;
+    pcb->snd_wl1 = seg->seq;
+    pcb->snd_wl2 = seg->ack;
+    pcb->cwnd    = 10u * pcb->mss;
+    pcb->retries = 0;
+}
+
+// Queue in-order payload on the receive queue without copying it. Returns
+// true if the pbuf was consumed (queued or freed).
+static bool
+receive_data(tcp_pcb_t *pcb, pbuf_t *pb, const struct tcp_seg *seg)
+{
+    uint32_t seq = seg->seq;
+    uint32_t len = seg->len;
+
+    // Trim anything already received.
+    if (SEQ_LT(seq, pcb->rcv_nxt)) {
+        uint32_t dup = pcb->rcv_nxt - seq;
+        if (dup >= len)
+            return false;
+        pb   = pbuf_drop(pb, dup);
+        len -= dup;
+        seq  = pcb->rcv_nxt;
+    }
+
+    // Out-of-order segments are not kept; a duplicate ACK tells the sender
+    // where the gap is.
+    if (seq != pcb->rcv_nxt) {
+        pcb->ack_now = true;
+        return false;
+    }
+
+    uint32_t space = TCP_RCV_BUF - pcb->rcvq_len;
+    if (len > space) {
+        if (space == 0) {
+            pcb->ack_now = true;
+            pbuf_free(pb);
+            return true;
+        }
+        pbuf_trim(pb, space);
+        len = space;
+    }
+
+    pb->flags   = 0;
+    pb->nextpkt = NULL;
+    if (pcb->rcvq == NULL) {
+        pcb->rcvq = pb;
+    }
+    else {
+        pcb->rcvq_tail->next  = pb;
+        pcb->rcvq->tot_len   += len;
+    }
+    pbuf_t *tail = pb;
+    while (tail->next != NULL)
+        tail = tail->next;
+    pcb->rcvq_tail = tail;
+    if (pcb->rcvq != pb)
+        pb->tot_len = 0;
+
+    pcb->rcvq_len += len;
+    pcb->rcv_nxt  += len;
+
+    // Acknowledge every second segment; the timer covers the rest.
+    if (++pcb->ack_pending >= 2)
+        pcb->ack_now = true;
+    return true;
+}
+
+static void
+process_fin(tcp_pcb_t *pcb)
+{
+    pcb->rcv_nxt++;
+    pcb->fin_rcvd = true;
+    pcb->ack_now  = true;
+
+    switch (pcb->state) {
+        case TCP_SYN_RCVD:
+        case TCP_ESTABLISHED:
+            pcb->state = TCP_CLOSE_WAIT;
+            break;
+
+        case TCP_FIN_WAIT_1:
+            // Our FIN is still unacknowledged.
+            pcb->state = TCP_CLOSING;
+            break;
+
+        case TCP_FIN_WAIT_2:
+            enter_time_wait(pcb);
+            break;
+
+        default:
+            break;
+    }
+}
+
+// Process a segment for a synchronized connection. Called with the
+// connection's table lock held. Returns true if the pbuf was consumed.
+static bool
+process(tcp_pcb_t *pcb, pbuf_t *pb, const struct tcp_seg *seg)
+{
+    uint32_t seglen = seg->len + ((seg->flags & TCP_FIN) ? 1 : 0);
+    uint32_t wnd    = rcv_wnd(pcb);
+
+    // Is any of the segment inside the receive window?
+    bool ok;
+    if (seglen == 0)
+        ok = (wnd == 0) ? seg->seq == pcb->rcv_nxt
+                        : SEQ_GEQ(seg->seq, pcb->rcv_nxt) &&
+                          SEQ_LT(seg->seq, pcb->rcv_nxt + wnd);
+    else
+        ok = wnd > 0 &&
+             SEQ_LT(seg->seq, pcb->rcv_nxt + wnd) &&
+             SEQ_GT(seg->seq + seglen, pcb->rcv_nxt);
+
+    // A repeated SYN means our SYN-ACK was lost.
+    if (pcb->state == TCP_SYN_RCVD && (seg->flags & TCP_SYN) &&
+        !(seg->flags & (TCP_ACK | TCP_RST)) && seg->seq == pcb->irs) {
+        pcb->snd_nxt = pcb->iss;
+        tcp_output(pcb, false);
+        return false;
+    }
+
+    if (!ok) {
+        if (!(seg->flags & TCP_RST)) {
+            pcb->ack_now = true;
+            tcp_output(pcb, false);
+        }
+        return false;
+    }
+
+    if (seg->flags & TCP_RST) {
+        tcp_drop(pcb, pcb->state == TCP_SYN_RCVD ? -ECONNREFUSED
+                                                 : -ECONNRESET);
+        return false;
+    }
+
+    if (seg->flags & TCP_SYN) {
+        send_reset(pcb->laddr, pcb->lport, pcb->raddr, pcb->rport,
+                   pcb->snd_nxt, 0, false);
+        tcp_drop(pcb, -ECONNRESET);
+        return false;
+    }
+
+    if (!(seg->flags & TCP_ACK))
+        return false;
+
+    if (pcb->state == TCP_SYN_RCVD) {
+        if (!SEQ_LT(pcb->snd_una, seg->ack) ||
+            !SEQ_LEQ(seg->ack, pcb->snd_max)) {
+            send_reset(pcb->laddr, pcb->lport, pcb->raddr, pcb->rport,
+                       seg->ack, 0, false);
+            return false;
+        }
+
+        // Hand the connection to its listener. From here on it counts
+        // against the listener only through the accept queue.
+        tcp_pcb_t *l = pcb->parent;
+        spin_lock(listen_lock);
+        l->pending--;
+        pcb->parent = NULL;
+        bool live = (l->state == TCP_LISTEN);
+        if (live) {
+            pcb->anext = NULL;
+            if (l->acceptq_tail != NULL)
+                l->acceptq_tail->anext = pcb;
+            else
+                l->acceptq = pcb;
+            l->acceptq_tail = pcb;
+            l->queued++;
+            pcb->user = true;
+        }
+        else {
+            listener_release(l);
+        }
+        spin_unlock(listen_lock);
+
+        if (!live) {
+            send_reset(pcb->laddr, pcb->lport, pcb->raddr, pcb->rport,
+                       seg->ack, 0, false);
+            tcp_drop(pcb, -ECONNRESET);
+            return false;
+        }
+        establish(pcb, seg);
+    }
+
+    if (SEQ_GT(seg->ack, pcb->snd_max)) {
+        pcb->ack_now = true;
+        tcp_output(pcb, false);
+        return false;
+    }
+
+    process_ack(pcb, seg);
+
+    bool fin_acked = pcb->fin_queued && pcb->snd_una == pcb->snd_max &&
+                     pcb->snd_una == pcb->snd_buf + pcb->sndq_len + 1;
+    switch (pcb->state) {
+        case TCP_FIN_WAIT_1:
+            if (fin_acked) {
+                pcb->state = TCP_FIN_WAIT_2;
+                if (!pcb->user)
+                    pcb->timer = net_time() + TCP_FINWAIT_MS;
+            }
+            break;
+
+        case TCP_CLOSING:
+            if (fin_acked)
+                enter_time_wait(pcb);
+            break;
+
+        case TCP_LAST_ACK:
+            if (fin_acked) {
+                tcp_drop(pcb, 0);
+                return false;
+            }
+            break;
+
+        case TCP_TIME_WAIT:
+            // A retransmitted FIN: acknowledge it again.
+            if (seg->flags & TCP_FIN) {
+                pcb->ack_now = true;
+                enter_time_wait(pcb);
+                tcp_output(pcb, false);
+            }
+            return false;
+
+        default:
+            break;
+    }
+
+    bool consumed = false;
+    if (seg->len > 0) {
+        switch (pcb->state) {
+            case TCP_ESTABLISHED:
+            case TCP_FIN_WAIT_1:
+            case TCP_FIN_WAIT_2:
+                consumed = receive_data(pcb, pb, seg);
+                break;
+            default:
+                break;
+        }
+    }
+
+    if ((seg->flags & TCP_FIN) && !pcb->fin_rcvd &&
+        seg->seq + seg->len == pcb->rcv_nxt)
+        process_fin(pcb);
+
+    tcp_output(pcb, false);
+    return consumed;
+}
+
+static void
+process_syn_sent(tcp_pcb_t *pcb, const struct tcp_seg *seg)
+{
+    bool ack_ok = (seg->flags & TCP_ACK) && seg->ack == pcb->iss + 1;
+
+    if ((seg->flags & TCP_ACK) && !ack_ok) {
+        if (!(seg->flags & TCP_RST))
+            send_reset(pcb->laddr, pcb->lport, pcb->raddr, pcb->rport,
+                       seg->ack, 0, false);
+        return;
+    }
+    if (seg->flags & TCP_RST) {
+        if (ack_ok)
+            tcp_drop(pcb, -ECONNREFUSED);
+        return;
+    }
+    if (!(seg->flags & TCP_SYN))
+        return;
+
+    pcb->irs     = seg->seq;
+    pcb->rcv_nxt = seg->seq + 1;
+    pcb->mss     = min(local_mss(pcb->raddr),
+                       seg->mss ? seg->mss : TCP_DEFAULT_MSS);
+
+    if (ack_ok) {
+        pcb->snd_una = seg->ack;
+        pcb->timer   = 0;
+        if (pcb->rtt_active)
+            rtt_sample(pcb);
+        establish(pcb, seg);
+        pcb->ack_now = true;
+    }
+    else {
+        // Simultaneous open: answer with SYN-ACK.
+        pcb->state   = TCP_SYN_RCVD;
+        pcb->snd_nxt = pcb->iss;
+    }
+    tcp_output(pcb, false);
+}
+
+static void
+process_listen(tcp_pcb_t *l, const struct ip_hdr *ip,
+               const struct tcp_hdr *th, const struct tcp_seg *seg)
+{
+    if (seg->flags & TCP_RST)
+        return;
+    if (seg->flags & TCP_ACK) {
+        send_reset(ip->dst, ntohs(th->dport), ip->src, ntohs(th->sport),
+                   seg->ack, 0, false);
+        return;
+    }
+    if (!(seg->flags & TCP_SYN))
+        return;
+
+    // Reserve a backlog slot under the listen lock, then build the new
+    // connection in this CPU's table.
+    spin_lock(listen_lock);
+    bool room = (l->state == TCP_LISTEN &&
+                 l->pending + l->queued < l->backlog);
+    if (room)
+        l->pending++;
+    spin_unlock(listen_lock);
+    if (!room)
+        return;
+
+    tcp_pcb_t *pcb = pcb_alloc();
+    if (pcb == NULL) {
+        spin_lock(listen_lock);
+        l->pending--;
+        listener_release(l);
+        spin_unlock(listen_lock);
+        return;
+    }
+
+    pcb->state    = TCP_SYN_RCVD;
+    pcb->parent   = l;
+    pcb->laddr    = ip->dst;
+    pcb->raddr    = ip->src;
+    pcb->lport    = ntohs(th->dport);
+    pcb->rport    = ntohs(th->sport);
+    pcb->irs      = seg->seq;
+    pcb->rcv_nxt  = seg->seq + 1;
+    pcb->iss      = new_iss();
+    pcb->snd_una  = pcb->iss;
+    pcb->snd_nxt  = pcb->iss;
+    pcb->snd_max  = pcb->iss;
+    pcb->snd_buf  = pcb->iss + 1;
+    pcb->snd_wnd  = seg->wnd;
+    pcb->mss      = min(local_mss(pcb->raddr),
+                        seg->mss ? seg->mss : TCP_DEFAULT_MSS);
+
+    struct tcp_table *t = &tables[net_cpu()];
+    spin_lock(t->lock);
+    pcb_hash(pcb, net_cpu());
+    tcp_output(pcb, false);
+    spin_unlock(t->lock);
+}
+
+static bool
+parse(pbuf_t *pb, const struct ip_hdr *ip, struct tcp_seg *seg,
+      uint32_t *hlen)
+{
+    if (pb->len < TCP_HLEN)
+        return false;
+
+    const struct tcp_hdr *th = (const struct tcp_hdr *)pb->data;
+    uint32_t              hl = (uint32_t)(th->off >> 4) * 4;
+    if (hl < TCP_HLEN || hl > pb->len)
+        return false;
+
+    if (!(pb->flags & PBUF_CSUM_VALID)) {
+        uint32_t sum = net_csum_pseudo(ip->src, ip->dst, IP_PROTO_TCP,
+                                       pb->tot_len);
+        if (net_csum_fold(net_csum_pbuf(pb, 0, pb->tot_len, sum)) != 0)
+            return false;
+    }
+
+    seg->seq   = ntohl(th->seq);
+    seg->ack   = ntohl(th->ack);
+    seg->flags = th->flags;
+    seg->wnd   = ntohs(th->wnd);
+    seg->len   = pb->tot_len - hl;
+    seg->mss   = 0;
+
+    // The only option of interest is the MSS on a SYN.
+    const uint8_t *opt = (const uint8_t *)(th + 1);
+    const uint8_t *end = (const uint8_t *)th + hl;
+    while (opt < end && *opt != TCP_OPT_END) {
+        if (*opt == TCP_OPT_NOP) {
+            opt++;
+            continue;
+        }
+        if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end)
+            break;
+        if (opt[0] == TCP_OPT_MSS && opt[1] == 4)
+            seg->mss = (uint16_t)((opt[2] << 8) | opt[3]);
+        opt += opt[1];
+    }
+
+    *hlen = hl;
+    return true;
+}
+
+void
+tcp_input(netif_t *netif, pbuf_t *pb, const struct ip_hdr *ip)
+{
+    (void)netif;
+
+    struct tcp_seg seg;
+    uint32_t       hlen;
+    if (!parse(pb, ip, &seg, &hlen)) {
+        pbuf_free(pb);
+        return;
+    }
+
+    const struct tcp_hdr *th    = (const struct tcp_hdr *)pb->data;
+    uint16_t              sport = ntohs(th->sport);
+    uint16_t              dport = ntohs(th->dport);
+
+    struct tcp_table *t;
+    tcp_pcb_t        *pcb = lookup(ip->dst, dport, ip->src, sport, &t);
+    if (pcb != NULL) {
+        bool consumed = false;
+        pbuf_pull(pb, hlen);
+        if (pcb->state == TCP_SYN_SENT)
+            process_syn_sent(pcb, &seg);
+        else
+            consumed = process(pcb, pb, &seg);
+        spin_unlock(t->lock);
+        if (!consumed)
+            pbuf_free(pb);
+        return;
+    }
+
+    spin_lock(listen_lock);
+    tcp_pcb_t *l = find_listener(ip->dst, dport);
+    spin_unlock(listen_lock);
+
+    if (l != NULL) {
+        process_listen(l, ip, th, &seg);
+    }
+    else if (!(seg.flags & TCP_RST)) {
+        // Nobody is listening: refuse with a reset.
+        if (seg.flags & TCP_ACK)
+            send_reset(ip->dst, dport, ip->src, sport, seg.ack, 0, false);
+        else
+            send_reset(ip->dst, dport, ip->src, sport, 0,
+                       seg.seq + seg.len + ((seg.flags & TCP_SYN) ? 1 : 0) +
+                       ((seg.flags & TCP_FIN) ? 1 : 0), true);
+    }
+    pbuf_free(pb);
+}
+
+//----------------------------------------------------------------------------
+// Timers
+//----------------------------------------------------------------------------
+
+static void
+timeout(tcp_pcb_t *pcb, uint64_t now)
+{
+    switch (pcb->state) {
+        case TCP_TIME_WAIT:
+        case TCP_FIN_WAIT_2:
+            tcp_drop(pcb, 0);
+            return;
+        default:
+            break;
+    }
+
+    int limit = (pcb->state == TCP_SYN_SENT || pcb->state == TCP_SYN_RCVD)
+                ? TCP_SYN_RETRIES : TCP_MAX_RETRIES;
+    if (++pcb->retries > limit) {
+        if (pcb->state != TCP_SYN_SENT)
+            send_reset(pcb->laddr, pcb->lport, pcb->raddr, pcb->rport,
+                       pcb->snd_nxt, 0, false);
+        tcp_drop(pcb, -ETIMEDOUT);
+        return;
+    }
+
+    pcb->rto        = min(pcb->rto * 2, (uint32_t)TCP_RTO_MAX);
+    pcb->rtt_active = false;
+    pcb->timer      = 0;
+
+    bool probe = (pcb->snd_wnd == 0 && pcb->snd_una == pcb->snd_max);
+    if (!probe) {
+        // Go back to the oldest unacknowledged byte and restart slow start.
+        uint32_t flight = pcb->snd_max - pcb->snd_una;
+        pcb->ssthresh = max(flight / 2, 2u * pcb->mss);
+        pcb->cwnd     = pcb->mss;
+        pcb->dupacks  = 0;
+        pcb->snd_nxt  = pcb->snd_una;
+    }
+    tcp_output(pcb, probe);
+    if (pcb->snd_una != pcb->snd_max || pcb->sndq_len > 0)
+        pcb->timer = now + pcb->rto;
+}
+
+void
+tcp_tick(uint64_t now)
+{
+    for (int i = 0; i < NET_CPUS; i++) {
+        struct tcp_table *t = &tables[i];
+        spin_lock(t->lock);
+        for (int h = 0; h < TCP_HASH; h++) {
+            tcp_pcb_t *next;
+            for (tcp_pcb_t *pcb = t->hash[h]; pcb != NULL; pcb = next) {
+                next = pcb->hnext;
+
+                // Flush delayed acknowledgements.
+                if (pcb->ack_pending > 0) {
+                    pcb->ack_now = true;
+                    tcp_output(pcb, false);
+                }
+
+                if (pcb->timer != 0 && now >= pcb->timer)
+                    timeout(pcb, now);
+            }
+        }
+        spin_unlock(t->lock);
+    }
+}
+
+//----------------------------------------------------------------------------
+// Interface
+//----------------------------------------------------------------------------
+
+static inline uint64_t
+pcb_lock(int cpu)
+{
+    uint64_t flags = save_interrupts();
+    if (cpu >= 0)
+        spin_lock(tables[cpu].lock);
+    return flags;
+}
+
+static inline void
+pcb_unlock(int cpu, uint64_t flags)
+{
+    if (cpu >= 0)
+        spin_unlock(tables[cpu].lock);
+    netdev_flush();
+    restore_interrupts(flags);
+}
+
+int
+tcp_listen(ip4_addr_t addr, uint16_t port, int backlog, tcp_pcb_t **pcb)
+{
+    int        err = 0;
+    tcp_pcb_t *l   = NULL;
+
+    uint64_t flags = save_interrupts();
+    spin_lock(listen_lock);
+    if (port == 0 || find_listener(addr, port) != NULL)
+        err = -EADDRINUSE;
+    else if ((l = pcb_alloc()) == NULL)
+        err = -ENOMEM;
+    else {
+        l->state   = TCP_LISTEN;
+        l->user    = true;
+        l->laddr   = addr;
+        l->lport   = port;
+        l->backlog = max(backlog, 1);
+        l->hnext   = listeners;
+        listeners  = l;
+    }
+    spin_unlock(listen_lock);
+    restore_interrupts(flags);
+
+    *pcb = l;
+    return err;
+}
+
+int
+tcp_accept(tcp_pcb_t *listener, tcp_pcb_t **conn)
+{
+    int        err = 0;
+    tcp_pcb_t *pcb = NULL;
+
+    uint64_t flags = save_interrupts();
+    spin_lock(listen_lock);
+    if (listener->state != TCP_LISTEN) {
+        err = -EINVAL;
+    }
+    else if ((pcb = listener->acceptq) == NULL) {
+        err = -EAGAIN;
+    }
+    else {
+        listener->acceptq = pcb->anext;
+        if (listener->acceptq == NULL)
+            listener->acceptq_tail = NULL;
+        listener->queued--;
+        pcb->anext = NULL;
+    }
+    spin_unlock(listen_lock);
+    restore_interrupts(flags);
+
+    *conn = pcb;
+    return err;
+}
+
+int
+tcp_connect(ip4_addr_t addr, uint16_t port, tcp_pcb_t **conn)
+{
+    *conn = NULL;
+
+    ip4_addr_t src = ip_source(addr);
+    if (src == IP4_ANY)
+        return -ENETUNREACH;
+
+    uint64_t flags = save_interrupts();
+
+    // Pick an ephemeral port.
+    spin_lock(listen_lock);
+    uint16_t lport = 0;
+    for (int n = TCP_PORT_LAST - TCP_PORT_FIRST + 1; n > 0; n--) {
+        uint16_t candidate = next_port;
+        next_port = (next_port == TCP_PORT_LAST) ? TCP_PORT_FIRST
+                                                 : next_port + 1;
+        if (!port_in_use(candidate)) {
+            lport = candidate;
+            break;
+        }
+    }
+    spin_unlock(listen_lock);
+
+    tcp_pcb_t *pcb = (lport != 0) ? pcb_alloc() : NULL;
+    if (pcb == NULL) {
+        restore_interrupts(flags);
+        return lport ? -ENOMEM : -EADDRINUSE;
+    }
+
+    pcb->state   = TCP_SYN_SENT;
+    pcb->user    = true;
+    pcb->laddr   = src;
+    pcb->raddr   = addr;
+    pcb->lport   = lport;
+    pcb->rport   = port;
+    pcb->iss     = new_iss();
+    pcb->snd_una = pcb->iss;
+    pcb->snd_nxt = pcb->iss;
+    pcb->snd_max = pcb->iss;
+    pcb->snd_buf = pcb->iss + 1;
+    pcb->mss     = local_mss(addr);
+
+    int cpu = net_cpu();
+    spin_lock(tables[cpu].lock);
+    pcb_hash(pcb, cpu);
+    pcb->rtt_active = true;
+    pcb->rtt_seq    = pcb->iss;
+    pcb->rtt_time   = net_time();
+    tcp_output(pcb, false);
+    pcb_unlock(cpu, flags);
+
+    *conn = pcb;
+    return 0;
+}
+
+// Common checks before queueing data. Called with the connection locked.
+static int
+send_check(const tcp_pcb_t *pcb)
+{
+    if (pcb->error != 0)
+        return pcb->error;
+    if (pcb->fin_queued)
+        return -EPIPE;
+    switch (pcb->state) {
+        case TCP_ESTABLISHED:
+        case TCP_CLOSE_WAIT:
+            break;
+        case TCP_SYN_SENT:
+        case TCP_SYN_RCVD:
+            return -EAGAIN;
+        default:
+            return -ENOTCONN;
+    }
+    if (pcb->sndq_len >= TCP_SND_BUF)
+        return -EAGAIN;
+    return 0;
+}
+
+int64_t
+tcp_send(tcp_pcb_t *pcb, const void *buf, size_t len)
+{
+    int      cpu   = pcb->cpu;
+    uint64_t flags = pcb_lock(cpu);
+
+    int64_t result = send_check(pcb);
+    if (result == 0 && len > 0) {
+        uint32_t room = TCP_SND_BUF - pcb->sndq_len;
+        uint32_t n    = pbuf_append(&pcb->sndq, buf,
+                                    (uint32_t)min(len, (size_t)room));
+        pcb->sndq_len += n;
+        result         = n ? (int64_t)n : -EAGAIN;
+        tcp_output(pcb, false);
+    }
+
+    pcb_unlock(cpu, flags);
+    return result;
+}
+
+int
+tcp_send_pbuf(tcp_pcb_t *pcb, pbuf_t *pb)
+{
+    int      cpu   = pcb->cpu;
+    uint64_t flags = pcb_lock(cpu);
+
+    int result = send_check(pcb);
+    if (result == 0) {
+        uint32_t len = pb->tot_len;
+        if (pcb->sndq == NULL)
+            pcb->sndq = pb;
+        else
+            pbuf_cat(pcb->sndq, pb);
+        pcb->sndq_len += len;
+        tcp_output(pcb, false);
+    }
+
+    pcb_unlock(cpu, flags);
+    return result;
+}
+
+// Common end-of-data and error handling for the receive calls.
+static int64_t
+recv_empty(const tcp_pcb_t *pcb)
+{
+    if (pcb->fin_rcvd)
+        return 0;
+    if (pcb->error != 0)
+        return pcb->error;
+    switch (pcb->state) {
+        case TCP_CLOSED:
+        case TCP_LISTEN:
+            return -ENOTCONN;
+        default:
+            return -EAGAIN;
+    }
+}
+
+// Tell the peer about a window that has opened by two segments or half the
+// buffer since it was last advertised.
+static void
+window_update(tcp_pcb_t *pcb)
+{
+    uint32_t adv  = pcb->rcv_adv - pcb->rcv_nxt;
+    uint32_t step = min(2u * pcb->mss, TCP_RCV_BUF / 2u);
+    if (pcb->state != TCP_CLOSED && rcv_wnd(pcb) >= adv + step) {
+        pcb->ack_now = true;
+        tcp_output(pcb, false);
+    }
+}
+
+int64_t
+tcp_recv(tcp_pcb_t *pcb, void *buf, size_t len)
+{
+    int      cpu   = pcb->cpu;
+    uint64_t flags = pcb_lock(cpu);
+
+    int64_t result;
+    if (pcb->rcvq_len == 0) {
+        result = recv_empty(pcb);
+    }
+    else {
+        uint32_t n = pbuf_copyout(pcb->rcvq, 0, buf,
+                                  (uint32_t)min(len, (size_t)pcb->rcvq_len));
+        pcb->rcvq      = pbuf_drop(pcb->rcvq, n);
+        pcb->rcvq_len -= n;
+        if (pcb->rcvq == NULL)
+            pcb->rcvq_tail = NULL;
+        window_update(pcb);
+        result = n;
+    }
+
+    pcb_unlock(cpu, flags);
+    return result;
+}
+
+int64_t
+tcp_recv_pbuf(tcp_pcb_t *pcb, pbuf_t **pb)
+{
+    int      cpu   = pcb->cpu;
+    uint64_t flags = pcb_lock(cpu);
+
+    int64_t result;
+    *pb = NULL;
+    if (pcb->rcvq_len == 0) {
+        result = recv_empty(pcb);
+    }
+    else {
+        *pb            = pcb->rcvq;
+        result         = pcb->rcvq_len;
+        pcb->rcvq      = NULL;
+        pcb->rcvq_tail = NULL;
+        pcb->rcvq_len  = 0;
+        window_update(pcb);
+    }
+
+    pcb_unlock(cpu, flags);
+    return result;
+}
+
+int
+tcp_events(const tcp_pcb_t *pcb)
+{
+    if (pcb->state == TCP_LISTEN)
+        return pcb->acceptq != NULL ? NET_EV_READ : 0;
+
+    int ev = 0;
+    if (pcb->rcvq_len > 0 || pcb->fin_rcvd || pcb->error != 0)
+        ev |= NET_EV_READ;
+    if ((pcb->state == TCP_ESTABLISHED || pcb->state == TCP_CLOSE_WAIT) &&
+        !pcb->fin_queued && pcb->sndq_len < TCP_SND_BUF)
+        ev |= NET_EV_WRITE;
+    if (pcb->error != 0)
+        ev |= NET_EV_ERR;
+    if (pcb->state == TCP_CLOSED || (pcb->fin_rcvd && pcb->fin_queued))
+        ev |= NET_EV_HUP;
+    return ev;
+}
+
+int
+tcp_error(const tcp_pcb_t *pcb)
+{
+    return pcb->error;
+}
+
+void
+tcp_peer(const tcp_pcb_t *pcb, ip4_addr_t *addr, uint16_t *port)
+{
+    *addr = pcb->raddr;
+    *port = pcb->rport;
+}
+
+// Release a connection, resetting it if it is still synchronized.
+static void
+abort_conn(tcp_pcb_t *pcb)
+{
+    int      cpu   = pcb->cpu;
+    uint64_t flags = pcb_lock(cpu);
+    pcb->user = false;
+
+    if (pcb->state == TCP_CLOSED) {
+        pcb_release(pcb);
+    }
+    else {
+        if (pcb->state != TCP_SYN_SENT)
+            send_reset(pcb->laddr, pcb->lport, pcb->raddr, pcb->rport,
+                       pcb->snd_nxt, 0, false);
+        tcp_drop(pcb, 0);
+    }
+
+    pcb_unlock(cpu, flags);
+}
+
+static void
+close_listener(tcp_pcb_t *l)
+{
+    uint64_t flags = save_interrupts();
+    spin_lock(listen_lock);
+
+    tcp_pcb_t **link = &listeners;
+    while (*link != NULL && *link != l)
+        link = &(*link)->hnext;
+    if (*link != NULL)
+        *link = l->hnext;
+
+    tcp_pcb_t *queue = l->acceptq;
+    l->acceptq       = NULL;
+    l->acceptq_tail  = NULL;
+    l->queued        = 0;
+    l->state         = TCP_CLOSED;
+    l->user          = false;
+    listener_release(l);
+
+    spin_unlock(listen_lock);
+    restore_interrupts(flags);
+
+    // Reset connections nobody accepted.
+    while (queue != NULL) {
+        tcp_pcb_t *pcb = queue;
+        queue = pcb->anext;
+        abort_conn(pcb);
+    }
+}
+
+void
+tcp_close(tcp_pcb_t *pcb)
+{
+    if (pcb->state == TCP_LISTEN) {
+        close_listener(pcb);
+        return;
+    }
+
+    // Unread data means the peer's last messages were lost on us: say so
+    // with a reset rather than a clean close.
+    if (pcb->rcvq_len > 0) {
+        abort_conn(pcb);
+        return;
+    }
+
+    int      cpu   = pcb->cpu;
+    uint64_t flags = pcb_lock(cpu);
+    pcb->user = false;
+
+    switch (pcb->state) {
+        case TCP_CLOSED:
+            pcb_release(pcb);
+            break;
+
+        case TCP_SYN_SENT:
+            tcp_drop(pcb, 0);
+            break;
+
+        case TCP_SYN_RCVD:
+        case TCP_ESTABLISHED:
+        case TCP_CLOSE_WAIT:
+            pcb->fin_queued = true;
+            pcb->state      = (pcb->state == TCP_CLOSE_WAIT) ? TCP_LAST_ACK
+                                                             : TCP_FIN_WAIT_1;
+            tcp_output(pcb, false);
+            break;
+
+        case TCP_FIN_WAIT_2:
+            pcb->timer = net_time() + TCP_FINWAIT_MS;
+            break;
+
+        default:
+            break;
+    }
+
+    pcb_unlock(cpu, flags);
+}
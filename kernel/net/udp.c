@@ -0,0 +1,248 @@
+//============================================================================
+/// @file       udp.c
+/// @brief      User Datagram Protocol.
+//============================================================================
+
+#include <core.h>
+#include <libc/string.h>
+#include <kernel/errno.h>
+#include <kernel/net/udp.h>
+#include <kernel/spinlock.h>
+#include <kernel/x86/cpu.h>
+#include "proto.h"
+
+// Number of UDP endpoints.
+#define MAX_UDP_PCBS         32
+
+// Datagrams queued on an endpoint before new arrivals are dropped.
+#define UDP_RCVQ_MAX         64
+
+// Ephemeral port range.
+#define UDP_PORT_FIRST       49152
+#define UDP_PORT_LAST        65535
+
+struct udp_pcb
+{
+    bool        used;
+    ip4_addr_t  addr;
+    uint16_t    port;
+    pbuf_t     *head;           ///< Received datagrams
+    pbuf_t     *tail;
+    int         queued;
+};
+
+static udp_pcb_t   pcbs[MAX_UDP_PCBS];
+static uint16_t    next_port = UDP_PORT_FIRST;
+static spin_lock_t lock;
+
+static udp_pcb_t *
+find(ip4_addr_t addr, uint16_t port)
+{
+    for (int i = 0; i < MAX_UDP_PCBS; i++) {
+        udp_pcb_t *pcb = &pcbs[i];
+        if (pcb->used && pcb->port == port &&
+            (pcb->addr == IP4_ANY || addr == IP4_ANY || pcb->addr == addr))
+            return pcb;
+    }
+    return NULL;
+}
+
+void
+udp_input(pbuf_t *pb, const struct ip_hdr *ip)
+{
+    const struct udp_hdr *udp = (const struct udp_hdr *)pb->data;
+    if (pb->len < UDP_HLEN)
+        goto drop;
+
+    uint32_t len = ntohs(udp->len);
+    if (len < UDP_HLEN || len > pb->tot_len)
+        goto drop;
+    if (len < pb->tot_len)
+        pbuf_trim(pb, len);
+
+    if (udp->csum != 0 && !(pb->flags & PBUF_CSUM_VALID)) {
+        uint32_t sum = net_csum_pseudo(ip->src, ip->dst, IP_PROTO_UDP, len);
+        if (net_csum_fold(net_csum_pbuf(pb, 0, len, sum)) != 0)
+            goto drop;
+    }
+
+    pb->addr = ip->src;
+    pb->port = ntohs(udp->sport);
+    uint16_t dport = ntohs(udp->dport);
+    pbuf_pull(pb, UDP_HLEN);
+
+    spin_lock(lock);
+    udp_pcb_t *pcb = find(ip->dst, dport);
+    if (pcb == NULL || pcb->queued == UDP_RCVQ_MAX) {
+        spin_unlock(lock);
+        goto drop;
+    }
+    pb->nextpkt = NULL;
+    if (pcb->tail != NULL)
+        pcb->tail->nextpkt = pb;
+    else
+        pcb->head = pb;
+    pcb->tail = pb;
+    pcb->queued++;
+    spin_unlock(lock);
+    return;
+
+drop:
+    pbuf_free(pb);
+}
+
+int
+udp_open(ip4_addr_t addr, uint16_t port, udp_pcb_t **pcb)
+{
+    int        err = 0;
+    udp_pcb_t *p   = NULL;
+
+    uint64_t flags = save_interrupts();
+    spin_lock(lock);
+
+    if (port == 0) {
+        for (int n = UDP_PORT_LAST - UDP_PORT_FIRST + 1; n > 0; n--) {
+            uint16_t candidate = next_port;
+            next_port = (next_port == UDP_PORT_LAST) ? UDP_PORT_FIRST
+                                                     : next_port + 1;
+            if (find(IP4_ANY, candidate) == NULL) {
+                port = candidate;
+                break;
+            }
+        }
+        if (port == 0)
+            err = -EADDRINUSE;
+    }
+    else if (find(addr, port) != NULL) {
+        err = -EADDRINUSE;
+    }
+
+    for (int i = 0; err == 0 && i < MAX_UDP_PCBS; i++) {
+        if (!pcbs[i].used) {
+            p = &pcbs[i];
+            break;
+        }
+    }
+    if (err == 0 && p == NULL)
+        err = -ENOMEM;
+
+    if (p != NULL) {
+        memzero(p, sizeof(*p));
+        p->used = true;
+        p->addr = addr;
+        p->port = port;
+    }
+
+    spin_unlock(lock);
+    restore_interrupts(flags);
+
+    *pcb = p;
+    return err;
+}
+
+int64_t
+udp_sendto(udp_pcb_t *pcb, ip4_addr_t addr, uint16_t port, const void *buf,
+           size_t len)
+{
+    if (len > 0xffff - IP_HLEN - UDP_HLEN)
+        return -EMSGSIZE;
+
+    ip4_addr_t nexthop;
+    netif_t   *netif = net_route(addr, &nexthop);
+    if (netif == NULL)
+        return -ENETUNREACH;
+    ip4_addr_t src = (pcb->addr != IP4_ANY) ? pcb->addr : netif->addr;
+
+    pbuf_t *pb = pbuf_alloc(PBUF_HEADROOM, UDP_HLEN);
+    if (pb == NULL)
+        return -ENOBUFS;
+    if (pbuf_append(&pb, buf, (uint32_t)len) != len) {
+        pbuf_free(pb);
+        return -ENOBUFS;
+    }
+
+    uint32_t        total = UDP_HLEN + (uint32_t)len;
+    struct udp_hdr *udp   = (struct udp_hdr *)pb->data;
+    udp->sport = htons(pcb->port);
+    udp->dport = htons(port);
+    udp->len   = htons((uint16_t)total);
+
+    uint32_t sum = net_csum_pseudo(src, addr, IP_PROTO_UDP, total);
+    if (netif->dev->features & NETDEV_F_TX_CSUM) {
+        udp->csum       = (uint16_t)~net_csum_fold(sum);
+        pb->flags      |= PBUF_CSUM_PARTIAL;
+        pb->csum_start  = 0;
+        pb->csum_offset = offsetof(struct udp_hdr, csum);
+    }
+    else {
+        udp->csum = 0;
+        udp->csum = net_csum_fold(net_csum_pbuf(pb, 0, total, sum));
+        if (udp->csum == 0)
+            udp->csum = 0xffff;
+    }
+
+    uint64_t flags = save_interrupts();
+    int      err   = ip_output(pb, src, addr, IP_PROTO_UDP);
+    netdev_flush();
+    restore_interrupts(flags);
+
+    return err < 0 ? err : (int64_t)len;
+}
+
+int64_t
+udp_recvfrom(udp_pcb_t *pcb, void *buf, size_t len, ip4_addr_t *addr,
+             uint16_t *port)
+{
+    uint64_t flags = save_interrupts();
+    spin_lock(lock);
+    pbuf_t *pb = pcb->head;
+    if (pb != NULL) {
+        pcb->head = pb->nextpkt;
+        if (pcb->head == NULL)
+            pcb->tail = NULL;
+        pcb->queued--;
+    }
+    spin_unlock(lock);
+    restore_interrupts(flags);
+
+    if (pb == NULL)
+        return -EAGAIN;
+
+    uint32_t n = pbuf_copyout(pb, 0, buf, (uint32_t)min(len, pb->tot_len));
+    if (addr != NULL)
+        *addr = pb->addr;
+    if (port != NULL)
+        *port = pb->port;
+    pbuf_free(pb);
+    return n;
+}
+
+int
+udp_events(const udp_pcb_t *pcb)
+{
+    return (pcb->head != NULL ? NET_EV_READ : 0) | NET_EV_WRITE;
+}
+
+uint16_t
+udp_local(const udp_pcb_t *pcb)
+{
+    return pcb->port;
+}
+
+void
+udp_close(udp_pcb_t *pcb)
+{
+    uint64_t flags = save_interrupts();
+    spin_lock(lock);
+    pbuf_t *queue = pcb->head;
+    pcb->head = pcb->tail = NULL;
+    pcb->used = false;
+    spin_unlock(lock);
+    restore_interrupts(flags);
+
+    while (queue != NULL) {
+        pbuf_t *pb = queue;
+        queue = pb->nextpkt;
+        pbuf_free(pb);
+    }
+}
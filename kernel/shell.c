@@ -7,22 +7,50 @@
 #include <libc/stdio.h>
 #include <libc/stdlib.h>
 #include <libc/string.h>
+#include <kernel/block/blkdev.h>
+#include <kernel/block/pcache.h>
+#include <kernel/errno.h>
 #include <kernel/device/pci.h>
 #include <kernel/device/tty.h>
 #include <kernel/device/keyboard.h>
+#include <kernel/device/timer.h>
+#include <kernel/fcntl.h>
+#include <kernel/fs/vfs.h>
 #include <kernel/mem/acpi.h>
 #include <kernel/mem/heap.h>
 #include <kernel/mem/paging.h>
+#include <kernel/net/net.h>
+#include <kernel/net/netdev.h>
+#include <kernel/net/socket.h>
+#include <kernel/net/tcp.h>
 #include <kernel/x86/cpu.h>
 
 #define TTY_CONSOLE  0
 
+// Rows moved by the page up and page down keys.
+#define SCROLL_ROWS  12
+
+// Connections served at once by the echo server.
+#define ECHO_CONNS   32
+
+// Loopback benchmark port, message size and phase length.
+#define BENCH_PORT   7777
+#define BENCH_MSG    64
+#define BENCH_MS     1000
+
 // Forward declarations
 static void command_prompt();
 static void command_run();
 static void keycode_run();
 static bool cmd_display_help();
 static bool cmd_display_apic();
+static bool cmd_display_blk();
+static bool cmd_cat(const char *args);
+static bool cmd_ls(const char *args);
+static bool cmd_display_net();
+static bool cmd_echod(const char *args);
+static bool cmd_netbench();
+static bool cmd_sync();
 static bool cmd_display_pci();
 static bool cmd_display_pcie();
 static bool cmd_switch_to_keycodes();
@@ -71,7 +99,7 @@ struct cmd
 {
     const char *str;
     const char *help;
-    bool        (*run)();
+    bool        (*run)(const char *args);
 };
 
 static struct cmd commands[] =
@@ -79,8 +107,15 @@ static struct cmd commands[] =
     { "?", NULL, cmd_display_help },
     { "help", "Show this help text", cmd_display_help },
     { "apic", "Show APIC configuration", cmd_display_apic },
+    { "blk", "Show block devices and their first sector", cmd_display_blk },
+    { "cat", "Print a file", cmd_cat },
+    { "echod", "Run a TCP echo server on a port", cmd_echod },
+    { "ls", "List a directory", cmd_ls },
+    { "net", "Show network interfaces", cmd_display_net },
+    { "netbench", "Measure TCP over loopback", cmd_netbench },
     { "pci", "Show PCI devices", cmd_display_pci },
     { "pcie", "Show PCIexpress configuration", cmd_display_pcie },
+    { "sync", "Write cached data to disk", cmd_sync },
     { "kc", "Switch to keycode display mode", cmd_switch_to_keycodes },
     { "heap", "Test heap allocation", cmd_test_heap },
 };
@@ -145,7 +180,339 @@ cmd_display_apic()
 static bool
 cmd_display_pci()
 {
-    pci_init();         // Temporary
+    const pcidev_t *dev = NULL;
+    while ((dev = pci_next_device(dev)) != NULL) {
+        tty_printf(TTY_CONSOLE,
+                   "%02x:%02x.%u %04x:%04x class=%02x/%02x %s\n",
+                   dev->bus, dev->device, dev->func, dev->vendor, dev->devid,
+                   dev->class, dev->subclass,
+                   dev->driver ? dev->driver->name : "");
+        for (int i = 0; i < 6; i++) {
+            const pcibar_t *bar = &dev->bar[i];
+            if (bar->size == 0)
+                continue;
+            tty_printf(TTY_CONSOLE, "    bar%d %s %#lx size=%#lx\n", i,
+                       (bar->flags & PCI_BAR_IO) ? "io " : "mem",
+                       bar->addr, bar->size);
+        }
+    }
+    return true;
+}
+
+static bool
+cmd_display_blk()
+{
+    blkdev_t *dev = blkdev_next(NULL);
+    if (dev == NULL) {
+        tty_print(TTY_CONSOLE, "No block devices.\n");
+        return true;
+    }
+
+    uint8_t *buf = kpage_alloc(1);
+    for (; dev != NULL; dev = blkdev_next(dev)) {
+        tty_printf(TTY_CONSOLE, "%s: %lu sectors of %u bytes, %d queue(s)\n",
+                   dev->name, dev->sectors, dev->sector_size, dev->nr_queues);
+
+        if (buf == NULL || blkdev_read(dev, 0, 1, buf) != BLK_STATUS_OK) {
+            tty_print(TTY_CONSOLE, "    read failed\n");
+            continue;
+        }
+        for (int i = 0; i < 64; i += 16) {
+            tty_printf(TTY_CONSOLE, "    %04x:", i);
+            for (int j = 0; j < 16; j++)
+                tty_printf(TTY_CONSOLE, " %02x", buf[i + j]);
+            tty_print(TTY_CONSOLE, "\n");
+        }
+    }
+    if (buf != NULL)
+        kpage_free(buf, 1);
+    return true;
+}
+
+static bool
+cmd_cat(const char *args)
+{
+    file_t *file;
+    int     err = vfs_open(args, O_RDONLY, &file);
+    if (err < 0) {
+        tty_printf(TTY_CONSOLE, "cat: %s: error %d\n", args, err);
+        return true;
+    }
+
+    char    buf[128];
+    int64_t n;
+    while ((n = vfs_read(file, buf, sizeof(buf) - 1)) > 0) {
+        buf[n] = 0;
+        tty_print(TTY_CONSOLE, buf);
+    }
+    vfs_close(file);
+    return true;
+}
+
+static bool
+cmd_ls(const char *args)
+{
+    const char *path = (args[0] != 0) ? args : "/";
+
+    file_t *file;
+    int     err = vfs_open(path, O_RDONLY, &file);
+    if (err < 0) {
+        tty_printf(TTY_CONSOLE, "ls: %s: error %d\n", path, err);
+        return true;
+    }
+
+    dirent_t ent;
+    while (vfs_readdir(file, &ent) > 0) {
+        tty_printf(TTY_CONSOLE, "  %s%s\n", ent.name,
+                   ent.type == T_DIR ? "/" : "");
+    }
+    vfs_close(file);
+    return true;
+}
+
+static bool
+cmd_display_net()
+{
+    netdev_t *dev = netdev_next(NULL);
+    if (dev == NULL) {
+        tty_print(TTY_CONSOLE, "No network devices.\n");
+        return true;
+    }
+
+    for (; dev != NULL; dev = netdev_next(dev)) {
+        tty_printf(TTY_CONSOLE,
+                   "%s: %02x:%02x:%02x:%02x:%02x:%02x mtu %u, %d queue(s)\n",
+                   dev->name, dev->mac[0], dev->mac[1], dev->mac[2],
+                   dev->mac[3], dev->mac[4], dev->mac[5], dev->mtu,
+                   dev->nr_queues);
+
+        const netif_t *netif = net_netif(dev);
+        if (netif != NULL && netif->up) {
+            tty_printf(TTY_CONSOLE,
+                       "    inet %u.%u.%u.%u mask %u.%u.%u.%u gw %u.%u.%u.%u\n",
+                       IP4_BYTES(netif->addr), IP4_BYTES(netif->mask),
+                       IP4_BYTES(netif->gw));
+        }
+
+        for (int q = 0; q < dev->nr_queues; q++) {
+            const netdev_stats_t *st = &dev->stats[q];
+            tty_printf(TTY_CONSOLE,
+                       "    q%d rx %lu/%lu drop %lu  tx %lu/%lu drop %lu\n",
+                       q, st->rx_packets, st->rx_bytes, st->rx_dropped,
+                       st->tx_packets, st->tx_bytes, st->tx_dropped);
+        }
+    }
+    return true;
+}
+
+static bool
+cmd_echod(const char *args)
+{
+    int port = 0;
+    for (const char *s = args; *s >= '0' && *s <= '9' && port <= 0xffff; s++)
+        port = port * 10 + (*s - '0');
+    if (port <= 0 || port > 0xffff) {
+        tty_print(TTY_CONSOLE, "usage: echod <port>\n");
+        return true;
+    }
+
+    tcp_pcb_t *listener;
+    int        err = tcp_listen(IP4_ANY, (uint16_t)port, ECHO_CONNS, &listener);
+    if (err < 0) {
+        tty_printf(TTY_CONSOLE, "echod: listen failed (%d)\n", err);
+        return true;
+    }
+    tty_printf(TTY_CONSOLE, "echod: listening on port %d, "
+               "press a key to stop\n", port);
+
+    // Received data is sent back in the buffers it arrived in. Data the
+    // send queue has no room for waits in `held'.
+    tcp_pcb_t *conns[ECHO_CONNS] = { 0 };
+    pbuf_t    *held[ECHO_CONNS]  = { 0 };
+
+    bool busy = false;
+    for (;;) {
+        // Sleep only when no receive queue is still being polled.
+        if (!busy)
+            halt();
+        busy = net_poll();
+
+        key_t key;
+        if (kb_getkey(&key))
+            break;
+
+        tcp_pcb_t *conn;
+        while (tcp_accept(listener, &conn) == 0) {
+            int i = 0;
+            while (i < ECHO_CONNS && conns[i] != NULL)
+                i++;
+            if (i == ECHO_CONNS)
+                tcp_close(conn);
+            else
+                conns[i] = conn;
+        }
+
+        for (int i = 0; i < ECHO_CONNS; i++) {
+            if (conns[i] == NULL)
+                continue;
+
+            if (held[i] == NULL) {
+                int64_t n = tcp_recv_pbuf(conns[i], &held[i]);
+                if (n == -EAGAIN)
+                    continue;
+                if (n <= 0) {
+                    tcp_close(conns[i]);
+                    conns[i] = NULL;
+                    continue;
+                }
+            }
+
+            err = tcp_send_pbuf(conns[i], held[i]);
+            if (err == 0) {
+                held[i] = NULL;
+            }
+            else if (err != -EAGAIN) {
+                pbuf_free(held[i]);
+                held[i] = NULL;
+                tcp_close(conns[i]);
+                conns[i] = NULL;
+            }
+        }
+    }
+
+    for (int i = 0; i < ECHO_CONNS; i++) {
+        if (conns[i] != NULL) {
+            pbuf_free(held[i]);
+            tcp_close(conns[i]);
+        }
+    }
+    tcp_close(listener);
+    return true;
+}
+
+static uint64_t
+now_ms()
+{
+    return timer_ticks() * 1000 / timer_rate();
+}
+
+// Receive exactly `len' bytes from a non-blocking socket.
+static bool
+bench_recv(int fd, char *buf, size_t len)
+{
+    uint64_t deadline = now_ms() + BENCH_MS;
+    while (len > 0) {
+        int64_t n = sock_recv(fd, buf, len, MSG_DONTWAIT);
+        if (n == -EAGAIN && now_ms() < deadline) {
+            net_poll();
+            continue;
+        }
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static bool
+cmd_netbench()
+{
+    static char buf[16384];
+
+    struct sockaddr_in sin;
+    memzero(&sin, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port   = htons(BENCH_PORT);
+    sin.sin_addr   = IP4_ADDR(127, 0, 0, 1);
+
+    // The client and server run in this one loop, so every call must be
+    // non-blocking.
+    int lfd = sock_socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int cfd = sock_socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int sfd = -1;
+    int ep  = sock_epoll_create();
+    int err = (lfd < 0) ? lfd : (cfd < 0) ? cfd : (ep < 0) ? ep : 0;
+    if (err == 0)
+        err = sock_bind(lfd, &sin, sizeof(sin));
+    if (err == 0)
+        err = sock_listen(lfd, 1);
+    if (err == 0 && (err = sock_connect(cfd, &sin, sizeof(sin))) ==
+        -EINPROGRESS) {
+        uint64_t deadline = now_ms() + BENCH_MS;
+        while ((sfd = sock_accept(lfd, NULL, NULL)) == -EAGAIN &&
+               now_ms() < deadline)
+            net_poll();
+        err = (sfd < 0) ? sfd : 0;
+    }
+    if (err < 0) {
+        tty_printf(TTY_CONSOLE, "netbench: setup failed (%d)\n", err);
+        goto done;
+    }
+
+    // Request/response latency
+    memset(buf, 'x', sizeof(buf));
+    uint64_t count = 0;
+    uint64_t start = now_ms();
+    uint64_t elapsed;
+    while ((elapsed = now_ms() - start) < BENCH_MS) {
+        if (sock_send(cfd, buf, BENCH_MSG, 0) != BENCH_MSG ||
+            !bench_recv(sfd, buf, BENCH_MSG) ||
+            sock_send(sfd, buf, BENCH_MSG, 0) != BENCH_MSG ||
+            !bench_recv(cfd, buf, BENCH_MSG)) {
+            tty_print(TTY_CONSOLE, "netbench: round trip failed\n");
+            goto done;
+        }
+        count++;
+    }
+    tty_printf(TTY_CONSOLE, "latency:    %lu round trips/s, %lu ns each\n",
+               count * 1000 / elapsed, elapsed * 1000000 / max(count, 1ul));
+
+    // Streaming throughput, driven by readiness events
+    struct epoll_event ev = { .events = EPOLLOUT, .data = (uint64_t)cfd };
+    sock_epoll_ctl(ep, EPOLL_CTL_ADD, cfd, &ev);
+    ev.events = EPOLLIN;
+    ev.data   = (uint64_t)sfd;
+    sock_epoll_ctl(ep, EPOLL_CTL_ADD, sfd, &ev);
+
+    uint64_t bytes = 0;
+    start = now_ms();
+    while ((elapsed = now_ms() - start) < BENCH_MS) {
+        struct epoll_event ready[2];
+        int n = sock_epoll_wait(ep, ready, arrsize(ready), 100);
+        for (int i = 0; i < n; i++) {
+            int     fd = (int)ready[i].data;
+            int64_t r;
+            if (fd == cfd)
+                r = sock_send(cfd, buf, sizeof(buf), MSG_DONTWAIT);
+            else if ((r = sock_recv(sfd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+                bytes += (uint64_t)r;
+            if (r < 0 && r != -EAGAIN) {
+                tty_printf(TTY_CONSOLE, "netbench: stream failed (%ld)\n", r);
+                goto done;
+            }
+        }
+    }
+    tty_printf(TTY_CONSOLE, "throughput: %lu KiB/s\n",
+               bytes * 1000 / 1024 / elapsed);
+
+done:
+    if (sfd >= 0)
+        sock_close(sfd);
+    if (cfd >= 0)
+        sock_close(cfd);
+    if (lfd >= 0)
+        sock_close(lfd);
+    if (ep >= 0)
+        sock_close(ep);
+    return true;
+}
+
+static bool
+cmd_sync()
+{
+    if (pcache_sync(NULL) != BLK_STATUS_OK)
+        tty_print(TTY_CONSOLE, "sync: write error\n");
     return true;
 }
 
@@ -159,12 +526,15 @@ cmd_display_pcie()
     }
 
     while (addr != NULL) {
-        tty_printf(TTY_CONSOLE, "PCIe addr=0x%08x  grp=%-2u bus=%02x..%02x\n",
+        tty_printf(TTY_CONSOLE, "PCIe addr=0x%08lx  grp=%-2u bus=%02x..%02x\n",
                    addr->base, addr->seg_group, addr->bus_start,
                    addr->bus_end);
         addr = acpi_next_mcfg_addr(addr);
     }
 
+    tty_printf(TTY_CONSOLE, "Config access: %s\n",
+               pci_access() == PCI_ACCESS_ECAM ? "ECAM" : "legacy port I/O");
+
     return true;
 }
 
@@ -204,9 +574,22 @@ command_exec(const char *cmd)
     if (cmd[0] == 0)
         return true;
 
+    // Split the command name from its arguments.
+    char name[16];
+    int  len = 0;
+    while (cmd[len] != 0 && cmd[len] != ' ' && len < arrsize(name) - 1) {
+        name[len] = cmd[len];
+        len++;
+    }
+    name[len] = 0;
+
+    const char *args = cmd + len;
+    while (*args == ' ')
+        args++;
+
     for (int i = 0; i < arrsize(commands); i++) {
-        if (!strcmp(commands[i].str, cmd))
-            return commands[i].run();
+        if (!strcmp(commands[i].str, name))
+            return commands[i].run(args);
     }
 
     tty_printf(TTY_CONSOLE, "Unknown command: %s\n", cmd);
@@ -225,8 +608,12 @@ command_run()
     char cmd[256];
     int  cmdlen = 0;
 
+    bool busy = false;
     for (;;) {
-        halt();
+        if (!busy)
+            halt();
+        busy = net_poll();
+        pcache_writeback();
 
         key_t key;
         bool  avail;
@@ -266,6 +653,12 @@ command_run()
                     cmdlen--;
                 }
 
+                // Page through the console's scrollback history.
+                else if (key.code == KEY_PGUP)
+                    tty_scroll(TTY_CONSOLE, SCROLL_ROWS);
+                else if (key.code == KEY_PGDN)
+                    tty_scroll(TTY_CONSOLE, -SCROLL_ROWS);
+
             }
         }
     }
@@ -274,8 +667,12 @@ command_run()
 static void
 keycode_run()
 {
+    bool busy = false;
     for (;;) {
-        halt();
+        if (!busy)
+            halt();
+        busy = net_poll();
+        pcache_writeback();
 
         key_t key;
         bool  avail;
@@ -4,6 +4,8 @@
 //============================================================================
 
 #include <core.h>
+#include <kernel/errno.h>
+#include <kernel/net/socket.h>
 #include <kernel/x86/cpu.h>
 #include <kernel/interrupt/exception.h>
 #include <kernel/interrupt/interrupt.h>
@@ -21,6 +23,47 @@ syscall_handle()
     // Do nothing for now.
 }
 
+int64_t
+syscall_dispatch(uint64_t num, uint64_t arg0, uint64_t arg1, uint64_t arg2,
+                 uint64_t arg3, uint64_t arg4, uint64_t arg5)
+{
+    switch (num) {
+        case SYS_CLOSE:
+            return sock_close((int)arg0);
+        case SYS_SOCKET:
+            return sock_socket((int)arg0, (int)arg1, (int)arg2);
+        case SYS_CONNECT:
+            return sock_connect((int)arg0, (const struct sockaddr_in *)arg1,
+                                (socklen_t)arg2);
+        case SYS_ACCEPT:
+            return sock_accept((int)arg0, (struct sockaddr_in *)arg1,
+                               (socklen_t *)arg2);
+        case SYS_SENDTO:
+            return sock_sendto((int)arg0, (const void *)arg1, (size_t)arg2,
+                               (int)arg3, (const struct sockaddr_in *)arg4,
+                               (socklen_t)arg5);
+        case SYS_RECVFROM:
+            return sock_recvfrom((int)arg0, (void *)arg1, (size_t)arg2,
+                                 (int)arg3, (struct sockaddr_in *)arg4,
+                                 (socklen_t *)arg5);
+        case SYS_BIND:
+            return sock_bind((int)arg0, (const struct sockaddr_in *)arg1,
+                             (socklen_t)arg2);
+        case SYS_LISTEN:
+            return sock_listen((int)arg0, (int)arg1);
+        case SYS_EPOLL_CREATE:
+            return sock_epoll_create();
+        case SYS_EPOLL_WAIT:
+            return sock_epoll_wait((int)arg0, (struct epoll_event *)arg1,
+                                   (int)arg2, (int)arg3);
+        case SYS_EPOLL_CTL:
+            return sock_epoll_ctl((int)arg0, (int)arg1, (int)arg2,
+                                  (const struct epoll_event *)arg3);
+        default:
+            return -ENOSYS;
+    }
+}
+
 void
 syscall_init()
 {
@@ -24,6 +24,8 @@ section .text
     global invalidate_page
     global enable_interrupts
     global disable_interrupts
+    global save_interrupts
+    global restore_interrupts
     global halt
     global invalid_opcode
     global fatal
@@ -210,6 +212,32 @@ disable_interrupts:
     cli
     ret
 
+;-----------------------------------------------------------------------------
+; @function     save_interrupts
+; @brief        关闭中断，并返回之前的标志寄存器
+; @reg[out]     rax     (之前的标志寄存器)
+;-----------------------------------------------------------------------------
+save_interrupts:
+
+    pushfq
+    pop     rax
+    cli
+    ret
+
+;-----------------------------------------------------------------------------
+; @function     restore_interrupts
+; @brief        如果保存标志寄存器时中断是开启的，那么重新开启中断
+; @reg[in]      rdi     (save_interrupts返回的标志寄存器)
+;-----------------------------------------------------------------------------
+restore_interrupts:
+
+    test    rdi,    0x200       ; IF标志位
+    jz      .done
+    sti
+
+    .done:
+    ret
+
 ;-----------------------------------------------------------------------------
 ; @function     halt
 ; @brief        挂起CPU直到出现一个中断
@@ -0,0 +1,16 @@
+//============================================================================
+/// @file       cbprintf.c
+/// @brief      Write formatted output to a sink callback.
+//============================================================================
+
+#include <libc/stdio.h>
+
+int
+cbprintf(printf_sink sink, void *arg, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int result = vcbprintf(sink, arg, format, args);
+    va_end(args);
+    return result;
+}
@@ -66,11 +66,18 @@ enum datalen
     DATALEN_PTRDIFF_T,
 };
 
+// Size of the buffer used to pass formatted output to a sink.
+#define SINK_CHUNK   128
+
 // Parser state data
 struct parse
 {
+    char        *buf;            // Start of the output buffer
     char        *bufptr;
     const char  *bufterm;
+    printf_sink  sink;           // Receives each full buffer, or NULL
+    void        *arg;            // Sink argument
+    int          flushed;        // Characters already passed to the sink
     enum state   state;
     uint32_t     flags;          // FLAG_*
     int          width;
@@ -82,21 +89,111 @@ struct parse
 static const char digits_lower[] = "0123456789abcdef";
 static const char digits_upper[] = "0123456789ABCDEF";
 
+// Decimal digit pairs "00" through "99", so that decimal conversion needs
+// one division for every two digits.
+static const char digit_pairs[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
 static __forceinline bool
 isdigit(char ch)
 {
     return(ch >= '0' && ch <= '9');
 }
 
+static void
+flush(struct parse *parse)
+{
+    size_t n = (size_t)(parse->bufptr - parse->buf);
+    if (n > 0) {
+        parse->sink(parse->arg, parse->buf, n);
+        parse->flushed += (int)n;
+        parse->bufptr   = parse->buf;
+    }
+}
+
 static __forceinline void
 addchar(struct parse *parse, char ch)
 {
+    if ((parse->bufptr == parse->bufterm) && parse->sink) {
+        flush(parse);
+    }
     if (parse->bufptr < parse->bufterm) {
         *parse->bufptr = ch;
     }
     ++parse->bufptr;
 }
 
+static void
+addchars(struct parse *parse, const char *s, int n)
+{
+    while (n > 0) {
+        if ((parse->bufptr == parse->bufterm) && parse->sink) {
+            flush(parse);
+        }
+
+        // Without a sink, characters past the end of the buffer are only
+        // counted.
+        int room = (int)(parse->bufterm - parse->bufptr);
+        if (room <= 0) {
+            parse->bufptr += n;
+            return;
+        }
+
+        int chunk = min(n, room);
+        memcpy(parse->bufptr, s, chunk);
+        parse->bufptr += chunk;
+        s             += chunk;
+        n             -= chunk;
+    }
+}
+
+// Convert a value to decimal digits, ending at `end'. Returns the first
+// digit. A zero value has no digits.
+static char *
+todec(char *end, uintmax_t value)
+{
+    // Division by a constant compiles to a multiply by its reciprocal,
+    // which is cheaper still on 32-bit operands.
+    while (value > UINT32_MAX) {
+        uintmax_t q = value / 100;
+        end -= 2;
+        memcpy(end, digit_pairs + 2 * (value - q * 100), 2);
+        value = q;
+    }
+
+    uint32_t v = (uint32_t)value;
+    while (v >= 100) {
+        uint32_t q = v / 100;
+        end -= 2;
+        memcpy(end, digit_pairs + 2 * (v - q * 100), 2);
+        v = q;
+    }
+    if (v >= 10) {
+        end -= 2;
+        memcpy(end, digit_pairs + 2 * v, 2);
+    }
+    else if (v > 0) {
+        *--end = (char)('0' + v);
+    }
+    return end;
+}
+
+// Convert a value to digits in a power-of-two base, taking `shift' bits
+// per digit, ending at `end'. Returns the first digit.
+static char *
+topow2(char *end, uintmax_t value, int shift, const char *digits)
+{
+    uintmax_t mask = ((uintmax_t)1 << shift) - 1;
+    for (; value; value >>= shift) {
+        *--end = digits[value & mask];
+    }
+    return end;
+}
+
 static void
 addstring(struct parse *parse, const char *s)
 {
@@ -122,9 +219,7 @@ addstring(struct parse *parse, const char *s)
     }
 
     // Add string.
-    for (int i = slen; i; i--) {
-        addchar(parse, *s++);
-    }
+    addchars(parse, s, slen);
 
     // Pad on right with spaces.
     if ((parse->width > slen) && (parse->flags & FLAG_MINUS)) {
@@ -146,13 +241,30 @@ addint(struct parse *parse, uintmax_t value)
         value = (uintmax_t)(-(intmax_t)value);
     }
 
-    // Count the number of digits.
-    int       ndigits = 0;
-    uintmax_t tmpval  = value;
-    while (tmpval) {
-        tmpval /= parse->base;
-        ndigits++;
+    // Select lower-case or upper-case hexadecimal digits.
+    const char *digits = (parse->flags & FLAG_UPPER)
+                         ? digits_upper : digits_lower;
+
+    // Convert the value to digits. A zero value has no digits of its own.
+    char  digitbuf[24];
+    char *end = digitbuf + sizeof(digitbuf);
+    char *first;
+    switch (parse->base)
+    {
+        case 16:
+            first = topow2(end, value, 4, digits);
+            break;
+
+        case 8:
+            first = topow2(end, value, 3, digits);
+            break;
+
+        default:
+            first = todec(end, value);
+            break;
     }
+    int count   = (int)(end - first);
+    int ndigits = count;
 
     // In octal mode, make space for a preceding zero.
     if ((parse->flags & FLAG_HASH) && (parse->base == 8)) {
@@ -215,24 +327,11 @@ addint(struct parse *parse, uintmax_t value)
         }
     }
 
-    // Advance the buffer pointer (possibly beyond the end of the buffer
-    // terminator).
-    parse->bufptr += ndigits;
-
-    // Select lower-case or upper-case hexadecimal digits.
-    const char *digits = (parse->flags & FLAG_UPPER)
-                         ? digits_upper : digits_lower;
-
-    // Generate the digits backwards.
-    char *ptr = parse->bufptr;
-    while (ndigits > 0) {
-        --ptr;
-        --ndigits;
-        if (ptr < parse->bufterm) {
-            *ptr = digits[value % parse->base];
-        }
-        value /= parse->base;
+    // Add leading zeroes to fill out the precision, then the digits.
+    for (int i = ndigits; i > count; i--) {
+        addchar(parse, '0');
     }
+    addchars(parse, first, count);
 
     // Pad width on right, if requested.
     if (parse->flags & FLAG_MINUS) {
@@ -243,22 +342,20 @@ addint(struct parse *parse, uintmax_t value)
     }
 }
 
-int
-vsnprintf(char *buf, size_t n, const char *format, va_list args)
+// Format into the parser's buffer. Returns the number of characters
+// produced, including any beyond the end of a buffer without a sink.
+static int
+vformat(struct parse *p, const char *format, va_list args)
 {
     const char *fptr = format;
 
-    struct parse parse =
-    {
-        .bufptr    = buf,
-        .bufterm   = buf + n,
-        .state     = STATE_CHARS,
-        .flags     = 0,
-        .width     = 0,
-        .precision = -1,
-        .datalen   = DATALEN_INT,
-        .base      = 10,
-    };
+    struct parse parse = *p;
+    parse.state     = STATE_CHARS;
+    parse.flags     = 0;
+    parse.width     = 0;
+    parse.precision = -1;
+    parse.datalen   = DATALEN_INT;
+    parse.base      = 10;
 
     char ch;
     while ((ch = *fptr++) != 0) {
@@ -272,9 +369,27 @@ vsnprintf(char *buf, size_t n, const char *format, va_list args)
                 parse.precision = -1;
                 parse.datalen   = DATALEN_INT;
                 parse.base      = 10;
+
+                // Most specifiers have no flags, width, precision or
+                // length, so go straight to the data type for those.
+                switch (*fptr)
+                {
+                    case 'd':
+                    case 'i':
+                    case 'u':
+                    case 'x':
+                    case 's':
+                        parse.state = STATE_DATATYPE;
+                        break;
+                }
             }
             else {
-                addchar(&parse, ch);
+                // Copy the whole run of literal characters at once.
+                const char *run = fptr - 1;
+                while (*fptr && *fptr != '%') {
+                    fptr++;
+                }
+                addchars(&parse, run, (int)(fptr - run));
             }
         }
 
@@ -439,7 +554,8 @@ vsnprintf(char *buf, size_t n, const char *format, va_list args)
                     goto add_unsigned;
 
                 case 'n':
-                    *(int *)va_arg(args, int *) = (int)(parse.bufptr - buf);
+                    *(int *)va_arg(args, int *) =
+                        parse.flushed + (int)(parse.bufptr - parse.buf);
                     break;
 
                 default:
@@ -545,14 +661,53 @@ vsnprintf(char *buf, size_t n, const char *format, va_list args)
 
     }
 
+    *p = parse;
+    return parse.flushed + (int)(parse.bufptr - parse.buf);
+}
+
+int
+vsnprintf(char *buf, size_t n, const char *fmt, va_list args)
+{
+    struct parse parse =
+    {
+        .buf     = buf,
+        .bufptr  = buf,
+        .bufterm = buf + n,
+        .sink    = NULL,
+        .arg     = NULL,
+        .flushed = 0,
+    };
+
+    int result = vformat(&parse, fmt, args);
+
     // Add a null terminator.
     if (parse.bufptr < parse.bufterm) {
         *parse.bufptr = 0;
     }
     else if (n > 0) {
-        parse.bufptr[-1] = 0;
+        buf[n - 1] = 0;
     }
 
     // Return the number of characters processed.
-    return (int)(parse.bufptr - buf);
+    return result;
+}
+
+int
+vcbprintf(printf_sink sink, void *arg, const char *fmt, va_list args)
+{
+    char chunk[SINK_CHUNK];
+
+    struct parse parse =
+    {
+        .buf     = chunk,
+        .bufptr  = chunk,
+        .bufterm = chunk + sizeof(chunk),
+        .sink    = sink,
+        .arg     = arg,
+        .flushed = 0,
+    };
+
+    vformat(&parse, fmt, args);
+    flush(&parse);
+    return parse.flushed;
 }
@@ -0,0 +1,18 @@
+//============================================================================
+/// @file       memcmp.c
+/// @brief      比较两块内存区域
+//============================================================================
+
+#include <core.h>
+
+int
+memcmp(const void *buf1, const void *buf2, size_t num)
+{
+    const uint8_t *b1 = (const uint8_t *)buf1;
+    const uint8_t *b2 = (const uint8_t *)buf2;
+    for (size_t i = 0; i < num; i++) {
+        if (b1[i] != b2[i])
+            return (int)b1[i] - (int)b2[i];
+    }
+    return 0;
+}
@@ -47,10 +47,18 @@ CTAGS		:= ctags
 
 DOXYGEN		:= doxygen
 
+MKFS		:= mkfs.ext2
+
 MAKE_FLAGS	:= --quiet --no-print-directory
 
 QEMU		:= qemu-system-x86_64
 
+QEMU_IMG	:= qemu-img
+
+# Disk image and CPU count used by "make disktest".
+DISK		?= $(DIR_BUILD)/disk.img
+SMP		?= 2
+
 UNCRUSTIFY	:= uncrustify
 
 UNCRUSTIFY_CFG	:= $(DIR_SCRIPTS)/uncrustify.cfg
@@ -15,6 +15,9 @@ cp build/loader.sys build/iso/loader.sys
 cp build/monk.sys build/iso/monk.sys
 strip build/iso/monk.sys
 
+# Pack the initial RAM disk
+./scripts/mkinitrd.sh initrd build/iso/initrd.img
+
 # Generate the ISO file (with a boot catalog)
 genisoimage -R -J \
 	-c boot/bootcat \
@@ -0,0 +1,62 @@
+#!/bin/bash
+
+# Pack a directory into a cpio "newc" archive for use as the initrd.
+#
+# Usage: mkinitrd.sh <directory> <archive>
+#
+# The data of every regular file starts on a 4KiB boundary, so the kernel
+# can map file pages straight out of the loaded archive. This is done by
+# padding each file's name with extra NUL bytes, which cpio readers ignore.
+
+set -e
+export LC_ALL=C
+
+src=$1
+out=$2
+pos=0
+ino=1
+
+# Append zero bytes to the archive.
+zeros() {
+	head -c "$1" /dev/zero >> "$out"
+	pos=$((pos + $1))
+}
+
+# Append one entry: name, mode, size, and the file holding its data.
+entry() {
+	local name=$1 mode=$2 size=$3 file=$4
+	local namesize=$((${#name} + 1))
+
+	if [ -n "$file" ]; then
+		local base=$((pos + 110 + namesize))
+		namesize=$((namesize + (4096 - base % 4096) % 4096))
+	fi
+
+	printf '070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X' \
+		$ino $mode 0 0 1 0 $size 0 0 0 0 $namesize 0 >> "$out"
+	printf '%s' "$name" >> "$out"
+	pos=$((pos + 110 + ${#name}))
+	zeros $((namesize - ${#name}))
+	zeros $(((4 - pos % 4) % 4))
+
+	if [ -n "$file" ]; then
+		cat "$file" >> "$out"
+		pos=$((pos + size))
+		zeros $(((4 - pos % 4) % 4))
+	fi
+	ino=$((ino + 1))
+}
+
+: > "$out"
+(cd "$src" && find . -mindepth 1 | sed 's|^\./||' | sort) | while read -r name; do
+	path=$src/$name
+	if [ -d "$path" ]; then
+		entry "$name" $((0040755)) 0
+	elif [ -f "$path" ]; then
+		entry "$name" $((0100644)) $(stat -c %s "$path") "$path"
+	fi
+done
+
+# The trailer needs the final offset, which the subshell above kept.
+pos=$(stat -c %s "$out")
+entry "TRAILER!!!" 0 0